@@ -0,0 +1,127 @@
+#ifndef REDIS_AOF_H
+#define REDIS_AOF_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//Append-only file (appendonly.aof): every write command, RESP encoded, in the order
+//the commands executed.
+//
+//Writers only append to an in-memory buffer, under db_mutex so the order is
+//the execution order. A dedicated thread swaps the buffer out and writes it with one
+//write(), then syncs according to the appendfsync policy:
+//  always    fdatasync() after every batch; clients wait for it before their reply
+//  everysec  fdatasync() at most once a second
+//  no        never; the kernel flushes when it likes
+//Whatever accumulates while a batch is being written and synced forms the next
+//batch, so with "always" concurrent writers share one write + fdatasync (group
+//commit) and no thread but the writer ever blocks on the disk for the log.
+//
+//Rewrite (BGREWRITEAOF, or automatically once the file has grown by a percentage
+//over its size after the last rewrite): a rewrite thread writes the dataset as the
+//fewest commands that rebuild it, from a copy-on-write snapshot, to a temporary
+//file. Commands appended after the snapshot are captured on the side and copied
+//behind it while clients keep writing; the writer thread copies and syncs the last
+//few, then renames the new file over the old one between two batches.
+enum class AofFsync { Always, EverySec, No };
+
+class RedisAof {
+public:
+    static RedisAof& getInstance();
+
+    //open path for appending and start the writer thread
+    bool open(const std::string& path, AofFsync policy);
+    bool isOpen() const { return fd >= 0; }
+
+    //queue one command; the caller holds db_mutex
+    void append(const std::vector<std::string>& argv);
+
+    //block until everything the calling thread appended is synced. Returns at once
+    //unless appendfsync is always; call it without holding db_mutex.
+    void waitDurable();
+
+    //write and sync everything appended so far, then stop the writer
+    void close();
+
+    //Produces the dataset for a rewrite: every command through emit, with
+    //snapshotTaken() called under db_mutex at the point the dataset is taken.
+    using Emit = std::function<void(const std::vector<std::string>&)>;
+    using DatasetWriter = std::function<void(const Emit& emit, const std::function<void()>& snapshotTaken)>;
+    void setDatasetWriter(DatasetWriter writer);
+    //rewrite once the file is percentage% bigger than after the last rewrite (0 = never)
+    //and at least minSize bytes
+    void setAutoRewrite(int percentage, uint64_t minSize);
+    //false when the AOF is off or a rewrite is already running
+    bool rewriteInBackground();
+    bool rewriting() const { return rewrite_running; }
+    //for INFO; read from atomics, without aof_mutex
+    struct Status {
+        bool enabled;
+        bool rewriting;
+        uint64_t currentSize;   //bytes written to the file so far
+        uint64_t baseSize;      //its size after the last rewrite (or at startup)
+        uint64_t bufferBytes;   //appended, not yet handed to the writer
+    };
+    Status status();
+
+    //Feed each command in path to apply, in order, decoding the file in place
+    //(mmap) instead of through the network parser. A last record cut short, or a
+    //MULTI without its EXEC, is what a crash mid-write leaves: it is ignored and
+    //cut off the file so later appends follow complete records. False when
+    //the file can't be read or is corrupt before its end.
+    static bool replay(const std::string& path, const std::function<void(std::vector<std::string>&)>& apply,
+                       size_t& commands);
+
+private:
+    RedisAof() = default;
+    ~RedisAof();
+    RedisAof(const RedisAof&) = delete;
+    RedisAof& operator=(const RedisAof&) = delete;
+
+    void writerLoop();
+    void writeBatch(const std::string& batch);
+    //caller holds aof_mutex
+    bool startRewrite();
+    void rewriteLoop();
+    //writer thread, lock held on entry and on return
+    void finishRewrite(std::unique_lock<std::mutex>& lock);
+    void endRewrite();
+
+    std::atomic<int> fd{-1};
+    std::string path;
+    AofFsync policy = AofFsync::EverySec;
+    std::thread writer;
+
+    std::mutex aof_mutex;
+    std::condition_variable work_cv;
+    std::condition_variable durable_cv;
+    std::string pending;    //appended, not yet handed to the writer
+    std::atomic<uint64_t> pending_bytes{0}; //its size, for status()
+    std::string writing;    //the batch being written (kept to reuse its capacity)
+    uint64_t appended = 0;  //bytes appended since open
+    std::atomic<uint64_t> durable{0}; //bytes written, and synced as the policy asks
+    std::atomic<bool> stopping{false};
+    std::atomic<uint64_t> file_size{0};
+
+    //Rewrite state, guarded by aof_mutex
+    DatasetWriter dataset_writer;
+    std::thread rewriter;
+    std::atomic<bool> rewrite_running{false};
+    bool capturing = false;       //appends are also copied to rewrite_buffer
+    bool rewrite_ready = false;   //temp file holds the dataset; the writer swaps it in
+    std::string rewrite_buffer;
+    std::string rewrite_path;
+    int rewrite_fd = -1;
+    uint64_t rewrite_size = 0;    //bytes in the temporary file
+    int auto_rewrite_percentage = 100;
+    uint64_t auto_rewrite_min_size = 64 * 1024 * 1024;
+    std::atomic<uint64_t> base_size{0}; //file size after the last rewrite (or at startup)
+};
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef REDIS_BITMAP_H
+#define REDIS_BITMAP_H
+
+#include <cstddef>
+#include <cstdint>
+
+//Bit-level kernels used by the bitmap commands (SETBIT/GETBIT/BITCOUNT/BITPOS/BITOP).
+//Bitmaps are plain string values; bit 0 is the most significant bit of byte 0.
+//The popcount and BITOP kernels pick the widest implementation the CPU supports
+//(AVX2, hardware POPCNT, or portable 64-bit words) once at startup.
+
+enum class BitOp { AND, OR, XOR, NOT };
+
+//count set bits in p[0, n)
+uint64_t bitmapPopcount(const unsigned char* p, size_t n);
+
+//dst[i] = dst[i] op src[i] for i in [0, n). NOT ignores dst and writes ~src.
+void bitmapOp(BitOp op, unsigned char* dst, const unsigned char* src, size_t n);
+
+//position (in bits, from the start of p) of the first bit equal to `bit`, or -1
+int64_t bitmapFirstBit(const unsigned char* p, size_t n, int bit);
+
+//name of the kernel set picked at runtime ("avx2", "popcnt" or "generic")
+const char* bitmapKernelName();
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef REDIS_CLIENT_H
+#define REDIS_CLIENT_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include "RedisResp.h"
+
+//Per-connection state, owned by the thread serving the connection.
+//
+//Everything written to the socket goes through one output queue so replies and
+//pushed messages (pub/sub) keep their order. Queue entries are shared buffers:
+//a PUBLISH serializes its message once and every subscriber queues the same
+//buffer. Other threads may push() into the queue; the owning thread is woken
+//through wakeFd() and does the actual writes in flush().
+//
+//Large replies are attached as a ReplyStream. flush() pulls one chunk at a time
+//and only asks for the next once the previous one is on the socket, so a slow
+//reader holds back the stream (and this connection's input) instead of growing
+//the queue.
+class RedisClient {
+public:
+    using Buffer = std::shared_ptr<const std::string>;
+
+    explicit RedisClient(int fd);
+    ~RedisClient();
+    RedisClient(const RedisClient&) = delete;
+    RedisClient& operator=(const RedisClient&) = delete;
+
+    int fd() const { return socket_fd; }
+    int wakeFd() const { return wake_fd; }
+
+    //true once the peer has closed or reset the connection
+    bool peerClosed() const;
+
+    //queue a reply from the owning thread
+    void reply(std::string data);
+
+    //queue a shared buffer from any thread. Returns false when the client is
+    //closing, including when this push took it over its output buffer limit.
+    bool push(const Buffer& buffer);
+
+    //owning thread: continue the current reply with a stream, sent after
+    //everything already queued
+    void setStream(ReplyStream stream);
+
+    //owning thread: detach the attached stream, if any, to consume it elsewhere
+    ReplyStream takeStream();
+
+    //owning thread: write out everything queued, then any attached stream.
+    //False on socket error or close.
+    bool flush();
+
+    //owning thread: reset the wakeup counter after poll() reported wakeFd()
+    void drainWakeups();
+
+    bool closing() const { return close_requested.load(); }
+
+    //any thread: drop the connection, e.g. a replica that has to resync
+    void disconnect(const char* reason);
+
+    //Pub/Sub state. The sets are guarded by RedisPubSub's mutex; the counter is
+    //readable without it so the command filter stays cheap.
+    std::unordered_set<std::string> channels;
+    std::unordered_set<std::string> patterns;
+    std::atomic<size_t> subscriptions{0};
+
+    //set once the connection became a replica's link (PSYNC/SYNC)
+    std::atomic<bool> replica{false};
+    //the replica side of that link: the client applying the master's stream, the
+    //only one that may write to a read-only replica
+    bool master_link = false;
+    //cluster: the next command may use a slot this node is importing (ASKING)
+    bool asking = false;
+
+    //MULTI/EXEC state, only touched by the owning thread
+    bool in_multi = false;
+    std::vector<std::vector<std::string>> queued_commands;
+    //WATCHed keys with their versions (RedisDatabase::WatchList)
+    std::vector<std::pair<std::string, uint64_t>> watched;
+
+private:
+    bool overLimit(std::chrono::steady_clock::time_point now);
+    void closeAsync(const char* reason);
+
+    int socket_fd;
+    int wake_fd;
+
+    std::mutex out_mutex;
+    std::deque<Buffer> out_queue;
+    ReplyStream reply_stream;
+    size_t queued_bytes = 0;
+    std::chrono::steady_clock::time_point soft_limit_since{};
+    std::atomic<bool> close_requested{false};
+};
+
+#endif
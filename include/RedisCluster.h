@@ -0,0 +1,127 @@
+#ifndef REDIS_CLUSTER_H
+#define REDIS_CLUSTER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+//Cluster mode (--cluster-enabled yes).
+//
+//Keys map to 16384 hash slots: CRC16 of the key modulo 16384, or of its hash tag,
+//the part between the first { and the next } when that is not empty, so
+//{user1}.name and {user1}.mail share a slot. Each slot is served by one node. A
+//command whose keys are in a slot another node serves is answered
+//-MOVED <slot> <host>:<port>, one whose keys span slots -CROSSSLOT.
+//
+//Nodes meet with CLUSTER MEET and then gossip: once a second every node sends each
+//node it knows its ID and address, the slots it claims with its config epoch, and
+//the nodes it knows (CLUSTER GOSSIP, on the ordinary client port); the answer is the
+//same about the receiver. A slot belongs to the claimant with the highest config
+//epoch; a node takes an epoch above every epoch it has seen whenever it claims
+//slots. The node table is saved to the cluster config file on every change.
+//
+//Slots move between nodes live, as in Redis: CLUSTER SETSLOT <slot> IMPORTING <source>
+//on the target and MIGRATING <target> on the source, MIGRATE for each key
+//CLUSTER GETKEYSINSLOT lists, then SETSLOT <slot> NODE <target> on both. Meanwhile the
+//source serves the keys it still has and answers -ASK <slot> <target> for the others,
+//and the target serves commands for the slot that follow ASKING.
+
+static const int CLUSTER_SLOTS = 16384;
+
+//the hash slot of a key
+int keyHashSlot(const std::string& key);
+
+class RedisCluster {
+public:
+    static RedisCluster& getInstance();
+
+    //startup: load the node table from configFile, or start a new one there, and
+    //start gossiping. announceHost is this node's address for the others ("": the
+    //address they reach it at).
+    bool enable(const std::string& configFile, const std::string& announceHost, int port);
+    bool enabled() const { return cluster_enabled; }
+
+    //Where a command with these keys (none: it runs here) is served:
+    //  Local      here
+    //  Migrating  here if every key is still here, else reply holds the -ASK
+    //  Importing  here, the client sent ASKING for a slot this node imports
+    //  Redirect   elsewhere; reply holds the -MOVED, -CROSSSLOT or -CLUSTERDOWN
+    enum class Route { Local, Migrating, Importing, Redirect };
+    Route route(const std::vector<std::string>& keys, bool asking, std::string& reply);
+
+    //CLUSTER subcommands; "" on success, else the error reply
+    std::string meet(const std::string& host, int port);
+    std::string addSlots(const std::vector<int>& slots);
+    std::string delSlots(const std::vector<int>& slots);
+    std::string setSlot(int slot, const std::string& how, const std::string& nodeId);
+    //CLUSTER GOSSIP <message>, on a connection from peer: take in what the sender
+    //tells and answer with the same about this node
+    std::string gossip(const std::vector<std::string>& tokens, const std::string& peer,
+                       const std::string& local, std::vector<std::string>& answer);
+
+    std::string myId();
+    //CLUSTER NODES and CLUSTER INFO text
+    std::string nodes();
+    std::string info();
+    //CLUSTER SLOTS: the owner of each run of slots
+    struct SlotRange {
+        int first;
+        int last;
+        std::string id;
+        std::string host;
+        int port;
+    };
+    std::vector<SlotRange> slotRanges();
+
+private:
+    RedisCluster() = default;
+    ~RedisCluster();
+    RedisCluster(const RedisCluster&) = delete;
+    RedisCluster& operator=(const RedisCluster&) = delete;
+
+    struct Node {
+        std::string id;
+        std::string host;
+        int port = 0;
+        uint64_t configEpoch = 0;
+        bool linked = false;        //the last gossip exchange with it succeeded
+        std::chrono::steady_clock::time_point lastSeen = std::chrono::steady_clock::now();
+    };
+
+    //all of these with cluster_mutex held
+    Node* addNode(const std::string& id, const std::string& host, int port);
+    Node* findNode(const std::string& id);
+    std::vector<std::string> message();
+    bool merge(const std::vector<std::string>& body, size_t at, const std::string& host);
+    //a config epoch above every other, taken when this node claims slots
+    void bumpEpoch();
+    bool suspect(const Node& node) const;
+    std::string nodesText();
+    bool loadConfig();
+    void saveConfig();
+
+    void cronLoop();
+
+    std::mutex cluster_mutex;
+    std::condition_variable cluster_cv;
+    bool cluster_enabled = false;
+    std::string config_file;
+    std::unordered_map<std::string, std::unique_ptr<Node>> node_table;
+    Node* myself = nullptr;
+    uint64_t current_epoch = 0;
+    //owner of each slot (nullptr: unassigned), and the slots on the move
+    std::vector<Node*> slot_owner = std::vector<Node*>(CLUSTER_SLOTS, nullptr);
+    std::unordered_map<int, Node*> migrating_to;
+    std::unordered_map<int, Node*> importing_from;
+
+    std::thread cron_thread;
+    bool stopping = false;
+};
+
+#endif
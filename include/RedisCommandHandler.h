@@ -6,13 +6,20 @@
 #include <sstream>
 #include <algorithm>
 #include <iostream>
+#include "RedisClient.h"
 
 class RedisCommandHandler {
 public:
     RedisCommandHandler();
 
     //process command from client and return RESP-formatted response.
-    std::string processCommand(const std::string& commandLine);
+    std::string processCommand(const std::string& commandLine, RedisClient& client);
+
+    //startup: rebuild the dataset from an append-only file; commands counts the records applied
+    bool loadAppendOnlyFile(const std::string& path, size_t& commands);
+
+    //replica: apply one command of the master's stream; the caller holds an ExecLock
+    void applyReplicated(std::vector<std::string>& tokens, RedisClient& client);
 };
 
 #endif
\ No newline at end of file
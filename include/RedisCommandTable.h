@@ -0,0 +1,43 @@
+#ifndef REDIS_COMMAND_TABLE_H
+#define REDIS_COMMAND_TABLE_H
+
+#include <string>
+#include <vector>
+
+//Static facts about each command, for code that has to reason about a command
+//without running it (which commands the AOF logs, for instance).
+
+enum CommandFlag : unsigned {
+    CMD_WRITE = 1u << 0,       //may modify the keyspace
+    CMD_READONLY = 1u << 1,    //only reads the keyspace
+    CMD_BLOCKING = 1u << 2,    //may wait (for data, for another server); logs its effects as they happen
+    CMD_ADMIN = 1u << 3,       //server management (SAVE, BGSAVE, ...)
+    CMD_PUBSUB = 1u << 4,
+    CMD_TRANSACTION = 1u << 5, //MULTI, EXEC, DISCARD, WATCH, UNWATCH
+    CMD_LOADING = 1u << 6,     //allowed while the dataset is loading
+    CMD_NO_MULTI = 1u << 7,    //refused inside MULTI
+};
+
+//Key positions are Redis': the first and last argument that is a key (a negative
+//last counts from the end, -1 being the last argument) and the step between keys.
+//firstKey 0 means the command takes no keys.
+struct CommandInfo {
+    const char* name;
+    unsigned flags;
+    int firstKey = 0;
+    int lastKey = 0;
+    int keyStep = 0;
+};
+
+//nullptr for unknown commands; name must be upper case
+const CommandInfo* lookupCommand(const std::string& name);
+
+//commands by their position in the table, e.g. for per-command counters
+size_t commandCount();
+size_t commandIndex(const CommandInfo& info);
+const CommandInfo& commandAt(size_t index);
+
+//the arguments of argv (argv[0] being the command name) that are keys
+void commandKeys(const CommandInfo& info, const std::vector<std::string>& argv, std::vector<std::string>& keys);
+
+#endif
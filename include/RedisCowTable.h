@@ -0,0 +1,307 @@
+#ifndef REDIS_COW_TABLE_H
+#define REDIS_COW_TABLE_H
+
+#include "RedisCluster.h"
+#include <array>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+//A string keyed hash table split into COW_TABLE_SHARDS shards, each held through a
+//shared_ptr, so freeze() takes a point-in-time View of the whole table in
+//O(shards), however many keys it has. A change to a shard some View still holds
+//first copies that shard alone (copy-on-write per shard, as fork() does per page):
+//a writer pays for one shard's copy at most, once per View, and the View's owner
+//reads it on another thread without any lock.
+//
+//Non-const lookups and iteration hand out writable entries, so they copy a shared
+//shard before returning; const ones never copy. Any change to the table
+//invalidates its iterators.
+//
+//Keys are sharded by cluster hash slot, so all the keys of a slot sit in one
+//shard (slot % COW_TABLE_SHARDS): CLUSTER COUNTKEYSINSLOT and GETKEYSINSLOT walk
+//that shard alone.
+
+static const size_t COW_TABLE_SHARDS = 1024;
+static_assert(CLUSTER_SLOTS % COW_TABLE_SHARDS == 0, "a hash slot must map to one shard");
+
+template <typename V>
+class CowTable {
+public:
+    using Shard = std::unordered_map<std::string, V>;
+    using key_type = std::string;
+    using mapped_type = V;
+    using value_type = typename Shard::value_type;
+    using Shards = std::array<std::shared_ptr<Shard>, COW_TABLE_SHARDS>;
+
+    //the shard key belongs in, and the one that holds every key of a slot
+    static size_t shardOf(const std::string& key) { return shardOfSlot(keyHashSlot(key)); }
+    static size_t shardOfSlot(int slot) { return static_cast<size_t>(slot) % COW_TABLE_SHARDS; }
+
+    class const_iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = typename Shard::value_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const value_type*;
+        using reference = const value_type&;
+
+        const_iterator() = default;
+        reference operator*() const { return *it; }
+        pointer operator->() const { return &*it; }
+        const_iterator& operator++()
+        {
+            ++it;
+            settle();
+            return *this;
+        }
+        const_iterator operator++(int)
+        {
+            const_iterator before = *this;
+            ++*this;
+            return before;
+        }
+        bool operator==(const const_iterator& other) const
+        {
+            return shard == other.shard && (shard == COW_TABLE_SHARDS || it == other.it);
+        }
+        bool operator!=(const const_iterator& other) const { return !(*this == other); }
+
+    private:
+        friend class CowTable;
+        //the first entry at or after it in shard; shards may be null in a View
+        const_iterator(const Shards* shards, size_t shard, typename Shard::const_iterator it)
+            : shards(shards), shard(shard), it(it) { settle(); }
+        const_iterator(const Shards* shards, size_t shard) : shards(shards), shard(shard)
+        {
+            if(shard < COW_TABLE_SHARDS && (*shards)[shard]) it = (*shards)[shard]->cbegin();
+            settle();
+        }
+        void settle()
+        {
+            while(shard < COW_TABLE_SHARDS && (!(*shards)[shard] || it == (*shards)[shard]->cend())) {
+                if(++shard < COW_TABLE_SHARDS && (*shards)[shard]) it = (*shards)[shard]->cbegin();
+            }
+        }
+
+        const Shards* shards = nullptr;
+        size_t shard = COW_TABLE_SHARDS;
+        typename Shard::const_iterator it{};
+    };
+
+    class iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = typename Shard::value_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = value_type*;
+        using reference = value_type&;
+
+        iterator() = default;
+        reference operator*() const { return *it; }
+        pointer operator->() const { return &*it; }
+        iterator& operator++()
+        {
+            ++it;
+            settle();
+            return *this;
+        }
+        iterator operator++(int)
+        {
+            iterator before = *this;
+            ++*this;
+            return before;
+        }
+        bool operator==(const iterator& other) const
+        {
+            return shard == other.shard && (shard == COW_TABLE_SHARDS || it == other.it);
+        }
+        bool operator!=(const iterator& other) const { return !(*this == other); }
+        operator const_iterator() const
+        {
+            return shard == COW_TABLE_SHARDS ? const_iterator() : const_iterator(&table->shards, shard, it);
+        }
+
+    private:
+        friend class CowTable;
+        //it must be in a shard the table owns; every shard entered later is copied first
+        iterator(CowTable* table, size_t shard, typename Shard::iterator it) : table(table), shard(shard), it(it)
+        {
+            settle();
+        }
+        void settle()
+        {
+            while(shard < COW_TABLE_SHARDS && it == table->shards[shard]->end()) {
+                if(++shard < COW_TABLE_SHARDS) it = table->own(shard).begin();
+            }
+        }
+
+        CowTable* table = nullptr;
+        size_t shard = COW_TABLE_SHARDS;
+        typename Shard::iterator it{};
+    };
+
+    //A frozen table, or entries collected by hand with add(). Read-only; copying it
+    //is O(shards).
+    class View {
+    public:
+        View() = default;
+        const_iterator begin() const { return const_iterator(&shards, 0); }
+        const_iterator end() const { return const_iterator(); }
+        size_t size() const { return elements; }
+        bool empty() const { return elements == 0; }
+        const_iterator find(const std::string& key) const
+        {
+            size_t s = shardOf(key);
+            if(!shards[s]) return end();
+            auto it = shards[s]->find(key);
+            return it == shards[s]->end() ? end() : const_iterator(&shards, s, it);
+        }
+        void add(const std::string& key, V value)
+        {
+            auto& shard = shards[shardOf(key)];
+            if(!shard) shard = std::make_shared<Shard>();
+            if(shard->emplace(key, std::move(value)).second) ++elements;
+        }
+
+    private:
+        friend class CowTable;
+        Shards shards;
+        size_t elements = 0;
+    };
+
+    CowTable()
+    {
+        for(auto& shard : shards) shard = std::make_shared<Shard>();
+    }
+    CowTable(const CowTable&) = delete;
+    CowTable& operator=(const CowTable&) = delete;
+
+    //O(shards): the table as it is now, for as long as the View lives
+    View freeze() const
+    {
+        View view;
+        view.shards = shards;
+        view.elements = elements;
+        return view;
+    }
+
+    size_t size() const { return elements; }
+    bool empty() const { return elements == 0; }
+
+    iterator begin() { return iterator(this, 0, own(0).begin()); }
+    iterator end() { return iterator(); }
+    const_iterator begin() const { return const_iterator(&shards, 0); }
+    const_iterator end() const { return const_iterator(); }
+
+    iterator find(const std::string& key)
+    {
+        size_t s = shardOf(key);
+        auto it = shards[s]->find(key);
+        if(it == shards[s]->end()) return end();
+        if(shards[s].use_count() > 1) it = own(s).find(key);
+        return iterator(this, s, it);
+    }
+    const_iterator find(const std::string& key) const
+    {
+        size_t s = shardOf(key);
+        auto it = shards[s]->find(key);
+        return it == shards[s]->end() ? end() : const_iterator(&shards, s, it);
+    }
+    size_t count(const std::string& key) const { return shards[shardOf(key)]->count(key); }
+
+    V& operator[](const std::string& key)
+    {
+        Shard& shard = own(shardOf(key));
+        size_t before = shard.size();
+        V& value = shard[key];
+        elements += shard.size() - before;
+        return value;
+    }
+    V& operator[](std::string&& key)
+    {
+        Shard& shard = own(shardOf(key));
+        size_t before = shard.size();
+        V& value = shard[std::move(key)];
+        elements += shard.size() - before;
+        return value;
+    }
+    template <typename K, typename... Args>
+    std::pair<iterator, bool> emplace(K&& key, Args&&... args)
+    {
+        size_t s = shardOf(key);
+        auto done = own(s).emplace(std::forward<K>(key), std::forward<Args>(args)...);
+        if(done.second) ++elements;
+        return {iterator(this, s, done.first), done.second};
+    }
+
+    size_t erase(const std::string& key)
+    {
+        size_t s = shardOf(key);
+        if(!shards[s]->count(key)) return 0;
+        own(s).erase(key);
+        --elements;
+        return 1;
+    }
+    iterator erase(iterator pos)
+    {
+        auto next = shards[pos.shard]->erase(pos.it);
+        --elements;
+        return iterator(this, pos.shard, next);
+    }
+
+    void clear()
+    {
+        for(auto& shard : shards) {
+            if(shard.use_count() > 1) shard = std::make_shared<Shard>();
+            else shard->clear();
+        }
+        elements = 0;
+    }
+    void swap(CowTable& other)
+    {
+        shards.swap(other.shards);
+        std::swap(elements, other.elements);
+    }
+    //room for about count entries in all, spread over the shards no View holds
+    void reserve(size_t count)
+    {
+        if(count < COW_TABLE_SHARDS) return;
+        for(auto& shard : shards) {
+            if(shard.use_count() == 1) shard->reserve(count / COW_TABLE_SHARDS);
+        }
+    }
+
+    //Shard access for walks a slice at a time (tiered storage, RANDOMKEY) and for
+    //filling disjoint shards from several threads: a writable shard, then recount()
+    static constexpr size_t shardCount() { return COW_TABLE_SHARDS; }
+    const Shard& shard(size_t s) const { return *shards[s]; }
+    Shard& ownShard(size_t s) { return own(s); }
+    void recount()
+    {
+        elements = 0;
+        for(const auto& shard : shards) elements += shard->size();
+    }
+    //shrink a shard left sparse by deletions, unless a View holds it
+    void compact(size_t s)
+    {
+        if(shards[s].use_count() == 1) shards[s]->rehash(0);
+    }
+
+private:
+    //shard s, copied first if a View still holds it. Views are only taken with the
+    //owner's lock held, so a count of 1 can't rise behind our back.
+    Shard& own(size_t s)
+    {
+        if(shards[s].use_count() > 1) shards[s] = std::make_shared<Shard>(*shards[s]);
+        return *shards[s];
+    }
+
+    Shards shards;
+    size_t elements = 0;
+};
+
+#endif
@@ -4,85 +4,627 @@
 #include <vector>
 #include <string>
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
 #include <fstream>
 #include <unordered_map>
+#include <unordered_set>
 #include <sstream>
 #include <chrono>
 #include <algorithm>
 #include <iterator>
 #include <random>
+#include <cstdint>
+#include "RedisBitmap.h"
+#include "RedisLzf.h"
+#include "RedisResp.h"
+#include "RedisCowTable.h"
+#include "RedisSnapshot.h"
+#include "RedisValueLog.h"
+
+//Keys whose values are still on disk (a lazily loaded snapshot, or the tiered value
+//log) are paged in by key lookups (see LAZY LOAD and TIERED STORAGE in
+//RedisDatabase.cpp); a no-op while everything is in memory.
+void pageInKey(const std::string& key);
+
+//Coarse clock in seconds, stamped on a value whenever its key is looked up. Tiered
+//storage spills values whose stamp is old enough.
+uint32_t accessClock();
+
+//A key -> value table whose lookups by key page the key in first, so no code path
+//sees a keyspace with values still on disk, and stamp the value's access clock.
+//Iteration, size() and peek() do neither. Snapshots freeze() it (RedisCowTable.h).
+template <typename T>
+class KeyTable : public CowTable<std::shared_ptr<T>> {
+    using Base = CowTable<std::shared_ptr<T>>;
+public:
+    using Base::erase;
+
+    typename Base::iterator find(const std::string& key)
+    {
+        pageInKey(key);
+        return stamp(Base::find(key));
+    }
+    typename Base::const_iterator find(const std::string& key) const
+    {
+        pageInKey(key);
+        auto it = Base::find(key);
+        if(it != this->end()) it->second->access = accessClock();
+        return it;
+    }
+    size_t count(const std::string& key) const
+    {
+        pageInKey(key);
+        return Base::count(key);
+    }
+    std::shared_ptr<T>& operator[](const std::string& key)
+    {
+        pageInKey(key);
+        return stampValue(Base::operator[](key));
+    }
+    std::shared_ptr<T>& operator[](std::string&& key)
+    {
+        pageInKey(key);
+        return stampValue(Base::operator[](std::move(key)));
+    }
+    size_t erase(const std::string& key)
+    {
+        pageInKey(key);
+        return Base::erase(key);
+    }
+    //find for the tiering and lazy-load code itself
+    typename Base::iterator peek(const std::string& key) { return Base::find(key); }
+    typename Base::const_iterator peek(const std::string& key) const { return Base::find(key); }
+
+private:
+    typename Base::iterator stamp(typename Base::iterator it)
+    {
+        if(it != this->end()) it->second->access = accessClock();
+        return it;
+    }
+    std::shared_ptr<T>& stampValue(std::shared_ptr<T>& handle)
+    {
+        if(handle) handle->access = accessClock();
+        return handle;
+    }
+};
 
 class RedisDatabase {
 public:
+    //A string value. With value compression on, a value of at least the threshold
+    //that LZF makes smaller is kept compressed (rawSize > 0) and expanded on access.
+    struct StringValue {
+        std::string data;
+        size_t rawSize = 0;
+
+        StringValue() = default;
+        explicit StringValue(std::string raw);
+        StringValue(std::string packed, size_t raw);
+        StringValue(const StringValue& other);
+        StringValue& operator=(const StringValue&) = delete;
+        ~StringValue();
+        bool compressed() const { return rawSize > 0; }
+        size_t size() const { return compressed() ? rawSize : data.size(); }
+
+        //last lookup (accessClock()), for tiered storage
+        mutable uint32_t access = accessClock();
+    };
+    struct ListValue : std::vector<std::string> {
+        using std::vector<std::string>::vector;
+        ListValue() = default;
+        ListValue(std::vector<std::string> items) : std::vector<std::string>(std::move(items)) {}
+        mutable uint32_t access = accessClock();
+    };
+    struct HashValue : std::unordered_map<std::string, std::string> {
+        using std::unordered_map<std::string, std::string>::unordered_map;
+        HashValue() = default;
+        HashValue(std::unordered_map<std::string, std::string> fields)
+            : std::unordered_map<std::string, std::string>(std::move(fields)) {}
+        mutable uint32_t access = accessClock();
+    };
+    //keys a client WATCHes, with the version each had when it was watched
+    using WatchList = std::vector<std::pair<std::string, uint64_t>>;
+
     //Get the singleton instance
     static RedisDatabase& getInstance();
 
     //Persistance: Dump /Load the database from a file
-    bool dump(const std::string& filename);
+    //dump writes a point-in-time snapshot; only taking it holds db_mutex. One save
+    //runs at a time: with busy given (SAVE, which may run inside EXEC with db_mutex
+    //held) a running one fails the call and sets *busy, otherwise it is waited out.
+    bool dump(const std::string& filename, bool delta = false, bool* busy = nullptr);
+    //sections are checked and decoded in parallel; the keyspace is swapped in at the end
     bool load(const std::string& filename);
+    //startup: set while the dataset is being loaded; clients are answered -LOADING meanwhile.
+    //Clearing it also clears the dirty counter: the dataset just came from disk.
+    void setLoading(bool active)
+    {
+        loading_active = active;
+        if(!active) dirty = 0;
+    }
+    bool loading() const { return loading_active; }
+    struct LoadStatus {
+        bool loading;
+        uint64_t bytesTotal;
+        uint64_t bytesDone;
+        uint64_t keysLoaded;
+        uint64_t keysOnDisk;    //lazy load: keys not paged in yet
+    };
+    LoadStatus loadStatus() const;
+    //Lazy load: load() only indexes the keys of a binary snapshot and leaves the values
+    //in the mapped file until first use; warmUp pages the rest in on a background thread.
+    //Set at startup.
+    void setLazyLoad(bool lazy, bool warmUp)
+    {
+        lazy_load = lazy;
+        lazy_warm_up = warmUp;
+    }
+    //caller holds db_mutex
+    void pageIn(const std::string& key);
+
+    //Tiered storage: values of at least minBytes not looked up for idleSeconds are
+    //spilled to a value log at path and read back on first use. Set at startup.
+    bool setTiering(const std::string& path, uint32_t idleSeconds, size_t minBytes);
+    struct TierStatus {
+        bool enabled;
+        uint64_t keys;          //values in the value log now
+        uint64_t liveBytes;     //their size there
+        uint64_t fileBytes;     //the log, dead records included
+        uint64_t spilled;       //values written out since startup
+        uint64_t fetched;       //values read back since startup
+    };
+    TierStatus tierStatus();
+    //true when some values are not in memory; a cheap check without the lock
+    bool hasColdKeys() const { return cold_count > 0; }
+    //read the values of keys that are on disk without holding db_mutex, so a
+    //command that needs them doesn't keep other clients waiting on the disk
+    void prefetch(const std::vector<std::string>& keys);
+
+    //Replication (RedisReplication.h). dumpForSync writes a snapshot for a replica's
+    //full resync to path, outside the save bookkeeping (last save, dirty counter, delta
+    //chain); snapshotTaken runs under db_mutex at its point in time, as for rewriteCommands.
+    bool dumpForSync(const std::string& path, const std::function<void()>& snapshotTaken);
+    //replica: replace the dataset with a snapshot received from the master. The file
+    //becomes filename, the replica's own dump, and is loaded from there.
+    bool loadSyncSnapshot(const std::string& received, const std::string& filename);
+
+    //dump on a background thread; false when a background save is already running.
+    //delta: only the keys changed since the last save, if the delta chain allows it
+    bool bgsave(const std::string& filename, bool delta = false);
+    struct SaveStatus {
+        bool running;
+        size_t keysDone;
+        size_t keysTotal;
+        int64_t lastSave;   //unix seconds of the last successful save (or startup)
+        bool lastOk;
+        uint64_t changesSinceSave;
+    };
+    SaveStatus saveStatus() const;
+    //Save rules, as Redis' "save <seconds> <changes>": save in the background once a
+    //rule's number of writes happened and its seconds passed since the last save.
+    //Set at startup; no rules means no automatic saves.
+    struct SaveRule {
+        int64_t seconds;
+        uint64_t changes;
+    };
+    void setSaveRules(std::vector<SaveRule> rules) { save_rules = std::move(rules); }
+    //called once a second: start a background save if a rule is met and none is running
+    bool saveIfDue(const std::string& filename);
+    //Delta checkpoints: between full snapshots, saves write only the keys changed since
+    //the previous save, up to maxDeltas delta files in a row (0: off). Set at startup.
+    void setDeltaSaves(size_t maxDeltas) { delta_max = maxDeltas; }
+    //keep string values of at least minBytes LZF compressed when that saves space (0: off)
+    void setValueCompression(size_t minBytes) { compress_min = minBytes; }
+    //string values held compressed right now, and their raw and stored sizes
+    LzfStats compressionStats() const;
+
+    //For INFO, which must not wait for db_mutex: the figures that need it, as of the
+    //last refreshStatus() (called once a second)
+    struct DatasetStatus {
+        uint64_t keys = 0;
+        uint64_t expires = 0;
+        TierStatus tier{};
+        bool deltaValid = false;
+        size_t deltaFiles = 0;
+        uint64_t deltaBytes = 0;
+        size_t changedKeys = 0;     //tracked for the next delta
+    };
+    void refreshStatus();
+    DatasetStatus datasetStatus();
+    //cheap reads without the lock
+    size_t blockedClients() const { return blocked_count; }
+    uint64_t expiredKeys() const { return expired_keys; }
+    size_t lazyFreePending() const { return lazyfree_pending; }
+
+    //the dataset as write commands (SET, RPUSH, HMSET, PEXPIREAT), e.g. for an AOF rewrite.
+    //Only taking the snapshot holds db_mutex; snapshotTaken runs under it right after.
+    void rewriteCommands(const std::function<void(const std::vector<std::string>&)>& emit,
+                         const std::function<void()>& snapshotTaken = nullptr);
+
+    //one key as the commands that rebuild it, like rewriteCommands, e.g. for MIGRATE;
+    //false when it does not exist
+    bool keyCommands(const std::string& key, const std::function<void(const std::vector<std::string>&)>& emit);
+
+    //DUMP: the key's value and expiry as a payload (RedisSnapshot.h); false when it does
+    //not exist. The value is serialized after db_mutex is released.
+    bool dumpKey(const std::string& key, std::string& payload);
+    //RESTORE: key gets the value in entry (readPayload()), expiring at entry.expireAtMs
+    //(-1: never; in the past: it is gone right away). False when key exists and !replace.
+    bool restoreKey(const std::string& key, SnapshotEntry& entry, bool replace);
+
+    //Propagation: every write, in execution order, to a sink (the AOF and replication).
+    //The sink is called under db_mutex; it is installed at startup, once the dataset is
+    //loaded and before any client may write.
+    using Propagator = std::function<void(const std::vector<std::string>&)>;
+    void setPropagator(Propagator sink);
+    bool propagating() const { return static_cast<bool>(propagator); }
+    //log a command now, followed by the effects it caused; caller holds db_mutex
+    void propagate(const std::vector<std::string>& argv);
+    //Held around a write command: the command, its log record and the effects it has
+    //on blocked clients (logged as the pops they amount to) are ordered the same in
+    //memory and in the log.
+    class WriteScope {
+    public:
+        explicit WriteScope(RedisDatabase& db) : db(db), lock(db.db_mutex) { ++db.propagate_hold; }
+        ~WriteScope() { if(--db.propagate_hold == 0) db.flushEffects(); }
+        WriteScope(const WriteScope&) = delete;
+        WriteScope& operator=(const WriteScope&) = delete;
+    private:
+        RedisDatabase& db;
+        std::lock_guard<std::recursive_mutex> lock;
+    };
 
     //Common Commands
-    bool flushAll();
+    //async: swap the stores out and destroy them on the lazy-free thread
+    bool flushAll(bool async = false);
 
     //Key Value commands
     void set(const std::string& key, const std::string& value);
     std::string getSet(const std::string& key, const std::string& value);
     bool get(const std::string& key, std::string& value);
     std::vector<std::string> keys();
+    //up to count keys in a cluster hash slot (RedisCluster.h), and how many it has;
+    //a walk of the one table shard that holds the slot
+    std::vector<std::string> keysInSlot(int slot, size_t count);
+    size_t countKeysInSlot(int slot);
     std::string type(const std::string& key);
-    bool del(const std::string& key);
+
+    //Multi-key commands: the whole batch runs under one lock acquisition
+    //append the MGET array to reply; missing and non-string keys are nil
+    void mget(const std::vector<std::string>& keys, std::string& reply);
+    void mset(const std::vector<std::pair<std::string, std::string>>& pairs);
+    //all or nothing: false, and nothing is written, when any of the keys exists
+    bool msetnx(const std::vector<std::pair<std::string, std::string>>& pairs);
+    //these return how many of the keys existed (a repeated key counts each time for exists)
+    size_t del(const std::vector<std::string>& keys);
+    //like del, but values above the lazy-free threshold are destroyed in the background
+    size_t unlink(const std::vector<std::string>& keys);
+    size_t exists(const std::vector<std::string>& keys);
     //expire
     bool expire(const std::string& key, int seconds);
-    //rename
+    //absolute unix time in milliseconds; a time in the past expires the key
+    bool expireAt(const std::string& key, int64_t unixMs);
+    //rename: moves the value's handle, O(1) whatever its size; newKey is overwritten
     bool rename(const std::string& oldKey, const std::string& newKey);
-    int copy(const std::string& oldKey, const std::string& newKey);
+    //copy: shares the value with newKey (copied on the next write to either key).
+    //Returns 1 when copied, 0 when oldKey is missing or newKey exists and !replace.
+    int copy(const std::string& oldKey, const std::string& newKey, bool replace = false);
     size_t dbsize();
+    //uniformly sampled key from the whole keyspace; false when empty
+    bool randomKey(std::string& key);
+
+    //Bitmap Operations (on string values); setbit returns -1 for a list or hash key
+    int setbit(const std::string& key, uint64_t offset, int bit);
+    int getbit(const std::string& key, uint64_t offset);
+    uint64_t bitcount(const std::string& key, int64_t start, int64_t end, bool bitUnit);
+    int64_t bitpos(const std::string& key, int bit, int64_t start, int64_t end, bool endGiven, bool bitUnit);
+    size_t bitop(BitOp op, const std::string& destKey, const std::vector<std::string>& srcKeys);
 
     //List Operations
     ssize_t llen(const std::string& key);
-    std::vector<std::string> Lget(const std::string& key);
+    //append the RESP array for elements [start, stop] (negative = from the tail) to reply;
+    //false when the key does not exist. Given a stream, big windows are left to it.
+    bool lrange(const std::string& key, long long start, long long stop, std::string& reply, ReplyStream* stream = nullptr);
     bool lindex(const std::string& key, int index, std::string& value);
     bool lSet(const std::string& key, int index, const std::string& value);
     int lRemove(const std::string& key, int count, const std::string& value);
     void lpush(const std::string& key, const std::string& value);
-    void lpush(const std::string& key, const std::vector<std::string>& values);
+    size_t lpush(const std::string& key, const std::vector<std::string>& values);
     void rpush(const std::string& key, const std::string& value);
-    void rpush(const std::string& key, const std::vector<std::string>& values);
+    size_t rpush(const std::string& key, const std::vector<std::string>& values);
     bool lpop(const std::string& key, std::string& value);
     bool rpop(const std::string& key, std::string& value);
+    bool lmove(const std::string& source, const std::string& destination, bool fromLeft, bool toLeft, std::string& value);
+
+    //Blocking list operations: wait up to timeoutSeconds (0 = forever) for data.
+    //The client's socket clientFd is watched meanwhile, so a dropped connection
+    //stops blocking (-1: not watched).
+    bool blockingPop(const std::vector<std::string>& keys, bool fromLeft, double timeoutSeconds,
+                     std::string& key, std::string& value, int clientFd);
+    bool blmove(const std::string& source, const std::string& destination, bool fromLeft, bool toLeft,
+                double timeoutSeconds, std::string& value, int clientFd);
     int linsert(const std::string& key, const std::string& value, const std::string& pivot);
     bool ltrim(const std::string& key, const int& start, const int& stop);
 
+    //Transactions
+    //Held by EXEC while it runs the queued commands, so they execute under one
+    //acquisition of db_mutex (recursive for this). Blocking commands inside it
+    //behave as if their timeout expired instead of waiting.
+    class ExecLock {
+    public:
+        explicit ExecLock(RedisDatabase& db) : db(db), lock(db.db_mutex), was_active(db.exec_active) { db.exec_active = true; }
+        ~ExecLock() { db.exec_active = was_active; }
+        ExecLock(const ExecLock&) = delete;
+        ExecLock& operator=(const ExecLock&) = delete;
+    private:
+        RedisDatabase& db;
+        std::lock_guard<std::recursive_mutex> lock;
+        bool was_active;
+    };
+    //true when the calling thread runs inside EXEC, so must not block
+    bool inExec()
+    {
+        std::lock_guard<std::recursive_mutex> lock(db_mutex);
+        return exec_active;
+    }
+    //WATCH: record the current version of each key not yet in watched
+    void watch(const std::vector<std::string>& keys, WatchList& watched);
+    //UNWATCH: forget every key in watched and clear it
+    void unwatch(WatchList& watched);
+    //false when any watched key was modified since it was watched; O(watched keys)
+    bool watchedUnchanged(const WatchList& watched);
+
     //Hash Operations
     ssize_t Hlen(const std::string& key);
     bool Hset(const std::string& key, const std::string& field, const std::string& value);
     bool Hget(const std::string& key, const std::string &field, std::string& value);
     bool Hexists(const std::string& key, const std::string& field);
     bool Hdel(const std::string& key, const std::string& field);
-    std::vector<std::string> Hkeys(const std::string& key);
-    std::vector<std::string> Hvals(const std::string& key);
-    std::unordered_map<std::string, std::string> Hgetall(const std::string& key);
+    //HKEYS/HVALS/HGETALL reply: appended to reply, or for big hashes the header goes
+    //to reply and the entries are left to stream
+    enum class HashPart { Fields, Values, Both };
+    void hashReply(const std::string& key, HashPart part, std::string& reply, ReplyStream& stream);
     bool HMset(const std::string& key, const std::vector<std::pair<std::string, std::string>>& fieldValues);
     bool Hsetnx(const std::string& key, const std::string& field, const std::string& value);
-    bool Hrandfield(const std::string& key, std::vector<std::string>& value, const int& count);
+    //count < 0 allows repeats; with values, fields and values are interleaved
+    bool Hrandfield(const std::string& key, long long count, bool withValues, std::vector<std::string>& value);
     bool Hscan(const std::string& key, const int& cursor, std::vector<std::string>& values);
     std::vector<std::string> Hgetdel (const std::string& key, const std::string& field, const int& count, const std::vector<std::string>& fields);
 
 private:
-    RedisDatabase() = default;
-    ~RedisDatabase() = default;
+    RedisDatabase();
+    ~RedisDatabase();
     RedisDatabase(const RedisDatabase&) = delete;
     RedisDatabase& operator=(const RedisDatabase&) = delete;
 
+    //a client parked in BLPOP/BRPOP/BLMOVE, queued on every key it waits for
+    struct BlockedClient {
+        std::condition_variable_any cv;
+        std::vector<std::string> keys;
+        bool popLeft = true;
+        bool moveTo = false;        //BLMOVE: push the popped element onto target
+        std::string target;
+        bool pushLeft = true;
+        int fd = -1;                //the client's socket, watched for a hang-up
+        bool abandoned = false;     //the hang-up watch saw the client go away
+        bool served = false;
+        std::string servedKey;
+        std::string servedValue;
+    };
+
+    //Where a value that is not in memory is: in the mapped snapshot (section set),
+    //or a record of the value log
+    struct ColdRef {
+        SnapshotType type;
+        const SnapshotFile::Section* section;
+        const char* value;
+        uint64_t offset;
+        uint32_t length;
+        bool operator==(const ColdRef& other) const
+        {
+            return type == other.type && section == other.section && value == other.value &&
+                   offset == other.offset && length == other.length;
+        }
+    };
+    static bool readCold(const ColdRef& ref, const RedisValueLog* log, SnapshotEntry& entry);
+    bool dropCold(const std::string& key);
+    void installCold(const std::string& key, SnapshotEntry& entry);
+    bool loadIndex(const std::string& filename);
+    void warmUp(std::shared_ptr<SnapshotFile> file);
+    void tierLoop();
+    void spillIdle();
+    void compactTier();
+
+    //key -> expiry deadline
+    using ExpireTable = CowTable<std::chrono::steady_clock::time_point>;
+
+    //point-in-time view of the keyspace: the tables frozen (RedisCowTable.h), or the
+    //entries of a delta or of one key, with shared handles to the values
+    struct Snapshot {
+        KeyTable<StringValue>::View strings;
+        KeyTable<ListValue>::View lists;
+        KeyTable<HashValue>::View hashes;
+        ExpireTable::View expires;
+        //the dirty counter when it was taken
+        uint64_t dirty = 0;
+        //deltas: the file to write, and changed keys that no longer exist
+        std::string deltaFile;
+        std::vector<std::string> deleted;
+        //keys whose values are still on disk, and the files holding them
+        CowTable<ColdRef>::View cold;
+        std::shared_ptr<SnapshotFile> lazyFile;
+        std::shared_ptr<RedisValueLog> tierLog;
+    };
+    Snapshot snapshot();
+    //the snapshot a save writes: the whole keyspace, or a delta when asked and possible.
+    //Either way change tracking restarts from here.
+    Snapshot saveSnapshot(const std::string& filename, bool delta);
+    bool deltaDue();
+    void trackDelta(const std::string& key);
+    bool resetDeltaChain(const std::string& filename, uint64_t base);
+    bool appendDelta(const std::string& filename, const std::string& deltaFile);
+    void loadDeltas(const std::string& filename, uint64_t base, uint64_t baseBytes);
+    bool applyDelta(const std::string& deltaFile, uint64_t& bytes);
+    //dump files from before the binary format
+    bool loadText(const std::string& filename);
+    bool writeSnapshot(const Snapshot& snap, const std::string& filename);
+    //claim save_running, waiting on save_cv while another save has it (never call
+    //with db_mutex held: a finishing save may need it), and give it back
+    void beginSave();
+    void endSave();
+    //every record of snap; progress() is called once per key
+    bool writeRecords(const Snapshot& snap, SnapshotWriter& out, const std::function<void()>& progress);
+
     void purgeExpired();
-    void emplace_rand_fields(const std::string &key, std::vector<std::string> &value, const int &count);
+    bool hasKey(const std::string& key) const;
+    //record a modification of key for WATCH; every write path goes through this
+    void touchKey(const std::string& key);
+    //touchKey() plus a writable (detached) reference to the key's value
+    template <typename T> T& modify(const std::string& key, std::shared_ptr<T>& handle);
+    void setValue(const std::string& key, std::shared_ptr<StringValue> value);
+    //a value for kv_store, compressed if value compression applies; needs no lock
+    std::shared_ptr<StringValue> makeString(std::string value) const;
+    //the bytes of value: its data, or the data expanded into scratch (cut short, and
+    //logged, if the compressed data is damaged)
+    static const std::string& stringBytes(const StringValue& value, std::string& scratch);
+    //expand value in place, for writers that edit the bytes
+    static std::string& rawBytes(StringValue& value);
+    bool removeKey(const std::string& key, bool lazy);
+    template <typename T> void disposeValue(T&& value);
+    template <typename T> void disposeValue(std::shared_ptr<T>&& handle);
+    void freeAsync(std::shared_ptr<void> garbage);
+    void lazyFreeLoop();
+    bool popFrom(const std::string& key, bool left, std::string& value);
+    void pushTo(const std::string& key, const std::string& value, bool left);
+    bool blockOn(const std::shared_ptr<BlockedClient>& waiter, double timeoutSeconds,
+                 std::string& key, std::string& value);
+    void unblock(const std::shared_ptr<BlockedClient>& waiter);
+    void watchHangup(const std::shared_ptr<BlockedClient>& waiter, bool watch);
+    void hangupLoop();
+    void serveBlockedClients(const std::string& key);
+    //log what serving a blocked client did to the keyspace
+    void propagatePop(const BlockedClient& waiter, const std::string& key);
+    void propagateEffect(std::vector<std::string> argv);
+    void flushEffects();
+    void emplace_rand_fields(std::unordered_map<std::string, std::string> &hash, long long count, bool withValues, std::vector<std::string> &value);
+
+    std::recursive_mutex db_mutex;
+    bool exec_active = false;
+    //values are shared, copy-on-write handles (see detach() in RedisDatabase.cpp)
+    KeyTable<StringValue> kv_store;
+    KeyTable<ListValue> list_store;
+    KeyTable<HashValue> hash_store;
+
+    ExpireTable expire_map;
+    std::unordered_map<std::string, std::deque<std::shared_ptr<BlockedClient>>> blocking_keys;
+
+    //Hang-up watch: a thread polls the sockets of blocked clients and wakes the
+    //ones whose peer went away. hangup_wake (an eventfd) makes it re-read the list.
+    std::thread hangup_thread;
+    std::mutex hangup_mutex;
+    std::vector<std::shared_ptr<BlockedClient>> hangup_watch;
+    int hangup_wake = -1;
+    bool hangup_stop = false;
+
+    //Modification versions, kept only for keys some client is watching
+    struct WatchedKey {
+        uint64_t version = 0;
+        size_t watchers = 0;
+    };
+    std::unordered_map<std::string, WatchedKey> watched_keys;
+
+    //Propagation sink, and effects held back until the running write command is logged
+    Propagator propagator;
+    int propagate_hold = 0;
+    std::vector<std::vector<std::string>> held_effects;
+
+    //Lazy free: values too big to destroy under db_mutex are moved (O(1)) into a
+    //type-erased holder and destroyed by a background thread.
+    std::thread lazyfree_thread;
+    std::mutex lazyfree_mutex;
+    std::condition_variable lazyfree_cv;
+    std::vector<std::shared_ptr<void>> lazyfree_queue;
+    bool lazyfree_stop = false;
+    std::atomic<size_t> lazyfree_pending{0};
+
+    //Background save
+    std::thread bgsave_thread;
+    std::atomic<bool> save_running{false};
+    std::mutex save_mutex;
+    std::condition_variable save_cv;
+    std::atomic<size_t> save_keys_done{0};
+    std::atomic<size_t> save_keys_total{0};
+    std::atomic<int64_t> last_save{0};
+    std::atomic<int64_t> last_save_try{0};
+    std::atomic<bool> last_save_ok{true};
+    //writes since the last successful save; every write bumps it through touchKey()
+    std::atomic<uint64_t> dirty{0};
+    std::vector<SaveRule> save_rules;
+
+    //Delta checkpoints: the keys changed since the last save (valid only while every
+    //change since then is in it), and the chain of delta files on top of the base
+    size_t delta_max = 0;
+    bool delta_valid = false;
+    std::unordered_set<std::string> delta_keys;
+    uint64_t delta_base = 0;        //checksum of the base snapshot
+    uint64_t delta_base_bytes = 0;
+    std::vector<std::string> delta_files;
+    uint64_t delta_bytes = 0;
+
+    //Startup load
+    std::atomic<bool> loading_active{false};
+    std::atomic<uint64_t> load_bytes_total{0};
+    std::atomic<uint64_t> load_bytes_done{0};
+    std::atomic<uint64_t> load_keys{0};
+
+    //Keys whose values are on disk, guarded by db_mutex. cold_count mirrors
+    //cold_index.size(): once it is 0 lookups skip the index.
+    CowTable<ColdRef> cold_index;
+    std::atomic<size_t> cold_count{0};
+    size_t cold_strings = 0;
+
+    //Lazy load: lazy_pending of the cold keys are in lazy_file
+    bool lazy_load = false;
+    bool lazy_warm_up = false;
+    std::shared_ptr<SnapshotFile> lazy_file;
+    std::atomic<size_t> lazy_pending{0};
+    std::thread warmup_thread;
+
+    //Tiered storage: the rest are in tier_log. tier_log only changes under db_mutex;
+    //readers outside it hold their own reference.
+    std::string tier_path;
+    uint32_t tier_idle = 0;
+    size_t tier_min_bytes = 0;
+    std::shared_ptr<RedisValueLog> tier_log;
+    uint64_t tier_live_bytes = 0;
+    size_t tier_keys = 0;
+    std::atomic<uint64_t> tier_spilled{0};
+    std::atomic<uint64_t> tier_fetched{0};
+    //next shard and bucket to scan, per store (tier thread)
+    struct TierCursor {
+        size_t shard = 0;
+        size_t bucket = 0;
+    };
+    TierCursor tier_cursors[3];
+    //record bytes spilled since the heap was last trimmed, and when that was (tier thread)
+    uint64_t tier_untrimmed = 0;
+    std::chrono::steady_clock::time_point tier_trimmed;
+    std::thread tier_thread;
+    std::mutex tier_mutex;
+    std::condition_variable tier_cv;
+    bool tier_stop = false;
 
-    std::mutex db_mutex;
-    std::unordered_map<std::string, std::string> kv_store;
-    std::unordered_map<std::string, std::vector<std::string>> list_store;
-    std::unordered_map<std::string, std::unordered_map<std::string, std::string>> hash_store;
+    std::atomic<size_t> compress_min{0};
 
-    std::unordered_map<std::string, std::chrono::steady_clock::time_point> expire_map;
+    //INFO figures
+    std::mutex status_mutex;
+    DatasetStatus dataset_status;
+    std::atomic<size_t> blocked_count{0};
+    std::atomic<uint64_t> expired_keys{0};
 
 };
 #endif
@@ -0,0 +1,31 @@
+#ifndef REDIS_LZF_H
+#define REDIS_LZF_H
+
+#include <cstddef>
+#include <cstdint>
+
+//LZF compression (the format of liblzf, which Redis uses for RDB strings), self-contained.
+//
+//The output is a series of chunks:
+//  000LLLLL <L+1 literal bytes>                literal run of 1..32 bytes
+//  LLLooooo oooooooo                           back reference, length L+2 (L in 1..6)
+//  111ooooo LLLLLLLL oooooooo                  back reference, length L+9
+//where o is the distance back minus one (up to 8KB). Matches are found through a
+//hash table of 3-byte sequences, one probe per position: fast, not the best ratio.
+
+//Compress len bytes into out. Returns the compressed size, or 0 when it would not
+//fit in outLen bytes (pass outLen < len to only accept output that is smaller).
+size_t lzfCompress(const void* in, size_t len, void* out, size_t outLen);
+
+//Decompress into out, which must hold the original size. Returns the size
+//written, or 0 on corrupt input or when out is too small.
+size_t lzfDecompress(const void* in, size_t len, void* out, size_t outLen);
+
+//What compression saved over a set of strings
+struct LzfStats {
+    uint64_t strings = 0;     //strings stored compressed
+    uint64_t rawBytes = 0;    //their size uncompressed
+    uint64_t storedBytes = 0; //their size compressed
+};
+
+#endif
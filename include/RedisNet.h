@@ -0,0 +1,42 @@
+#ifndef REDIS_NET_H
+#define REDIS_NET_H
+
+#include <string>
+#include <vector>
+
+//Blocking socket helpers for the threads that talk to other servers as a client:
+//a replica to its master, a cluster node to its peers, MIGRATE to its target.
+
+//numeric address of the other end of fd, "?" when unknown
+std::string peerName(int fd);
+//numeric address of this end of fd: the address the other end reached us at
+std::string localName(int fd);
+
+//connected socket to host:port, -1 on failure or after timeoutMs (-1: no limit of our own)
+int connectTo(const std::string& host, int port, int timeoutMs = -1);
+
+//Idle connections kept by host:port for the next caller, e.g. MIGRATE moving a slot
+//batch after batch to one target. takeConnection returns a kept connection that is
+//still open, else a new one as connectTo; giveBack keeps it again once the caller
+//is done with it and no reply is outstanding (on errors, close it instead).
+//Connections unused for more than 10 seconds are closed.
+int takeConnection(const std::string& host, int port, int timeoutMs);
+void giveBack(const std::string& host, int port, int fd);
+
+//all of data, waiting up to timeoutMs in all (-1: no limit) for the other end to take it
+bool sendAll(int fd, const std::string& data, int timeoutMs = -1);
+
+//argv as a RESP array of bulk strings
+bool sendCommand(int fd, const std::vector<std::string>& argv);
+
+//wait up to timeoutMs (-1: no limit) for more bytes: 1 got some, 0 none yet, -1 closed or failed
+int receive(int fd, std::string& in, int timeoutMs);
+
+//the next line in in (without its CRLF), receiving more for up to timeoutMs (-1: no limit)
+bool readLine(int fd, std::string& in, std::string& line, int timeoutMs);
+
+//One RESP array of bulk strings (a command) at in[pos]: its length, 0 when it is
+//not complete yet, npos when in is not RESP arrays of bulk strings.
+size_t parseCommand(const std::string& in, size_t pos, std::vector<std::string>& argv);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef REDIS_PUBSUB_H
+#define REDIS_PUBSUB_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "RedisClient.h"
+
+//Channel and pattern subscriptions (SUBSCRIBE/PSUBSCRIBE/PUBLISH).
+//
+//A published message is serialized once per match kind (one "message" buffer for
+//the channel's subscribers, one "pmessage" buffer per matching pattern) and the
+//same refcounted buffer is pushed to every receiving client.
+//
+//Patterns are indexed by their literal prefix (the part before the first glob
+//character). PUBLISH only looks up the channel's prefixes whose lengths are in
+//use, so its cost does not grow with the number of unrelated patterns.
+class RedisPubSub {
+public:
+    static RedisPubSub& getInstance();
+
+    //each call queues the subscribe/unsubscribe confirmations on the client itself,
+    //under the registry lock, so they are always ordered before any message
+    void subscribe(RedisClient& client, const std::vector<std::string>& channels);
+    void unsubscribe(RedisClient& client, const std::vector<std::string>& channels);
+    void psubscribe(RedisClient& client, const std::vector<std::string>& patterns);
+    void punsubscribe(RedisClient& client, const std::vector<std::string>& patterns);
+
+    //drop every subscription of a disconnecting client
+    void removeClient(RedisClient& client);
+
+    //returns the number of clients that received the message
+    size_t publish(const std::string& channel, const std::string& message);
+
+private:
+    RedisPubSub() = default;
+    ~RedisPubSub() = default;
+    RedisPubSub(const RedisPubSub&) = delete;
+    RedisPubSub& operator=(const RedisPubSub&) = delete;
+
+    using ClientSet = std::unordered_set<RedisClient*>;
+
+    void unsubscribeChannel(RedisClient& client, const std::string& channel);
+    void unsubscribePattern(RedisClient& client, const std::string& pattern);
+    void confirm(RedisClient& client, const char* kind, const std::string& name);
+
+    std::mutex pubsub_mutex;
+    std::unordered_map<std::string, ClientSet> channels;
+
+    //literal prefix -> pattern -> subscribers
+    std::unordered_map<std::string, std::unordered_map<std::string, ClientSet>> patterns_by_prefix;
+    //prefix length -> number of distinct patterns with a prefix of that length
+    std::map<size_t, size_t> prefix_lengths;
+};
+
+//Redis style glob match: * ? [abc] [^a-z] and \ escapes
+bool globMatch(const std::string& pattern, const std::string& str);
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef REDIS_REPLICATION_H
+#define REDIS_REPLICATION_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "RedisClient.h"
+
+//Master-replica replication (REPLICAOF, PSYNC).
+//
+//A master feeds every write, RESP encoded as in the AOF, into a circular backlog
+//(--repl-backlog-size, 1MB by default; allocated when the first replica connects)
+//and to its replicas. The replication offset counts the bytes of that stream under
+//the current replication ID. A replica asks for PSYNC <replid> <offset + 1>: when
+//the ID is the master's and the backlog still holds everything after the offset,
+//the master answers +CONTINUE and sends just those bytes (partial resync).
+//Otherwise it answers +FULLRESYNC <replid> <offset>, then $<size> and a snapshot
+//taken at that offset, then the stream from there on; writes made while the
+//snapshot is on its way wait in a buffer of that replica.
+//
+//A replica runs a link thread that connects, syncs and applies the stream like an
+//AOF replay, acknowledging its offset with REPLCONF ACK every second. It adopts the
+//master's ID and offset and feeds the stream it applied into its own backlog, so
+//after a dropped link it resumes with a partial resync, and replicas of it can
+//too. Writes sent to a replica directly are not passed on. A replica promoted
+//with REPLICAOF NO ONE takes a new ID and keeps the old one as replid2 up to its
+//current offset, so its former siblings can still continue from it.
+//
+//Replicas are read-only unless --replica-read-only no: only the stream from the
+//master writes to them. WAIT on a master blocks a client until enough replicas
+//acknowledged the offset the stream had when WAIT was called, asking them for an
+//acknowledgement (REPLCONF GETACK) right away instead of waiting for the next one.
+class RedisReplication {
+public:
+    static RedisReplication& getInstance();
+
+    //set at startup
+    void setBacklogSize(size_t bytes) { backlog_size = bytes; }
+    void setListeningPort(int port) { listening_port = port; }
+    void setReadOnly(bool readOnly) { read_only = readOnly; }
+
+    //true on a replica that takes no writes from clients; a cheap check without the lock
+    bool readOnlyReplica() const { return replica_role && read_only; }
+    bool isReplica() const { return replica_role; }
+
+    //for ROLE and INFO
+    struct ReplicaInfo {
+        std::string address;
+        int port;
+        const char* state;          //handshake, send_bulk or online
+        uint64_t ackOffset;
+        int64_t lagSeconds;         //since its last acknowledgement
+    };
+    struct Status {
+        bool replica;
+        std::string masterHost;
+        int masterPort;
+        const char* linkState;      //connect, connecting, sync or connected
+        int64_t lastIoSecondsAgo;   //-1 while there is no link
+        bool readOnly;
+        std::string replid;
+        std::string replid2;
+        uint64_t offset;
+        uint64_t secondOffset;      //0 when there is no replid2
+        bool backlogActive;
+        size_t backlogSize;
+        uint64_t backlogFirstByte;
+        uint64_t backlogHistlen;
+        std::vector<ReplicaInfo> replicas;
+    };
+    Status status();
+
+    //Master side
+    //a write to pass on to the replicas; the caller holds db_mutex
+    void feed(const std::vector<std::string>& argv);
+    //PSYNC <replid> <offset>, or SYNC (withHeader false: always a full resync, sent
+    //without the +FULLRESYNC line). The answer is queued on the client itself;
+    //returns an error reply or "".
+    std::string psync(RedisClient& client, const std::string& replid, const std::string& offset, bool withHeader);
+    //REPLCONF listening-port <port> | ACK <offset> | ...
+    std::string replconf(RedisClient& client, const std::vector<std::string>& tokens);
+    //forget a disconnecting replica
+    void removeClient(RedisClient& client);
+    //WAIT: block until numReplicas replicas acknowledged the current offset, timeoutMs
+    //passed (0: no limit) or abandoned() says the client is gone. Returns how many did.
+    size_t wait(size_t numReplicas, long long timeoutMs, const std::function<bool()>& abandoned);
+
+    //Replica side: follow host:port, or become a master again when host is empty
+    void replicaOf(const std::string& host, int port);
+
+private:
+    RedisReplication();
+    ~RedisReplication();
+    RedisReplication(const RedisReplication&) = delete;
+    RedisReplication& operator=(const RedisReplication&) = delete;
+
+    struct Replica {
+        enum class State { Handshake, Snapshot, Online };
+        RedisClient* client;
+        std::string address;        //for the log; the socket may be gone by then
+        State state = State::Handshake;
+        std::string pending;        //stream held back while the snapshot is sent
+        uint64_t ackOffset = 0;
+        std::chrono::steady_clock::time_point ackTime = std::chrono::steady_clock::now();
+        int listeningPort = 0;
+    };
+
+    //all of these with repl_mutex held
+    std::shared_ptr<Replica> addReplica(RedisClient& client);
+    void createBacklog();
+    void appendStream(std::string bytes);
+    bool canContinue(const std::string& id, long long offset) const;
+    void backlogFrom(uint64_t offset, std::string& out) const;
+    void newReplid();
+
+    void cronLoop();
+    void linkLoop(std::string host, int port, uint64_t generation);
+    bool linkCurrent(uint64_t generation);
+    bool fullSync(int fd, std::string& in, const std::string& id, uint64_t offset);
+
+    std::mutex repl_mutex;
+    std::condition_variable repl_cv;
+    //signalled on every REPLCONF ACK, for WAIT
+    std::condition_variable ack_cv;
+    std::string replid;
+    //the previous ID, valid for offsets before second_offset (after a promotion)
+    std::string replid2;
+    uint64_t second_offset = 0;
+    uint64_t master_offset = 0;
+
+    size_t backlog_size = 1024 * 1024;
+    std::vector<char> backlog;
+    size_t backlog_idx = 0;        //where the next byte goes
+    uint64_t backlog_histlen = 0;  //bytes of history in it
+    //writes are encoded for the replicas: this is a master with a backlog
+    std::atomic<bool> feeding{false};
+    std::vector<std::shared_ptr<Replica>> replicas;
+    int listening_port = 0;
+
+    //replica side
+    std::string master_host;
+    int master_port = 0;
+    std::atomic<bool> replica_role{false};
+    std::atomic<bool> read_only{true};
+    const char* link_state = "connect";
+    std::chrono::steady_clock::time_point link_last_io{};
+    uint64_t link_generation = 0;  //bumped by every REPLICAOF
+    int link_fd = -1;
+    std::thread link_thread;
+
+    std::thread cron_thread;
+    bool stopping = false;
+};
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef REDIS_RESP_H
+#define REDIS_RESP_H
+
+#include <functional>
+#include <string>
+
+//A reply produced incrementally. Each call appends the next chunk to out and
+//returns true while more remains. Streams run without any database lock.
+using ReplyStream = std::function<bool(std::string& out)>;
+
+//Helpers for appending RESP replies in place, for code that serializes straight
+//from stored data into a reply buffer instead of building intermediate copies.
+
+inline void respAppendArrayHeader(std::string& out, size_t count)
+{
+    out += '*';
+    out += std::to_string(count);
+    out += "\r\n";
+}
+
+inline void respAppendBulk(std::string& out, const std::string& value)
+{
+    out += '$';
+    out += std::to_string(value.size());
+    out += "\r\n";
+    out += value;
+    out += "\r\n";
+}
+
+//bytes respAppendBulk will add for a value of the given length
+inline size_t respBulkSize(size_t len)
+{
+    return 1 + std::to_string(len).size() + 2 + len + 2;
+}
+
+#endif
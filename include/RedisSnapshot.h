@@ -0,0 +1,220 @@
+#ifndef REDIS_SNAPSHOT_H
+#define REDIS_SNAPSHOT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "RedisLzf.h"
+
+//Binary snapshot file (dump.my_rdb), version 3.
+//
+//  "MYRDB" <version byte>
+//  sections, each a run of records, each record optionally preceded by
+//  OP_EXPIRE_MS <8 byte LE unix time in ms>
+//    TYPE_STRING <key> <value>
+//    TYPE_LIST   <key> <varint count> <element>...
+//    TYPE_HASH   <key> <varint count> (<field> <value>)...
+//    TYPE_DELETE <key>                   (delta files only)
+//  OP_EOF <varint section count>
+//    per section: <varint offset> <varint length> <varint strings> <varint lists> <varint hashes> <8 byte CRC64>
+//  <8 byte LE offset of OP_EOF> <8 byte LE CRC64 of everything from OP_EOF on>
+//
+//Strings are a varint (LEB128) n followed by n >> 1 bytes, so keys and values
+//may hold any byte. When n & 1 is set the bytes are LZF compressed (RedisLzf.h)
+//and a varint with the uncompressed size comes before them; strings of at least
+//SNAPSHOT_COMPRESS_MIN bytes are stored that way when it makes them smaller. A section closes at the first record boundary after
+//SNAPSHOT_SECTION_BYTES. The index at the end lets a loader map the file, check
+//and decode the sections on several threads at once, and size its tables up front.
+//Writes go through a large buffer and land in a temporary file
+//(<target>.tmp.<pid>.<n>) that replaces the target only once it is complete and
+//synced.
+//The trailer checksum identifies a file (checksum()).
+//
+//Delta files (<snapshot>.delta.<n>) use the same format and hold only the keys
+//changed since the previous save, with TYPE_DELETE for keys that are gone. The
+//manifest (<snapshot>.manifest) names the base snapshot by its checksum and lists
+//the deltas to apply to it, oldest first; deltas of any other base are ignored.
+//Version 2 files are the same without compression (a plain varint length).
+//Version 1 files, one CRC over the whole file and no index, are read as a single
+//section.
+//
+//DUMP payloads (one key, for DUMP, RESTORE and MIGRATE) are a single record with
+//an empty key, laid out like Redis' own:
+//  <record> <2 byte LE snapshot version> <8 byte LE CRC64 of everything before>
+enum class SnapshotType : uint8_t { String = 0, List = 1, Hash = 2, Delete = 3 };
+
+//CRC-64/Jones (reflected, as used by Redis), slicing-by-8
+uint64_t crc64(uint64_t crc, const void* data, size_t len);
+
+class SnapshotWriter {
+public:
+    SnapshotWriter();
+    ~SnapshotWriter();
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+    //start writing a snapshot that will replace path on commit()
+    bool open(const std::string& path);
+    //or a DUMP payload, kept in memory: write one record, then take payload()
+    void openPayload();
+    std::string payload();
+
+    //expireAtMs: absolute unix time in milliseconds, or -1 for no expiry
+    void writeString(const std::string& key, const std::string& value, int64_t expireAtMs);
+    void writeList(const std::string& key, const std::vector<std::string>& list, int64_t expireAtMs);
+    void writeHash(const std::string& key, const std::unordered_map<std::string, std::string>& hash, int64_t expireAtMs);
+    //a string value kept LZF compressed in memory, written without recompressing it
+    void writeCompressedString(const std::string& key, const std::string& compressed, size_t rawSize, int64_t expireAtMs);
+    //delta files: key no longer exists
+    void writeDelete(const std::string& key);
+
+    //what compressing strings saved so far
+    const LzfStats& compression() const { return stats; }
+
+    //write the trailer, sync and move the file into place. False on any I/O error.
+    bool commit();
+    //the checksum in the trailer, once committed
+    uint64_t checksum() const { return crc; }
+
+private:
+    void beginRecord(SnapshotType type, const std::string& key, int64_t expireAtMs);
+    void putByte(uint8_t byte);
+    void putVarint(uint64_t value);
+    void putFixed64(uint64_t value);
+    void putString(const std::string& value);
+    void putRaw(const char* data, size_t len);
+    void reserve(size_t bytes);
+    bool flushBuffer();
+    void endSection();
+
+    struct SectionInfo {
+        uint64_t offset;
+        uint64_t length;
+        uint64_t counts[3];  //records by SnapshotType
+        uint64_t crc;
+    };
+
+    int fd = -1;
+    bool in_memory = false;
+    std::string path;
+    std::string tmp_path;
+    std::vector<char> buffer;
+    size_t used = 0;
+    size_t crc_from = 0;     //bytes before this in buffer are already in crc
+    uint64_t flushed = 0;    //bytes written to the file
+    uint64_t crc = 0;
+    bool failed = false;
+    SectionInfo section{};
+    std::vector<SectionInfo> sections;
+    std::string scratch;     //compression output
+    LzfStats stats;
+};
+
+//One decoded key
+struct SnapshotEntry {
+    SnapshotType type = SnapshotType::String;
+    std::string key;
+    int64_t expireAtMs = -1;
+    std::string str;
+    std::vector<std::string> list;
+    std::unordered_map<std::string, std::string> hash;
+};
+
+//A snapshot file mapped into memory, with its section index
+class SnapshotFile {
+public:
+    struct Section {
+        const char* begin;
+        const char* end;
+        uint64_t strings = 0;
+        uint64_t lists = 0;
+        uint64_t hashes = 0;
+        //bytes covered by crc (for version 1 the whole file, header included)
+        const char* check_begin;
+        const char* check_end;
+        uint64_t crc;
+        uint8_t version;
+    };
+
+    SnapshotFile() = default;
+    ~SnapshotFile();
+    SnapshotFile(const SnapshotFile&) = delete;
+    SnapshotFile& operator=(const SnapshotFile&) = delete;
+
+    //true when path starts with the snapshot magic (older dumps are plain text)
+    static bool isSnapshot(const std::string& path);
+
+    //map path and read its index; the sections are not checked yet
+    bool open(const std::string& path);
+    const std::vector<Section>& sections() const { return parts; }
+    uint64_t size() const { return length; }
+    //the trailer checksum, the same as SnapshotWriter::checksum() gave
+    uint64_t checksum() const { return file_checksum; }
+    const std::string& error() const { return error_message; }
+
+    //CRC check of one section; sections may be checked concurrently
+    static bool verify(const Section& section);
+
+private:
+    bool fail(const char* message);
+    bool openVersion1();
+    bool openIndex(uint8_t version);
+
+    void* map = nullptr;
+    uint64_t length = 0;
+    uint64_t file_checksum = 0;
+    std::vector<Section> parts;
+    std::string error_message;
+};
+
+//The delta chain of a snapshot: which base it belongs to and the deltas to apply
+struct SnapshotManifest {
+    uint64_t base = 0;
+    std::vector<std::string> deltas;
+
+    //false when there is no readable manifest
+    bool read(const std::string& path);
+    //replace path atomically
+    bool write(const std::string& path) const;
+};
+
+//Decodes the records of one section
+class SectionDecoder {
+public:
+    explicit SectionDecoder(const SnapshotFile::Section& section)
+        : p(section.begin), end(section.end), compressed_strings(section.version >= 3) {}
+
+    //decode the next key into entry. False at the end of the section or on a
+    //format error; ok() then tells which.
+    bool next(SnapshotEntry& entry);
+    //like next(), but only the expiry, type and key; the value is skipped and
+    //value is left pointing at it for readValue()
+    bool nextKey(SnapshotEntry& entry, const char*& value);
+    //decode the value nextKey() skipped; entry.type must be the record's type
+    bool readValue(const char* value, SnapshotEntry& entry);
+    bool ok() const { return error_message == nullptr; }
+    const char* error() const { return error_message; }
+
+private:
+    bool fail(const char* message);
+    bool getByte(uint8_t& byte);
+    bool getVarint(uint64_t& value);
+    bool getFixed64(uint64_t& value);
+    bool getString(std::string& out);
+    bool skipString();
+    bool header(SnapshotEntry& entry);
+    bool body(SnapshotEntry& entry);
+
+    const char* p;
+    const char* end;
+    bool compressed_strings;
+    const char* error_message = nullptr;
+};
+
+//decode a DUMP payload; false when its version or checksum is wrong or it does
+//not hold exactly one value
+bool readPayload(const std::string& payload, SnapshotEntry& entry);
+
+#endif
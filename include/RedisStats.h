@@ -0,0 +1,112 @@
+#ifndef REDIS_STATS_H
+#define REDIS_STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "RedisCommandTable.h"
+
+//Server statistics for INFO.
+//
+//Counters are kept per thread: a connection thread is the only writer of its own,
+//so a bump is a relaxed load and store, with no locked instruction and no cache
+//line shared with another thread. totals() adds up the counters of every live
+//thread and what exited threads left behind, without stopping anyone. A sampler
+//thread records the totals ten times a second for the instantaneous rates (the
+//average over the last 16 samples, as in Redis). Nothing here takes db_mutex.
+class RedisStats {
+public:
+    static RedisStats& getInstance();
+
+    //set at startup
+    void setListeningPort(int port) { listening_port = port; }
+    int listeningPort() const { return listening_port; }
+
+    //the calling thread's counters. info is nullptr for an unknown command, which
+    //only counts towards the total.
+    void commandCalled(const CommandInfo* info, uint64_t usec);
+    void bytesIn(size_t bytes);
+    void bytesOut(size_t bytes);
+    //connections are rare next to commands: these are plain shared counters
+    void clientConnected();
+    void clientDisconnected();
+
+    struct CommandStat {
+        uint64_t calls = 0;
+        uint64_t usec = 0;
+    };
+    struct Totals {
+        uint64_t commands = 0;
+        uint64_t netInput = 0;
+        uint64_t netOutput = 0;
+        std::vector<CommandStat> perCommand;    //by commandIndex()
+    };
+    //perCommand false leaves Totals::perCommand empty
+    Totals totals(bool perCommand = true);
+
+    struct Rates {
+        uint64_t opsPerSec;
+        double inputKbps;
+        double outputKbps;
+    };
+    Rates rates();
+
+    uint64_t connectedClients() const { return connected_clients; }
+    uint64_t connectionsReceived() const { return connections_received; }
+    int64_t uptimeSeconds() const;
+
+    //heap bytes in use as malloc counts them and the most seen, both as the sampler
+    //last measured them (once a second), and the resident set size of the process
+    size_t usedMemory() const { return used_memory; }
+    size_t peakMemory() const { return peak_memory; }
+    size_t residentMemory();
+
+private:
+    RedisStats();
+    ~RedisStats();
+    RedisStats(const RedisStats&) = delete;
+    RedisStats& operator=(const RedisStats&) = delete;
+
+    struct ThreadCounters;
+    struct ThreadSlot;
+    //the calling thread's counters, registered on first use
+    static ThreadCounters& local();
+    static void add(Totals& into, const ThreadCounters& counters);
+
+    void samplerLoop();
+    //ask malloc, which takes every arena lock: only the sampler does
+    size_t measureMemory();
+    void sampleMemory();
+
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+    int listening_port = 0;
+    std::atomic<uint64_t> connected_clients{0};
+    std::atomic<uint64_t> connections_received{0};
+    std::atomic<size_t> used_memory{0};
+    std::atomic<size_t> peak_memory{0};
+
+    //the counters of live threads, and the sum of those of threads that exited
+    std::mutex stats_mutex;
+    std::vector<ThreadCounters*> live;
+    Totals retired;
+
+    //ring of per-second rates, one per sample: commands, input and output bytes
+    struct Sample {
+        uint64_t ops = 0;
+        uint64_t input = 0;
+        uint64_t output = 0;
+    };
+    std::mutex sample_mutex;
+    std::condition_variable sample_cv;
+    std::vector<Sample> samples;
+    size_t sample_idx = 0;
+    bool stopping = false;
+    std::thread sampler_thread;
+};
+
+#endif
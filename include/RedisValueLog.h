@@ -0,0 +1,47 @@
+#ifndef REDIS_VALUE_LOG_H
+#define REDIS_VALUE_LOG_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+//Append-structured file of values spilled by tiered storage (see TIERED STORAGE
+//in RedisDatabase.cpp).
+//
+//  record: <4 byte LE length> <8 byte LE CRC64 of the bytes> <bytes>
+//
+//A record is named by its offset and length; nothing in the file says which key
+//it belongs to. Records are never rewritten in place: a value read back or deleted
+//just leaves dead bytes, which compaction drops by copying the live records to a
+//new log. The file is scratch space, not persistence: every value in it is also
+//written to snapshots and the AOF, and a new log is started at every boot.
+class RedisValueLog {
+public:
+    RedisValueLog() = default;
+    ~RedisValueLog();
+    RedisValueLog(const RedisValueLog&) = delete;
+    RedisValueLog& operator=(const RedisValueLog&) = delete;
+
+    //start an empty log at path. The new file replaces path by rename, so logs
+    //still open on the old file keep reading it.
+    bool create(const std::string& path);
+    //give the file another name, replacing whatever is there; unlink() drops it
+    bool moveTo(const std::string& path);
+    void unlink();
+    const std::string& path() const { return file_path; }
+
+    //add one record; false on I/O error. One writer at a time.
+    bool append(const std::string& bytes, uint64_t& offset);
+    //read the record at offset back; false on I/O error or a damaged record.
+    //Safe from any thread, concurrently with append().
+    bool read(uint64_t offset, uint32_t length, std::string& bytes) const;
+
+    uint64_t size() const { return end; }
+
+private:
+    int fd = -1;
+    std::string file_path;
+    std::atomic<uint64_t> end{0};
+};
+
+#endif
@@ -0,0 +1,436 @@
+#include "RedisAof.h"
+#include "RedisResp.h"
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//everysec: the longest a write may sit in the file unsynced
+static const auto AOF_SYNC_INTERVAL = std::chrono::seconds(1);
+//wait this long before retrying a failed write
+static const auto AOF_RETRY_DELAY = std::chrono::seconds(1);
+//rewrite: bytes buffered before each write to the temporary file
+static const size_t REWRITE_BUFFER_SIZE = 1 << 20;
+//rewrite: rounds of copying captured commands before the writer takes the rest,
+//stopping early once a round is this small
+static const int REWRITE_DRAIN_ROUNDS = 10;
+static const size_t REWRITE_DRAIN_SMALL = 64 * 1024;
+
+//last byte offset each thread appended, for waitDurable()
+static thread_local uint64_t last_appended = 0;
+
+RedisAof& RedisAof::getInstance()
+{
+    static RedisAof instance;
+    return instance;
+}
+
+RedisAof::~RedisAof()
+{
+    close();
+}
+
+static bool writeAll(int out, const char* data, size_t len)
+{
+    while(len > 0) {
+        ssize_t n = ::write(out, data, len);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool RedisAof::open(const std::string& filename, AofFsync fsyncPolicy)
+{
+    int opened = ::open(filename.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if(opened < 0) {
+        std::cerr << "Error opening " << filename << ": " << std::strerror(errno) << "\n";
+        return false;
+    }
+    struct stat st;
+    uint64_t size = fstat(opened, &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+    //INFO may look at these while the dataset is still loading
+    std::lock_guard<std::mutex> lock(aof_mutex);
+    fd = opened;
+    file_size = base_size = size;
+    path = filename;
+    policy = fsyncPolicy;
+    stopping = false;
+    writer = std::thread(&RedisAof::writerLoop, this);
+    return true;
+}
+
+void RedisAof::append(const std::vector<std::string>& argv)
+{
+    std::lock_guard<std::mutex> lock(aof_mutex);
+    size_t before = pending.size();
+    respAppendArrayHeader(pending, argv.size());
+    for(const auto& arg : argv) respAppendBulk(pending, arg);
+    appended += pending.size() - before;
+    pending_bytes = pending.size();
+    last_appended = appended;
+    if(capturing) rewrite_buffer.append(pending, before, std::string::npos);
+
+    //a non-empty buffer means the writer has been told already
+    if(before == 0) work_cv.notify_one();
+}
+
+void RedisAof::waitDurable()
+{
+    if(policy != AofFsync::Always || durable >= last_appended) return;
+    std::unique_lock<std::mutex> lock(aof_mutex);
+    durable_cv.wait(lock, [this]() { return durable >= last_appended; });
+}
+
+void RedisAof::close()
+{
+    if(!writer.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(aof_mutex);
+        stopping = true;
+    }
+    //a rewrite still producing the dataset gives up
+    if(rewriter.joinable()) rewriter.join();
+    work_cv.notify_one();
+    writer.join();
+    ::close(fd);
+    fd = -1;
+}
+
+RedisAof::Status RedisAof::status()
+{
+    //atomics, not aof_mutex: INFO doesn't wait behind appends or a rewrite's swap
+    return Status{fd >= 0, rewrite_running.load(), file_size, base_size, pending_bytes};
+}
+
+void RedisAof::writerLoop()
+{
+    auto lastSync = std::chrono::steady_clock::now();
+    bool unsynced = false;
+    auto ready = [this]() { return stopping || !pending.empty() || rewrite_ready; };
+
+    std::unique_lock<std::mutex> lock(aof_mutex);
+    while(true) {
+        if(policy == AofFsync::EverySec && unsynced) work_cv.wait_until(lock, lastSync + AOF_SYNC_INTERVAL, ready);
+        else work_cv.wait(lock, ready);
+
+        if(rewrite_ready) {
+            finishRewrite(lock);
+            unsynced = false;
+            continue;
+        }
+
+        writing.swap(pending);
+        pending_bytes = 0;
+        uint64_t upTo = appended;
+        uint64_t batchBytes = writing.size();
+        bool stop = stopping;
+        lock.unlock();
+
+        if(!writing.empty()) {
+            writeBatch(writing);
+            writing.clear();
+            unsynced = true;
+        }
+        auto now = std::chrono::steady_clock::now();
+        bool sync = unsynced && (policy == AofFsync::Always || stop ||
+                                 (policy == AofFsync::EverySec && now - lastSync >= AOF_SYNC_INTERVAL));
+        if(sync) {
+            if(fdatasync(fd) != 0) std::cerr << "AOF fdatasync failed: " << std::strerror(errno) << "\n";
+            lastSync = now;
+            unsynced = false;
+        }
+
+        lock.lock();
+        file_size += batchBytes;
+        durable = upTo;
+        durable_cv.notify_all();
+        if(stop && pending.empty()) break;
+
+        if(auto_rewrite_percentage > 0 && file_size >= auto_rewrite_min_size &&
+           file_size >= base_size + base_size * static_cast<uint64_t>(auto_rewrite_percentage) / 100 &&
+           !rewrite_running && dataset_writer)
+        {
+            std::cout << "AOF grew from " << base_size << " to " << file_size << " bytes, rewriting it\n";
+            startRewrite();
+        }
+    }
+}
+
+void RedisAof::writeBatch(const std::string& batch)
+{
+    size_t done = 0;
+    while(done < batch.size()) {
+        ssize_t n = ::write(fd, batch.data() + done, batch.size() - done);
+        if(n >= 0) {
+            done += static_cast<size_t>(n);
+            continue;
+        }
+        if(errno == EINTR) continue;
+
+        //the log must not skip commands: keep retrying the rest of the batch
+        std::cerr << "AOF write failed: " << std::strerror(errno) << (stopping ? ", giving up\n" : ", retrying\n");
+        if(stopping) return;
+        std::this_thread::sleep_for(AOF_RETRY_DELAY);
+    }
+}
+
+// REWRITE
+
+void RedisAof::setDatasetWriter(DatasetWriter writer)
+{
+    std::lock_guard<std::mutex> lock(aof_mutex);
+    dataset_writer = std::move(writer);
+}
+
+void RedisAof::setAutoRewrite(int percentage, uint64_t minSize)
+{
+    std::lock_guard<std::mutex> lock(aof_mutex);
+    auto_rewrite_percentage = percentage;
+    auto_rewrite_min_size = minSize;
+}
+
+bool RedisAof::rewriteInBackground()
+{
+    std::lock_guard<std::mutex> lock(aof_mutex);
+    if(fd < 0 || stopping) return false;
+    return startRewrite();
+}
+
+bool RedisAof::startRewrite()
+{
+    if(rewrite_running || !dataset_writer) return false;
+    //the previous rewrite has finished; its thread is at most returning
+    if(rewriter.joinable()) rewriter.join();
+    rewrite_running = true;
+    rewriter = std::thread(&RedisAof::rewriteLoop, this);
+    return true;
+}
+
+void RedisAof::rewriteLoop()
+{
+    std::string tmp = path + ".tmp." + std::to_string(getpid());
+    int out = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = out >= 0;
+    std::string buffer;
+    uint64_t written = 0;
+    auto flush = [&]() {
+        if(ok && !writeAll(out, buffer.data(), buffer.size())) ok = false;
+        written += buffer.size();
+        buffer.clear();
+    };
+
+    if(ok) {
+        Emit emit = [&](const std::vector<std::string>& argv) {
+            if(!ok || stopping) return;
+            respAppendArrayHeader(buffer, argv.size());
+            for(const auto& arg : argv) respAppendBulk(buffer, arg);
+            if(buffer.size() >= REWRITE_BUFFER_SIZE) flush();
+        };
+        //from here on every append is captured for the new file as well
+        dataset_writer(emit, [this]() {
+            std::lock_guard<std::mutex> lock(aof_mutex);
+            capturing = true;
+        });
+        flush();
+
+        //copy what was captured meanwhile; the writer takes the last of it
+        for(int round = 0; ok && !stopping && round < REWRITE_DRAIN_ROUNDS; ++round) {
+            {
+                std::lock_guard<std::mutex> lock(aof_mutex);
+                buffer.swap(rewrite_buffer);
+            }
+            size_t copied = buffer.size();
+            flush();
+            if(copied < REWRITE_DRAIN_SMALL) break;
+        }
+        if(ok && fdatasync(out) != 0) ok = false;
+    }
+
+    std::lock_guard<std::mutex> lock(aof_mutex);
+    if(!ok || stopping) {
+        if(!ok) std::cerr << "AOF rewrite failed writing " << tmp << ": " << std::strerror(errno) << "\n";
+        if(out >= 0) ::close(out);
+        unlink(tmp.c_str());
+        endRewrite();
+        return;
+    }
+    rewrite_fd = out;
+    rewrite_path = tmp;
+    rewrite_size = written;
+    rewrite_ready = true;
+    work_cv.notify_one();
+}
+
+void RedisAof::finishRewrite(std::unique_lock<std::mutex>& lock)
+{
+    //Writer thread, so no batch is in flight. What was captured so far is copied and
+    //synced with aof_mutex free, since every writer appends under it while holding
+    //db_mutex; only what arrives meanwhile is copied under the lock, where no append
+    //can land until the new file is in place. That short tail is synced after.
+    std::string captured;
+    captured.swap(rewrite_buffer);
+    lock.unlock();
+    bool ok = writeAll(rewrite_fd, captured.data(), captured.size()) && fdatasync(rewrite_fd) == 0;
+    lock.lock();
+    ok = ok && writeAll(rewrite_fd, rewrite_buffer.data(), rewrite_buffer.size()) &&
+         rename(rewrite_path.c_str(), path.c_str()) == 0;
+    if(!ok) {
+        std::cerr << "AOF rewrite failed: " << std::strerror(errno) << "\n";
+        ::close(rewrite_fd);
+        unlink(rewrite_path.c_str());
+        rewrite_fd = -1;
+        endRewrite();
+        return;
+    }
+    ::close(fd);
+    fd = rewrite_fd;
+    file_size = base_size = rewrite_size + captured.size() + rewrite_buffer.size();
+    //whatever was pending is either in the snapshot or was captured behind it
+    pending.clear();
+    pending_bytes = 0;
+    uint64_t upTo = appended;
+    rewrite_fd = -1;
+    endRewrite();
+    std::cout << "Background AOF rewrite finished: " << file_size << " bytes\n";
+
+    lock.unlock();
+    if(fdatasync(fd) != 0) std::cerr << "AOF fdatasync failed: " << std::strerror(errno) << "\n";
+    lock.lock();
+    durable = upTo;
+    durable_cv.notify_all();
+}
+
+void RedisAof::endRewrite()
+{
+    capturing = false;
+    rewrite_ready = false;
+    std::string().swap(rewrite_buffer);
+    rewrite_running = false;
+}
+
+// REPLAY
+
+namespace {
+enum class ParseStatus { Ok, Incomplete, Corrupt };
+}
+
+//"<prefix><decimal>\r\n"
+static ParseStatus parseLength(const char*& p, const char* end, char prefix, size_t& value)
+{
+    if(p == end) return ParseStatus::Incomplete;
+    if(*p != prefix) return ParseStatus::Corrupt;
+    ++p;
+
+    value = 0;
+    const char* digits = p;
+    while(p < end && *p >= '0' && *p <= '9') {
+        if(p - digits >= 18) return ParseStatus::Corrupt;
+        value = value * 10 + static_cast<size_t>(*p - '0');
+        ++p;
+    }
+    if(end - p < 2) return ParseStatus::Incomplete;
+    if(p == digits || p[0] != '\r' || p[1] != '\n') return ParseStatus::Corrupt;
+    p += 2;
+    return ParseStatus::Ok;
+}
+
+//one "*<n>\r\n" array of n "$<len>\r\n<bytes>\r\n" strings
+static ParseStatus parseCommand(const char*& p, const char* end, std::vector<std::string>& argv)
+{
+    size_t count;
+    ParseStatus status = parseLength(p, end, '*', count);
+    if(status != ParseStatus::Ok) return status;
+    if(count == 0) return ParseStatus::Corrupt;
+    //every argument takes at least 6 bytes; more than fits can only be a cut-off tail
+    if(count > static_cast<size_t>(end - p) / 6) return ParseStatus::Incomplete;
+
+    argv.resize(count);
+    for(auto& arg : argv) {
+        size_t len;
+        status = parseLength(p, end, '$', len);
+        if(status != ParseStatus::Ok) return status;
+        if(static_cast<size_t>(end - p) < len + 2) return ParseStatus::Incomplete;
+        if(p[len] != '\r' || p[len + 1] != '\n') return ParseStatus::Corrupt;
+        arg.assign(p, len);
+        p += len + 2;
+    }
+    return ParseStatus::Ok;
+}
+
+bool RedisAof::replay(const std::string& path, const std::function<void(std::vector<std::string>&)>& apply,
+                      size_t& commands)
+{
+    commands = 0;
+    int in = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(in < 0) {
+        std::cerr << "Error opening " << path << ": " << std::strerror(errno) << "\n";
+        return false;
+    }
+    struct stat st;
+    if(fstat(in, &st) != 0) {
+        std::cerr << "Error reading " << path << ": " << std::strerror(errno) << "\n";
+        ::close(in);
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    if(size == 0) {
+        ::close(in);
+        return true;
+    }
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, in, 0);
+    ::close(in);
+    if(map == MAP_FAILED) {
+        std::cerr << "Error mapping " << path << ": " << std::strerror(errno) << "\n";
+        return false;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    const char* begin = static_cast<const char*>(map);
+    const char* end = begin + size;
+    const char* p = begin;
+    const char* complete = begin; //end of the last record outside a transaction
+    bool inMulti = false;
+    std::vector<std::string> argv;
+    ParseStatus status = ParseStatus::Ok;
+    while(p < end) {
+        const char* start = p;
+        status = parseCommand(p, end, argv);
+        if(status != ParseStatus::Ok) {
+            p = start;
+            break;
+        }
+        //apply may consume argv, so look at it first
+        if(strcasecmp(argv[0].c_str(), "MULTI") == 0) inMulti = true;
+        else if(strcasecmp(argv[0].c_str(), "EXEC") == 0) inMulti = false;
+        apply(argv);
+        ++commands;
+        if(!inMulti) complete = p;
+    }
+    size_t failedAt = static_cast<size_t>(p - begin);
+    size_t keep = static_cast<size_t>(complete - begin);
+    munmap(map, size);
+
+    if(status == ParseStatus::Corrupt) {
+        std::cerr << "Bad format in " << path << " at offset " << failedAt << "\n";
+        return false;
+    }
+    if(keep < size) {
+        std::cerr << "Warning: " << path << " ends with an incomplete command or transaction; truncating it from "
+                  << size << " to " << keep << " bytes\n";
+        if(truncate(path.c_str(), static_cast<off_t>(keep)) != 0) {
+            std::cerr << "Error truncating " << path << ": " << std::strerror(errno) << "\n";
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,200 @@
+#include "RedisBitmap.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define REDIS_BITMAP_X86 1
+#endif
+
+static inline uint64_t loadWord(const unsigned char* p)
+{
+    uint64_t w;
+    std::memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+static inline void storeWord(unsigned char* p, uint64_t w)
+{
+    std::memcpy(p, &w, sizeof(w));
+}
+
+// Portable kernels: 64 bits at a time, used as the fallback and for tails.
+
+static uint64_t popcountGeneric(const unsigned char* p, size_t n)
+{
+    uint64_t count = 0;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w = loadWord(p + i);
+        // SWAR popcount so this path never depends on a POPCNT instruction
+        w = w - ((w >> 1) & 0x5555555555555555ULL);
+        w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+        w = (w + (w >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+        count += (w * 0x0101010101010101ULL) >> 56;
+    }
+    for (; i < n; ++i) {
+        count += __builtin_popcount(p[i]);
+    }
+    return count;
+}
+
+static void bitopGeneric(BitOp op, unsigned char* dst, const unsigned char* src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t s = loadWord(src + i);
+        uint64_t d = loadWord(dst + i);
+        switch (op) {
+            case BitOp::AND: d &= s; break;
+            case BitOp::OR:  d |= s; break;
+            case BitOp::XOR: d ^= s; break;
+            case BitOp::NOT: d = ~s; break;
+        }
+        storeWord(dst + i, d);
+    }
+    for (; i < n; ++i) {
+        switch (op) {
+            case BitOp::AND: dst[i] &= src[i]; break;
+            case BitOp::OR:  dst[i] |= src[i]; break;
+            case BitOp::XOR: dst[i] ^= src[i]; break;
+            case BitOp::NOT: dst[i] = ~src[i]; break;
+        }
+    }
+}
+
+#ifdef REDIS_BITMAP_X86
+
+// Hardware POPCNT: four independent accumulators keep the popcnt ports busy.
+__attribute__((target("popcnt")))
+static uint64_t popcountHw(const unsigned char* p, size_t n)
+{
+    uint64_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        c0 += __builtin_popcountll(loadWord(p + i));
+        c1 += __builtin_popcountll(loadWord(p + i + 8));
+        c2 += __builtin_popcountll(loadWord(p + i + 16));
+        c3 += __builtin_popcountll(loadWord(p + i + 24));
+    }
+    for (; i + 8 <= n; i += 8) {
+        c0 += __builtin_popcountll(loadWord(p + i));
+    }
+    for (; i < n; ++i) {
+        c0 += __builtin_popcount(p[i]);
+    }
+    return c0 + c1 + c2 + c3;
+}
+
+// AVX2 nibble-lookup popcount (pshufb into a 16 entry table, summed with psadbw).
+__attribute__((target("avx2,popcnt")))
+static uint64_t popcountAvx2(const unsigned char* p, size_t n)
+{
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i lowMask = _mm256_set1_epi8(0x0f);
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        __m256i lo = _mm256_and_si256(v, lowMask);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), lowMask);
+        __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo), _mm256_shuffle_epi8(lut, hi));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(cnt, _mm256_setzero_si256()));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + popcountHw(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void bitopAvx2(BitOp op, unsigned char* dst, const unsigned char* src, size_t n)
+{
+    size_t i = 0;
+    const __m256i ones = _mm256_set1_epi8(static_cast<char>(0xff));
+    for (; i + 32 <= n; i += 32) {
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+        switch (op) {
+            case BitOp::AND: d = _mm256_and_si256(d, s); break;
+            case BitOp::OR:  d = _mm256_or_si256(d, s); break;
+            case BitOp::XOR: d = _mm256_xor_si256(d, s); break;
+            case BitOp::NOT: d = _mm256_xor_si256(s, ones); break;
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), d);
+    }
+    bitopGeneric(op, dst + i, src + i, n - i);
+}
+
+#endif
+
+// Runtime dispatch: resolved once, on first use.
+
+using PopcountFn = uint64_t (*)(const unsigned char*, size_t);
+using BitopFn = void (*)(BitOp, unsigned char*, const unsigned char*, size_t);
+
+struct BitmapKernels {
+    PopcountFn popcount = popcountGeneric;
+    BitopFn bitop = bitopGeneric;
+    const char* name = "generic";
+
+    BitmapKernels()
+    {
+#ifdef REDIS_BITMAP_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+            popcount = popcountAvx2;
+            bitop = bitopAvx2;
+            name = "avx2";
+        } else if (__builtin_cpu_supports("popcnt")) {
+            popcount = popcountHw;
+            name = "popcnt";
+        }
+#endif
+    }
+};
+
+static const BitmapKernels& kernels()
+{
+    static const BitmapKernels k;
+    return k;
+}
+
+uint64_t bitmapPopcount(const unsigned char* p, size_t n)
+{
+    return kernels().popcount(p, n);
+}
+
+void bitmapOp(BitOp op, unsigned char* dst, const unsigned char* src, size_t n)
+{
+    kernels().bitop(op, dst, src, n);
+}
+
+const char* bitmapKernelName()
+{
+    return kernels().name;
+}
+
+int64_t bitmapFirstBit(const unsigned char* p, size_t n, int bit)
+{
+    // Words that are all 0 (searching for 1) or all 1 (searching for 0) are skipped
+    // whole; the first interesting word is byte-swapped so clz gives the MSB-first index.
+    const uint64_t skip = bit ? 0 : ~0ULL;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w = loadWord(p + i);
+        if (w == skip) continue;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        w = __builtin_bswap64(w);
+#endif
+        if (!bit) w = ~w;
+        return static_cast<int64_t>(i * 8 + __builtin_clzll(w));
+    }
+    for (; i < n; ++i) {
+        unsigned char b = bit ? p[i] : static_cast<unsigned char>(~p[i]);
+        if (b == 0) continue;
+        return static_cast<int64_t>(i * 8 + (__builtin_clz(b) - 24));
+    }
+    return -1;
+}
@@ -0,0 +1,175 @@
+#include "RedisClient.h"
+#include "RedisStats.h"
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+//Output buffer limits for subscribers, as in Redis' "client-output-buffer-limit pubsub 32mb 8mb 60":
+//a subscriber is dropped once it has 32MB queued, or has stayed above 8MB for 60 seconds.
+static const size_t PUBSUB_HARD_LIMIT = 32 * 1024 * 1024;
+static const size_t PUBSUB_SOFT_LIMIT = 8 * 1024 * 1024;
+static const std::chrono::seconds PUBSUB_SOFT_SECONDS(60);
+//and for replicas, as in "client-output-buffer-limit replica 256mb 64mb 60"
+static const size_t REPLICA_HARD_LIMIT = 256 * 1024 * 1024;
+static const size_t REPLICA_SOFT_LIMIT = 64 * 1024 * 1024;
+static const std::chrono::seconds REPLICA_SOFT_SECONDS(60);
+
+RedisClient::RedisClient(int fd) : socket_fd(fd)
+{
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        std::cerr << "Warning: eventfd() failed: " << std::strerror(errno) << "\n";
+    }
+}
+
+RedisClient::~RedisClient()
+{
+    if (wake_fd >= 0) close(wake_fd);
+}
+
+bool RedisClient::peerClosed() const
+{
+    if (socket_fd < 0) return false;
+
+    struct pollfd pfd;
+    pfd.fd = socket_fd;
+    pfd.events = POLLRDHUP;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) <= 0) return false;
+    return (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR | POLLNVAL)) != 0;
+}
+
+void RedisClient::reply(std::string data)
+{
+    if (data.empty()) return;
+    std::lock_guard<std::mutex> lock(out_mutex);
+    if (close_requested) return;
+    queued_bytes += data.size();
+    out_queue.push_back(std::make_shared<const std::string>(std::move(data)));
+}
+
+bool RedisClient::push(const Buffer& buffer)
+{
+    bool wasEmpty;
+    {
+        std::lock_guard<std::mutex> lock(out_mutex);
+        if (close_requested) return false;
+
+        wasEmpty = out_queue.empty();
+        out_queue.push_back(buffer);
+        queued_bytes += buffer->size();
+
+        if ((subscriptions > 0 || replica) && overLimit(std::chrono::steady_clock::now())) {
+            closeAsync(replica ? "replica output buffer limit reached" : "pubsub output buffer limit reached");
+            return false;
+        }
+    }
+
+    //the owner drains the whole queue per wakeup, so only the first push needs to signal
+    if (wasEmpty && wake_fd >= 0) {
+        uint64_t one = 1;
+        (void)write(wake_fd, &one, sizeof(one));
+    }
+    return true;
+}
+
+bool RedisClient::overLimit(std::chrono::steady_clock::time_point now)
+{
+    //caller holds out_mutex
+    size_t hard = replica ? REPLICA_HARD_LIMIT : PUBSUB_HARD_LIMIT;
+    size_t soft = replica ? REPLICA_SOFT_LIMIT : PUBSUB_SOFT_LIMIT;
+    auto softSeconds = replica ? REPLICA_SOFT_SECONDS : PUBSUB_SOFT_SECONDS;
+    if (queued_bytes > hard) return true;
+
+    if (queued_bytes <= soft) {
+        soft_limit_since = {};
+        return false;
+    }
+    if (soft_limit_since == std::chrono::steady_clock::time_point{}) {
+        soft_limit_since = now;
+        return false;
+    }
+    return now - soft_limit_since >= softSeconds;
+}
+
+void RedisClient::disconnect(const char* reason)
+{
+    std::lock_guard<std::mutex> lock(out_mutex);
+    if (!close_requested) closeAsync(reason);
+}
+
+void RedisClient::closeAsync(const char* reason)
+{
+    //caller holds out_mutex. Shutting the socket down kicks the owning thread out of
+    //a blocked send()/poll(); it then notices close_requested and tears down.
+    std::cerr << "Closing client " << socket_fd << ": " << reason << "\n";
+    close_requested = true;
+    out_queue.clear();
+    queued_bytes = 0;
+    ::shutdown(socket_fd, SHUT_RDWR);
+    if (wake_fd >= 0) {
+        uint64_t one = 1;
+        (void)write(wake_fd, &one, sizeof(one));
+    }
+}
+
+void RedisClient::setStream(ReplyStream stream)
+{
+    reply_stream = std::move(stream);
+}
+
+ReplyStream RedisClient::takeStream()
+{
+    ReplyStream stream = std::move(reply_stream);
+    reply_stream = nullptr;
+    return stream;
+}
+
+bool RedisClient::flush()
+{
+    while (true) {
+        Buffer next;
+        {
+            std::lock_guard<std::mutex> lock(out_mutex);
+            if (close_requested) return false;
+            if (!out_queue.empty()) {
+                next = std::move(out_queue.front());
+                out_queue.pop_front();
+                queued_bytes -= next->size();
+            }
+        }
+
+        if (!next) {
+            if (!reply_stream) return true;
+
+            //the queue is drained: produce the next chunk of the streamed reply
+            std::string chunk;
+            if (!reply_stream(chunk)) reply_stream = nullptr;
+            if (chunk.empty()) continue;
+            next = std::make_shared<const std::string>(std::move(chunk));
+        }
+
+        //write without holding out_mutex so publishers never wait on a slow socket
+        size_t sent = 0;
+        while (sent < next->size()) {
+            ssize_t n = send(socket_fd, next->data() + sent, next->size() - sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            sent += static_cast<size_t>(n);
+        }
+        RedisStats::getInstance().bytesOut(sent);
+    }
+}
+
+void RedisClient::drainWakeups()
+{
+    if (wake_fd < 0) return;
+    uint64_t count;
+    while (read(wake_fd, &count, sizeof(count)) > 0) {}
+}
@@ -0,0 +1,606 @@
+#include "RedisCluster.h"
+#include "RedisDatabase.h"
+#include "RedisNet.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//every node gossips with every other this often
+static const auto GOSSIP_PERIOD = std::chrono::seconds(1);
+//for connecting to a node and for its answer
+static const int GOSSIP_TIMEOUT_MS = 2000;
+//a node not heard from for this long is flagged fail? in CLUSTER NODES
+static const auto NODE_TIMEOUT = std::chrono::seconds(15);
+
+//CRC16-CCITT (XModem), as Redis Cluster uses
+static uint16_t crc16(const char* data, size_t len)
+{
+    static const auto table = []() {
+        std::vector<uint16_t> t(256);
+        for(int i = 0; i < 256; ++i) {
+            uint16_t crc = static_cast<uint16_t>(i << 8);
+            for(int bit = 0; bit < 8; ++bit) crc = (crc & 0x8000) ? static_cast<uint16_t>((crc << 1) ^ 0x1021) : static_cast<uint16_t>(crc << 1);
+            t[i] = crc;
+        }
+        return t;
+    }();
+    uint16_t crc = 0;
+    for(size_t i = 0; i < len; ++i) {
+        crc = static_cast<uint16_t>((crc << 8) ^ table[((crc >> 8) ^ static_cast<uint8_t>(data[i])) & 0xff]);
+    }
+    return crc;
+}
+
+int keyHashSlot(const std::string& key)
+{
+    size_t open = key.find('{');
+    if(open != std::string::npos) {
+        size_t close = key.find('}', open + 1);
+        if(close != std::string::npos && close > open + 1) {
+            return crc16(key.data() + open + 1, close - open - 1) & (CLUSTER_SLOTS - 1);
+        }
+    }
+    return crc16(key.data(), key.size()) & (CLUSTER_SLOTS - 1);
+}
+
+static std::string newNodeId()
+{
+    static const char HEX[] = "0123456789abcdef";
+    std::random_device seed;
+    std::mt19937_64 random(seed());
+    std::string id;
+    for(int i = 0; i < 40; ++i) id += HEX[random() & 15];
+    return id;
+}
+
+//"0-99,200" <-> slot numbers; "-" for none
+static std::string formatSlots(const std::vector<int>& slots, char separator)
+{
+    std::string out;
+    for(size_t i = 0; i < slots.size(); ) {
+        size_t j = i;
+        while(j + 1 < slots.size() && slots[j + 1] == slots[j] + 1) ++j;
+        if(!out.empty()) out += separator;
+        out += std::to_string(slots[i]);
+        if(j > i) out += "-" + std::to_string(slots[j]);
+        i = j + 1;
+    }
+    return out;
+}
+
+static bool parseSlotRange(const std::string& text, std::vector<int>& slots)
+{
+    char* end = nullptr;
+    long first = std::strtol(text.c_str(), &end, 10);
+    long last = first;
+    if(*end == '-') last = std::strtol(end + 1, &end, 10);
+    if(text.empty() || *end != '\0' || first < 0 || last < first || last >= CLUSTER_SLOTS) return false;
+    for(long slot = first; slot <= last; ++slot) slots.push_back(static_cast<int>(slot));
+    return true;
+}
+
+static bool parseSlots(const std::string& text, std::vector<int>& slots)
+{
+    if(text == "-") return true;
+    std::istringstream in(text);
+    std::string range;
+    while(std::getline(in, range, ',')) {
+        if(!parseSlotRange(range, slots)) return false;
+    }
+    return true;
+}
+
+//send argv and read the RESP array it is answered with
+static bool exchange(int fd, const std::vector<std::string>& argv, std::vector<std::string>& answer)
+{
+    if(!sendCommand(fd, argv)) return false;
+    std::string in;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(GOSSIP_TIMEOUT_MS);
+    while(true) {
+        size_t used = parseCommand(in, 0, answer);
+        if(used == std::string::npos) return false;
+        if(used > 0) return !answer.empty();
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if(left.count() <= 0 || receive(fd, in, static_cast<int>(left.count())) < 0) return false;
+    }
+}
+
+RedisCluster& RedisCluster::getInstance()
+{
+    static RedisCluster instance;
+    return instance;
+}
+
+RedisCluster::~RedisCluster()
+{
+    {
+        std::lock_guard<std::mutex> lock(cluster_mutex);
+        stopping = true;
+    }
+    cluster_cv.notify_all();
+    if(cron_thread.joinable()) cron_thread.join();
+}
+
+bool RedisCluster::enable(const std::string& configFile, const std::string& announceHost, int port)
+{
+    std::lock_guard<std::mutex> lock(cluster_mutex);
+    config_file = configFile;
+    struct stat st;
+    if(stat(config_file.c_str(), &st) == 0) {
+        if(!loadConfig()) {
+            std::cerr << "Bad cluster config file " << config_file << "\n";
+            return false;
+        }
+        std::cout << "Cluster node " << myself->id << " loaded from " << config_file << "\n";
+    } else {
+        myself = addNode(newNodeId(), announceHost, port);
+        std::cout << "No cluster config found, new cluster node " << myself->id << "\n";
+    }
+    myself->port = port;
+    if(!announceHost.empty()) myself->host = announceHost;
+    saveConfig();
+    cluster_enabled = true;
+    cron_thread = std::thread([this]() { cronLoop(); });
+    return true;
+}
+
+RedisCluster::Node* RedisCluster::addNode(const std::string& id, const std::string& host, int port)
+{
+    std::unique_ptr<Node>& node = node_table[id];
+    if(!node) {
+        node.reset(new Node);
+        node->id = id;
+    }
+    node->host = host;
+    node->port = port;
+    return node.get();
+}
+
+RedisCluster::Node* RedisCluster::findNode(const std::string& id)
+{
+    auto it = node_table.find(id);
+    return it == node_table.end() ? nullptr : it->second.get();
+}
+
+void RedisCluster::bumpEpoch()
+{
+    myself->configEpoch = ++current_epoch;
+}
+
+bool RedisCluster::suspect(const Node& node) const
+{
+    return &node != myself && !node.linked && std::chrono::steady_clock::now() - node.lastSeen > NODE_TIMEOUT;
+}
+
+// ROUTING
+
+RedisCluster::Route RedisCluster::route(const std::vector<std::string>& keys, bool asking, std::string& reply)
+{
+    if(keys.empty()) return Route::Local;
+    int slot = keyHashSlot(keys[0]);
+    for(size_t i = 1; i < keys.size(); ++i) {
+        if(keyHashSlot(keys[i]) != slot) {
+            reply = "-CROSSSLOT Keys in request don't hash to the same slot\r\n";
+            return Route::Redirect;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(cluster_mutex);
+    auto address = [slot](const Node* node) {
+        return std::to_string(slot) + " " + node->host + ":" + std::to_string(node->port) + "\r\n";
+    };
+    const Node* owner = slot_owner[slot];
+    if(!owner) {
+        reply = "-CLUSTERDOWN Hash slot not served\r\n";
+        return Route::Redirect;
+    }
+    if(owner == myself) {
+        auto migrating = migrating_to.find(slot);
+        if(migrating == migrating_to.end()) return Route::Local;
+        reply = "-ASK " + address(migrating->second);
+        return Route::Migrating;
+    }
+    if(asking && importing_from.count(slot)) return Route::Importing;
+    reply = "-MOVED " + address(owner);
+    return Route::Redirect;
+}
+
+// GOSSIP
+//
+// A message is: sender ID, its host ("" when it does not know the address the
+// others reach it at), its port, the current epoch, its config epoch, the slots it
+// claims, then ID, host and port of each other node it knows.
+
+std::vector<std::string> RedisCluster::message()
+{
+    std::vector<int> mine;
+    for(int slot = 0; slot < CLUSTER_SLOTS; ++slot) {
+        if(slot_owner[slot] == myself) mine.push_back(slot);
+    }
+    std::vector<std::string> body = {myself->id, myself->host, std::to_string(myself->port),
+                                     std::to_string(current_epoch), std::to_string(myself->configEpoch),
+                                     mine.empty() ? "-" : formatSlots(mine, ',')};
+    for(const auto& entry : node_table) {
+        const Node& node = *entry.second;
+        if(&node == myself || node.host.empty()) continue;
+        body.insert(body.end(), {node.id, node.host, std::to_string(node.port)});
+    }
+    return body;
+}
+
+bool RedisCluster::merge(const std::vector<std::string>& body, size_t at, const std::string& host)
+{
+    if(body.size() < at + 6 || (body.size() - at - 6) % 3 != 0) return false;
+    const std::string& id = body[at];
+    if(id == myself->id) return false;
+    char* end = nullptr;
+    long port = std::strtol(body[at + 2].c_str(), &end, 10);
+    if(*end != '\0' || port <= 0 || port > 65535) return false;
+    uint64_t currentEpoch = std::strtoull(body[at + 3].c_str(), nullptr, 10);
+    uint64_t configEpoch = std::strtoull(body[at + 4].c_str(), nullptr, 10);
+    std::vector<int> claimed;
+    if(!parseSlots(body[at + 5], claimed)) return false;
+
+    bool changed = false;
+    std::string address = body[at + 1].empty() ? host : body[at + 1];
+    Node* node = findNode(id);
+    if(!node) {
+        node = addNode(id, address, static_cast<int>(port));
+        std::cout << "Cluster: node " << id << " at " << address << ":" << port << " joined\n";
+        changed = true;
+    } else if(node->host != address || node->port != port) {
+        node->host = address;
+        node->port = static_cast<int>(port);
+        changed = true;
+    }
+    if(!node->linked) std::cout << "Cluster: link to node " << id << " is up\n";
+    node->linked = true;
+    node->lastSeen = std::chrono::steady_clock::now();
+    if(node->configEpoch != configEpoch) {
+        node->configEpoch = configEpoch;
+        changed = true;
+    }
+    current_epoch = std::max({current_epoch, currentEpoch, configEpoch});
+
+    //what a node says about its own slots wins over older claims
+    size_t taken = 0;
+    for(int slot : claimed) {
+        Node* owner = slot_owner[slot];
+        if(owner == node || (owner && owner->configEpoch >= configEpoch)) continue;
+        if(owner == myself) migrating_to.erase(slot);
+        slot_owner[slot] = node;
+        ++taken;
+    }
+    if(taken > 0) {
+        std::cout << "Cluster: " << taken << " slots now served by " << id << "\n";
+        changed = true;
+    }
+
+    for(size_t i = at + 6; i + 2 < body.size(); i += 3) {
+        if(body[i] == myself->id || body[i + 1].empty() || findNode(body[i])) continue;
+        long otherPort = std::strtol(body[i + 2].c_str(), &end, 10);
+        if(*end != '\0' || otherPort <= 0 || otherPort > 65535) continue;
+        addNode(body[i], body[i + 1], static_cast<int>(otherPort));
+        std::cout << "Cluster: heard of node " << body[i] << " at " << body[i + 1] << ":" << otherPort << "\n";
+        changed = true;
+    }
+    return changed;
+}
+
+std::string RedisCluster::gossip(const std::vector<std::string>& tokens, const std::string& peer,
+                                 const std::string& local, std::vector<std::string>& answer)
+{
+    std::lock_guard<std::mutex> lock(cluster_mutex);
+    if(myself->host.empty()) myself->host = local;
+    if(tokens.size() < 8 || tokens[2] == myself->id) return "-ERR Bad gossip message\r\n";
+    if(merge(tokens, 2, peer)) saveConfig();
+    answer = message();
+    return "";
+}
+
+void RedisCluster::cronLoop()
+{
+    //node ID -> socket to that node; only this thread touches them
+    std::unordered_map<std::string, int> links;
+    struct Peer {
+        std::string id;
+        std::string host;
+        int port;
+    };
+    std::unique_lock<std::mutex> lock(cluster_mutex);
+    while(!stopping) {
+        cluster_cv.wait_for(lock, GOSSIP_PERIOD, [this]() { return stopping; });
+        if(stopping) break;
+        std::vector<Peer> peers;
+        for(const auto& entry : node_table) {
+            const Node& node = *entry.second;
+            if(&node != myself) peers.push_back({node.id, node.host, node.port});
+        }
+        std::vector<std::string> command = {"CLUSTER", "GOSSIP"};
+        std::vector<std::string> body = message();
+        command.insert(command.end(), body.begin(), body.end());
+        lock.unlock();
+
+        for(const auto& peer : peers) {
+            auto link = links.find(peer.id);
+            if(link == links.end()) {
+                int fd = connectTo(peer.host, peer.port, GOSSIP_TIMEOUT_MS);
+                if(fd >= 0) link = links.emplace(peer.id, fd).first;
+            }
+            std::vector<std::string> answer;
+            bool ok = link != links.end() && exchange(link->second, command, answer);
+            std::string local = ok ? localName(link->second) : "";
+            if(!ok && link != links.end()) {
+                ::close(link->second);
+                links.erase(link);
+            }
+
+            std::lock_guard<std::mutex> guard(cluster_mutex);
+            if(ok) {
+                if(myself->host.empty()) myself->host = local;
+                if(merge(answer, 0, peer.host)) saveConfig();
+            } else if(Node* node = findNode(peer.id)) {
+                if(node->linked) std::cout << "Cluster: lost link to node " << peer.id << "\n";
+                node->linked = false;
+            }
+        }
+        lock.lock();
+    }
+    for(const auto& link : links) ::close(link.second);
+}
+
+// CLUSTER SUBCOMMANDS
+
+std::string RedisCluster::meet(const std::string& host, int port)
+{
+    int fd = connectTo(host, port, GOSSIP_TIMEOUT_MS);
+    if(fd < 0) return "-ERR Can't connect to " + host + ":" + std::to_string(port) + "\r\n";
+    std::vector<std::string> command = {"CLUSTER", "GOSSIP"};
+    {
+        std::lock_guard<std::mutex> lock(cluster_mutex);
+        if(myself->host.empty()) myself->host = localName(fd);
+        std::vector<std::string> body = message();
+        command.insert(command.end(), body.begin(), body.end());
+    }
+    std::vector<std::string> answer;
+    bool ok = exchange(fd, command, answer);
+    ::close(fd);
+    if(!ok) return "-ERR " + host + ":" + std::to_string(port) + " did not answer as a cluster node\r\n";
+
+    std::lock_guard<std::mutex> lock(cluster_mutex);
+    if(merge(answer, 0, host)) saveConfig();
+    return "";
+}
+
+std::string RedisCluster::addSlots(const std::vector<int>& slots)
+{
+    std::lock_guard<std::mutex> lock(cluster_mutex);
+    for(int slot : slots) {
+        if(slot_owner[slot]) return "-ERR Slot " + std::to_string(slot) + " is already busy\r\n";
+    }
+    bumpEpoch();
+    for(int slot : slots) {
+        slot_owner[slot] = myself;
+        importing_from.erase(slot);
+    }
+    saveConfig();
+    return "";
+}
+
+std::string RedisCluster::delSlots(const std::vector<int>& slots)
+{
+    std::lock_guard<std::mutex> lock(cluster_mutex);
+    for(int slot : slots) {
+        if(!slot_owner[slot]) return "-ERR Slot " + std::to_string(slot) + " is already unassigned\r\n";
+    }
+    for(int slot : slots) {
+        slot_owner[slot] = nullptr;
+        migrating_to.erase(slot);
+        importing_from.erase(slot);
+    }
+    saveConfig();
+    return "";
+}
+
+std::string RedisCluster::setSlot(int slot, const std::string& how, const std::string& nodeId)
+{
+    //looked at before cluster_mutex is taken: the keyspace lock comes first
+    bool holdsKeys = how == "NODE" && !RedisDatabase::getInstance().keysInSlot(slot, 1).empty();
+
+    std::lock_guard<std::mutex> lock(cluster_mutex);
+    if(how == "STABLE") {
+        migrating_to.erase(slot);
+        importing_from.erase(slot);
+        saveConfig();
+        return "";
+    }
+    Node* node = findNode(nodeId);
+    if(!node) return "-ERR I don't know about node " + nodeId + "\r\n";
+    if(how == "MIGRATING") {
+        if(slot_owner[slot] != myself) return "-ERR I'm not the owner of hash slot " + std::to_string(slot) + "\r\n";
+        if(node == myself) return "-ERR I can't migrate a slot to myself\r\n";
+        migrating_to[slot] = node;
+    } else if(how == "IMPORTING") {
+        if(slot_owner[slot] == myself) return "-ERR I'm already the owner of hash slot " + std::to_string(slot) + "\r\n";
+        if(node == myself) return "-ERR I can't import a slot from myself\r\n";
+        importing_from[slot] = node;
+    } else if(how == "NODE") {
+        if(slot_owner[slot] == myself && node != myself && holdsKeys) {
+            return "-ERR Can't assign hashslot " + std::to_string(slot) +
+                   " to a different node while I still hold keys for this hash slot.\r\n";
+        }
+        migrating_to.erase(slot);
+        if(node == myself) {
+            //the end of an import: claim the slot with an epoch the old owner can't match
+            if(slot_owner[slot] != myself) bumpEpoch();
+            importing_from.erase(slot);
+        }
+        slot_owner[slot] = node;
+    } else {
+        return "-ERR Invalid CLUSTER SETSLOT action or number of arguments\r\n";
+    }
+    saveConfig();
+    return "";
+}
+
+std::string RedisCluster::myId()
+{
+    std::lock_guard<std::mutex> lock(cluster_mutex);
+    return myself->id;
+}
+
+std::string RedisCluster::nodes()
+{
+    std::lock_guard<std::mutex> lock(cluster_mutex);
+    return nodesText();
+}
+
+std::string RedisCluster::nodesText()
+{
+    std::unordered_map<const Node*, std::vector<int>> owned;
+    for(int slot = 0; slot < CLUSTER_SLOTS; ++slot) {
+        if(slot_owner[slot]) owned[slot_owner[slot]].push_back(slot);
+    }
+    auto now = std::chrono::steady_clock::now();
+    int64_t nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+
+    //Redis' layout: id host:port@cport flags master ping-sent pong-recv epoch link slots...
+    std::string out;
+    for(const auto& entry : node_table) {
+        const Node& node = *entry.second;
+        bool self = &node == myself;
+        int64_t seenMs = self ? 0 : nowMs - std::chrono::duration_cast<std::chrono::milliseconds>(now - node.lastSeen).count();
+        out += node.id + " " + node.host + ":" + std::to_string(node.port) + "@" + std::to_string(node.port) + " ";
+        out += self ? "myself,master" : suspect(node) ? "master,fail?" : "master";
+        out += " - 0 " + std::to_string(seenMs) + " " + std::to_string(node.configEpoch) + " ";
+        out += self || node.linked ? "connected" : "disconnected";
+        auto slots = owned.find(&node);
+        if(slots != owned.end()) out += " " + formatSlots(slots->second, ' ');
+        if(self) {
+            for(const auto& move : migrating_to) out += " [" + std::to_string(move.first) + "->-" + move.second->id + "]";
+            for(const auto& move : importing_from) out += " [" + std::to_string(move.first) + "-<-" + move.second->id + "]";
+        }
+        out += "\n";
+    }
+    return out;
+}
+
+std::string RedisCluster::info()
+{
+    std::lock_guard<std::mutex> lock(cluster_mutex);
+    size_t assigned = 0, pfail = 0;
+    std::unordered_map<const Node*, bool> serving;
+    for(const Node* owner : slot_owner) {
+        if(!owner) continue;
+        ++assigned;
+        if(suspect(*owner)) ++pfail;
+        serving[owner] = true;
+    }
+    std::string out;
+    auto field = [&out](const std::string& name, const std::string& value) { out += name + ":" + value + "\r\n"; };
+    field("cluster_state", assigned == CLUSTER_SLOTS ? "ok" : "fail");
+    field("cluster_slots_assigned", std::to_string(assigned));
+    field("cluster_slots_ok", std::to_string(assigned - pfail));
+    field("cluster_slots_pfail", std::to_string(pfail));
+    field("cluster_slots_fail", "0");
+    field("cluster_known_nodes", std::to_string(node_table.size()));
+    field("cluster_size", std::to_string(serving.size()));
+    field("cluster_current_epoch", std::to_string(current_epoch));
+    field("cluster_my_epoch", std::to_string(myself->configEpoch));
+    return out;
+}
+
+std::vector<RedisCluster::SlotRange> RedisCluster::slotRanges()
+{
+    std::lock_guard<std::mutex> lock(cluster_mutex);
+    std::vector<SlotRange> ranges;
+    for(int slot = 0; slot < CLUSTER_SLOTS; ) {
+        const Node* owner = slot_owner[slot];
+        int last = slot;
+        while(last + 1 < CLUSTER_SLOTS && slot_owner[last + 1] == owner) ++last;
+        if(owner) ranges.push_back({slot, last, owner->id, owner->host, owner->port});
+        slot = last + 1;
+    }
+    return ranges;
+}
+
+// CONFIG FILE
+//
+// The CLUSTER NODES lines, with this node's slots on the move in brackets, then
+// "vars currentEpoch <n>". Rewritten whole, through a temporary file, on every change.
+
+bool RedisCluster::loadConfig()
+{
+    std::ifstream in(config_file);
+    if(!in) return false;
+    std::vector<std::pair<int, std::string>> migrating, importing;
+    std::string line;
+    while(std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::vector<std::string> tokens;
+        std::string token;
+        while(fields >> token) tokens.push_back(token);
+        if(tokens.empty()) continue;
+        if(tokens[0] == "vars") {
+            for(size_t i = 1; i + 1 < tokens.size(); i += 2) {
+                if(tokens[i] == "currentEpoch") current_epoch = std::strtoull(tokens[i + 1].c_str(), nullptr, 10);
+            }
+            continue;
+        }
+        if(tokens.size() < 8) return false;
+        const std::string& address = tokens[1];
+        size_t colon = address.rfind(':', address.find('@'));
+        if(colon == std::string::npos) return false;
+        int port = std::atoi(address.c_str() + colon + 1);
+        Node* node = addNode(tokens[0], address.substr(0, colon), port);
+        node->configEpoch = std::strtoull(tokens[6].c_str(), nullptr, 10);
+        if(tokens[2].find("myself") != std::string::npos) myself = node;
+        for(size_t i = 8; i < tokens.size(); ++i) {
+            const std::string& slots = tokens[i];
+            if(slots[0] == '[') {
+                size_t arrow = slots.find("->-");
+                bool out = arrow != std::string::npos;
+                if(!out) arrow = slots.find("-<-");
+                if(arrow == std::string::npos || slots.back() != ']') return false;
+                int slot = std::atoi(slots.c_str() + 1);
+                std::string other = slots.substr(arrow + 3, slots.size() - arrow - 4);
+                (out ? migrating : importing).push_back({slot, other});
+                continue;
+            }
+            std::vector<int> owned;
+            if(!parseSlotRange(slots, owned)) return false;
+            for(int slot : owned) slot_owner[slot] = node;
+        }
+    }
+    if(!myself) return false;
+    for(const auto& move : migrating) {
+        if(Node* node = findNode(move.second)) migrating_to[move.first] = node;
+    }
+    for(const auto& move : importing) {
+        if(Node* node = findNode(move.second)) importing_from[move.first] = node;
+    }
+    return true;
+}
+
+void RedisCluster::saveConfig()
+{
+    std::string tmp = config_file + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        out << nodesText() << "vars currentEpoch " << current_epoch << "\n";
+        out.flush();
+        if(!out) {
+            std::cerr << "Cluster: can't write " << tmp << "\n";
+            return;
+        }
+    }
+    if(std::rename(tmp.c_str(), config_file.c_str()) != 0) {
+        std::cerr << "Cluster: can't replace " << config_file << "\n";
+    }
+}
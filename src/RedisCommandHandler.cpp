@@ -1,5 +1,17 @@
 #include "RedisCommandHandler.h"
+#include "RedisAof.h"
+#include "RedisCluster.h"
+#include "RedisCommandTable.h"
 #include "RedisDatabase.h"
+#include "RedisNet.h"
+#include "RedisPubSub.h"
+#include "RedisReplication.h"
+#include "RedisStats.h"
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <sys/utsname.h>
+#include <unistd.h>
 
 
 //RESP parser:
@@ -83,8 +95,18 @@ static std::string handleEcho(const std::vector<std::string>& tokens, RedisDatab
     return "$" + std::to_string(msg.size()) + "\r\n" + msg + "\r\n"; 
 }
 
-static std::string handleFlushAll(const std::vector<std::string>& /*tokens*/, RedisDatabase& db) {
-    db.flushAll();
+static std::string handleFlushAll(const std::vector<std::string>& tokens, RedisDatabase& db) {
+    bool async = false;
+    if (tokens.size() > 2) {
+        return "-ERR syntax error\r\n";
+    }
+    if (tokens.size() == 2) {
+        std::string mode = tokens[1];
+        std::transform(mode.begin(), mode.end(), mode.begin(), ::toupper);
+        if (mode == "ASYNC") async = true;
+        else if (mode != "SYNC") return "-ERR syntax error\r\n";
+    }
+    db.flushAll(async);
     return "+OK\r\n";
 }
 
@@ -120,9 +142,62 @@ static std::string handleDel(const std::vector<std::string>& tokens, RedisDataba
     if (tokens.size() < 2) {
         return "-ERR wrong number of arguments for " + tokens[0] + "command. Requires key\r\n";
     } else {
-        bool res = db.del(tokens[1]);
-        return ":" + std::string(res ? "1" : "0") + "\r\n";
+        std::vector<std::string> keys(tokens.begin() + 1, tokens.end());
+        return ":" + std::to_string(db.del(keys)) + "\r\n";
+    }
+}
+
+static std::string handleUnlink(const std::vector<std::string>& tokens, RedisDatabase& db) {
+    if (tokens.size() < 2) {
+        return "-ERR wrong number of arguments for " + tokens[0] + "command. Requires key\r\n";
+    } else {
+        std::vector<std::string> keys(tokens.begin() + 1, tokens.end());
+        return ":" + std::to_string(db.unlink(keys)) + "\r\n";
+    }
+}
+
+static std::string handleExists(const std::vector<std::string>& tokens, RedisDatabase& db) {
+    if (tokens.size() < 2) {
+        return "-ERR wrong number of arguments for 'EXISTS' command\r\n";
+    }
+    std::vector<std::string> keys(tokens.begin() + 1, tokens.end());
+    return ":" + std::to_string(db.exists(keys)) + "\r\n";
+}
+
+static std::string handleMget(const std::vector<std::string>& tokens, RedisDatabase& db) {
+    if (tokens.size() < 2) {
+        return "-ERR wrong number of arguments for 'MGET' command\r\n";
+    }
+    std::vector<std::string> keys(tokens.begin() + 1, tokens.end());
+    std::string reply;
+    db.mget(keys, reply);
+    return reply;
+}
+
+//MSET/MSETNX arguments: key value [key value ...]
+static bool parsePairs(const std::vector<std::string>& tokens, std::vector<std::pair<std::string, std::string>>& pairs) {
+    if (tokens.size() < 3 || tokens.size() % 2 == 0) return false;
+    for (size_t i = 1; i + 1 < tokens.size(); i += 2) {
+        pairs.emplace_back(tokens[i], tokens[i + 1]);
+    }
+    return true;
+}
+
+static std::string handleMset(const std::vector<std::string>& tokens, RedisDatabase& db) {
+    std::vector<std::pair<std::string, std::string>> pairs;
+    if (!parsePairs(tokens, pairs)) {
+        return "-ERR wrong number of arguments for 'MSET' command\r\n";
     }
+    db.mset(pairs);
+    return "+OK\r\n";
+}
+
+static std::string handleMsetnx(const std::vector<std::string>& tokens, RedisDatabase& db) {
+    std::vector<std::pair<std::string, std::string>> pairs;
+    if (!parsePairs(tokens, pairs)) {
+        return "-ERR wrong number of arguments for 'MSETNX' command\r\n";
+    }
+    return db.msetnx(pairs) ? ":1\r\n" : ":0\r\n";
 }
 
 static std::string handleKeys(const std::vector<std::string>& tokens, RedisDatabase& db) {
@@ -137,12 +212,29 @@ static std::string handleKeys(const std::vector<std::string>& tokens, RedisDatab
     return response.str();
 }
 
+//EXPIRE's seconds from now as a unix time in ms; false when that overflows
+static bool expireAtMs(long long seconds, long long& atMs)
+{
+    long long nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    if(seconds > (LLONG_MAX - nowMs) / 1000 || seconds < LLONG_MIN / 1000) return false;
+    atMs = nowMs + seconds * 1000;
+    return true;
+}
+
 static std::string handleExpire(const std::vector<std::string>& tokens, RedisDatabase& db) {
-    if (tokens.size() < 2) {
+    if (tokens.size() < 3) {
         return "-ERR wrong number of arguments for " + tokens[0] + "command. Requires key and seconds.\r\n";
     } else {
-        int seconds = std::stoi(tokens[2]);        
-        if(db.expire(tokens[1], seconds)){
+        char* end = nullptr;
+        long long seconds = std::strtoll(tokens[2].c_str(), &end, 10);
+        if(tokens[2].empty() || *end != '\0')
+            return "-ERR value is not an integer or out of range\r\n";
+        //the database keeps int seconds on a steady clock
+        long long atMs;
+        if(!expireAtMs(seconds, atMs) || seconds > INT_MAX || seconds < INT_MIN)
+            return "-ERR invalid expire time in 'expire' command\r\n";
+        if(db.expire(tokens[1], static_cast<int>(seconds))){
             return + "+OK\r\n";
         } else {
             return "-Error: Key not found\r\n";
@@ -150,6 +242,16 @@ static std::string handleExpire(const std::vector<std::string>& tokens, RedisDat
     }
 }
 
+static std::string handlePexpireat(const std::vector<std::string>& tokens, RedisDatabase& db) {
+    if (tokens.size() < 3)
+        return "-ERR wrong number of arguments for 'PEXPIREAT' command\r\n";
+    char* end = nullptr;
+    long long unixMs = std::strtoll(tokens[2].c_str(), &end, 10);
+    if (tokens[2].empty() || *end != '\0')
+        return "-ERR value is not an integer or out of range\r\n";
+    return db.expireAt(tokens[1], unixMs) ? ":1\r\n" : ":0\r\n";
+}
+
 static std::string handleRename(const std::vector<std::string>& tokens, RedisDatabase& db) {
     if (tokens.size() < 3) {
         return "-Error: RENAME requires old key and new key\r\n";
@@ -167,8 +269,110 @@ static std::string handleCopy(const std::vector<std::string>& tokens, RedisDatab
     {
         return "-Error: COPY requires key to be copied, and name of new key\r\n";
     }
-    int response = db.copy(tokens[1], tokens[2]);
-    return response == 1 ?  "+OK\r\n" : "-Error: Copy Key already exists.\r\n";
+    bool replace = false;
+    for(size_t i = 3; i < tokens.size(); ++i) {
+        std::string opt = tokens[i];
+        std::transform(opt.begin(), opt.end(), opt.begin(), ::toupper);
+        if(opt != "REPLACE") return "-ERR syntax error\r\n";
+        replace = true;
+    }
+    if(tokens[1] == tokens[2])
+        return "-ERR source and destination objects are the same\r\n";
+
+    //:1 when copied, :0 when the source is missing or the destination exists
+    return ":" + std::to_string(db.copy(tokens[1], tokens[2], replace)) + "\r\n";
+}
+
+static std::string handleDump(const std::vector<std::string>& tokens, RedisDatabase& db)
+{
+    if(tokens.size() != 2)
+        return "-ERR wrong number of arguments for 'DUMP' command\r\n";
+    std::string payload;
+    if(!db.dumpKey(tokens[1], payload)) return "$-1\r\n";
+    std::string reply;
+    respAppendBulk(reply, payload);
+    return reply;
+}
+
+//RESTORE key ttl payload [REPLACE] [ABSTTL]: ttl is in milliseconds, a unix time with
+//ABSTTL; 0 keeps the expiry the payload carries
+static std::string handleRestore(const std::vector<std::string>& tokens, RedisDatabase& db)
+{
+    if(tokens.size() < 4)
+        return "-ERR wrong number of arguments for 'RESTORE' command\r\n";
+    char* end = nullptr;
+    long long ttl = std::strtoll(tokens[2].c_str(), &end, 10);
+    if(tokens[2].empty() || *end != '\0')
+        return "-ERR value is not an integer or out of range\r\n";
+    if(ttl < 0)
+        return "-ERR Invalid TTL value, must be >= 0\r\n";
+    bool replace = false, absolute = false;
+    for(size_t i = 4; i < tokens.size(); ++i) {
+        std::string option = tokens[i];
+        std::transform(option.begin(), option.end(), option.begin(), ::toupper);
+        if(option == "REPLACE") replace = true;
+        else if(option == "ABSTTL") absolute = true;
+        else return "-ERR syntax error\r\n";
+    }
+
+    //decoded before taking the lock
+    SnapshotEntry entry;
+    if(!readPayload(tokens[3], entry))
+        return "-ERR DUMP payload version or checksum are wrong\r\n";
+    if(ttl > 0) {
+        long long nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        if(!absolute && ttl > LLONG_MAX - nowMs)
+            return "-ERR invalid expire time in 'restore' command\r\n";
+        entry.expireAtMs = absolute ? ttl : nowMs + ttl;
+    }
+    if(!db.restoreKey(tokens[1], entry, replace))
+        return "-BUSYKEY Target key name already exists.\r\n";
+    return "+OK\r\n";
+}
+
+static const char* SNAPSHOT_FILE = "dump.my_rdb";
+
+static std::string handleSave(const std::vector<std::string>& /*tokens*/, RedisDatabase& db)
+{
+    //never waits for a running save: inside EXEC this thread holds db_mutex
+    bool busy = false;
+    if(!db.dump(SNAPSHOT_FILE, false, &busy))
+        return busy ? "-ERR Background save already in progress\r\n" : "-ERR Error saving the database\r\n";
+    return "+OK\r\n";
+}
+
+static std::string handleBgsave(const std::vector<std::string>& /*tokens*/, RedisDatabase& db)
+{
+    if(!db.bgsave(SNAPSHOT_FILE)) {
+        auto status = db.saveStatus();
+        return "-ERR Background save already in progress (" + std::to_string(status.keysDone) + "/" +
+               std::to_string(status.keysTotal) + " keys written)\r\n";
+    }
+    return "+Background saving started\r\n";
+}
+
+static std::string handleLastsave(const std::vector<std::string>& /*tokens*/, RedisDatabase& db)
+{
+    return ":" + std::to_string(db.saveStatus().lastSave) + "\r\n";
+}
+
+static std::string handleBgrewriteaof(const std::vector<std::string>& /*tokens*/, RedisDatabase& /*db*/)
+{
+    RedisAof& aof = RedisAof::getInstance();
+    if(!aof.isOpen())
+        return "-ERR Append only file is not enabled\r\n";
+    if(!aof.rewriteInBackground())
+        return "-ERR Background append only file rewriting already in progress\r\n";
+    return "+Background append only file rewriting started\r\n";
+}
+
+static std::string handleRandomkey(const std::vector<std::string>& /*tokens*/, RedisDatabase& db)
+{
+    std::string key;
+    if(!db.randomKey(key))
+        return "$-1\r\n";
+    return "$" + std::to_string(key.size()) + "\r\n" + key + "\r\n";
 }
 
 static std::string handleDbsize(const std::vector<std::string>& tokens, RedisDatabase& db)
@@ -177,6 +381,677 @@ static std::string handleDbsize(const std::vector<std::string>& tokens, RedisDat
     return ":" + std::to_string(response) + "\r\n";
 }
 
+//REPLICATION HANDLERS
+//PSYNC/SYNC queue their answer (and the snapshot or backlog) on the client themselves
+
+static std::string handlePsync(const std::vector<std::string>& tokens, RedisClient& client)
+{
+    if(tokens.size() != 3)
+        return "-ERR wrong number of arguments for 'PSYNC' command\r\n";
+    return RedisReplication::getInstance().psync(client, tokens[1], tokens[2], true);
+}
+
+static std::string handleSync(const std::vector<std::string>& /*tokens*/, RedisClient& client)
+{
+    return RedisReplication::getInstance().psync(client, "?", "-1", false);
+}
+
+static std::string handleReplconf(const std::vector<std::string>& tokens, RedisClient& client)
+{
+    return RedisReplication::getInstance().replconf(client, tokens);
+}
+
+//REPLICAOF host port | REPLICAOF NO ONE (SLAVEOF is the old name)
+static std::string handleReplicaof(const std::vector<std::string>& tokens)
+{
+    if(tokens.size() != 3)
+        return "-ERR wrong number of arguments for '" + tokens[0] + "' command\r\n";
+    std::string host = tokens[1], port = tokens[2];
+    std::transform(host.begin(), host.end(), host.begin(), ::toupper);
+    std::transform(port.begin(), port.end(), port.begin(), ::toupper);
+    if(host == "NO" && port == "ONE") {
+        RedisReplication::getInstance().replicaOf("", 0);
+        return "+OK\r\n";
+    }
+    char* end = nullptr;
+    long number = std::strtol(tokens[2].c_str(), &end, 10);
+    if(tokens[2].empty() || *end != '\0' || number <= 0 || number > 65535)
+        return "-ERR Invalid master port\r\n";
+    RedisReplication::getInstance().replicaOf(tokens[1], static_cast<int>(number));
+    return "+OK\r\n";
+}
+
+//WAIT numreplicas timeout: the number of replicas that acknowledged every write
+//made so far. Inside EXEC it does not block and just counts.
+static std::string handleWait(const std::vector<std::string>& tokens, RedisDatabase& db, RedisClient& client)
+{
+    if(tokens.size() != 3)
+        return "-ERR wrong number of arguments for 'WAIT' command\r\n";
+    RedisReplication& replication = RedisReplication::getInstance();
+    if(replication.isReplica())
+        return "-ERR WAIT cannot be used with replica instances\r\n";
+    char* end = nullptr;
+    long long count = std::strtoll(tokens[1].c_str(), &end, 10);
+    if(tokens[1].empty() || *end != '\0' || count < 0)
+        return "-ERR value is not an integer or out of range\r\n";
+    long long timeout = std::strtoll(tokens[2].c_str(), &end, 10);
+    if(tokens[2].empty() || *end != '\0' || timeout < 0)
+        return "-ERR timeout is negative\r\n";
+    //the deadline is taken on steady_clock, which counts nanoseconds
+    long long nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    if(timeout > LLONG_MAX / 1000000 - nowMs)
+        return "-ERR timeout is out of range\r\n";
+    if(db.inExec()) count = 0;
+    size_t acked = replication.wait(static_cast<size_t>(count), timeout, [&client]() { return client.peerClosed(); });
+    return ":" + std::to_string(acked) + "\r\n";
+}
+
+static std::string handleRole(const std::vector<std::string>& /*tokens*/)
+{
+    RedisReplication::Status status = RedisReplication::getInstance().status();
+    std::string reply;
+    if(status.replica) {
+        respAppendArrayHeader(reply, 5);
+        respAppendBulk(reply, "slave");
+        respAppendBulk(reply, status.masterHost);
+        reply += ":" + std::to_string(status.masterPort) + "\r\n";
+        respAppendBulk(reply, status.linkState);
+        reply += ":" + std::to_string(status.offset) + "\r\n";
+        return reply;
+    }
+    respAppendArrayHeader(reply, 3);
+    respAppendBulk(reply, "master");
+    reply += ":" + std::to_string(status.offset) + "\r\n";
+    respAppendArrayHeader(reply, status.replicas.size());
+    for(const auto& replica : status.replicas) {
+        respAppendArrayHeader(reply, 3);
+        respAppendBulk(reply, replica.address);
+        respAppendBulk(reply, std::to_string(replica.port));
+        respAppendBulk(reply, std::to_string(replica.ackOffset));
+    }
+    return reply;
+}
+
+static void appendReplicationInfo(std::string& out)
+{
+    RedisReplication::Status status = RedisReplication::getInstance().status();
+    auto field = [&out](const std::string& name, const std::string& value) { out += name + ":" + value + "\r\n"; };
+    out += "# Replication\r\n";
+    field("role", status.replica ? "slave" : "master");
+    if(status.replica) {
+        field("master_host", status.masterHost);
+        field("master_port", std::to_string(status.masterPort));
+        field("master_link_status", std::string(status.linkState) == "connected" ? "up" : "down");
+        field("master_last_io_seconds_ago", std::to_string(status.lastIoSecondsAgo));
+        field("master_sync_in_progress", std::string(status.linkState) == "sync" ? "1" : "0");
+        field("slave_repl_offset", std::to_string(status.offset));
+        field("slave_read_only", status.readOnly ? "1" : "0");
+    }
+    field("connected_slaves", std::to_string(status.replicas.size()));
+    for(size_t i = 0; i < status.replicas.size(); ++i) {
+        const auto& replica = status.replicas[i];
+        //lag in bytes of stream not yet acknowledged, and seconds since the last ACK
+        field("slave" + std::to_string(i), "ip=" + replica.address + ",port=" + std::to_string(replica.port) +
+              ",state=" + replica.state + ",offset=" + std::to_string(replica.ackOffset) +
+              ",lag=" + std::to_string(replica.lagSeconds) +
+              ",lag_bytes=" + std::to_string(status.offset - std::min(status.offset, replica.ackOffset)));
+    }
+    field("master_replid", status.replid);
+    field("master_replid2", status.replid2);
+    field("master_repl_offset", std::to_string(status.offset));
+    field("second_repl_offset", std::to_string(status.secondOffset));
+    field("repl_backlog_active", status.backlogActive ? "1" : "0");
+    field("repl_backlog_size", std::to_string(status.backlogSize));
+    field("repl_backlog_first_byte_offset", std::to_string(status.backlogFirstByte));
+    field("repl_backlog_histlen", std::to_string(status.backlogHistlen));
+}
+
+//INFO SECTIONS
+//
+//Everything here comes from atomics, per-thread counters (RedisStats.h) or figures
+//the database publishes once a second, so INFO never waits for db_mutex.
+
+static std::string humanBytes(uint64_t bytes)
+{
+    static const char* const UNITS[] = {"B", "K", "M", "G", "T"};
+    double value = static_cast<double>(bytes);
+    size_t unit = 0;
+    while(value >= 1024 && unit + 1 < sizeof(UNITS) / sizeof(UNITS[0])) {
+        value /= 1024;
+        ++unit;
+    }
+    char text[32];
+    std::snprintf(text, sizeof(text), unit == 0 ? "%.0f%s" : "%.2f%s", value, UNITS[unit]);
+    return text;
+}
+
+static std::string decimal(double value)
+{
+    char text[32];
+    std::snprintf(text, sizeof(text), "%.2f", value);
+    return text;
+}
+
+static void appendServerInfo(std::string& out)
+{
+    RedisStats& stats = RedisStats::getInstance();
+    auto field = [&out](const std::string& name, const std::string& value) { out += name + ":" + value + "\r\n"; };
+    struct utsname name{};
+    uname(&name);
+    out += "# Server\r\n";
+    field("redis_mode", RedisCluster::getInstance().enabled() ? "cluster" : "standalone");
+    field("os", std::string(name.sysname) + " " + name.release + " " + name.machine);
+    field("arch_bits", std::to_string(sizeof(void*) * 8));
+    field("multiplexing_api", "thread-per-connection");
+    field("process_id", std::to_string(::getpid()));
+    field("tcp_port", std::to_string(stats.listeningPort()));
+    field("uptime_in_seconds", std::to_string(stats.uptimeSeconds()));
+    field("uptime_in_days", std::to_string(stats.uptimeSeconds() / 86400));
+}
+
+static void appendClientsInfo(std::string& out)
+{
+    auto field = [&out](const std::string& name, const std::string& value) { out += name + ":" + value + "\r\n"; };
+    out += "# Clients\r\n";
+    field("connected_clients", std::to_string(RedisStats::getInstance().connectedClients()));
+    field("blocked_clients", std::to_string(RedisDatabase::getInstance().blockedClients()));
+}
+
+static void appendMemoryInfo(std::string& out)
+{
+    RedisStats& stats = RedisStats::getInstance();
+    RedisDatabase& db = RedisDatabase::getInstance();
+    auto field = [&out](const std::string& name, const std::string& value) { out += name + ":" + value + "\r\n"; };
+    size_t used = stats.usedMemory(), rss = stats.residentMemory(), peak = stats.peakMemory();
+    out += "# Memory\r\n";
+    field("used_memory", std::to_string(used));
+    field("used_memory_human", humanBytes(used));
+    field("used_memory_rss", std::to_string(rss));
+    field("used_memory_rss_human", humanBytes(rss));
+    field("used_memory_peak", std::to_string(peak));
+    field("used_memory_peak_human", humanBytes(peak));
+    field("mem_fragmentation_ratio", decimal(used ? static_cast<double>(rss) / used : 0));
+    field("lazyfree_pending_objects", std::to_string(db.lazyFreePending()));
+    LzfStats packed = db.compressionStats();
+    field("compressed_values", std::to_string(packed.strings));
+    field("compressed_values_raw_bytes", std::to_string(packed.rawBytes));
+    field("compressed_values_stored_bytes", std::to_string(packed.storedBytes));
+    RedisDatabase::TierStatus tier = db.datasetStatus().tier;
+    field("tier_enabled", tier.enabled ? "1" : "0");
+    field("tier_keys", std::to_string(tier.keys));
+    field("tier_live_bytes", std::to_string(tier.liveBytes));
+    field("tier_file_bytes", std::to_string(tier.fileBytes));
+    field("tier_spilled", std::to_string(tier.spilled));
+    field("tier_fetched", std::to_string(tier.fetched));
+}
+
+static void appendPersistenceInfo(std::string& out)
+{
+    RedisDatabase& db = RedisDatabase::getInstance();
+    auto field = [&out](const std::string& name, const std::string& value) { out += name + ":" + value + "\r\n"; };
+    RedisDatabase::LoadStatus load = db.loadStatus();
+    RedisDatabase::SaveStatus save = db.saveStatus();
+    RedisDatabase::DatasetStatus dataset = db.datasetStatus();
+    RedisAof::Status aof = RedisAof::getInstance().status();
+    out += "# Persistence\r\n";
+    field("loading", load.loading ? "1" : "0");
+    if(load.loading) {
+        field("loading_total_bytes", std::to_string(load.bytesTotal));
+        field("loading_loaded_bytes", std::to_string(load.bytesDone));
+        field("loading_loaded_perc", decimal(load.bytesTotal ? 100.0 * load.bytesDone / load.bytesTotal : 0));
+        field("loading_loaded_keys", std::to_string(load.keysLoaded));
+    }
+    field("lazy_keys_on_disk", std::to_string(load.keysOnDisk));
+    field("rdb_changes_since_last_save", std::to_string(save.changesSinceSave));
+    field("rdb_bgsave_in_progress", save.running ? "1" : "0");
+    field("rdb_saving_keys_done", std::to_string(save.keysDone));
+    field("rdb_saving_keys_total", std::to_string(save.keysTotal));
+    field("rdb_last_save_time", std::to_string(save.lastSave));
+    field("rdb_last_bgsave_status", save.lastOk ? "ok" : "err");
+    field("rdb_delta_chain_valid", dataset.deltaValid ? "1" : "0");
+    field("rdb_delta_files", std::to_string(dataset.deltaFiles));
+    field("rdb_delta_bytes", std::to_string(dataset.deltaBytes));
+    field("rdb_delta_changed_keys", std::to_string(dataset.changedKeys));
+    field("aof_enabled", aof.enabled ? "1" : "0");
+    field("aof_rewrite_in_progress", aof.rewriting ? "1" : "0");
+    if(aof.enabled) {
+        field("aof_current_size", std::to_string(aof.currentSize));
+        field("aof_base_size", std::to_string(aof.baseSize));
+        field("aof_buffer_length", std::to_string(aof.bufferBytes));
+    }
+}
+
+static void appendStatsInfo(std::string& out)
+{
+    RedisStats& stats = RedisStats::getInstance();
+    auto field = [&out](const std::string& name, const std::string& value) { out += name + ":" + value + "\r\n"; };
+    RedisStats::Totals totals = stats.totals(false);
+    RedisStats::Rates rates = stats.rates();
+    out += "# Stats\r\n";
+    field("total_connections_received", std::to_string(stats.connectionsReceived()));
+    field("total_commands_processed", std::to_string(totals.commands));
+    field("instantaneous_ops_per_sec", std::to_string(rates.opsPerSec));
+    field("total_net_input_bytes", std::to_string(totals.netInput));
+    field("total_net_output_bytes", std::to_string(totals.netOutput));
+    field("instantaneous_input_kbps", decimal(rates.inputKbps));
+    field("instantaneous_output_kbps", decimal(rates.outputKbps));
+    field("expired_keys", std::to_string(RedisDatabase::getInstance().expiredKeys()));
+}
+
+static void appendClusterInfo(std::string& out)
+{
+    out += "# Cluster\r\n";
+    out += std::string("cluster_enabled:") + (RedisCluster::getInstance().enabled() ? "1" : "0") + "\r\n";
+}
+
+static void appendKeyspaceInfo(std::string& out)
+{
+    RedisDatabase::DatasetStatus dataset = RedisDatabase::getInstance().datasetStatus();
+    out += "# Keyspace\r\n";
+    if(dataset.keys > 0)
+        out += "db0:keys=" + std::to_string(dataset.keys) + ",expires=" + std::to_string(dataset.expires) + "\r\n";
+}
+
+static void appendCommandstatsInfo(std::string& out)
+{
+    RedisStats::Totals totals = RedisStats::getInstance().totals();
+    out += "# Commandstats\r\n";
+    for(size_t i = 0; i < totals.perCommand.size(); ++i) {
+        const RedisStats::CommandStat& stat = totals.perCommand[i];
+        if(stat.calls == 0) continue;
+        std::string name = commandAt(i).name;
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        out += "cmdstat_" + name + ":calls=" + std::to_string(stat.calls) + ",usec=" + std::to_string(stat.usec) +
+               ",usec_per_call=" + decimal(static_cast<double>(stat.usec) / stat.calls) + "\r\n";
+    }
+}
+
+//INFO [section ...]: default is every section but commandstats, all (or everything)
+//every one
+static std::string handleInfo(const std::vector<std::string>& tokens)
+{
+    static const struct {
+        const char* name;
+        void (*append)(std::string&);
+        bool byDefault;
+    } SECTIONS[] = {
+        {"server", appendServerInfo, true},
+        {"clients", appendClientsInfo, true},
+        {"memory", appendMemoryInfo, true},
+        {"persistence", appendPersistenceInfo, true},
+        {"stats", appendStatsInfo, true},
+        {"replication", appendReplicationInfo, true},
+        {"cluster", appendClusterInfo, true},
+        {"keyspace", appendKeyspaceInfo, true},
+        {"commandstats", appendCommandstatsInfo, false},
+    };
+    std::vector<std::string> asked(tokens.begin() + 1, tokens.end());
+    if(asked.empty()) asked.push_back("default");
+    for(auto& section : asked) std::transform(section.begin(), section.end(), section.begin(), ::tolower);
+    auto wanted = [&asked](const char* name, bool byDefault) {
+        for(const auto& section : asked) {
+            if(section == name || section == "all" || section == "everything" || (byDefault && section == "default"))
+                return true;
+        }
+        return false;
+    };
+
+    std::string info;
+    for(const auto& section : SECTIONS) {
+        if(!wanted(section.name, section.byDefault)) continue;
+        if(!info.empty()) info += "\r\n";
+        section.append(info);
+    }
+    std::string reply;
+    respAppendBulk(reply, info);
+    return reply;
+}
+
+//CLUSTER HANDLERS
+
+//a slot number argument; -1 when it is not one
+static int parseSlot(const std::string& text)
+{
+    char* end = nullptr;
+    long slot = std::strtol(text.c_str(), &end, 10);
+    if(text.empty() || *end != '\0' || slot < 0 || slot >= CLUSTER_SLOTS) return -1;
+    return static_cast<int>(slot);
+}
+
+static std::string handleCluster(const std::vector<std::string>& tokens, RedisDatabase& db, RedisClient& client)
+{
+    if(tokens.size() < 2)
+        return "-ERR wrong number of arguments for 'CLUSTER' command\r\n";
+    RedisCluster& cluster = RedisCluster::getInstance();
+    if(!cluster.enabled())
+        return "-ERR This instance has cluster support disabled\r\n";
+    std::string sub = tokens[1];
+    std::transform(sub.begin(), sub.end(), sub.begin(), ::toupper);
+    std::string reply, error;
+
+    if(sub == "KEYSLOT" && tokens.size() == 3) {
+        return ":" + std::to_string(keyHashSlot(tokens[2])) + "\r\n";
+    } else if(sub == "MYID" && tokens.size() == 2) {
+        respAppendBulk(reply, cluster.myId());
+        return reply;
+    } else if(sub == "NODES" && tokens.size() == 2) {
+        respAppendBulk(reply, cluster.nodes());
+        return reply;
+    } else if(sub == "INFO" && tokens.size() == 2) {
+        respAppendBulk(reply, cluster.info());
+        return reply;
+    } else if(sub == "SLOTS" && tokens.size() == 2) {
+        std::vector<RedisCluster::SlotRange> ranges = cluster.slotRanges();
+        respAppendArrayHeader(reply, ranges.size());
+        for(const auto& range : ranges) {
+            respAppendArrayHeader(reply, 3);
+            reply += ":" + std::to_string(range.first) + "\r\n:" + std::to_string(range.last) + "\r\n";
+            respAppendArrayHeader(reply, 3);
+            respAppendBulk(reply, range.host);
+            reply += ":" + std::to_string(range.port) + "\r\n";
+            respAppendBulk(reply, range.id);
+        }
+        return reply;
+    } else if(sub == "MEET" && (tokens.size() == 4 || tokens.size() == 5)) {
+        char* end = nullptr;
+        long port = std::strtol(tokens[3].c_str(), &end, 10);
+        if(tokens[3].empty() || *end != '\0' || port <= 0 || port > 65535)
+            return "-ERR Invalid node address specified: " + tokens[2] + ":" + tokens[3] + "\r\n";
+        error = cluster.meet(tokens[2], static_cast<int>(port));
+    } else if((sub == "ADDSLOTS" || sub == "DELSLOTS") && tokens.size() >= 3) {
+        std::vector<int> slots;
+        for(size_t i = 2; i < tokens.size(); ++i) {
+            int slot = parseSlot(tokens[i]);
+            if(slot < 0) return "-ERR Invalid or out of range slot\r\n";
+            slots.push_back(slot);
+        }
+        error = sub == "ADDSLOTS" ? cluster.addSlots(slots) : cluster.delSlots(slots);
+    } else if(sub == "SETSLOT" && tokens.size() >= 4) {
+        int slot = parseSlot(tokens[2]);
+        if(slot < 0) return "-ERR Invalid or out of range slot\r\n";
+        std::string how = tokens[3];
+        std::transform(how.begin(), how.end(), how.begin(), ::toupper);
+        if(tokens.size() != (how == "STABLE" ? 4u : 5u))
+            return "-ERR Invalid CLUSTER SETSLOT action or number of arguments\r\n";
+        error = cluster.setSlot(slot, how, how == "STABLE" ? "" : tokens[4]);
+    } else if(sub == "COUNTKEYSINSLOT" && tokens.size() == 3) {
+        int slot = parseSlot(tokens[2]);
+        if(slot < 0) return "-ERR Invalid slot\r\n";
+        return ":" + std::to_string(db.countKeysInSlot(slot)) + "\r\n";
+    } else if(sub == "GETKEYSINSLOT" && tokens.size() == 4) {
+        int slot = parseSlot(tokens[2]);
+        char* end = nullptr;
+        long long count = std::strtoll(tokens[3].c_str(), &end, 10);
+        if(slot < 0 || tokens[3].empty() || *end != '\0' || count < 0)
+            return "-ERR Invalid slot or number of keys\r\n";
+        std::vector<std::string> keys = db.keysInSlot(slot, static_cast<size_t>(count));
+        respAppendArrayHeader(reply, keys.size());
+        for(const auto& key : keys) respAppendBulk(reply, key);
+        return reply;
+    } else if(sub == "GOSSIP") {
+        //between the nodes themselves (RedisCluster.h)
+        std::vector<std::string> answer;
+        error = cluster.gossip(tokens, peerName(client.fd()), localName(client.fd()), answer);
+        if(!error.empty()) return error;
+        respAppendArrayHeader(reply, answer.size());
+        for(const auto& field : answer) respAppendBulk(reply, field);
+        return reply;
+    } else {
+        return "-ERR Unknown subcommand or wrong number of arguments for '" + tokens[1] + "'\r\n";
+    }
+    return error.empty() ? "+OK\r\n" : error;
+}
+
+static std::string handleAsking(RedisClient& client)
+{
+    if(!RedisCluster::getInstance().enabled())
+        return "-ERR This instance has cluster support disabled\r\n";
+    client.asking = true;
+    return "+OK\r\n";
+}
+
+//MIGRATE host port key|"" 0 timeout [COPY] [REPLACE] [KEYS key...]: move keys to another
+//server (copy them with COPY) as DUMP payloads. The connection is made before the
+//keyspace is locked; from the dump until the target answered, it stays locked, so
+//no write to a key slips in between and a cluster client never finds it on neither
+//node. timeout caps the whole exchange, not each read. The move is logged as a DEL.
+//
+//When the target does not answer in time the keys stay here, but it may still
+//restore them once the RESTOREs reach it: a key can then be on both servers, as in
+//Redis. Running MIGRATE again with REPLACE settles it.
+static std::string handleMigrate(const std::vector<std::string>& tokens, RedisDatabase& db)
+{
+    if(tokens.size() < 6)
+        return "-ERR wrong number of arguments for 'MIGRATE' command\r\n";
+    char* end = nullptr;
+    long port = std::strtol(tokens[2].c_str(), &end, 10);
+    if(tokens[2].empty() || *end != '\0' || port <= 0 || port > 65535)
+        return "-ERR Invalid port\r\n";
+    if(tokens[4] != "0")
+        return "-ERR only database 0 exists\r\n";
+    long long timeout = std::strtoll(tokens[5].c_str(), &end, 10);
+    if(tokens[5].empty() || *end != '\0')
+        return "-ERR value is not an integer or out of range\r\n";
+    if(timeout <= 0) timeout = 1000;
+    //poll() takes int milliseconds, and a negative one waits forever
+    timeout = std::min<long long>(timeout, INT_MAX);
+    bool copy = false, replace = false;
+    std::vector<std::string> keys;
+    for(size_t i = 6; i < tokens.size(); ++i) {
+        std::string option = tokens[i];
+        std::transform(option.begin(), option.end(), option.begin(), ::toupper);
+        if(option == "COPY") copy = true;
+        else if(option == "REPLACE") replace = true;
+        else if(option == "KEYS") {
+            if(!tokens[3].empty())
+                return "-ERR When using MIGRATE KEYS option, the key argument must be set to the empty string\r\n";
+            keys.assign(tokens.begin() + i + 1, tokens.end());
+            break;
+        }
+        else return "-ERR syntax error\r\n";
+    }
+    if(keys.empty()) keys.push_back(tokens[3]);
+    const std::string& host = tokens[1];
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    auto left = [&deadline]() {
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        return static_cast<int>(std::max<long long>(ms.count(), 0));
+    };
+
+    //as in Redis, nothing to move is answered before the target is tried
+    if(db.exists(keys) == 0) return "+NOKEY\r\n";
+    //a slow or unreachable target keeps only this client waiting
+    int fd = takeConnection(host, static_cast<int>(port), static_cast<int>(timeout));
+    if(fd < 0)
+        return "-IOERR error or timeout connecting to the client\r\n";
+
+    //The source stays locked until the keys are in place and gone from here, so no
+    //client sees a key in both places or in neither
+    RedisDatabase::WriteScope scope(db);
+    std::vector<std::string> found;
+    std::vector<std::string> payloads;
+    for(const auto& key : keys) {
+        std::string payload;
+        if(!db.dumpKey(key, payload)) continue;
+        found.push_back(key);
+        payloads.push_back(std::move(payload));
+    }
+    if(found.empty()) {
+        giveBack(host, static_cast<int>(port), fd);
+        return "+NOKEY\r\n";
+    }
+    //One pipeline of RESTOREs carrying the expiry in the payload, each preceded by
+    //ASKING for a cluster node importing the slot
+    bool asking = RedisCluster::getInstance().enabled();
+    std::string out;
+    for(size_t i = 0; i < found.size(); ++i) {
+        if(asking) {
+            respAppendArrayHeader(out, 1);
+            respAppendBulk(out, "ASKING");
+        }
+        respAppendArrayHeader(out, replace ? 5 : 4);
+        respAppendBulk(out, "RESTORE");
+        respAppendBulk(out, found[i]);
+        respAppendBulk(out, "0");
+        respAppendBulk(out, payloads[i]);
+        if(replace) respAppendBulk(out, "REPLACE");
+    }
+    if(!sendAll(fd, out, left())) {
+        ::close(fd);
+        return "-IOERR error or timeout writing to the target instance\r\n";
+    }
+
+    //A target outside cluster mode refuses ASKING, which it doesn't need anyway.
+    //Keys the target refused stay here; the first refusal is the reply.
+    std::string in, line, error;
+    std::vector<std::string> moved;
+    for(size_t i = 0; i < found.size(); ++i) {
+        bool ok = !asking || readLine(fd, in, line, left());
+        if(ok) ok = readLine(fd, in, line, left());
+        if(!ok) {
+            error = "-IOERR error or timeout reading from the target instance\r\n";
+            break;
+        }
+        if(!line.empty() && line[0] == '-') {
+            if(error.empty()) error = "-ERR Target instance replied with error: " + line.substr(1) + "\r\n";
+        } else {
+            moved.push_back(found[i]);
+        }
+    }
+    if(error.compare(0, 6, "-IOERR") == 0) ::close(fd);
+    else giveBack(host, static_cast<int>(port), fd);
+
+    if(!copy && !moved.empty()) {
+        db.del(moved);
+        std::vector<std::string> logged{"DEL"};
+        logged.insert(logged.end(), moved.begin(), moved.end());
+        db.propagate(logged);
+    }
+    return error.empty() ? "+OK\r\n" : error;
+}
+
+//BITMAP HANDLERS
+
+//bitmaps are capped at 512MB like Redis strings
+static const uint64_t MAX_BIT_OFFSET = (512ULL * 1024 * 1024 * 8) - 1;
+
+static bool parseBitOffset(const std::string& token, uint64_t& offset)
+{
+    if(token.empty() || token[0] == '-') return false;
+    try {
+        size_t used = 0;
+        offset = std::stoull(token, &used);
+        return used == token.size() && offset <= MAX_BIT_OFFSET;
+    } catch(const std::exception&) {
+        return false;
+    }
+}
+
+//parse the optional BYTE|BIT unit argument; returns false on anything else
+static bool parseBitUnit(const std::string& token, bool& bitUnit)
+{
+    std::string unit = token;
+    std::transform(unit.begin(), unit.end(), unit.begin(), ::toupper);
+    if(unit == "BYTE") bitUnit = false;
+    else if(unit == "BIT") bitUnit = true;
+    else return false;
+    return true;
+}
+
+static std::string handleSetbit(const std::vector<std::string>& tokens, RedisDatabase& db)
+{
+    if(tokens.size() < 4)
+        return "-ERR SETBIT requires key, offset, and value\r\n";
+
+    uint64_t offset = 0;
+    if(!parseBitOffset(tokens[2], offset))
+        return "-ERR bit offset is not an integer or out of range\r\n";
+    if(tokens[3] != "0" && tokens[3] != "1")
+        return "-ERR bit is not an integer or out of range\r\n";
+
+    int old = db.setbit(tokens[1], offset, tokens[3] == "1");
+    if(old < 0)
+        return "-WRONGTYPE Operation against a key holding the wrong kind of value\r\n";
+    return ":" + std::to_string(old) + "\r\n";
+}
+
+static std::string handleGetbit(const std::vector<std::string>& tokens, RedisDatabase& db)
+{
+    if(tokens.size() < 3)
+        return "-ERR GETBIT requires key and offset\r\n";
+
+    uint64_t offset = 0;
+    if(!parseBitOffset(tokens[2], offset))
+        return "-ERR bit offset is not an integer or out of range\r\n";
+    return ":" + std::to_string(db.getbit(tokens[1], offset)) + "\r\n";
+}
+
+static std::string handleBitcount(const std::vector<std::string>& tokens, RedisDatabase& db)
+{
+    if(tokens.size() != 2 && tokens.size() != 4 && tokens.size() != 5)
+        return "-ERR BITCOUNT requires key and optional start end [BYTE|BIT]\r\n";
+
+    int64_t start = 0, end = -1;
+    bool bitUnit = false;
+    try {
+        if(tokens.size() >= 4) {
+            start = std::stoll(tokens[2]);
+            end = std::stoll(tokens[3]);
+        }
+    } catch(const std::exception&) {
+        return "-ERR value is not an integer or out of range\r\n";
+    }
+    if(tokens.size() == 5 && !parseBitUnit(tokens[4], bitUnit))
+        return "-ERR syntax error\r\n";
+
+    return ":" + std::to_string(db.bitcount(tokens[1], start, end, bitUnit)) + "\r\n";
+}
+
+static std::string handleBitpos(const std::vector<std::string>& tokens, RedisDatabase& db)
+{
+    if(tokens.size() < 3 || tokens.size() > 6)
+        return "-ERR BITPOS requires key, bit, and optional start end [BYTE|BIT]\r\n";
+    if(tokens[2] != "0" && tokens[2] != "1")
+        return "-ERR The bit argument must be 1 or 0.\r\n";
+
+    int64_t start = 0, end = -1;
+    bool bitUnit = false;
+    try {
+        if(tokens.size() >= 4) start = std::stoll(tokens[3]);
+        if(tokens.size() >= 5) end = std::stoll(tokens[4]);
+    } catch(const std::exception&) {
+        return "-ERR value is not an integer or out of range\r\n";
+    }
+    if(tokens.size() == 6 && !parseBitUnit(tokens[5], bitUnit))
+        return "-ERR syntax error\r\n";
+
+    int64_t pos = db.bitpos(tokens[1], tokens[2] == "1", start, end, tokens.size() >= 5, bitUnit);
+    return ":" + std::to_string(pos) + "\r\n";
+}
+
+static std::string handleBitop(const std::vector<std::string>& tokens, RedisDatabase& db)
+{
+    if(tokens.size() < 4)
+        return "-ERR BITOP requires operation, destkey, and at least one key\r\n";
+
+    std::string opName = tokens[1];
+    std::transform(opName.begin(), opName.end(), opName.begin(), ::toupper);
+    BitOp op;
+    if(opName == "AND") op = BitOp::AND;
+    else if(opName == "OR") op = BitOp::OR;
+    else if(opName == "XOR") op = BitOp::XOR;
+    else if(opName == "NOT") op = BitOp::NOT;
+    else return "-ERR syntax error\r\n";
+
+    if(op == BitOp::NOT && tokens.size() != 4)
+        return "-ERR BITOP NOT must be called with a single source key.\r\n";
+
+    std::vector<std::string> srcKeys(tokens.begin() + 3, tokens.end());
+    size_t len = db.bitop(op, tokens[2], srcKeys);
+    return ":" + std::to_string(len) + "\r\n";
+}
+
 //LIST HANDLERS
 
 static std::string handleLlen(const std::vector<std::string>& tokens, RedisDatabase& db) {
@@ -188,16 +1063,35 @@ static std::string handleLlen(const std::vector<std::string>& tokens, RedisDatab
     }
 }
 
-static std::string handleLGet(const std::vector<std::string>& tokens, RedisDatabase& db) {
-    std::vector<std::string> allElements = db.Lget(tokens[1]);
-    std::ostringstream response;
+static std::string handleLrange(const std::vector<std::string>& tokens, RedisDatabase& db, RedisClient& client) {
+    if (tokens.size() != 4) {
+        return "-ERR LRANGE requires key, start, and stop.\r\n";
+    }
+    long long start, stop;
+    try {
+        start = std::stoll(tokens[2]);
+        stop = std::stoll(tokens[3]);
+    } catch (const std::exception&) {
+        return "-ERR value is not an integer or out of range\r\n";
+    }
 
-    response << "*" << allElements.size() << "\r\n";
+    std::string response;
+    ReplyStream stream;
+    db.lrange(tokens[1], start, stop, response, &stream);
+    if (stream) client.setStream(std::move(stream));
+    return response;
+}
 
-    for(const auto& element : allElements){
-        response << "$" << element.size() << "\r\n" << element << "\r\n";
+//non-standard: every element, i.e. LRANGE key 0 -1
+static std::string handleLGet(const std::vector<std::string>& tokens, RedisDatabase& db, RedisClient& client) {
+    if (tokens.size() < 2) {
+        return "-ERR LGET requires a key.\r\n";
     }
-    return response.str();
+    std::string response;
+    ReplyStream stream;
+    db.lrange(tokens[1], 0, -1, response, &stream);
+    if (stream) client.setStream(std::move(stream));
+    return response;
 }
 
 static std::string handleLindex(const std::vector<std::string>& tokens, RedisDatabase& db) {
@@ -255,8 +1149,7 @@ static std::string handleLPush(const std::vector<std::string>& tokens, RedisData
         for(size_t i = 2; i < tokens.size(); i++){
             values.emplace_back(tokens[i]);
         }
-        db.lpush(tokens[1], values);
-        ssize_t len = db.llen(tokens[1]);
+        size_t len = db.lpush(tokens[1], values);
         return ":" + std::to_string(len) + "\r\n";
     }
     
@@ -285,8 +1178,7 @@ static std::string handleRPush(const std::vector<std::string>& tokens, RedisData
         for(size_t i = 2; i < tokens.size(); i++){
             values.emplace_back(tokens[i]);
         }
-        db.rpush(tokens[1], values);
-        ssize_t len = db.llen(tokens[1]);
+        size_t len = db.rpush(tokens[1], values);
         return ":" + std::to_string(len) + "\r\n";
     }
 }
@@ -304,6 +1196,133 @@ static std::string handleRPop(const std::vector<std::string>& tokens, RedisDatab
     }
 }
 
+//parse LEFT|RIGHT for LMOVE/BLMOVE; returns false on anything else
+static bool parseListEnd(const std::string& token, bool& left)
+{
+    std::string end = token;
+    std::transform(end.begin(), end.end(), end.begin(), ::toupper);
+    if(end == "LEFT") left = true;
+    else if(end == "RIGHT") left = false;
+    else return false;
+    return true;
+}
+
+//blocking timeouts are seconds, fractional allowed, 0 meaning forever
+static bool parseTimeout(const std::string& token, double& timeout)
+{
+    try {
+        size_t used = 0;
+        timeout = std::stod(token, &used);
+        return used == token.size() && timeout >= 0;
+    } catch(const std::exception&) {
+        return false;
+    }
+}
+
+//the deadline now + timeout has to fit steady_clock, or it wraps into the past
+static bool timeoutInRange(double timeout)
+{
+    auto left = std::chrono::steady_clock::duration::max() - std::chrono::steady_clock::now().time_since_epoch();
+    return std::isfinite(timeout) && timeout < std::chrono::duration<double>(left).count();
+}
+
+static std::string handleLmove(const std::vector<std::string>& tokens, RedisDatabase& db)
+{
+    if(tokens.size() != 5)
+        return "-ERR LMOVE requires source, destination, LEFT|RIGHT, and LEFT|RIGHT\r\n";
+
+    bool fromLeft, toLeft;
+    if(!parseListEnd(tokens[3], fromLeft) || !parseListEnd(tokens[4], toLeft))
+        return "-ERR syntax error\r\n";
+
+    std::string val;
+    if(db.lmove(tokens[1], tokens[2], fromLeft, toLeft, val)){
+        return "$" + std::to_string(val.size()) + "\r\n" + val + "\r\n";
+    }
+    return "$-1\r\n";
+}
+
+static std::string handleBlockingPop(const std::vector<std::string>& tokens, RedisDatabase& db, RedisClient& client, bool fromLeft)
+{
+    if(tokens.size() < 3)
+        return "-ERR " + tokens[0] + " requires at least one key and a timeout\r\n";
+
+    double timeout = 0;
+    if(!parseTimeout(tokens.back(), timeout))
+        return "-ERR timeout is not a float or out of range\r\n";
+    if(!timeoutInRange(timeout))
+        return "-ERR timeout is out of range\r\n";
+
+    std::vector<std::string> keys(tokens.begin() + 1, tokens.end() - 1);
+    std::string key, val;
+    if(!db.blockingPop(keys, fromLeft, timeout, key, val, client.fd())){
+        return "*-1\r\n";
+    }
+    return "*2\r\n$" + std::to_string(key.size()) + "\r\n" + key + "\r\n$" +
+           std::to_string(val.size()) + "\r\n" + val + "\r\n";
+}
+
+static std::string handleBlmove(const std::vector<std::string>& tokens, RedisDatabase& db, RedisClient& client)
+{
+    if(tokens.size() != 6)
+        return "-ERR BLMOVE requires source, destination, LEFT|RIGHT, LEFT|RIGHT, and timeout\r\n";
+
+    bool fromLeft, toLeft;
+    if(!parseListEnd(tokens[3], fromLeft) || !parseListEnd(tokens[4], toLeft))
+        return "-ERR syntax error\r\n";
+
+    double timeout = 0;
+    if(!parseTimeout(tokens[5], timeout))
+        return "-ERR timeout is not a float or out of range\r\n";
+    if(!timeoutInRange(timeout))
+        return "-ERR timeout is out of range\r\n";
+
+    std::string val;
+    if(db.blmove(tokens[1], tokens[2], fromLeft, toLeft, timeout, val, client.fd())){
+        return "$" + std::to_string(val.size()) + "\r\n" + val + "\r\n";
+    }
+    return "$-1\r\n";
+}
+
+//PUB/SUB HANDLERS
+//(un)subscribe confirmations are queued on the client by RedisPubSub, so these return nothing
+
+static std::string handleSubscribe(const std::vector<std::string>& tokens, RedisClient& client)
+{
+    if(tokens.size() < 2)
+        return "-ERR SUBSCRIBE requires at least one channel\r\n";
+    RedisPubSub::getInstance().subscribe(client, std::vector<std::string>(tokens.begin() + 1, tokens.end()));
+    return "";
+}
+
+static std::string handleUnsubscribe(const std::vector<std::string>& tokens, RedisClient& client)
+{
+    RedisPubSub::getInstance().unsubscribe(client, std::vector<std::string>(tokens.begin() + 1, tokens.end()));
+    return "";
+}
+
+static std::string handlePsubscribe(const std::vector<std::string>& tokens, RedisClient& client)
+{
+    if(tokens.size() < 2)
+        return "-ERR PSUBSCRIBE requires at least one pattern\r\n";
+    RedisPubSub::getInstance().psubscribe(client, std::vector<std::string>(tokens.begin() + 1, tokens.end()));
+    return "";
+}
+
+static std::string handlePunsubscribe(const std::vector<std::string>& tokens, RedisClient& client)
+{
+    RedisPubSub::getInstance().punsubscribe(client, std::vector<std::string>(tokens.begin() + 1, tokens.end()));
+    return "";
+}
+
+static std::string handlePublish(const std::vector<std::string>& tokens)
+{
+    if(tokens.size() != 3)
+        return "-ERR PUBLISH requires channel and message\r\n";
+    size_t receivers = RedisPubSub::getInstance().publish(tokens[1], tokens[2]);
+    return ":" + std::to_string(receivers) + "\r\n";
+}
+
 ///HASH HANDLE FUNCTIONS
 static std::string handleHset(const std::vector<std::string>& tokens, RedisDatabase& db)
 {
@@ -359,54 +1378,38 @@ static std::string handleHlen(const std::vector<std::string>& tokens, RedisDatab
     }
 }
 
-static std::string handleHvals(const std::vector<std::string>& tokens, RedisDatabase& db)
+//HKEYS/HVALS/HGETALL: big hashes are streamed to the client chunk by chunk
+static std::string hashReply(const std::vector<std::string>& tokens, RedisDatabase& db, RedisClient& client, RedisDatabase::HashPart part)
+{
+    std::string response;
+    ReplyStream stream;
+    db.hashReply(tokens[1], part, response, stream);
+    if(stream) client.setStream(std::move(stream));
+    return response;
+}
+
+static std::string handleHvals(const std::vector<std::string>& tokens, RedisDatabase& db, RedisClient& client)
 {
     if(tokens.size() < 2){
         return "-Error: HVALS requires key.\r\n";
-    } else {
-        std::vector<std::string> allValues = db.Hvals(tokens[1]);
-        std::ostringstream response;
-
-        response << "*" << allValues.size() << "\r\n";
-
-        for(const auto& value : allValues){
-            response << "$" << value.size() << "\r\n" << value << "\r\n";
-        }
-        return response.str();
     }
+    return hashReply(tokens, db, client, RedisDatabase::HashPart::Values);
 }
 
-static std::string handleHgetall(const std::vector<std::string>& tokens, RedisDatabase& db)
+static std::string handleHgetall(const std::vector<std::string>& tokens, RedisDatabase& db, RedisClient& client)
 {
     if(tokens.size() < 2){
         return "-Error: HGETALL requires key.\r\n";
-    } else {
-        auto hash = db.Hgetall(tokens[1]);
-        std::ostringstream oss;
-        oss << "*" << hash.size() * 2 << "\r\n";
-        for(const auto& pair : hash){
-            oss << "$" << std::to_string(pair.first.size()) << "\r\n" << pair.first << "\r\n";
-            oss << "$" << std::to_string(pair.second.size()) << "\r\n" << pair.second << "\r\n";
-        }
-        return oss.str();
     }
+    return hashReply(tokens, db, client, RedisDatabase::HashPart::Both);
 }
 
-static std::string handleHkeys(const std::vector<std::string>& tokens, RedisDatabase& db)
+static std::string handleHkeys(const std::vector<std::string>& tokens, RedisDatabase& db, RedisClient& client)
 {
     if(tokens.size() < 2){
         return "-Error: HKEYS requires key.\r\n";
-    } else {
-        std::vector<std::string> allKeys = db.Hkeys(tokens[1]);
-        std::ostringstream response;
-
-        response << "*" << allKeys.size() << "\r\n";
-
-        for(const auto& key : allKeys){
-            response << "$" << key.size() << "\r\n" << key << "\r\n";
-        }
-        return response.str();
-    }    
+    }
+    return hashReply(tokens, db, client, RedisDatabase::HashPart::Fields);
 }
 
 static std::string handleHmset(const std::vector<std::string>& tokens, RedisDatabase& db)
@@ -443,25 +1446,50 @@ static std::string handleHsetnx(const std::vector<std::string>& tokens, RedisDat
     return ":" + std::to_string(result ? 1 : 0) + "\r\n";
 }
 
+//a negative HRANDFIELD count may repeat fields, so nothing but this bounds the reply
+static const long long MAX_RANDFIELD_SAMPLES = 1LL << 20;
+
 static std::string handleHrandfield(const std::vector<std::string>& tokens, RedisDatabase& db)
 {
-    //check if count is provided
-    if(tokens.size() < 3)
-        return "-Error: HRANDFIELD requires key and count\r\n";
-    
-    std::vector<std::string> values;
-    db.Hrandfield(tokens[1], values, std::stoi(tokens[2]));
-    
-    std::ostringstream response;
+    if(tokens.size() < 2 || tokens.size() > 4)
+        return "-Error: HRANDFIELD requires key and optional count [WITHVALUES]\r\n";
 
-        response << "*" << values.size() << "\r\n";
-        int i = 1;
+    //no count: a single field as a bulk string
+    if(tokens.size() == 2) {
+        std::vector<std::string> values;
+        if(!db.Hrandfield(tokens[1], 1, false, values))
+            return "$-1\r\n";
+        return "$" + std::to_string(values[0].size()) + "\r\n" + values[0] + "\r\n";
+    }
 
-        for(const auto& key : values){
-            response << "$" << key.size() << "\r\n" << i << ")" <<key << "\r\n";
-            i++;
-        }
-        return response.str();
+    long long count = 0;
+    try {
+        size_t used = 0;
+        count = std::stoll(tokens[2], &used);
+        if(used != tokens[2].size()) throw std::invalid_argument("count");
+    } catch(const std::exception&) {
+        return "-ERR value is not an integer or out of range\r\n";
+    }
+    if(count < -MAX_RANDFIELD_SAMPLES)
+        return "-ERR value is out of range\r\n";
+
+    bool withValues = false;
+    if(tokens.size() == 4) {
+        std::string flag = tokens[3];
+        std::transform(flag.begin(), flag.end(), flag.begin(), ::toupper);
+        if(flag != "WITHVALUES") return "-ERR syntax error\r\n";
+        withValues = true;
+    }
+
+    std::vector<std::string> values;
+    db.Hrandfield(tokens[1], count, withValues, values);
+
+    std::ostringstream response;
+    response << "*" << values.size() << "\r\n";
+    for(const auto& value : values){
+        response << "$" << value.size() << "\r\n" << value << "\r\n";
+    }
+    return response.str();
 }
 
 static std::string handleHscan(const std::vector<std::string>& tokens, RedisDatabase& db)
@@ -524,18 +1552,280 @@ static std::string handleLtrim(const std::vector<std::string>& tokens, RedisData
 }
 
 
-std::string RedisCommandHandler::processCommand(const std::string& commandLine){
+static std::string executeCommand(std::vector<std::string>& tokens, RedisClient& client);
+
+static bool isWriteCommand(std::string name)
+{
+    std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+    const CommandInfo* info = lookupCommand(name);
+    return info && (info->flags & CMD_WRITE);
+}
+
+static std::string handleMulti(RedisClient& client)
+{
+    if(client.in_multi)
+        return "-ERR MULTI calls can not be nested\r\n";
+    client.in_multi = true;
+    return "+OK\r\n";
+}
+
+static std::string handleExec(RedisDatabase& db, RedisClient& client)
+{
+    if(!client.in_multi)
+        return "-ERR EXEC without MULTI\r\n";
+    client.in_multi = false;
+    std::vector<std::vector<std::string>> queued;
+    queued.swap(client.queued_commands);
+
+    //the WATCH check and the queued commands run under one lock hold, so no other
+    //client's command can land between them
+    RedisDatabase::ExecLock lock(db);
+    bool unchanged = db.watchedUnchanged(client.watched);
+    db.unwatch(client.watched);
+    if(!unchanged)
+        return "*-1\r\n";
+
+    //logged as one MULTI ... EXEC block so a replay applies all of it or none
+    bool logged = db.propagating() &&
+        std::any_of(queued.begin(), queued.end(), [](const std::vector<std::string>& tokens){ return isWriteCommand(tokens[0]); });
+    if(logged) db.propagate({"MULTI"});
+
+    std::string reply;
+    respAppendArrayHeader(reply, queued.size());
+    for(auto& tokens : queued) {
+        reply += executeCommand(tokens, client);
+        //a streamed reply is drained in place to keep it inside the EXEC array
+        if(ReplyStream stream = client.takeStream()) {
+            while(stream(reply)) {}
+        }
+    }
+    if(logged) db.propagate({"EXEC"});
+    return reply;
+}
+
+static std::string handleDiscard(RedisDatabase& db, RedisClient& client)
+{
+    if(!client.in_multi)
+        return "-ERR DISCARD without MULTI\r\n";
+    client.in_multi = false;
+    client.queued_commands.clear();
+    db.unwatch(client.watched);
+    return "+OK\r\n";
+}
+
+static std::string handleWatch(const std::vector<std::string>& tokens, RedisDatabase& db, RedisClient& client)
+{
+    if(tokens.size() < 2)
+        return "-ERR wrong number of arguments for 'WATCH' command\r\n";
+    if(client.in_multi)
+        return "-ERR WATCH inside MULTI is not allowed\r\n";
+    std::vector<std::string> keys(tokens.begin() + 1, tokens.end());
+    db.watch(keys, client.watched);
+    return "+OK\r\n";
+}
+
+static std::string handleUnwatch(RedisDatabase& db, RedisClient& client)
+{
+    db.unwatch(client.watched);
+    return "+OK\r\n";
+}
+
+//Lazy load and tiered storage: the values of a command's keys that are on disk are
+//read before it runs, without db_mutex (RedisDatabase::prefetch), so only this
+//client waits for the disk. For EXEC that is the keys of every queued command.
+//Commands that never look at the old values are left out.
+static void prefetchKeys(const std::vector<std::string>& tokens, const RedisClient& client)
+{
+    RedisDatabase& db = RedisDatabase::getInstance();
+    if(!db.hasColdKeys()) return;
+
+    std::vector<std::string> keys, commandKeyList;
+    auto add = [&](const std::vector<std::string>& argv) {
+        std::string name = argv[0];
+        std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+        if(name == "DEL" || name == "UNLINK" || name == "EXISTS" || name == "SET" || name == "MSET" || name == "MSETNX") return;
+        const CommandInfo* info = lookupCommand(name);
+        if(!info || (info->flags & CMD_TRANSACTION)) return;
+        commandKeys(*info, argv, commandKeyList);
+        keys.insert(keys.end(), commandKeyList.begin(), commandKeyList.end());
+    };
+    std::string cmd = tokens[0];
+    std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::toupper);
+    if(cmd == "EXEC") {
+        for(const auto& queued : client.queued_commands) add(queued);
+    } else if(!client.in_multi) {
+        add(tokens);
+    }
+    if(!keys.empty()) db.prefetch(keys);
+}
+
+//Cluster mode: a command runs on the node serving the slot of its keys
+//(RedisCluster.h); for EXEC those are the keys of every queued command. While the
+//slot migrates, whether it runs here depends on its keys being here, so that check
+//and the command share one lock hold and MIGRATE can't move a key in between.
+static std::string executeClustered(std::vector<std::string>& tokens, RedisClient& client)
+{
+    RedisDatabase& db = RedisDatabase::getInstance();
+    std::string cmd = tokens[0];
+    std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::toupper);
+    std::vector<std::string> keys, commandKeyList;
+    auto add = [&](const std::vector<std::string>& argv) {
+        std::string name = argv[0];
+        std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+        const CommandInfo* info = lookupCommand(name);
+        if(!info) return;
+        commandKeys(*info, argv, commandKeyList);
+        keys.insert(keys.end(), commandKeyList.begin(), commandKeyList.end());
+    };
+    if(cmd == "EXEC") {
+        for(const auto& queued : client.queued_commands) add(queued);
+    } else {
+        add(tokens);
+    }
+    //ASKING covers the next command only
+    bool asking = client.asking;
+    if(cmd != "ASKING") client.asking = false;
+
+    std::string redirect;
+    RedisCluster::Route route = RedisCluster::getInstance().route(keys, asking, redirect);
+    if(route == RedisCluster::Route::Local) return executeCommand(tokens, client);
+    //a transaction that can't run here is dropped
+    auto refuse = [&](const std::string& reply) {
+        if(cmd == "EXEC") handleDiscard(db, client);
+        return reply;
+    };
+    if(route == RedisCluster::Route::Redirect) return refuse(redirect);
+
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    RedisDatabase::ExecLock lock(db);
+    size_t present = db.exists(keys);
+    if(route == RedisCluster::Route::Migrating && present == 0) return refuse(redirect);
+    if(present < keys.size() && (route == RedisCluster::Route::Migrating || keys.size() > 1))
+        return refuse("-TRYAGAIN Multiple keys request during rehashing of slot\r\n");
+    return executeCommand(tokens, client);
+}
+
+std::string RedisCommandHandler::processCommand(const std::string& commandLine, RedisClient& client){
     //Using RESP parser;
     std::vector<std::string> tokens = parseRespCommand(commandLine);
 
     if(tokens.empty()) {
         return ""; // ignore empty commands
     } 
+    std::string cmd = tokens[0];
+    std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::toupper);
+    const CommandInfo* info = lookupCommand(cmd);
+    if(RedisDatabase::getInstance().loading() && (!info || !(info->flags & CMD_LOADING)))
+        return "-LOADING Redis is loading the dataset in memory\r\n";
+    prefetchKeys(tokens, client);
+    auto start = std::chrono::steady_clock::now();
+    std::string reply = RedisCluster::getInstance().enabled() ? executeClustered(tokens, client)
+                                                              : executeCommand(tokens, client);
+    RedisStats::getInstance().commandCalled(info, static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count()));
+    //appendfsync always: don't acknowledge a write before it is on disk
+    RedisAof::getInstance().waitDurable();
+    return reply;
+}
+
+bool RedisCommandHandler::loadAppendOnlyFile(const std::string& path, size_t& commands)
+{
+    //The log holds only commands that succeeded, none of them blocking, so it is
+    //replayed straight through executeCommand under one lock hold. A client with
+    //no socket carries MULTI state between the records of a transaction.
+    RedisClient replayClient(-1);
+    RedisDatabase::ExecLock lock(RedisDatabase::getInstance());
+    return RedisAof::replay(path, [&replayClient](std::vector<std::string>& tokens) {
+        executeCommand(tokens, replayClient);
+        replayClient.takeStream();
+    }, commands);
+}
+
+void RedisCommandHandler::applyReplicated(std::vector<std::string>& tokens, RedisClient& client)
+{
+    executeCommand(tokens, client);
+    client.takeStream();
+}
+
+static std::string dispatchCommand(const std::string& cmd, std::vector<std::string>& tokens, RedisDatabase& db, RedisClient& client);
+
+//The form a write is logged in, when it differs from the command as sent: relative
+//expiries become absolute so a replay expires keys at the same moment.
+static bool rewriteForLog(const std::string& cmd, const std::vector<std::string>& tokens, std::vector<std::string>& logged)
+{
+    if((cmd != "EXPIRE" && cmd != "RESTORE") || tokens.size() < 3) return false;
+    char* end = nullptr;
+    long long ttl = std::strtoll(tokens[2].c_str(), &end, 10);
+    if(tokens[2].empty() || *end != '\0') return false;
+
+    if(cmd == "EXPIRE") {
+        //out of range: the handler refuses it, so there is nothing to log
+        long long atMs;
+        if(!expireAtMs(ttl, atMs)) return false;
+        logged = {"PEXPIREAT", tokens[1], std::to_string(atMs)};
+        return true;
+    }
+    //RESTORE with a relative TTL: the same with ABSTTL
+    long long nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    if(ttl <= 0 || ttl > LLONG_MAX - nowMs || tokens.size() < 4) return false;
+    for(size_t i = 4; i < tokens.size(); ++i) {
+        std::string option = tokens[i];
+        std::transform(option.begin(), option.end(), option.begin(), ::toupper);
+        if(option == "ABSTTL") return false;
+    }
+    logged = tokens;
+    logged[2] = std::to_string(nowMs + ttl);
+    logged.push_back("ABSTTL");
+    return true;
+}
 
+static std::string executeCommand(std::vector<std::string>& tokens, RedisClient& client)
+{
     std::string cmd = tokens[0];
     std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::toupper);
     RedisDatabase& db = RedisDatabase::getInstance();
 
+    //a subscribed connection only takes (un)subscribe commands and PING
+    if(client.subscriptions > 0 && cmd != "SUBSCRIBE" && cmd != "UNSUBSCRIBE" &&
+       cmd != "PSUBSCRIBE" && cmd != "PUNSUBSCRIBE" && cmd != "PING")
+    {
+        return "-ERR Can't execute '" + tokens[0] + "': only (P)SUBSCRIBE / (P)UNSUBSCRIBE / PING are allowed in this context\r\n";
+    }
+
+    //a read-only replica is written to by its master only
+    if(!client.master_link && RedisReplication::getInstance().readOnlyReplica() && isWriteCommand(cmd))
+        return "-READONLY You can't write against a read only replica.\r\n";
+
+    //inside MULTI everything but the transaction commands is queued for EXEC, and
+    //what can't run inside one (a replication handshake, a subscription whose push
+    //messages would land inside the EXEC reply) is refused
+    if(client.in_multi && cmd != "EXEC" && cmd != "DISCARD" && cmd != "MULTI" && cmd != "WATCH")
+    {
+        const CommandInfo* info = lookupCommand(cmd);
+        if(info && (info->flags & CMD_NO_MULTI)) return "-ERR Command not allowed inside a transaction\r\n";
+        client.queued_commands.push_back(std::move(tokens));
+        return "+QUEUED\r\n";
+    }
+
+    //A write runs inside a WriteScope and is logged once it succeeded. Blocking
+    //commands are left to the database, which logs the pops they end up doing.
+    const CommandInfo* info = db.propagating() ? lookupCommand(cmd) : nullptr;
+    if(info && (info->flags & CMD_WRITE) && !(info->flags & CMD_BLOCKING))
+    {
+        RedisDatabase::WriteScope scope(db);
+        std::vector<std::string> logged;
+        bool rewritten = rewriteForLog(cmd, tokens, logged);
+        std::string reply = dispatchCommand(cmd, tokens, db, client);
+        if(reply.empty() || reply[0] != '-') db.propagate(rewritten ? logged : tokens);
+        return reply;
+    }
+    return dispatchCommand(cmd, tokens, db, client);
+}
+
+static std::string dispatchCommand(const std::string& cmd, std::vector<std::string>& tokens, RedisDatabase& db, RedisClient& client)
+{
     //check commands
     //First check for Common Commands
     if (cmd == "PING") 
@@ -547,6 +1837,27 @@ std::string RedisCommandHandler::processCommand(const std::string& commandLine){
     {
         return handleEcho(tokens,db) ;        
     } 
+    // Transactions
+    else if (cmd == "MULTI")
+    {
+        return handleMulti(client);
+    }
+    else if (cmd == "EXEC")
+    {
+        return handleExec(db, client);
+    }
+    else if (cmd == "DISCARD")
+    {
+        return handleDiscard(db, client);
+    }
+    else if (cmd == "WATCH")
+    {
+        return handleWatch(tokens, db, client);
+    }
+    else if (cmd == "UNWATCH")
+    {
+        return handleUnwatch(db, client);
+    }
     else if (cmd == "FLUSHALL") 
     {
         // If a real flush exists, call it on db; otherwise acknowledge
@@ -569,14 +1880,104 @@ std::string RedisCommandHandler::processCommand(const std::string& commandLine){
     {
         return handleType(tokens, db);
     }
-    else if(cmd == "DEL" || cmd == "UNLINK")
+    else if(cmd == "DEL")
     {
         return handleDel(tokens,db);
     }
+    else if(cmd == "UNLINK")
+    {
+        return handleUnlink(tokens,db);
+    }
+    else if(cmd == "EXISTS")
+    {
+        return handleExists(tokens,db);
+    }
+    else if(cmd == "SAVE")
+    {
+        return handleSave(tokens,db);
+    }
+    else if(cmd == "BGSAVE")
+    {
+        return handleBgsave(tokens,db);
+    }
+    else if(cmd == "LASTSAVE")
+    {
+        return handleLastsave(tokens,db);
+    }
+    else if(cmd == "BGREWRITEAOF")
+    {
+        return handleBgrewriteaof(tokens,db);
+    }
+    // Replication
+    else if(cmd == "PSYNC")
+    {
+        return handlePsync(tokens, client);
+    }
+    else if(cmd == "SYNC")
+    {
+        return handleSync(tokens, client);
+    }
+    else if(cmd == "REPLCONF")
+    {
+        return handleReplconf(tokens, client);
+    }
+    else if(cmd == "REPLICAOF" || cmd == "SLAVEOF")
+    {
+        return handleReplicaof(tokens);
+    }
+    // Cluster
+    else if(cmd == "CLUSTER")
+    {
+        return handleCluster(tokens, db, client);
+    }
+    else if(cmd == "ASKING")
+    {
+        return handleAsking(client);
+    }
+    else if(cmd == "MIGRATE")
+    {
+        return handleMigrate(tokens, db);
+    }
+    else if(cmd == "WAIT")
+    {
+        return handleWait(tokens, db, client);
+    }
+    else if(cmd == "ROLE")
+    {
+        return handleRole(tokens);
+    }
+    else if(cmd == "INFO")
+    {
+        return handleInfo(tokens);
+    }
+    else if(cmd == "MGET")
+    {
+        return handleMget(tokens,db);
+    }
+    else if(cmd == "MSET")
+    {
+        return handleMset(tokens,db);
+    }
+    else if(cmd == "MSETNX")
+    {
+        return handleMsetnx(tokens,db);
+    }
     else if (cmd =="EXPIRE")
     {
         return handleExpire(tokens, db);
     }
+    else if (cmd == "PEXPIREAT")
+    {
+        return handlePexpireat(tokens, db);
+    }
+    else if(cmd == "DUMP")
+    {
+        return handleDump(tokens, db);
+    }
+    else if(cmd == "RESTORE")
+    {
+        return handleRestore(tokens, db);
+    }
     else if(cmd == "RENAME")
     {
         return handleRename(tokens, db);
@@ -592,7 +1993,11 @@ std::string RedisCommandHandler::processCommand(const std::string& commandLine){
     }
     else if(cmd == "LGET")
     {
-        return handleLGet(tokens, db);
+        return handleLGet(tokens, db, client);
+    }
+    else if(cmd == "LRANGE")
+    {
+        return handleLrange(tokens, db, client);
     }
     else if(cmd == "LINDEX")
     {
@@ -622,6 +2027,22 @@ std::string RedisCommandHandler::processCommand(const std::string& commandLine){
     {
         return  handleRPop(tokens,db);
     }
+    else if(cmd == "LMOVE")
+    {
+        return handleLmove(tokens, db);
+    }
+    else if(cmd == "BLPOP")
+    {
+        return handleBlockingPop(tokens, db, client, true);
+    }
+    else if(cmd == "BRPOP")
+    {
+        return handleBlockingPop(tokens, db, client, false);
+    }
+    else if(cmd == "BLMOVE")
+    {
+        return handleBlmove(tokens, db, client);
+    }
     // Hash Operations
     else if( cmd == "HSET") 
     {
@@ -645,11 +2066,11 @@ std::string RedisCommandHandler::processCommand(const std::string& commandLine){
     }
     else if( cmd == "HVALS") 
     {
-        return handleHvals(tokens, db);
+        return handleHvals(tokens, db, client);
     }
     else if( cmd == "HGETALL") 
     {
-        return handleHgetall(tokens, db);
+        return handleHgetall(tokens, db, client);
     }
     else if( cmd == "HMSET") 
     {
@@ -657,7 +2078,7 @@ std::string RedisCommandHandler::processCommand(const std::string& commandLine){
     } 
     else if( cmd == "HKEYS") 
     {
-        return handleHkeys(tokens, db);
+        return handleHkeys(tokens, db, client);
     }
     else if(cmd == "HSETNX")    
     {
@@ -683,6 +2104,10 @@ std::string RedisCommandHandler::processCommand(const std::string& commandLine){
     {
         return handleCopy(tokens, db);
     }
+    else if(cmd == "RANDOMKEY")
+    {
+        return handleRandomkey(tokens, db);
+    }
     else if(cmd == "DBSIZE")
     {
         return handleDbsize(tokens, db);
@@ -691,6 +2116,48 @@ std::string RedisCommandHandler::processCommand(const std::string& commandLine){
     {
         return handleHgetdel(tokens, db);
     }
+    // Pub/Sub
+    else if(cmd == "SUBSCRIBE")
+    {
+        return handleSubscribe(tokens, client);
+    }
+    else if(cmd == "UNSUBSCRIBE")
+    {
+        return handleUnsubscribe(tokens, client);
+    }
+    else if(cmd == "PSUBSCRIBE")
+    {
+        return handlePsubscribe(tokens, client);
+    }
+    else if(cmd == "PUNSUBSCRIBE")
+    {
+        return handlePunsubscribe(tokens, client);
+    }
+    else if(cmd == "PUBLISH")
+    {
+        return handlePublish(tokens);
+    }
+    // Bitmap Operations
+    else if(cmd == "SETBIT")
+    {
+        return handleSetbit(tokens, db);
+    }
+    else if(cmd == "GETBIT")
+    {
+        return handleGetbit(tokens, db);
+    }
+    else if(cmd == "BITCOUNT")
+    {
+        return handleBitcount(tokens, db);
+    }
+    else if(cmd == "BITPOS")
+    {
+        return handleBitpos(tokens, db);
+    }
+    else if(cmd == "BITOP")
+    {
+        return handleBitop(tokens, db);
+    }
     else
     {
         return "-ERR unknown command '" + tokens[0] + "'\r\n";
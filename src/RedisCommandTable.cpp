@@ -0,0 +1,150 @@
+#include "RedisCommandTable.h"
+#include <strings.h>
+#include <unordered_map>
+
+static const CommandInfo COMMAND_TABLE[] = {
+    //Common
+    {"PING", CMD_LOADING},
+    {"ECHO", CMD_LOADING},
+    {"FLUSHALL", CMD_WRITE},
+    {"KEYS", CMD_READONLY},
+    {"TYPE", CMD_READONLY, 1, 1, 1},
+    {"DBSIZE", CMD_READONLY},
+    {"RANDOMKEY", CMD_READONLY},
+    {"SAVE", CMD_ADMIN},
+    {"BGSAVE", CMD_ADMIN},
+    {"LASTSAVE", CMD_ADMIN},
+    {"BGREWRITEAOF", CMD_ADMIN},
+
+    //Replication
+    {"PSYNC", CMD_ADMIN | CMD_NO_MULTI},
+    {"SYNC", CMD_ADMIN | CMD_NO_MULTI},
+    {"REPLCONF", CMD_ADMIN | CMD_NO_MULTI},
+    {"REPLICAOF", CMD_ADMIN},
+    {"SLAVEOF", CMD_ADMIN},
+    {"WAIT", 0},
+    {"ROLE", CMD_ADMIN | CMD_LOADING},
+    {"INFO", CMD_ADMIN | CMD_LOADING},
+
+    //Cluster
+    {"CLUSTER", CMD_ADMIN | CMD_LOADING},
+    {"ASKING", 0},
+    //logs the DEL it amounts to, not itself
+    {"MIGRATE", CMD_WRITE | CMD_BLOCKING, 3, 3, 1},
+
+    //Transactions
+    {"MULTI", CMD_TRANSACTION},
+    {"EXEC", CMD_TRANSACTION},
+    {"DISCARD", CMD_TRANSACTION},
+    {"WATCH", CMD_TRANSACTION, 1, -1, 1},
+    {"UNWATCH", CMD_TRANSACTION},
+
+    //Key/Value
+    {"SET", CMD_WRITE, 1, 1, 1},
+    {"GET", CMD_READONLY, 1, 1, 1},
+    {"GETSET", CMD_WRITE, 1, 1, 1},
+    {"MGET", CMD_READONLY, 1, -1, 1},
+    {"MSET", CMD_WRITE, 1, -1, 2},
+    {"MSETNX", CMD_WRITE, 1, -1, 2},
+    {"DEL", CMD_WRITE, 1, -1, 1},
+    {"UNLINK", CMD_WRITE, 1, -1, 1},
+    {"EXISTS", CMD_READONLY, 1, -1, 1},
+    {"EXPIRE", CMD_WRITE, 1, 1, 1},
+    {"PEXPIREAT", CMD_WRITE, 1, 1, 1},
+    {"RENAME", CMD_WRITE, 1, 2, 1},
+    {"COPY", CMD_WRITE, 1, 2, 1},
+    {"DUMP", CMD_READONLY, 1, 1, 1},
+    {"RESTORE", CMD_WRITE, 1, 1, 1},
+
+    //Bitmaps
+    {"SETBIT", CMD_WRITE, 1, 1, 1},
+    {"GETBIT", CMD_READONLY, 1, 1, 1},
+    {"BITCOUNT", CMD_READONLY, 1, 1, 1},
+    {"BITPOS", CMD_READONLY, 1, 1, 1},
+    {"BITOP", CMD_WRITE, 2, -1, 1},
+
+    //Lists
+    {"LLEN", CMD_READONLY, 1, 1, 1},
+    {"LGET", CMD_READONLY, 1, 1, 1},
+    {"LRANGE", CMD_READONLY, 1, 1, 1},
+    {"LINDEX", CMD_READONLY, 1, 1, 1},
+    {"LSET", CMD_WRITE, 1, 1, 1},
+    {"LREM", CMD_WRITE, 1, 1, 1},
+    {"LPUSH", CMD_WRITE, 1, 1, 1},
+    {"RPUSH", CMD_WRITE, 1, 1, 1},
+    {"LPOP", CMD_WRITE, 1, 1, 1},
+    {"RPOP", CMD_WRITE, 1, 1, 1},
+    {"LMOVE", CMD_WRITE, 1, 2, 1},
+    {"LINSERT", CMD_WRITE, 1, 1, 1},
+    {"LTRIM", CMD_WRITE, 1, 1, 1},
+    {"BLPOP", CMD_WRITE | CMD_BLOCKING, 1, -2, 1},
+    {"BRPOP", CMD_WRITE | CMD_BLOCKING, 1, -2, 1},
+    {"BLMOVE", CMD_WRITE | CMD_BLOCKING, 1, 2, 1},
+
+    //Hashes
+    {"HSET", CMD_WRITE, 1, 1, 1},
+    {"HGET", CMD_READONLY, 1, 1, 1},
+    {"HEXISTS", CMD_READONLY, 1, 1, 1},
+    {"HDEL", CMD_WRITE, 1, 1, 1},
+    {"HLEN", CMD_READONLY, 1, 1, 1},
+    {"HKEYS", CMD_READONLY, 1, 1, 1},
+    {"HVALS", CMD_READONLY, 1, 1, 1},
+    {"HGETALL", CMD_READONLY, 1, 1, 1},
+    {"HMSET", CMD_WRITE, 1, 1, 1},
+    {"HSETNX", CMD_WRITE, 1, 1, 1},
+    {"HRANDFIELD", CMD_READONLY, 1, 1, 1},
+    {"HSCAN", CMD_READONLY, 1, 1, 1},
+    {"HGETDEL", CMD_WRITE, 1, 1, 1},
+
+    //Pub/Sub
+    {"SUBSCRIBE", CMD_PUBSUB | CMD_NO_MULTI},
+    {"UNSUBSCRIBE", CMD_PUBSUB},
+    {"PSUBSCRIBE", CMD_PUBSUB | CMD_NO_MULTI},
+    {"PUNSUBSCRIBE", CMD_PUBSUB},
+    {"PUBLISH", CMD_PUBSUB},
+};
+
+void commandKeys(const CommandInfo& info, const std::vector<std::string>& argv, std::vector<std::string>& keys)
+{
+    keys.clear();
+    if(info.firstKey <= 0) return;
+    int argc = static_cast<int>(argv.size());
+    int last = info.lastKey < 0 ? argc + info.lastKey : info.lastKey;
+    for(int i = info.firstKey; i <= last && i < argc; i += info.keyStep) keys.push_back(argv[i]);
+    //MIGRATE ... "" ... KEYS key...: the keys are the arguments after KEYS
+    if(argc > 6 && argv[3].empty() && std::string(info.name) == "MIGRATE") {
+        keys.clear();
+        for(int i = 6; i < argc; ++i) {
+            if(strcasecmp(argv[i].c_str(), "KEYS") != 0) continue;
+            keys.assign(argv.begin() + i + 1, argv.end());
+            break;
+        }
+    }
+}
+
+size_t commandCount()
+{
+    return sizeof(COMMAND_TABLE) / sizeof(COMMAND_TABLE[0]);
+}
+
+size_t commandIndex(const CommandInfo& info)
+{
+    return static_cast<size_t>(&info - COMMAND_TABLE);
+}
+
+const CommandInfo& commandAt(size_t index)
+{
+    return COMMAND_TABLE[index];
+}
+
+const CommandInfo* lookupCommand(const std::string& name)
+{
+    static const std::unordered_map<std::string, const CommandInfo*> index = [](){
+        std::unordered_map<std::string, const CommandInfo*> byName;
+        for(const auto& info : COMMAND_TABLE) byName.emplace(info.name, &info);
+        return byName;
+    }();
+
+    auto it = index.find(name);
+    return it == index.end() ? nullptr : it->second;
+}
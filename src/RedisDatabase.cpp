@@ -1,5 +1,18 @@
+#include "RedisCluster.h"
 #include "RedisCommandHandler.h"
 #include "RedisDatabase.h"
+#include "RedisResp.h"
+#include "RedisSnapshot.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 RedisDatabase &RedisDatabase::getInstance()
 {    
@@ -7,6 +20,294 @@ RedisDatabase &RedisDatabase::getInstance()
     return instance;
 }
 
+RedisDatabase::RedisDatabase()
+{
+    last_save = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    lazyfree_thread = std::thread([this](){ lazyFreeLoop(); });
+    hangup_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(hangup_wake < 0) {
+        std::cerr << "Warning: eventfd() failed: " << std::strerror(errno) << "\n";
+    }
+    hangup_thread = std::thread([this](){ hangupLoop(); });
+}
+
+RedisDatabase::~RedisDatabase()
+{
+    if(bgsave_thread.joinable()) bgsave_thread.join();
+    {
+        //the warm-up stops once the file it pages in from is no longer current
+        std::lock_guard<std::recursive_mutex> lock(db_mutex);
+        lazy_file.reset();
+    }
+    if(warmup_thread.joinable()) warmup_thread.join();
+    {
+        std::lock_guard<std::mutex> lock(tier_mutex);
+        tier_stop = true;
+    }
+    tier_cv.notify_one();
+    if(tier_thread.joinable()) tier_thread.join();
+
+    {
+        std::lock_guard<std::mutex> lock(lazyfree_mutex);
+        lazyfree_stop = true;
+    }
+    lazyfree_cv.notify_one();
+    if(lazyfree_thread.joinable()) lazyfree_thread.join();
+
+    {
+        std::lock_guard<std::mutex> lock(hangup_mutex);
+        hangup_stop = true;
+    }
+    uint64_t one = 1;
+    if(hangup_wake >= 0 && write(hangup_wake, &one, sizeof(one)) < 0) {}
+    if(hangup_thread.joinable()) hangup_thread.join();
+    if(hangup_wake >= 0) close(hangup_wake);
+}
+
+// LAZY FREE
+//
+// Freeing a value costs roughly one deallocation per element, so dropping a big
+// list or hash under db_mutex stalls every client. Values whose free effort is
+// above LAZYFREE_THRESHOLD are moved into a heap holder instead (a pointer swap)
+// and destroyed on the lazy-free thread. Small values are cheaper to free inline
+// than to hand off.
+
+static const size_t LAZYFREE_THRESHOLD = 64;
+//a string is one allocation, but unmapping a huge one is not free: count 64KB as one unit
+static const size_t LAZYFREE_STRING_UNIT = 64 * 1024;
+
+static size_t freeEffort(const std::string& value)
+{
+    return value.size() / LAZYFREE_STRING_UNIT;
+}
+
+static size_t freeEffort(const RedisDatabase::StringValue& value)
+{
+    return freeEffort(value.data);
+}
+
+static size_t freeEffort(const std::vector<std::string>& value)
+{
+    return value.size();
+}
+
+static size_t freeEffort(const std::unordered_map<std::string, std::string>& value)
+{
+    return value.size();
+}
+
+template <typename T>
+static size_t freeEffort(const std::shared_ptr<T>& handle)
+{
+    return handle ? freeEffort(*handle) : 0;
+}
+
+template <typename T>
+void RedisDatabase::disposeValue(std::shared_ptr<T>&& handle)
+{
+    //shared values are already heap objects: hand the handle over as is
+    if(freeEffort(handle) > LAZYFREE_THRESHOLD) {
+        freeAsync(std::move(handle));
+    }
+}
+
+template <typename T>
+void RedisDatabase::disposeValue(T&& value)
+{
+    using Value = typename std::decay<T>::type;
+    if(freeEffort(value) > LAZYFREE_THRESHOLD) {
+        freeAsync(std::make_shared<Value>(std::move(value)));
+    }
+    //otherwise the caller destroys it inline
+}
+
+void RedisDatabase::freeAsync(std::shared_ptr<void> garbage)
+{
+    ++lazyfree_pending;
+    {
+        std::lock_guard<std::mutex> lock(lazyfree_mutex);
+        lazyfree_queue.emplace_back(std::move(garbage));
+    }
+    lazyfree_cv.notify_one();
+}
+
+void RedisDatabase::lazyFreeLoop()
+{
+    std::unique_lock<std::mutex> lock(lazyfree_mutex);
+    while(true) {
+        lazyfree_cv.wait(lock, [this](){ return lazyfree_stop || !lazyfree_queue.empty(); });
+        if(lazyfree_queue.empty()) return; //stopping and nothing left
+
+        std::vector<std::shared_ptr<void>> batch;
+        batch.swap(lazyfree_queue);
+        lock.unlock();
+
+        size_t count = batch.size();
+        batch.clear(); //the actual frees happen here, off every lock
+        lazyfree_pending -= count;
+
+        lock.lock();
+    }
+}
+
+//Remove key from every store and its expiry. Caller holds db_mutex.
+bool RedisDatabase::removeKey(const std::string& key, bool lazy)
+{
+    //a key still on disk goes without being paged in
+    bool removed = dropCold(key);
+
+    auto kv = kv_store.find(key);
+    if(kv != kv_store.end()) {
+        if(lazy) disposeValue(std::move(kv->second));
+        kv_store.erase(kv);
+        removed = true;
+    }
+
+    auto list = list_store.find(key);
+    if(list != list_store.end()) {
+        if(lazy) disposeValue(std::move(list->second));
+        list_store.erase(list);
+        removed = true;
+    }
+
+    auto hash = hash_store.find(key);
+    if(hash != hash_store.end()) {
+        if(lazy) disposeValue(std::move(hash->second));
+        hash_store.erase(hash);
+        removed = true;
+    }
+
+    expire_map.erase(key);
+    if(removed) touchKey(key);
+    return removed;
+}
+
+// COPY-ON-WRITE VALUES
+//
+// Every store holds its values through shared handles. Readers that need a value
+// beyond the lock (streamed replies, dump snapshots) and keys sharing a value after
+// COPY take a reference under db_mutex; writers call detach() first, which copies
+// the value only while such a reference is alive. New references are only created
+// under db_mutex, so a use_count() of 1 seen under the lock means nobody else can
+// be reading the value.
+
+template <typename T>
+static T& detach(std::shared_ptr<T>& handle)
+{
+    if(!handle) {
+        handle = std::make_shared<T>();
+    } else if(handle.use_count() > 1) {
+        handle = std::make_shared<T>(*handle);
+    }
+    return *handle;
+}
+
+template <typename T>
+T& RedisDatabase::modify(const std::string& key, std::shared_ptr<T>& handle)
+{
+    touchKey(key);
+    return detach(handle);
+}
+
+// TRANSACTIONS
+//
+// WATCH is optimistic: a watched key gets a version counter that every write to it
+// bumps, and EXEC compares the versions recorded at WATCH time. Counters exist only
+// while someone watches the key, so unwatched writes pay one failed lookup (none
+// at all while nothing is watched) and EXEC's check is O(watched keys).
+
+void RedisDatabase::touchKey(const std::string& key)
+{
+    ++dirty;
+    if(delta_valid) trackDelta(key);
+    if(watched_keys.empty()) return;
+    auto it = watched_keys.find(key);
+    if(it != watched_keys.end()) ++it->second.version;
+}
+
+void RedisDatabase::watch(const std::vector<std::string>& keys, WatchList& watched)
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    purgeExpired();
+    for(const auto& key : keys) {
+        bool already = std::any_of(watched.begin(), watched.end(),
+                                   [&key](const WatchList::value_type& entry){ return entry.first == key; });
+        if(already) continue;
+
+        auto& entry = watched_keys[key];
+        ++entry.watchers;
+        watched.emplace_back(key, entry.version);
+    }
+}
+
+void RedisDatabase::unwatch(WatchList& watched)
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    for(const auto& key : watched) {
+        auto it = watched_keys.find(key.first);
+        if(it != watched_keys.end() && --it->second.watchers == 0) watched_keys.erase(it);
+    }
+    watched.clear();
+}
+
+bool RedisDatabase::watchedUnchanged(const WatchList& watched)
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    purgeExpired(); //a watched key that expired since WATCH counts as modified
+    for(const auto& key : watched) {
+        auto it = watched_keys.find(key.first);
+        if(it == watched_keys.end() || it->second.version != key.second) return false;
+    }
+    return true;
+}
+
+// PROPAGATION
+//
+// Write commands are logged by the command layer (see RedisCommandHandler.cpp) under
+// a WriteScope, after they ran. Some writes happen outside any command a client
+// sent: an LPUSH that wakes a BLPOP also pops for it. Those are logged here as the
+// plain LPOP/RPOP/LMOVE they amount to, and held back while a WriteScope is open so
+// they follow the command that caused them. Replaying the log never blocks.
+
+void RedisDatabase::setPropagator(Propagator sink)
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    propagator = std::move(sink);
+}
+
+void RedisDatabase::propagate(const std::vector<std::string>& argv)
+{
+    if(!propagator) return;
+    propagator(argv);
+    flushEffects();
+}
+
+void RedisDatabase::propagateEffect(std::vector<std::string> argv)
+{
+    if(!propagator) return;
+    if(propagate_hold > 0) held_effects.push_back(std::move(argv));
+    else propagator(argv);
+}
+
+void RedisDatabase::flushEffects()
+{
+    if(held_effects.empty()) return;
+    std::vector<std::vector<std::string>> effects;
+    effects.swap(held_effects);
+    for(const auto& argv : effects) propagator(argv);
+}
+
+void RedisDatabase::propagatePop(const BlockedClient& waiter, const std::string& key)
+{
+    if(!propagator) return;
+    if(!waiter.moveTo) {
+        propagateEffect({waiter.popLeft ? "LPOP" : "RPOP", key});
+        return;
+    }
+    propagateEffect({"LMOVE", key, waiter.target, waiter.popLeft ? "LEFT" : "RIGHT", waiter.pushLeft ? "LEFT" : "RIGHT"});
+}
+
 // Key/Value operations
 // List Operations
 // Hash Operations
@@ -15,44 +316,1403 @@ RedisDatabase &RedisDatabase::getInstance()
 Memory -> file - dump()
 file -> load() memory when opening 
 
-K = key value
-L = list
-H = hash
-*/
+The file format is described in RedisSnapshot.h. Dumps from before it, lines of
+K key value / L key item... / H key field:value..., are still read by loadText().
+*/
+
+//expiry deadlines are steady_clock in memory and absolute unix milliseconds on disk
+static int64_t unixNowMs()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static int64_t toUnixMs(std::chrono::steady_clock::time_point deadline)
+{
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+    return unixNowMs() + left.count();
+}
+
+static std::chrono::steady_clock::time_point fromUnixMs(int64_t ms)
+{
+    return std::chrono::steady_clock::now() + std::chrono::milliseconds(ms - unixNowMs());
+}
+
+RedisDatabase::Snapshot RedisDatabase::snapshot()
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    purgeExpired();
+
+    //O(shards), not O(keys): the tables are frozen, not copied (RedisCowTable.h). A
+    //writer copies a shard the snapshot still holds before changing it, and the
+    //values in it stay shared until a writer detaches them.
+    Snapshot snap;
+    snap.strings = kv_store.freeze();
+    snap.lists = list_store.freeze();
+    snap.hashes = hash_store.freeze();
+    snap.expires = expire_map.freeze();
+    if(!cold_index.empty()) {
+        snap.cold = cold_index.freeze();
+        snap.lazyFile = lazy_file;
+        snap.tierLog = tier_log;
+    }
+    snap.dirty = dirty;
+    return snap;
+}
+
+bool RedisDatabase::dump(const std::string &filename, bool delta, bool* busy)
+{
+    //one save at a time: wait out a background save rather than race it for the file
+    if(!busy) {
+        beginSave();
+    } else if(save_running.exchange(true)) {
+        *busy = true;
+        return false;
+    }
+    //serialize a snapshot so writers are not held up while the file is written
+    bool ok = writeSnapshot(saveSnapshot(filename, delta), filename);
+    endSave();
+    return ok;
+}
+
+void RedisDatabase::beginSave()
+{
+    std::unique_lock<std::mutex> lock(save_mutex);
+    save_cv.wait(lock, [this]() { return !save_running.exchange(true); });
+}
+
+void RedisDatabase::endSave()
+{
+    {
+        std::lock_guard<std::mutex> lock(save_mutex);
+        save_running = false;
+    }
+    save_cv.notify_all();
+}
+
+//elements per RPUSH/HMSET when a collection is written out as commands
+static const size_t REWRITE_ITEMS_PER_COMMAND = 64;
+
+template <typename List>
+static void emitListCommands(const std::string& key, const List& lst,
+                             const std::function<void(const std::vector<std::string>&)>& emit)
+{
+    std::vector<std::string> argv;
+    for(size_t i = 0; i < lst.size(); ) {
+        argv.assign({"RPUSH", key});
+        for(size_t n = 0; n < REWRITE_ITEMS_PER_COMMAND && i < lst.size(); ++n) argv.push_back(lst[i++]);
+        emit(argv);
+    }
+}
+
+template <typename Hash>
+static void emitHashCommands(const std::string& key, const Hash& hash,
+                             const std::function<void(const std::vector<std::string>&)>& emit)
+{
+    std::vector<std::string> argv;
+    auto it = hash.begin();
+    while(it != hash.end()) {
+        argv.assign({"HMSET", key});
+        for(size_t n = 0; n < REWRITE_ITEMS_PER_COMMAND && it != hash.end(); ++n, ++it) {
+            argv.push_back(it->first);
+            argv.push_back(it->second);
+        }
+        emit(argv);
+    }
+}
+
+bool RedisDatabase::keyCommands(const std::string& key, const std::function<void(const std::vector<std::string>&)>& emit)
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    purgeExpired();
+    std::string scratch;
+    auto kv = kv_store.find(key);
+    if(kv != kv_store.end()) {
+        emit({"SET", key, stringBytes(*kv->second, scratch)});
+    } else {
+        auto list = list_store.find(key);
+        auto hash = hash_store.find(key);
+        if(list != list_store.end()) emitListCommands(key, *list->second, emit);
+        else if(hash != hash_store.end()) emitHashCommands(key, *hash->second, emit);
+        else return false;
+    }
+    auto expiry = expire_map.find(key);
+    if(expiry != expire_map.end()) emit({"PEXPIREAT", key, std::to_string(toUnixMs(expiry->second))});
+    return true;
+}
+
+bool RedisDatabase::dumpKey(const std::string& key, std::string& payload)
+{
+    //a one key snapshot under the empty name, written like a save writes its records
+    Snapshot snap;
+    {
+        std::lock_guard<std::recursive_mutex> lock(db_mutex);
+        purgeExpired();
+        auto kv = kv_store.find(key);
+        auto list = list_store.find(key);
+        auto hash = hash_store.find(key);
+        if(kv != kv_store.end()) snap.strings.add("", kv->second);
+        else if(list != list_store.end()) snap.lists.add("", list->second);
+        else if(hash != hash_store.end()) snap.hashes.add("", hash->second);
+        else return false;
+        auto expiry = expire_map.find(key);
+        if(expiry != expire_map.end()) snap.expires.add("", expiry->second);
+    }
+    SnapshotWriter out;
+    out.openPayload();
+    writeRecords(snap, out, [](){});
+    payload = out.payload();
+    return true;
+}
+
+bool RedisDatabase::restoreKey(const std::string& key, SnapshotEntry& entry, bool replace)
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    purgeExpired();
+    if(hasKey(key)) {
+        if(!replace) return false;
+        removeKey(key, true);
+    }
+    touchKey(key);
+    int64_t nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    if(entry.expireAtMs >= 0 && entry.expireAtMs <= nowMs) return true;
+
+    installCold(key, entry);
+    if(entry.expireAtMs >= 0) expire_map[key] = fromUnixMs(entry.expireAtMs);
+    if(entry.type == SnapshotType::List) serveBlockedClients(key);
+    return true;
+}
+
+void RedisDatabase::rewriteCommands(const std::function<void(const std::vector<std::string>&)>& emit,
+                                    const std::function<void()>& snapshotTaken)
+{
+    Snapshot snap;
+    {
+        std::lock_guard<std::recursive_mutex> lock(db_mutex);
+        snap = snapshot();
+        if(snapshotTaken) snapshotTaken();
+    }
+    std::string scratch;
+    auto expiry = [&](const std::string& key) {
+        auto it = snap.expires.find(key);
+        if(it != snap.expires.end()) emit({"PEXPIREAT", key, std::to_string(toUnixMs(it->second))});
+    };
+
+    for(const auto& entry : snap.strings) {
+        emit({"SET", entry.first, stringBytes(*entry.second, scratch)});
+        expiry(entry.first);
+    }
+    for(const auto& entry : snap.lists) {
+        emitListCommands(entry.first, *entry.second, emit);
+        expiry(entry.first);
+    }
+    for(const auto& entry : snap.hashes) {
+        emitHashCommands(entry.first, *entry.second, emit);
+        expiry(entry.first);
+    }
+    //values still on disk come straight from the mapped snapshot
+    SnapshotEntry value;
+    for(const auto& entry : snap.cold) {
+        if(!readCold(entry.second, snap.tierLog.get(), value)) continue;
+        if(value.type == SnapshotType::String) emit({"SET", entry.first, value.str});
+        else if(value.type == SnapshotType::List) emitListCommands(entry.first, value.list, emit);
+        else if(value.type == SnapshotType::Hash) emitHashCommands(entry.first, value.hash, emit);
+        expiry(entry.first);
+    }
+}
+
+// BACKGROUND SAVE
+//
+// BGSAVE needs no fork(): the key tables are sharded and copy-on-write, and so are
+// the values, so the snapshot taken under db_mutex (the tables frozen in O(shards),
+// no key or value copied) stays frozen while clients keep writing, and a saver
+// thread serializes it. While the save holds them, a writer pays one copy of each
+// shard it changes and of each value it modifies; a read through a non-const lookup
+// also copies its shard, as it may hand out a writable entry.
+
+//log a progress line at most this often during a save
+static const auto SAVE_PROGRESS_INTERVAL = std::chrono::seconds(1);
+
+bool RedisDatabase::writeSnapshot(const Snapshot& snap, const std::string& filename)
+{
+    last_save_try = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    //a delta goes to its own file and joins the chain once it is complete
+    bool delta = !snap.deltaFile.empty();
+    const std::string& target = delta ? snap.deltaFile : filename;
+    auto failed = [this]() {
+        last_save_ok = false;
+        std::lock_guard<std::recursive_mutex> lock(db_mutex);
+        delta_valid = false;
+        delta_keys.clear();
+        return false;
+    };
+    SnapshotWriter out;
+    if(!out.open(target)) return failed();
+
+    save_keys_total = snap.strings.size() + snap.lists.size() + snap.hashes.size() + snap.deleted.size() + snap.cold.size();
+    save_keys_done = 0;
+    size_t done = 0;
+    auto lastReport = std::chrono::steady_clock::now();
+    auto progress = [&]() {
+        if((++done & 1023) != 0) return;
+        save_keys_done = done;
+        auto now = std::chrono::steady_clock::now();
+        if(now - lastReport < SAVE_PROGRESS_INTERVAL) return;
+        lastReport = now;
+        std::cout << "Saving " << target << ": " << done << "/" << save_keys_total << " keys\n";
+    };
+    if(!writeRecords(snap, out, progress)) return failed();
+    save_keys_done = done;
+
+    if(!out.commit()) return failed();
+    const LzfStats& packed = out.compression();
+    if(packed.strings > 0) {
+        std::cout << "Compressed " << packed.strings << " strings in " << target << ": "
+                  << packed.rawBytes << " -> " << packed.storedBytes << " bytes\n";
+    }
+    if(delta) {
+        //not in the manifest, the delta would be skipped on load: the save did not happen
+        if(!appendDelta(filename, target)) return failed();
+    } else if(!resetDeltaChain(filename, out.checksum())) {
+        //the snapshot itself is good; only the chain on top of it cannot start
+        std::lock_guard<std::recursive_mutex> lock(db_mutex);
+        delta_valid = false;
+        delta_keys.clear();
+    }
+
+    last_save_ok = true;
+    last_save = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    //writes made while the file was written are not in it and stay dirty
+    dirty -= snap.dirty;
+    return true;
+}
+
+bool RedisDatabase::writeRecords(const Snapshot& snap, SnapshotWriter& out, const std::function<void()>& progress)
+{
+    auto expiry = [&snap](const std::string& key) {
+        auto it = snap.expires.find(key);
+        return it == snap.expires.end() ? int64_t(-1) : toUnixMs(it->second);
+    };
+
+    for(const auto& kv : snap.strings) {
+        const StringValue& value = *kv.second;
+        if(value.compressed()) out.writeCompressedString(kv.first, value.data, value.rawSize, expiry(kv.first));
+        else out.writeString(kv.first, value.data, expiry(kv.first));
+        progress();
+    }
+    for(const auto& kv : snap.lists) {
+        out.writeList(kv.first, *kv.second, expiry(kv.first));
+        progress();
+    }
+    for(const auto& kv : snap.hashes) {
+        out.writeHash(kv.first, *kv.second, expiry(kv.first));
+        progress();
+    }
+    for(const auto& key : snap.deleted) {
+        out.writeDelete(key);
+        progress();
+    }
+    SnapshotEntry value;
+    for(const auto& kv : snap.cold) {
+        if(!readCold(kv.second, snap.tierLog.get(), value)) return false;
+        if(value.type == SnapshotType::String) out.writeString(kv.first, value.str, expiry(kv.first));
+        else if(value.type == SnapshotType::List) out.writeList(kv.first, value.list, expiry(kv.first));
+        else if(value.type == SnapshotType::Hash) out.writeHash(kv.first, value.hash, expiry(kv.first));
+        progress();
+    }
+    return true;
+}
+
+bool RedisDatabase::dumpForSync(const std::string& path, const std::function<void()>& snapshotTaken)
+{
+    Snapshot snap;
+    {
+        std::lock_guard<std::recursive_mutex> lock(db_mutex);
+        snap = snapshot();
+        snapshotTaken();
+    }
+    SnapshotWriter out;
+    if(!out.open(path)) return false;
+    if(!writeRecords(snap, out, [](){})) return false;
+    return out.commit();
+}
+
+bool RedisDatabase::loadSyncSnapshot(const std::string& received, const std::string& filename)
+{
+    //no save may replace the file underneath, or the delta chain would name the wrong base
+    beginSave();
+    bool ok = std::rename(received.c_str(), filename.c_str()) == 0;
+    if(ok) {
+        flushAll(true);
+        ok = load(filename);
+    }
+    endSave();
+    return ok;
+}
+
+bool RedisDatabase::bgsave(const std::string &filename, bool delta)
+{
+    if(save_running.exchange(true)) return false;
+
+    //the previous saver has already finished; reap it
+    if(bgsave_thread.joinable()) bgsave_thread.join();
+
+    //the point in time is now: the snapshot is taken before this returns
+    auto snap = std::make_shared<Snapshot>(saveSnapshot(filename, delta));
+    bgsave_thread = std::thread([this, snap, filename]() {
+        auto start = std::chrono::steady_clock::now();
+        bool ok = writeSnapshot(*snap, filename);
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        const std::string& target = snap->deltaFile.empty() ? filename : snap->deltaFile;
+        if(ok) std::cout << "Background saving to " << target << " done in " << ms << " ms\n";
+        else std::cerr << "Background saving to " << target << " failed\n";
+        endSave();
+    });
+    return true;
+}
+
+RedisDatabase::SaveStatus RedisDatabase::saveStatus() const
+{
+    return SaveStatus{save_running.load(), save_keys_done.load(), save_keys_total.load(),
+                      last_save.load(), last_save_ok.load(), dirty.load()};
+}
+
+// SAVE RULES
+//
+// Nothing is written while the dataset is clean. Otherwise the first rule whose
+// change count is reached and whose interval has passed since the last successful
+// save starts a BGSAVE, as a delta when the chain allows it; bgsave() itself
+// refuses to run two saves at once. After a
+// failed save the next attempt waits SAVE_RETRY_SECONDS, so a full disk is not
+// hammered once a second.
+
+static const int64_t SAVE_RETRY_SECONDS = 5;
+
+bool RedisDatabase::saveIfDue(const std::string& filename)
+{
+    uint64_t changes = dirty;
+    if(changes == 0 || loading() || save_running) return false;
+
+    int64_t now = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    if(!last_save_ok && now - last_save_try < SAVE_RETRY_SECONDS) return false;
+
+    for(const auto& rule : save_rules) {
+        if(changes < rule.changes || now - last_save < rule.seconds) continue;
+        std::cout << changes << " changes in " << rule.seconds << " seconds. Saving...\n";
+        return bgsave(filename, true);
+    }
+    return false;
+}
+
+// DELTA CHECKPOINTS
+//
+// With --delta-saves N every write records its key in delta_keys. A save that may
+// be a delta writes just those keys (or a deletion for the ones that are gone) to
+// <snapshot>.delta.<n> and lists the file in <snapshot>.manifest; the manifest
+// names its base snapshot by checksum, so deltas of an older base are never
+// applied to a newer one. After N deltas, or once they add up to half the base,
+// the next save is a full one again, which consolidates the chain. FLUSHALL, a
+// failed save, or a change set over a quarter of the keyspace also force a full
+// save, as then the tracked keys no longer describe every change.
+
+static const size_t DELTA_MIN_KEYS = 1024;
+
+static std::string manifestName(const std::string& filename)
+{
+    return filename + ".manifest";
+}
+
+static uint64_t fileSize(const std::string& path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+}
+
+void RedisDatabase::trackDelta(const std::string& key)
+{
+    //caller holds db_mutex
+    delta_keys.insert(key);
+    if(delta_keys.size() < DELTA_MIN_KEYS) return;
+    if(delta_keys.size() * 4 > kv_store.size() + list_store.size() + hash_store.size() + cold_index.size()) {
+        delta_valid = false;
+        delta_keys.clear();
+    }
+}
+
+bool RedisDatabase::deltaDue()
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    return delta_max > 0 && delta_valid && delta_files.size() < delta_max && delta_bytes * 2 <= delta_base_bytes;
+}
+
+RedisDatabase::Snapshot RedisDatabase::saveSnapshot(const std::string& filename, bool delta)
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    if(!delta || !deltaDue()) {
+        Snapshot snap = snapshot();
+        delta_keys.clear();
+        delta_valid = delta_max > 0;
+        return snap;
+    }
+
+    purgeExpired();
+    //read through const references: no shard is copied for a snapshot that may
+    //still hold it, and peek() neither pages a key in nor stamps it as used
+    const auto& strings = kv_store;
+    const auto& lists = list_store;
+    const auto& hashes = hash_store;
+    const auto& coldKeys = cold_index;
+    const auto& expires = expire_map;
+    Snapshot snap;
+    for(const auto& key : delta_keys) {
+        //a key spilled since it changed is written from disk, as in snapshot()
+        auto cold = coldKeys.find(key);
+        auto kv = strings.peek(key);
+        auto list = lists.peek(key);
+        auto hash = hashes.peek(key);
+        if(cold != coldKeys.end()) snap.cold.add(key, cold->second);
+        else if(kv != strings.end()) snap.strings.add(key, kv->second);
+        else if(list != lists.end()) snap.lists.add(key, list->second);
+        else if(hash != hashes.end()) snap.hashes.add(key, hash->second);
+        else {
+            snap.deleted.push_back(key);
+            continue;
+        }
+        auto expiry = expires.find(key);
+        if(expiry != expires.end()) snap.expires.add(key, expiry->second);
+    }
+    if(!snap.cold.empty()) {
+        snap.lazyFile = lazy_file;
+        snap.tierLog = tier_log;
+    }
+    snap.dirty = dirty;
+    snap.deltaFile = filename + ".delta." + std::to_string(delta_files.size() + 1);
+    delta_keys.clear();
+    return snap;
+}
+
+//after a full save: the new base starts an empty chain and the old deltas go
+bool RedisDatabase::resetDeltaChain(const std::string& filename, uint64_t base)
+{
+    SnapshotManifest old;
+    bool hadChain = old.read(manifestName(filename));
+    bool ok = true;
+    if(delta_max > 0) {
+        SnapshotManifest fresh;
+        fresh.base = base;
+        ok = fresh.write(manifestName(filename));
+    } else if(hadChain) {
+        ::unlink(manifestName(filename).c_str());
+    }
+    for(const auto& delta : old.deltas) ::unlink(delta.c_str());
+
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    delta_base = base;
+    delta_base_bytes = fileSize(filename);
+    delta_files.clear();
+    delta_bytes = 0;
+    return ok;
+}
+
+bool RedisDatabase::appendDelta(const std::string& filename, const std::string& deltaFile)
+{
+    SnapshotManifest manifest;
+    {
+        std::lock_guard<std::recursive_mutex> lock(db_mutex);
+        manifest.base = delta_base;
+        manifest.deltas = delta_files;
+    }
+    manifest.deltas.push_back(deltaFile);
+    if(!manifest.write(manifestName(filename))) return false;
+
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    delta_files.push_back(deltaFile);
+    delta_bytes += fileSize(deltaFile);
+    return true;
+}
+
+//Apply the deltas the manifest lists for this base, oldest first, and carry on
+//the chain. A delta that cannot be read ends it there: the dataset is as of the
+//last good delta, and the next save is a full one.
+void RedisDatabase::loadDeltas(const std::string& filename, uint64_t base, uint64_t baseBytes)
+{
+    SnapshotManifest manifest;
+    std::vector<std::string> applied;
+    uint64_t bytes = 0;
+    bool intact = true;
+    if(manifest.read(manifestName(filename)) && manifest.base == base) {
+        for(const auto& delta : manifest.deltas) {
+            uint64_t size = 0;
+            if(!applyDelta(delta, size)) {
+                intact = false;
+                break;
+            }
+            applied.push_back(delta);
+            bytes += size;
+        }
+        if(!applied.empty()) std::cout << "Applied " << applied.size() << " delta files to " << filename << "\n";
+    }
+
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    delta_base = base;
+    delta_base_bytes = baseBytes;
+    delta_files = std::move(applied);
+    delta_bytes = bytes;
+    delta_keys.clear();
+    delta_valid = intact && delta_max > 0;
+}
+
+bool RedisDatabase::applyDelta(const std::string& deltaFile, uint64_t& bytes)
+{
+    SnapshotFile file;
+    if(!file.open(deltaFile)) {
+        std::cerr << "Cannot load " << deltaFile << ": " << file.error() << "\n";
+        return false;
+    }
+
+    //decode it all first so a bad delta is not applied halfway
+    std::vector<SnapshotEntry> entries;
+    for(const auto& section : file.sections()) {
+        if(!SnapshotFile::verify(section)) {
+            std::cerr << "Cannot load " << deltaFile << ": checksum mismatch\n";
+            return false;
+        }
+        SectionDecoder in(section);
+        entries.emplace_back();
+        while(in.next(entries.back())) entries.emplace_back();
+        entries.pop_back();
+        if(!in.ok()) {
+            std::cerr << "Cannot load " << deltaFile << ": " << in.error() << "\n";
+            return false;
+        }
+    }
+
+    const int64_t nowMs = unixNowMs();
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    for(auto& entry : entries) {
+        removeKey(entry.key, true);
+        if(entry.type == SnapshotType::Delete) continue;
+        if(entry.expireAtMs >= 0 && entry.expireAtMs <= nowMs) continue;
+        switch(entry.type) {
+        case SnapshotType::String:
+            kv_store[entry.key] = makeString(std::move(entry.str));
+            break;
+        case SnapshotType::List:
+            list_store[entry.key] = std::make_shared<ListValue>(std::move(entry.list));
+            break;
+        case SnapshotType::Hash:
+            hash_store[entry.key] = std::make_shared<HashValue>(std::move(entry.hash));
+            break;
+        case SnapshotType::Delete:
+            break;
+        }
+        if(entry.expireAtMs >= 0) expire_map[entry.key] = fromUnixMs(entry.expireAtMs);
+    }
+    bytes = file.size();
+    return true;
+}
+
+// PARALLEL LOAD
+//
+// The snapshot is mapped and its sections are checked and decoded by a pool of
+// threads, each into its own shard of key -> value handles, without db_mutex.
+// The shards are then moved into new stores, sized up front, one thread per store,
+// and the new keyspace is swapped in under the lock.
+
+//log a progress line at most this often while loading
+static const auto LOAD_PROGRESS_INTERVAL = std::chrono::seconds(1);
+
+RedisDatabase::LoadStatus RedisDatabase::loadStatus() const
+{
+    return LoadStatus{loading_active, load_bytes_total, load_bytes_done, load_keys, lazy_pending};
+}
+
+bool RedisDatabase::load(const std::string &filename)
+{
+    if(!SnapshotFile::isSnapshot(filename)) return loadText(filename);
+    if(lazy_load) return loadIndex(filename);
+
+    SnapshotFile file;
+    if(!file.open(filename)) {
+        std::cerr << "Cannot load " << filename << ": " << file.error() << "\n";
+        return false;
+    }
+    const auto& sections = file.sections();
+    uint64_t indexedKeys = 0;
+    for(const auto& section : sections) indexedKeys += section.strings + section.lists + section.hashes;
+
+    //what a worker decoded, by fill partition: the key's table shard modulo
+    //partitions, so the merge runs a thread per partition on disjoint table shards
+    struct Shard {
+        std::vector<std::vector<std::pair<std::string, std::shared_ptr<StringValue>>>> strings;
+        std::vector<std::vector<std::pair<std::string, std::shared_ptr<ListValue>>>> lists;
+        std::vector<std::vector<std::pair<std::string, std::shared_ptr<HashValue>>>> hashes;
+        std::vector<std::vector<std::pair<std::string, int64_t>>> expires;
+    };
+    size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+    size_t workers = std::max<size_t>(1, std::min(hardware, sections.size()));
+    size_t partitions = hardware;
+    std::vector<Shard> shards(workers);
+    for(auto& shard : shards) {
+        shard.strings.resize(partitions);
+        shard.lists.resize(partitions);
+        shard.hashes.resize(partitions);
+        shard.expires.resize(partitions);
+    }
+    std::atomic<size_t> nextSection{0};
+    std::atomic<bool> failed{false};
+    std::mutex errorMutex;
+    std::string error;
+    load_bytes_total = file.size();
+    load_bytes_done = 0;
+    load_keys = 0;
+    std::cout << "Loading " << filename << ": " << file.size() << " bytes, " << indexedKeys << " keys in "
+              << sections.size() << " sections on " << workers << " threads\n";
+
+    const int64_t nowMs = unixNowMs();
+    auto lastReport = std::chrono::steady_clock::now();
+    auto decode = [&](Shard& shard, bool reporter) {
+        SnapshotEntry entry;
+        size_t i;
+        while(!failed && (i = nextSection++) < sections.size()) {
+            const auto& section = sections[i];
+            const char* problem = nullptr;
+            size_t keys = 0;
+            if(!SnapshotFile::verify(section)) {
+                problem = "checksum mismatch";
+            } else {
+                SectionDecoder in(section);
+                while(in.next(entry)) {
+                    ++keys;
+                    if(entry.expireAtMs >= 0 && entry.expireAtMs <= nowMs) continue; //expired while on disk
+                    size_t part = ExpireTable::shardOf(entry.key) % partitions;
+                    if(entry.expireAtMs >= 0) shard.expires[part].emplace_back(entry.key, entry.expireAtMs);
+                    switch(entry.type) {
+                    case SnapshotType::String:
+                        shard.strings[part].emplace_back(std::move(entry.key), makeString(std::move(entry.str)));
+                        break;
+                    case SnapshotType::List:
+                        shard.lists[part].emplace_back(std::move(entry.key),
+                                                       std::make_shared<ListValue>(std::move(entry.list)));
+                        break;
+                    case SnapshotType::Hash:
+                        shard.hashes[part].emplace_back(std::move(entry.key),
+                                                        std::make_shared<HashValue>(std::move(entry.hash)));
+                        break;
+                    case SnapshotType::Delete:
+                        problem = "deletion in a full snapshot";
+                        break;
+                    }
+                    if(problem) break;
+                }
+                if(!problem && !in.ok()) problem = in.error();
+            }
+            if(problem) {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if(error.empty()) error = problem;
+                failed = true;
+                return;
+            }
+            load_keys += keys;
+            load_bytes_done += static_cast<uint64_t>(section.end - section.begin);
+
+            auto now = std::chrono::steady_clock::now();
+            if(reporter && now - lastReport >= LOAD_PROGRESS_INTERVAL) {
+                lastReport = now;
+                std::cout << "Loading: " << (100 * load_bytes_done / std::max<uint64_t>(1, load_bytes_total)) << "% ("
+                          << load_keys << " keys)\n";
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for(size_t w = 1; w < workers; ++w) pool.emplace_back(decode, std::ref(shards[w]), false);
+    decode(shards[0], true);
+    for(auto& worker : pool) worker.join();
+    if(failed) {
+        std::cerr << "Cannot load " << filename << ": " << error << "\n";
+        return false;
+    }
+
+    //Partition p fills the table shards s with s % partitions == p, in all four
+    //tables, through ownShard(): the tables are new, so no View holds a shard and
+    //the threads never touch the same one. The counts are settled after the join.
+    decltype(kv_store) strings;
+    decltype(list_store) lists;
+    decltype(hash_store) hashes;
+    decltype(expire_map) expires;
+    auto reserve = [&shards, partitions](auto& table, auto member) {
+        size_t total = 0;
+        for(const auto& shard : shards) {
+            for(size_t p = 0; p < partitions; ++p) total += (shard.*member)[p].size();
+        }
+        table.reserve(total);
+    };
+    reserve(strings, &Shard::strings);
+    reserve(lists, &Shard::lists);
+    reserve(hashes, &Shard::hashes);
+    reserve(expires, &Shard::expires);
+    auto fill = [&](size_t p) {
+        auto move = [](auto& table, auto& part) {
+            for(auto& entry : part) {
+                auto& into = table.ownShard(table.shardOf(entry.first));
+                into[std::move(entry.first)] = std::move(entry.second);
+            }
+            part.clear();
+            part.shrink_to_fit();
+        };
+        for(auto& shard : shards) {
+            move(strings, shard.strings[p]);
+            move(lists, shard.lists[p]);
+            move(hashes, shard.hashes[p]);
+            for(const auto& entry : shard.expires[p]) {
+                expires.ownShard(expires.shardOf(entry.first))[entry.first] = fromUnixMs(entry.second);
+            }
+            shard.expires[p].clear();
+            shard.expires[p].shrink_to_fit();
+        }
+    };
+    std::vector<std::thread> fillers;
+    for(size_t p = 1; p < partitions; ++p) fillers.emplace_back(fill, p);
+    fill(0);
+    for(auto& filler : fillers) filler.join();
+    strings.recount();
+    lists.recount();
+    hashes.recount();
+    expires.recount();
+
+    {
+        std::lock_guard<std::recursive_mutex> lock(db_mutex);
+        kv_store.swap(strings);
+        list_store.swap(lists);
+        hash_store.swap(hashes);
+        expire_map.swap(expires);
+        for(auto& watched : watched_keys) ++watched.second.version;
+    }
+    loadDeltas(filename, file.checksum(), file.size());
+    return true;
+}
+
+// LAZY LOAD
+//
+// With --lazy-load the snapshot stays mapped and load() builds only an index of
+// key -> record: a pool of threads checks the sections and reads their keys,
+// skipping the values, and the server is up as soon as the index is. A lookup of
+// a key (KeyTable) pages it in: the value is decoded from the mapping into the
+// stores and the index entry dropped. Values nobody asks for are never decoded,
+// and the kernel is free to drop their pages. --lazy-load warm also pages
+// everything in, in file order, from a background thread, WARMUP_BATCH keys per
+// hold of db_mutex. Saves and AOF rewrites decode what is still on disk straight
+// from the mapping. The mapping goes once none of its keys are left.
+//
+// The index (cold_index) is shared with tiered storage, whose values are in the
+// value log instead.
+
+static const size_t WARMUP_BATCH = 256;
+
+void pageInKey(const std::string& key)
+{
+    RedisDatabase::getInstance().pageIn(key);
+}
+
+bool RedisDatabase::dropCold(const std::string& key)
+{
+    if(cold_count == 0) return false;
+    auto it = cold_index.find(key);
+    if(it == cold_index.end()) return false;
+    const ColdRef& ref = it->second;
+    if(ref.type == SnapshotType::String) --cold_strings;
+    if(ref.section) {
+        if(--lazy_pending == 0) {
+            lazy_file.reset();
+            std::cout << "All keys paged in\n";
+        }
+    } else {
+        tier_live_bytes -= ref.length;
+        --tier_keys;
+    }
+    cold_index.erase(it);
+    --cold_count;
+    return true;
+}
+
+void RedisDatabase::installCold(const std::string& key, SnapshotEntry& entry)
+{
+    switch(entry.type) {
+    case SnapshotType::String:
+        kv_store.emplace(key, makeString(std::move(entry.str)));
+        break;
+    case SnapshotType::List:
+        list_store.emplace(key, std::make_shared<ListValue>(std::move(entry.list)));
+        break;
+    case SnapshotType::Hash:
+        hash_store.emplace(key, std::make_shared<HashValue>(std::move(entry.hash)));
+        break;
+    case SnapshotType::Delete:
+        break;
+    }
+}
+
+void RedisDatabase::pageIn(const std::string& key)
+{
+    if(cold_count == 0) return;
+    auto it = cold_index.find(key);
+    if(it == cold_index.end()) return;
+
+    //the files outlive dropCold() as long as these hold them
+    auto file = lazy_file;
+    auto log = tier_log;
+    ColdRef ref = it->second;
+    SnapshotEntry entry;
+    bool ok = readCold(ref, log.get(), entry);
+    dropCold(key);
+    if(!ok) {
+        //a checked section or record failing to decode: lose the key, not the server
+        std::cerr << "Cannot page in " << key << "\n";
+        expire_map.erase(key);
+        return;
+    }
+    if(!ref.section) ++tier_fetched;
+    installCold(key, entry);
+}
+
+void RedisDatabase::prefetch(const std::vector<std::string>& keys)
+{
+    if(cold_count == 0) return;
+    struct Fetch {
+        const std::string* key;
+        ColdRef ref;
+        SnapshotEntry entry;
+        bool ok = false;
+    };
+    std::vector<Fetch> fetches;
+    std::shared_ptr<SnapshotFile> file;
+    std::shared_ptr<RedisValueLog> log;
+    {
+        std::lock_guard<std::recursive_mutex> lock(db_mutex);
+        for(const auto& key : keys) {
+            auto it = cold_index.find(key);
+            if(it != cold_index.end()) fetches.push_back(Fetch{&key, it->second, SnapshotEntry{}});
+        }
+        if(fetches.empty()) return;
+        file = lazy_file;
+        log = tier_log;
+    }
+
+    //the disk reads and the decoding happen here, with db_mutex free
+    for(auto& fetch : fetches) fetch.ok = readCold(fetch.ref, log.get(), fetch.entry);
+
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    for(auto& fetch : fetches) {
+        //gone, paged in by someone else, or moved by a compaction meanwhile: the
+        //lookup pages it in the slow way if it still has to
+        auto it = cold_index.find(*fetch.key);
+        if(!fetch.ok || it == cold_index.end() || !(it->second == fetch.ref)) continue;
+        if(fetch.ref.section ? file != lazy_file : log != tier_log) continue;
+        dropCold(*fetch.key);
+        if(!fetch.ref.section) ++tier_fetched;
+        installCold(*fetch.key, fetch.entry);
+    }
+}
+
+bool RedisDatabase::loadIndex(const std::string& filename)
+{
+    auto start = std::chrono::steady_clock::now();
+    auto file = std::make_shared<SnapshotFile>();
+    if(!file->open(filename)) {
+        std::cerr << "Cannot load " << filename << ": " << file->error() << "\n";
+        return false;
+    }
+    const auto& sections = file->sections();
+
+    struct Shard {
+        std::vector<std::pair<std::string, ColdRef>> keys;
+        std::vector<std::pair<std::string, int64_t>> expires;
+        size_t strings = 0;
+    };
+    size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+    size_t workers = std::max<size_t>(1, std::min(hardware, sections.size()));
+    std::vector<Shard> shards(workers);
+    std::atomic<size_t> nextSection{0};
+    std::atomic<bool> failed{false};
+    std::mutex errorMutex;
+    std::string error;
+    load_bytes_total = file->size();
+    load_bytes_done = 0;
+    load_keys = 0;
+
+    const int64_t nowMs = unixNowMs();
+    auto index = [&](Shard& shard) {
+        SnapshotEntry entry;
+        const char* value;
+        size_t i;
+        while(!failed && (i = nextSection++) < sections.size()) {
+            const auto& section = sections[i];
+            const char* problem = nullptr;
+            if(!SnapshotFile::verify(section)) {
+                problem = "checksum mismatch";
+            } else {
+                SectionDecoder in(section);
+                while(!problem && in.nextKey(entry, value)) {
+                    if(entry.type == SnapshotType::Delete) problem = "deletion in a full snapshot";
+                    if(entry.expireAtMs >= 0) {
+                        if(entry.expireAtMs <= nowMs) continue;
+                        shard.expires.emplace_back(entry.key, entry.expireAtMs);
+                    }
+                    if(entry.type == SnapshotType::String) ++shard.strings;
+                    shard.keys.emplace_back(std::move(entry.key), ColdRef{entry.type, &section, value, 0, 0});
+                }
+                if(!problem && !in.ok()) problem = in.error();
+            }
+            if(problem) {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if(error.empty()) error = problem;
+                failed = true;
+                return;
+            }
+            load_bytes_done += static_cast<uint64_t>(section.end - section.begin);
+        }
+    };
+    std::vector<std::thread> pool;
+    for(size_t w = 1; w < workers; ++w) pool.emplace_back(index, std::ref(shards[w]));
+    index(shards[0]);
+    for(auto& worker : pool) worker.join();
+    if(failed) {
+        std::cerr << "Cannot load " << filename << ": " << error << "\n";
+        return false;
+    }
+
+    decltype(cold_index) keys;
+    decltype(expire_map) expires;
+    size_t total = 0, strings = 0;
+    for(const auto& shard : shards) {
+        total += shard.keys.size();
+        strings += shard.strings;
+    }
+    keys.reserve(total);
+    for(auto& shard : shards) {
+        for(auto& entry : shard.keys) keys.emplace(std::move(entry.first), entry.second);
+        for(const auto& entry : shard.expires) expires[entry.first] = fromUnixMs(entry.second);
+        shard.keys.clear();
+        shard.keys.shrink_to_fit();
+    }
+    load_keys = total;
+
+    {
+        std::lock_guard<std::recursive_mutex> lock(db_mutex);
+        kv_store.clear();
+        list_store.clear();
+        hash_store.clear();
+        cold_index.swap(keys);
+        expire_map.swap(expires);
+        lazy_file = cold_index.empty() ? nullptr : file;
+        lazy_pending = cold_index.size();
+        cold_count = cold_index.size();
+        cold_strings = strings;
+        for(auto& watched : watched_keys) ++watched.second.version;
+    }
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Indexed " << total << " keys of " << filename << " in " << ms << " ms; values are read on first use\n";
+
+    loadDeltas(filename, file->checksum(), file->size());
+    //a warm-up of the previous file (a replica's earlier full sync) stops now that lazy_file changed
+    if(warmup_thread.joinable()) warmup_thread.join();
+    if(lazy_warm_up && lazy_pending > 0) warmup_thread = std::thread(&RedisDatabase::warmUp, this, file);
+    return true;
+}
+
+void RedisDatabase::warmUp(std::shared_ptr<SnapshotFile> file)
+{
+    SnapshotEntry entry;
+    const char* value;
+    for(const auto& section : file->sections()) {
+        SectionDecoder in(section);
+        bool more = true;
+        while(more) {
+            std::lock_guard<std::recursive_mutex> lock(db_mutex);
+            //everything is in, the keyspace was flushed, or the server is going down
+            if(lazy_file != file) return;
+            for(size_t n = 0; n < WARMUP_BATCH && (more = in.nextKey(entry, value)); ++n) {
+                //keys spilled to the value log since are left there
+                auto it = cold_index.find(entry.key);
+                if(it != cold_index.end() && it->second.section) pageIn(entry.key);
+            }
+        }
+    }
+}
+
+// TIERED STORAGE
+//
+// With --tier-file, values of at least --tier-min-bytes whose key nobody looked
+// up for --tier-idle seconds move to an append-structured value log
+// (RedisValueLog) and leave only a cold_index entry in memory: the key, its type
+// and where its record is. A lookup pages the value back in, as with a lazily
+// loaded snapshot; so do saves and AOF rewrites, without paging it in.
+//
+// Every value carries the accessClock() second of its last lookup. Once a second
+// the tier thread advances the clock and walks part of the stores
+// (TIER_SCAN_BUCKETS buckets per hold of db_mutex, TIER_SCAN_PER_TICK per store
+// and tick), picking idle values nothing else holds (a save, a reply stream).
+// It encodes and writes them with db_mutex free, then swaps in the stubs for
+// those still unchanged and not looked up since. Reads avoid the lock too: the
+// command handler prefetch()es a command's keys before running it, so only the
+// client that needs a cold value waits for the disk.
+//
+// Reading a value back or deleting it leaves a dead record. Once the log is at
+// least TIER_COMPACT_MIN bytes and over half dead, the tier thread copies the
+// live records to a new log, off the lock, and points the index at them.
+//
+// Records hold a value without its key or expiry, little-endian:
+//   string  <4 byte size before LZF, 0 if stored as is> <bytes>
+//   list    <4 byte count> (<4 byte length> <element>)...
+//   hash    <4 byte count> (<4 byte length> <field> <4 byte length> <value>)...
+
+static const size_t TIER_SCAN_BUCKETS = 1024;
+static const size_t TIER_SCAN_PER_TICK = 64 * 1024;
+static const size_t TIER_SPILL_BATCH = 256;
+static const uint64_t TIER_COMPACT_MIN = 64 * 1024 * 1024;
+//malloc_trim walks the whole heap: it runs once this much was spilled, or at most this often
+static const uint64_t TIER_TRIM_BYTES = 64 * 1024 * 1024;
+static const auto TIER_TRIM_INTERVAL = std::chrono::minutes(1);
+
+static std::atomic<uint32_t> access_clock{0};
+
+uint32_t accessClock()
+{
+    return access_clock.load(std::memory_order_relaxed);
+}
+
+static void putU32(std::string& out, size_t value)
+{
+    for(int i = 0; i < 4; ++i) out.push_back(static_cast<char>(value >> (8 * i)));
+}
+
+static void putBytes(std::string& out, const std::string& bytes)
+{
+    putU32(out, bytes.size());
+    out += bytes;
+}
+
+static bool getU32(const char*& p, const char* end, uint32_t& value)
+{
+    if(end - p < 4) return false;
+    value = 0;
+    for(int i = 0; i < 4; ++i) value |= static_cast<uint32_t>(static_cast<uint8_t>(p[i])) << (8 * i);
+    p += 4;
+    return true;
+}
+
+static bool getBytes(const char*& p, const char* end, std::string& bytes)
+{
+    uint32_t n;
+    if(!getU32(p, end, n) || static_cast<size_t>(end - p) < n) return false;
+    bytes.assign(p, n);
+    p += n;
+    return true;
+}
+
+static void encodeTierValue(const RedisDatabase::StringValue& value, std::string& out)
+{
+    putU32(out, value.rawSize);
+    out += value.data;
+}
+
+static void encodeTierValue(const RedisDatabase::ListValue& list, std::string& out)
+{
+    putU32(out, list.size());
+    for(const auto& item : list) putBytes(out, item);
+}
+
+static void encodeTierValue(const RedisDatabase::HashValue& hash, std::string& out)
+{
+    putU32(out, hash.size());
+    for(const auto& field : hash) {
+        putBytes(out, field.first);
+        putBytes(out, field.second);
+    }
+}
+
+static bool decodeTierValue(const std::string& bytes, SnapshotEntry& entry)
+{
+    const char* p = bytes.data();
+    const char* end = p + bytes.size();
+    uint32_t n;
+    if(!getU32(p, end, n)) return false;
+    switch(entry.type) {
+    case SnapshotType::String:
+        if(n == 0) {
+            entry.str.assign(p, end);
+            return true;
+        }
+        entry.str.resize(n);
+        return lzfDecompress(p, end - p, &entry.str[0], n) == n;
+    case SnapshotType::List:
+        entry.list.clear();
+        entry.list.reserve(std::min<size_t>(n, bytes.size() / 4));
+        for(uint32_t i = 0; i < n; ++i) {
+            entry.list.emplace_back();
+            if(!getBytes(p, end, entry.list.back())) return false;
+        }
+        return p == end;
+    case SnapshotType::Hash: {
+        entry.hash.clear();
+        entry.hash.reserve(std::min<size_t>(n, bytes.size() / 8));
+        std::string field, value;
+        for(uint32_t i = 0; i < n; ++i) {
+            if(!getBytes(p, end, field) || !getBytes(p, end, value)) return false;
+            entry.hash[std::move(field)] = std::move(value);
+        }
+        return p == end;
+    }
+    case SnapshotType::Delete:
+        break;
+    }
+    return false;
+}
+
+//what spilling value would save, counted only up to limit
+static size_t tierBytes(const RedisDatabase::StringValue& value, size_t)
+{
+    return value.data.size();
+}
 
-bool RedisDatabase::dump(const std::string &filename)
+static size_t tierBytes(const RedisDatabase::ListValue& list, size_t limit)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
-    std::ofstream ofs(filename, std::ios::binary);
-    if (!ofs) return false;
+    size_t bytes = 0;
+    for(auto it = list.begin(); it != list.end() && bytes < limit; ++it) bytes += sizeof(*it) + it->size();
+    return bytes;
+}
 
-    for (const auto& kv: kv_store) {
-        ofs << "K " << kv.first << " " << kv.second << "\n";
+static size_t tierBytes(const RedisDatabase::HashValue& hash, size_t limit)
+{
+    size_t bytes = 0;
+    for(auto it = hash.begin(); it != hash.end() && bytes < limit; ++it) {
+        bytes += 2 * sizeof(std::string) + it->first.size() + it->second.size();
     }
-    for (const auto& kv : list_store) {
-        ofs << "L " << kv.first;
-        for (const auto& item : kv.second)
-            ofs << " " << item;
-        ofs << "\n";
+    return bytes;
+}
+
+bool RedisDatabase::readCold(const ColdRef& ref, const RedisValueLog* log, SnapshotEntry& entry)
+{
+    entry.type = ref.type;
+    if(ref.section) {
+        SectionDecoder in(*ref.section);
+        return in.readValue(ref.value, entry);
     }
-    for (const auto& kv : hash_store) {
-        ofs << "H " << kv.first;
-        for (const auto& field_val : kv.second) 
-            ofs << " " << field_val.first << ":" << field_val.second;
-        ofs << "\n";
+    std::string bytes;
+    return log && log->read(ref.offset, ref.length, bytes) && decodeTierValue(bytes, entry);
+}
+
+bool RedisDatabase::setTiering(const std::string& path, uint32_t idleSeconds, size_t minBytes)
+{
+    auto log = std::make_shared<RedisValueLog>();
+    if(!log->create(path)) return false;
+    {
+        std::lock_guard<std::recursive_mutex> lock(db_mutex);
+        tier_path = path;
+        tier_idle = idleSeconds;
+        tier_min_bytes = minBytes;
+        tier_log = log;
     }
+    tier_thread = std::thread(&RedisDatabase::tierLoop, this);
     return true;
 }
 
-bool RedisDatabase::load(const std::string &filename)
+RedisDatabase::TierStatus RedisDatabase::tierStatus()
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    return TierStatus{tier_log != nullptr, tier_keys, tier_live_bytes, tier_log ? tier_log->size() : 0,
+                      tier_spilled, tier_fetched};
+}
+
+void RedisDatabase::tierLoop()
+{
+    auto start = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(tier_mutex);
+    while(!tier_cv.wait_for(lock, std::chrono::seconds(1), [this](){ return tier_stop; })) {
+        lock.unlock();
+        access_clock = static_cast<uint32_t>(
+            std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - start).count());
+        //loading swaps whole stores in: nothing to spill from until it is done
+        if(!loading_active) {
+            spillIdle();
+            compactTier();
+        }
+        lock.lock();
+    }
+}
+
+void RedisDatabase::spillIdle()
+{
+    struct Spill {
+        std::string key;
+        SnapshotType type;
+        std::shared_ptr<const void> handle;   //keeps the value as it was picked
+        uint32_t access;
+        uint64_t offset = 0;
+        uint32_t length = 0;
+        bool written = false;
+    };
+    std::vector<Spill> batch;
+    const uint32_t now = accessClock();
+
+    auto write = [&]() {
+        std::shared_ptr<RedisValueLog> log;
+        {
+            std::lock_guard<std::recursive_mutex> lock(db_mutex);
+            log = tier_log;
+        }
+        std::string bytes;
+        for(auto& spill : batch) {
+            bytes.clear();
+            if(spill.type == SnapshotType::String) encodeTierValue(*static_cast<const StringValue*>(spill.handle.get()), bytes);
+            else if(spill.type == SnapshotType::List) encodeTierValue(*static_cast<const ListValue*>(spill.handle.get()), bytes);
+            else encodeTierValue(*static_cast<const HashValue*>(spill.handle.get()), bytes);
+            if(!log->append(bytes, spill.offset)) {
+                std::cerr << "Cannot write to " << log->path() << ": " << std::strerror(errno) << "\n";
+                break;
+            }
+            spill.length = static_cast<uint32_t>(bytes.size());
+            spill.written = true;
+        }
+
+        //stub out the values no one changed or looked up meanwhile
+        std::lock_guard<std::recursive_mutex> lock(db_mutex);
+        if(log != tier_log) return;
+        auto stubOut = [&](auto& store, const Spill& spill) {
+            auto it = store.peek(spill.key);
+            if(it == store.end() || it->second.get() != spill.handle.get() || it->second->access != spill.access) return false;
+            store.erase(it);
+            return true;
+        };
+        for(const auto& spill : batch) {
+            if(!spill.written) continue;
+            bool out = spill.type == SnapshotType::String ? stubOut(kv_store, spill)
+                     : spill.type == SnapshotType::List ? stubOut(list_store, spill)
+                     : stubOut(hash_store, spill);
+            if(!out) continue;
+            cold_index.emplace(spill.key, ColdRef{spill.type, nullptr, nullptr, spill.offset, spill.length});
+            ++cold_count;
+            if(spill.type == SnapshotType::String) ++cold_strings;
+            tier_live_bytes += spill.length;
+            tier_untrimmed += spill.length;
+            ++tier_keys;
+            ++tier_spilled;
+        }
+    };
+
+    auto scan = [&](const auto& store, TierCursor& cursor, SnapshotType type) {
+        for(size_t budget = TIER_SCAN_PER_TICK; budget > 0; ) {
+            {
+                std::lock_guard<std::recursive_mutex> lock(db_mutex);
+                for(size_t n = 0; n < TIER_SCAN_BUCKETS && budget > 0; ++n, --budget) {
+                    //a rehash between two slices moves keys between buckets; a pass
+                    //may miss some or see some twice, which only delays a spill
+                    const auto& shard = store.shard(cursor.shard);
+                    if(cursor.bucket >= shard.bucket_count()) {
+                        cursor.bucket = 0;
+                        if(++cursor.shard == store.shardCount()) {
+                            cursor.shard = 0;
+                            budget = 1;
+                        }
+                        continue;
+                    }
+                    for(auto it = shard.begin(cursor.bucket); it != shard.end(cursor.bucket); ++it) {
+                        const auto& handle = it->second;
+                        if(handle.use_count() != 1 || now - handle->access < tier_idle) continue;
+                        if(tierBytes(*handle, tier_min_bytes) < tier_min_bytes) continue;
+                        batch.push_back(Spill{it->first, type, handle, handle->access});
+                    }
+                    ++cursor.bucket;
+                }
+            }
+            if(batch.size() >= TIER_SPILL_BATCH) {
+                write();
+                //the values are freed here, outside db_mutex
+                batch.clear();
+            }
+        }
+    };
+    scan(kv_store, tier_cursors[0], SnapshotType::String);
+    scan(list_store, tier_cursors[1], SnapshotType::List);
+    scan(hash_store, tier_cursors[2], SnapshotType::Hash);
+    if(!batch.empty()) write();
+    batch.clear();
+#ifdef __GLIBC__
+    //the freed values sit between live allocations, where malloc keeps them: hand
+    //their pages back so the spill shows as memory the node no longer uses
+    auto clock = std::chrono::steady_clock::now();
+    if(tier_untrimmed >= TIER_TRIM_BYTES || (tier_untrimmed > 0 && clock - tier_trimmed >= TIER_TRIM_INTERVAL)) {
+        malloc_trim(0);
+        tier_untrimmed = 0;
+        tier_trimmed = clock;
+    }
+#endif
+}
+
+void RedisDatabase::compactTier()
+{
+    std::shared_ptr<RedisValueLog> old;
+    std::vector<std::pair<std::string, ColdRef>> live;
+    {
+        std::lock_guard<std::recursive_mutex> lock(db_mutex);
+        old = tier_log;
+        if(!old || old->size() < TIER_COMPACT_MIN || tier_live_bytes * 2 > old->size()) return;
+        live.reserve(tier_keys);
+        for(const auto& entry : std::as_const(cold_index)) {
+            if(!entry.second.section) live.push_back(entry);
+        }
+    }
+
+    //Only this thread appends, so nothing new lands in the old log meanwhile. The
+    //copy is built under a name of its own and takes tier_path under db_mutex, so
+    //a FLUSHALL starting a fresh log meanwhile can't be replaced by it.
+    auto log = std::make_shared<RedisValueLog>();
+    if(!log->create(tier_path + ".compact")) {
+        std::cerr << "Cannot compact " << tier_path << ": " << std::strerror(errno) << "\n";
+        return;
+    }
+    std::vector<uint64_t> offsets(live.size());
+    std::string bytes;
+    for(size_t i = 0; i < live.size(); ++i) {
+        const ColdRef& ref = live[i].second;
+        if(!old->read(ref.offset, ref.length, bytes) || !log->append(bytes, offsets[i])) {
+            std::cerr << "Cannot compact " << tier_path << ": " << std::strerror(errno) << "\n";
+            log->unlink();
+            return;
+        }
+    }
+
+    {
+        std::lock_guard<std::recursive_mutex> lock(db_mutex);
+        if(old != tier_log || !log->moveTo(tier_path)) {
+            log->unlink();
+            return;
+        }
+        //keys paged in or deleted meanwhile are just dead in the new log
+        for(size_t i = 0; i < live.size(); ++i) {
+            auto it = cold_index.find(live[i].first);
+            if(it != cold_index.end() && it->second == live[i].second) it->second.offset = offsets[i];
+        }
+        tier_log = log;
+    }
+    std::cout << "Compacted " << tier_path << ": " << old->size() << " -> " << log->size() << " bytes\n";
+}
+
+bool RedisDatabase::loadText(const std::string &filename)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     std::ifstream ifs(filename, std::ios::binary);
     if (!ifs) return false;
 
     kv_store.clear();
     list_store.clear();
     hash_store.clear();
+    for(auto& entry : watched_keys) ++entry.second.version;
 
     std::string line;
     while (std::getline(ifs, line)) {
@@ -62,7 +1722,7 @@ bool RedisDatabase::load(const std::string &filename)
         if (type == 'K') {
             std::string key, value;
             iss >> key >> value;
-            kv_store[key] = value;
+            kv_store[key] = makeString(std::move(value));
         } else if (type == 'L') {
             std::string key;
             iss >> key;
@@ -70,7 +1730,7 @@ bool RedisDatabase::load(const std::string &filename)
             std::vector<std::string> list;
             while (iss >> item)
                 list.push_back(item);
-            list_store[key] = list;
+            list_store[key] = std::make_shared<ListValue>(std::move(list));
         } else if (type == 'H') {
             std::string key;
             iss >> key;
@@ -84,230 +1744,826 @@ bool RedisDatabase::load(const std::string &filename)
                     hash[field] = value;
                 }
             }
-            hash_store[key] = hash;
+            hash_store[key] = std::make_shared<HashValue>(std::move(hash));
         }
     }
-    return true;
+    return true;
+}
+
+bool RedisDatabase::flushAll(bool async)
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    for(auto& entry : watched_keys) {
+        if(hasKey(entry.first)) ++entry.second.version;
+    }
+    dirty += kv_store.size() + list_store.size() + hash_store.size() + cold_index.size();
+    //no delta can express this: the next save is a full one
+    delta_valid = false;
+    delta_keys.clear();
+    cold_index.clear();
+    cold_count = 0;
+    cold_strings = 0;
+    lazy_pending = 0;
+    lazy_file.reset();
+    if(tier_log) {
+        //a fresh log; savers still reading the old one keep it open
+        auto log = std::make_shared<RedisValueLog>();
+        if(log->create(tier_path)) tier_log = log;
+        tier_live_bytes = 0;
+        tier_keys = 0;
+    }
+    if(!async) {
+        kv_store.clear();
+        list_store.clear();
+        hash_store.clear();
+        expire_map.clear();
+        return true;
+    }
+
+    //swap the whole keyspace out in O(1); the free thread does the rest
+    struct Keyspace {
+        decltype(kv_store) kv;
+        decltype(list_store) lists;
+        decltype(hash_store) hashes;
+        decltype(expire_map) expires;
+    };
+    auto old = std::make_shared<Keyspace>();
+    old->kv.swap(kv_store);
+    old->lists.swap(list_store);
+    old->hashes.swap(hash_store);
+    old->expires.swap(expire_map);
+    freeAsync(std::move(old));
+    return true;
+}
+
+// STRING VALUES
+//
+// With --compress-values-above, string values at least that long are compressed
+// with LZF when they are written, outside db_mutex, and kept that way only if it
+// saves at least 1/16 of their size. Readers expand into a scratch string;
+// writers that edit the bytes in place (SETBIT) expand the value for good.
+// Snapshots store a compressed value as is, without compressing it again.
+
+static std::atomic<uint64_t> compressed_values{0};
+static std::atomic<uint64_t> compressed_raw_bytes{0};
+static std::atomic<uint64_t> compressed_stored_bytes{0};
+
+static void countCompressed(const RedisDatabase::StringValue& value, int sign)
+{
+    if(!value.compressed()) return;
+    compressed_values += sign;
+    compressed_raw_bytes += sign * static_cast<int64_t>(value.rawSize);
+    compressed_stored_bytes += sign * static_cast<int64_t>(value.data.size());
+}
+
+RedisDatabase::StringValue::StringValue(std::string raw) : data(std::move(raw)) {}
+
+RedisDatabase::StringValue::StringValue(std::string packed, size_t raw)
+    : data(std::move(packed)), rawSize(raw)
+{
+    countCompressed(*this, 1);
+}
+
+RedisDatabase::StringValue::StringValue(const StringValue& other)
+    : data(other.data), rawSize(other.rawSize)
+{
+    countCompressed(*this, 1);
+}
+
+RedisDatabase::StringValue::~StringValue()
+{
+    countCompressed(*this, -1);
+}
+
+std::shared_ptr<RedisDatabase::StringValue> RedisDatabase::makeString(std::string value) const
+{
+    size_t min = compress_min;
+    if(min == 0 || value.size() < min || value.size() < 16) {
+        return std::make_shared<StringValue>(std::move(value));
+    }
+    std::string packed(value.size() - value.size() / 16, '\0');
+    size_t n = lzfCompress(value.data(), value.size(), &packed[0], packed.size());
+    if(n == 0) return std::make_shared<StringValue>(std::move(value));
+    packed.resize(n);
+    packed.shrink_to_fit();
+    return std::make_shared<StringValue>(std::move(packed), value.size());
+}
+
+const std::string& RedisDatabase::stringBytes(const StringValue& value, std::string& scratch)
+{
+    if(!value.compressed()) return value.data;
+    scratch.resize(value.rawSize);
+    size_t n = lzfDecompress(value.data.data(), value.data.size(), &scratch[0], scratch.size());
+    if(n != value.rawSize) {
+        //only a damaged value gets here; hand out what expanded, never stale scratch bytes
+        std::cerr << "Bad compressed string: expanded to " << n << " of " << value.rawSize << " bytes\n";
+        scratch.resize(n);
+    }
+    return scratch;
+}
+
+std::string& RedisDatabase::rawBytes(StringValue& value)
+{
+    if(value.compressed()) {
+        std::string raw;
+        stringBytes(value, raw);
+        countCompressed(value, -1);
+        value.data.swap(raw);
+        value.rawSize = 0;
+    }
+    return value.data;
+}
+
+LzfStats RedisDatabase::compressionStats() const
+{
+    LzfStats stats;
+    stats.strings = compressed_values;
+    stats.rawBytes = compressed_raw_bytes;
+    stats.storedBytes = compressed_stored_bytes;
+    return stats;
+}
+
+void RedisDatabase::refreshStatus()
+{
+    //the loader fills the stores without the lock
+    if(loading_active) return;
+    DatasetStatus status;
+    status.tier = tierStatus();
+    {
+        std::lock_guard<std::recursive_mutex> lock(db_mutex);
+        status.keys = kv_store.size() + list_store.size() + hash_store.size() + cold_index.size();
+        status.expires = expire_map.size();
+        status.deltaValid = delta_valid;
+        status.deltaFiles = delta_files.size();
+        status.deltaBytes = delta_bytes;
+        status.changedKeys = delta_keys.size();
+    }
+    std::lock_guard<std::mutex> lock(status_mutex);
+    dataset_status = status;
+}
+
+RedisDatabase::DatasetStatus RedisDatabase::datasetStatus()
+{
+    std::lock_guard<std::mutex> lock(status_mutex);
+    return dataset_status;
+}
+
+void RedisDatabase::set(const std::string& key, const std::string& value)
+{
+    auto handle = makeString(value);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    setValue(key, std::move(handle));
+}
+
+//SET semantics: replace whatever the key held, of any type, and its expiry.
+//Caller holds db_mutex.
+void RedisDatabase::setValue(const std::string& key, std::shared_ptr<StringValue> value)
+{
+    touchKey(key);
+    //a value on disk is replaced without reading it back
+    dropCold(key);
+    auto it = kv_store.find(key);
+    if(it == kv_store.end()) {
+        removeKey(key, true);
+        kv_store.emplace(key, std::move(value));
+        return;
+    }
+    //a fresh handle: keys still sharing the old value (COPY) keep it
+    disposeValue(std::move(it->second));
+    it->second = std::move(value);
+    expire_map.erase(key);
+}
+
+std::string RedisDatabase::getSet(const std::string &key, const std::string &value)
+{
+    auto handle = makeString(value);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    touchKey(key);
+    auto& slot = kv_store[key];
+    std::string oldValue = slot ? std::move(rawBytes(detach(slot))) : std::string();
+    slot = std::move(handle);
+    return oldValue;
+}
+
+bool RedisDatabase::get(const std::string &key, std::string &value)
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    auto it = kv_store.find(key);
+
+    if(it != kv_store.end()) {
+        if(it->second->compressed()) stringBytes(*it->second, value);
+        else value = it->second->data;
+        return true;
+    }
+    return false;
+}
+
+std::vector<std::string> RedisDatabase::keys()
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    purgeExpired();
+    std::vector<std::string> result;
+
+    for(const auto& pair : std::as_const(kv_store)){
+        result.push_back(pair.first);
+    }
+
+    for(const auto& pair : std::as_const(list_store)){
+        result.push_back(pair.first);
+    }
+
+    for(const auto& pair : std::as_const(hash_store)){
+        result.push_back(pair.first);
+    }
+
+    for(const auto& pair : std::as_const(cold_index)){
+        result.push_back(pair.first);
+    }
+    return result;
+}
+
+//A slot's keys share one table shard (RedisCowTable.h): only that shard is walked.
+template <typename Table, typename Visit>
+static void visitSlot(const Table& table, int slot, Visit&& visit)
+{
+    for(const auto& entry : table.shard(Table::shardOfSlot(slot))) {
+        if(keyHashSlot(entry.first) == slot && !visit(entry.first)) return;
+    }
+}
+
+std::vector<std::string> RedisDatabase::keysInSlot(int slot, size_t count)
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    purgeExpired();
+    std::vector<std::string> result;
+    auto collect = [&](const std::string& key) {
+        if(result.size() >= count) return false;
+        result.push_back(key);
+        return true;
+    };
+    visitSlot(kv_store, slot, collect);
+    visitSlot(list_store, slot, collect);
+    visitSlot(hash_store, slot, collect);
+    visitSlot(cold_index, slot, collect);
+    return result;
+}
+
+size_t RedisDatabase::countKeysInSlot(int slot)
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    purgeExpired();
+    size_t count = 0;
+    auto tally = [&count](const std::string&) {
+        ++count;
+        return true;
+    };
+    visitSlot(kv_store, slot, tally);
+    visitSlot(list_store, slot, tally);
+    visitSlot(hash_store, slot, tally);
+    visitSlot(cold_index, slot, tally);
+    return count;
+}
+
+std::string RedisDatabase::type(const std::string &key)
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    purgeExpired();
+
+    if(kv_store.find(key) != kv_store.end()) {
+        return "string";
+    }
+
+    if(list_store.find(key) != list_store.end()) {
+        return "list";
+    }
+
+    if(hash_store.find(key) != hash_store.end()) {
+        return "hash";
+    } else {
+        return "none";
+    }    
+}
+
+// BATCHED LOOKUPS
+//
+// Multi-key commands look their keys up in one pass over the const shards, so a
+// batch never copies a shard a View holds.
+// std::unordered_map gives no way to reach a bucket's slot without loading it, so
+// the lookups are not prefetched.
+
+//found[i] points at the entry for keys[i], or is null when it is missing. Shard
+//lookups bypass KeyTable's, so keys on disk are paged in first and hits are
+//stamped as read; presence checks (pageIn false) leave keys on disk and ask
+//hasKey() about the misses.
+template <typename Map>
+static void findBatch(const Map& map, const std::vector<std::string>& keys,
+                      std::vector<const typename Map::value_type*>& found, bool pageIn = true)
+{
+    if(pageIn) {
+        for(const auto& key : keys) pageInKey(key);
+    }
+
+    found.assign(keys.size(), nullptr);
+    for(size_t i = 0; i < keys.size(); ++i) {
+        const auto& shard = map.shard(Map::shardOf(keys[i]));
+        auto it = shard.find(keys[i]);
+        if(it == shard.end()) continue;
+        if(pageIn) it->second->access = accessClock();
+        found[i] = &*it;
+    }
+}
+
+void RedisDatabase::mget(const std::vector<std::string> &keys, std::string &reply)
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    purgeExpired();
+
+    std::vector<const decltype(kv_store)::value_type*> found;
+    findBatch(kv_store, keys, found);
+
+    respAppendArrayHeader(reply, keys.size());
+    std::string scratch;
+    for(auto* entry : found) {
+        if(entry) respAppendBulk(reply, stringBytes(*entry->second, scratch));
+        else reply += "$-1\r\n";
+    }
+}
+
+void RedisDatabase::mset(const std::vector<std::pair<std::string, std::string>> &pairs)
+{
+    std::vector<std::shared_ptr<StringValue>> values;
+    values.reserve(pairs.size());
+    for(const auto& pair : pairs) values.push_back(makeString(pair.second));
+
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    purgeExpired();
+
+    //grow the table once for the whole batch instead of rehashing along the way
+    kv_store.reserve(kv_store.size() + pairs.size());
+    for(size_t i = 0; i < pairs.size(); ++i) {
+        setValue(pairs[i].first, std::move(values[i]));
+    }
+}
+
+bool RedisDatabase::msetnx(const std::vector<std::pair<std::string, std::string>> &pairs)
+{
+    //as in mset, compress outside the lock; a failed check just drops them
+    std::vector<std::shared_ptr<StringValue>> values;
+    values.reserve(pairs.size());
+    for(const auto& pair : pairs) values.push_back(makeString(pair.second));
+
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    purgeExpired();
+
+    std::vector<std::string> keys;
+    keys.reserve(pairs.size());
+    for(const auto& pair : pairs) keys.push_back(pair.first);
+
+    std::vector<const decltype(kv_store)::value_type*> found;
+    findBatch(kv_store, keys, found, false);
+    for(size_t i = 0; i < keys.size(); ++i) {
+        if(found[i] || hasKey(keys[i])) return false;
+    }
+
+    kv_store.reserve(kv_store.size() + pairs.size());
+    for(size_t i = 0; i < pairs.size(); ++i) {
+        touchKey(pairs[i].first);
+        kv_store[pairs[i].first] = std::move(values[i]);
+    }
+    return true;
+}
+
+size_t RedisDatabase::del(const std::vector<std::string> &keys)
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    purgeExpired();
+    size_t removed = 0;
+    for(const auto& key : keys) {
+        if(removeKey(key, false)) ++removed;
+    }
+    return removed;
+}
+
+size_t RedisDatabase::unlink(const std::vector<std::string> &keys)
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    purgeExpired();
+    size_t removed = 0;
+    for(const auto& key : keys) {
+        if(removeKey(key, true)) ++removed;
+    }
+    return removed;
+}
+
+size_t RedisDatabase::exists(const std::vector<std::string> &keys)
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    purgeExpired();
+
+    //strings are the common case; only their misses are looked up in the other stores
+    //and the cold index, which answers for keys on disk without reading them
+    std::vector<const decltype(kv_store)::value_type*> found;
+    findBatch(kv_store, keys, found, false);
+
+    size_t count = 0;
+    for(size_t i = 0; i < keys.size(); ++i) {
+        if(found[i] || hasKey(keys[i])) ++count;
+    }
+    return count;
+}
+
+bool RedisDatabase::hasKey(const std::string& key) const
+{
+    //a key on disk is there without paging it in
+    if(cold_count > 0 && cold_index.count(key)) return true;
+    return kv_store.count(key) || list_store.count(key) || hash_store.count(key);
+}
+
+bool RedisDatabase::expire(const std::string &key, int seconds)
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    purgeExpired();
+    if(!hasKey(key)) return false;
+    touchKey(key);
+
+    expire_map[key] = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+    return true;
+}
+
+bool RedisDatabase::expireAt(const std::string &key, int64_t unixMs)
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    purgeExpired();
+    if(!hasKey(key)) return false;
+    touchKey(key);
+
+    expire_map[key] = fromUnixMs(unixMs);
+    return true;
+}
+
+void RedisDatabase::purgeExpired()
+{
+    // std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    auto now = std::chrono::steady_clock::now();
+    
+    //find them through a const walk, which copies no shard a snapshot still holds
+    std::vector<std::string> expired;
+    for(const auto& entry : std::as_const(expire_map)) {
+        if(now > entry.second) expired.push_back(entry.first);
+    }
+    for(const auto& key : expired) {
+        //Remove from all the stores if expired; big values are freed in the background
+        expire_map.erase(key);
+        removeKey(key, true);
+        ++expired_keys;
+    }
 }
 
-bool RedisDatabase::flushAll()
+//Move key's entry in store to newKey. The map node is erased before the insert so
+//no iterator into store is held across a rehash.
+template <typename Store>
+static bool moveEntry(Store& store, const std::string& key, const std::string& newKey)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
-    kv_store.clear();
-    list_store.clear();
-    hash_store.clear();
+    auto it = store.find(key);
+    if(it == store.end()) return false;
+    auto value = std::move(it->second);
+    store.erase(it);
+    store[newKey] = std::move(value);
     return true;
 }
 
-void RedisDatabase::set(const std::string& key, const std::string& value)
+template <typename Store>
+static bool shareEntry(Store& store, const std::string& key, const std::string& newKey)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
-    kv_store[key] = value;    
+    auto it = store.find(key);
+    if(it == store.end()) return false;
+    auto handle = it->second;
+    store[newKey] = std::move(handle);
+    return true;
 }
 
-std::string RedisDatabase::getSet(const std::string &key, const std::string &value)
-{
-    std::lock_guard<std::mutex> lock(db_mutex);
-    std::string oldValue = kv_store[key];
-    kv_store[key] = value;
-    return oldValue;
+bool RedisDatabase::rename(const std::string &oldKey, const std::string &newKey)
+{    
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    purgeExpired();
+
+    if(!hasKey(oldKey)) return false;
+    if(oldKey == newKey) return true;
+
+    //whatever newKey held is overwritten; only handles move, never the values
+    touchKey(oldKey);
+    touchKey(newKey);
+    removeKey(newKey, true);
+    moveEntry(kv_store, oldKey, newKey);
+    bool isList = moveEntry(list_store, oldKey, newKey);
+    moveEntry(hash_store, oldKey, newKey);
+    moveEntry(expire_map, oldKey, newKey);
+
+    if(isList) serveBlockedClients(newKey);
+    return true;
 }
 
-bool RedisDatabase::get(const std::string &key, std::string &value)
+int RedisDatabase::copy(const std::string &oldKey, const std::string &newKey, bool replace)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
-    auto it = kv_store.find(key);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    purgeExpired();
 
-    if(it != kv_store.end()) {
-        value = it->second;
-        return true;
+    if(!hasKey(oldKey) || oldKey == newKey) return 0;
+    if(hasKey(newKey)) {
+        if(!replace) return 0;
+        removeKey(newKey, true);
     }
-    return false;
+
+    //a refcount bump: the value is copied only when one of the keys is written
+    touchKey(newKey);
+    shareEntry(kv_store, oldKey, newKey);
+    bool isList = shareEntry(list_store, oldKey, newKey);
+    shareEntry(hash_store, oldKey, newKey);
+    shareEntry(expire_map, oldKey, newKey);
+
+    if(isList) serveBlockedClients(newKey);
+    return 1;
 }
 
-std::vector<std::string> RedisDatabase::keys()
+size_t RedisDatabase::dbsize()
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
-    std::vector<std::string> result;
+    
+    return kv_store.size() + cold_strings;
+}
 
-    for(const auto& pair :kv_store){
-        result.push_back(pair.first);
+//BITMAP
+
+//Resolve a Redis style [start, end] range (negative = from the end) against len units.
+//Returns false when the resulting range is empty.
+static bool normalizeRange(int64_t len, int64_t& start, int64_t& end)
+{
+    if(start < 0) start = len + start;
+    if(end < 0) end = len + end;
+    if(start < 0) start = 0;
+    if(end < 0) end = 0;
+    if(end >= len) end = len - 1;
+    return len > 0 && start <= end;
+}
+
+static inline int bitAt(const unsigned char* p, int64_t pos)
+{
+    return (p[pos >> 3] >> (7 - (pos & 7))) & 1;
+}
+
+//first bit equal to `bit` in the inclusive bit range [startBit, endBit], or -1
+static int64_t searchBits(const unsigned char* p, int64_t startBit, int64_t endBit, int bit)
+{
+    int64_t pos = startBit;
+    for(; pos <= endBit && (pos & 7); ++pos) {
+        if(bitAt(p, pos) == bit) return pos;
     }
 
-    for(const auto& pair :list_store){
-        result.push_back(pair.first);
+    size_t fullBytes = static_cast<size_t>((endBit + 1 - pos) / 8);
+    if(pos <= endBit && fullBytes > 0) {
+        int64_t found = bitmapFirstBit(p + (pos >> 3), fullBytes, bit);
+        if(found >= 0) return pos + found;
+        pos += static_cast<int64_t>(fullBytes) * 8;
     }
 
-    for(const auto& pair :hash_store){
-        result.push_back(pair.first);
+    for(; pos <= endBit; ++pos) {
+        if(bitAt(p, pos) == bit) return pos;
     }
-    return result;
+    return -1;
 }
 
-std::string RedisDatabase::type(const std::string &key)
+int RedisDatabase::setbit(const std::string &key, uint64_t offset, int bit)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
+    //kv_store's count() pages a string in from disk, so only a list or hash is left
+    if(!kv_store.count(key) && hasKey(key)) return -1;
+    std::string& bitmap = rawBytes(modify(key, kv_store[key]));
 
-    if(kv_store.find(key) != kv_store.end()) {
-        return "string";
+    size_t byte = static_cast<size_t>(offset >> 3);
+    if(bitmap.size() <= byte) {
+        bitmap.resize(byte + 1, '\0');
     }
 
-    if(list_store.find(key) != list_store.end()) {
-        return "list";
-    }
+    unsigned char mask = static_cast<unsigned char>(1u << (7 - (offset & 7)));
+    unsigned char& cell = reinterpret_cast<unsigned char&>(bitmap[byte]);
+    int old = (cell & mask) ? 1 : 0;
 
-    if(hash_store.find(key) != hash_store.end()) {
-        return "hash";
-    } else {
-        return "none";
-    }    
+    if(bit) cell |= mask;
+    else cell &= static_cast<unsigned char>(~mask);
+    return old;
 }
 
-bool RedisDatabase::del(const std::string &key)
+int RedisDatabase::getbit(const std::string &key, uint64_t offset)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
-    bool erased = false;
-    erased |= kv_store.erase(key) > 0;
-    erased |= list_store.erase(key) > 0;
-    erased |= hash_store.erase(key) > 0;
-    
-    return erased;
+    auto it = kv_store.find(key);
+    if(it == kv_store.end()) return 0;
+
+    size_t byte = static_cast<size_t>(offset >> 3);
+    if(byte >= it->second->size()) return 0;
+    std::string scratch;
+    const std::string& bitmap = stringBytes(*it->second, scratch);
+    return bitAt(reinterpret_cast<const unsigned char*>(bitmap.data()), static_cast<int64_t>(offset));
 }
 
-bool RedisDatabase::expire(const std::string &key, int seconds)
+uint64_t RedisDatabase::bitcount(const std::string &key, int64_t start, int64_t end, bool bitUnit)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
-    bool expired = (kv_store.find(key) != kv_store.end()) || 
-                    (list_store.find(key) != list_store.end() || 
-                    (hash_store.find(key) != hash_store.end()));
+    auto it = kv_store.find(key);
+    if(it == kv_store.end()) return 0;
 
-    if(!expired) return false;
+    std::string scratch;
+    const std::string& bitmap = stringBytes(*it->second, scratch);
+    const auto* p = reinterpret_cast<const unsigned char*>(bitmap.data());
+    int64_t len = static_cast<int64_t>(bitmap.size());
 
-    expire_map[key] = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
-    return true;
-}
+    if(!bitUnit) {
+        if(!normalizeRange(len, start, end)) return 0;
+        return bitmapPopcount(p + start, static_cast<size_t>(end - start + 1));
+    }
 
-void RedisDatabase::purgeExpired()
-{
-    // std::lock_guard<std::mutex> lock(db_mutex);
-    auto now = std::chrono::steady_clock::now();
-    
-    for(auto it = expire_map.begin(); it != expire_map.end(); ) {
-        if(now > it->second) {
-            //Remove from all the stores if expired
-            kv_store.erase(it->first);
-            list_store.erase(it->first);
-            hash_store.erase(it->first);
-            it = expire_map.erase(it);
-        } else {
-            ++it;
-        }
+    if(!normalizeRange(len * 8, start, end)) return 0;
+    int64_t firstByte = start >> 3;
+    int64_t lastByte = end >> 3;
+    unsigned char headMask = static_cast<unsigned char>(0xff >> (start & 7));
+    unsigned char tailMask = static_cast<unsigned char>(0xff << (7 - (end & 7)));
+
+    if(firstByte == lastByte) {
+        return __builtin_popcount(p[firstByte] & headMask & tailMask);
     }
+    uint64_t count = __builtin_popcount(p[firstByte] & headMask) + __builtin_popcount(p[lastByte] & tailMask);
+    return count + bitmapPopcount(p + firstByte + 1, static_cast<size_t>(lastByte - firstByte - 1));
 }
 
-bool RedisDatabase::rename(const std::string &oldKey, const std::string &newKey)
-{    
-    std::lock_guard<std::mutex> lock(db_mutex);
+int64_t RedisDatabase::bitpos(const std::string &key, int bit, int64_t start, int64_t end, bool endGiven, bool bitUnit)
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
-    bool found = false;
+    auto it = kv_store.find(key);
 
-    auto itKv = kv_store.find(oldKey);
+    //a missing key is an empty string: no set bits, and the first clear bit is bit 0
+    if(it == kv_store.end()) return bit ? -1 : 0;
 
-    if(itKv != kv_store.end()){
-        kv_store[newKey] = itKv->second;
-        kv_store.erase(oldKey);
-        found = true;
-    }
+    std::string scratch;
+    const std::string& bitmap = stringBytes(*it->second, scratch);
+    const auto* p = reinterpret_cast<const unsigned char*>(bitmap.data());
+    int64_t len = static_cast<int64_t>(bitmap.size());
+    int64_t units = bitUnit ? len * 8 : len;
 
-    auto itList = list_store.find(oldKey);
+    if(!normalizeRange(units, start, end)) return -1;
+    int64_t startBit = bitUnit ? start : start * 8;
+    int64_t endBit = bitUnit ? end : end * 8 + 7;
 
-    if(itList != list_store.end()){
-        list_store[newKey] = itList->second;
-        list_store.erase(oldKey);
-        found = true;
-    }
+    int64_t found = searchBits(p, startBit, endBit, bit);
 
-    auto itMap = hash_store.find(oldKey);
+    //looking for a clear bit with an open-ended range: the string is treated as
+    //right-padded with zeros, so the answer is the first bit past the range
+    if(found < 0 && bit == 0 && !endGiven) return endBit + 1;
+    return found;
+}
+
+size_t RedisDatabase::bitop(BitOp op, const std::string &destKey, const std::vector<std::string> &srcKeys)
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    purgeExpired();
 
-    if(itMap != hash_store.end()){
-        hash_store[newKey] = itMap->second;
-        hash_store.erase(oldKey);
-        found = true;
+    //missing keys take part as empty strings
+    std::vector<const std::string*> sources;
+    std::vector<std::string> expanded(srcKeys.size());
+    size_t maxLen = 0;
+    for(size_t i = 0; i < srcKeys.size(); ++i) {
+        auto it = kv_store.find(srcKeys[i]);
+        const std::string* src = (it != kv_store.end()) ? &stringBytes(*it->second, expanded[i]) : nullptr;
+        sources.push_back(src);
+        if(src) maxLen = std::max(maxLen, src->size());
     }
 
-    auto itExpire = expire_map.find(oldKey);
+    std::string result(maxLen, '\0');
+    auto* dst = reinterpret_cast<unsigned char*>(&result[0]);
 
-    if(itExpire != expire_map.end()){
-        expire_map[newKey] = itExpire->second;
-        expire_map.erase(oldKey);
-        found = true;
-    }
+    for(size_t i = 0; i < sources.size(); ++i) {
+        const std::string* src = sources[i];
+        size_t srcLen = src ? src->size() : 0;
+        const auto* s = src ? reinterpret_cast<const unsigned char*>(src->data()) : nullptr;
 
-    return found;                                                                                                                       
-}
+        if(op == BitOp::NOT) {
+            //result starts zeroed, so ~0 pads anything past the source
+            if(srcLen) bitmapOp(BitOp::NOT, dst, s, srcLen);
+            break;
+        }
+        if(i == 0) {
+            if(srcLen) std::memcpy(dst, s, srcLen);
+            continue;
+        }
+        if(srcLen) bitmapOp(op, dst, s, srcLen);
+        if(op == BitOp::AND && srcLen < maxLen) {
+            std::memset(dst + srcLen, 0, maxLen - srcLen);
+        }
+    }
 
-int RedisDatabase::copy(const std::string &oldKey, const std::string &newKey)
-{
-    std::lock_guard<std::mutex> lock(db_mutex);
-    purgeExpired();
-    
-    if (kv_store.find(newKey) != kv_store.end())
-    {
-        kv_store[newKey] = kv_store[oldKey];
-        return 1;
+    touchKey(destKey);
+    list_store.erase(destKey);
+    hash_store.erase(destKey);
+    expire_map.erase(destKey);
+    if(result.empty()) {
+        kv_store.erase(destKey);
+    } else {
+        kv_store[destKey] = makeString(std::move(result));
     }
-    else
-    {
-        return 0;
-    }    
+    return maxLen;
 }
 
-size_t RedisDatabase::dbsize()
-{
-    std::lock_guard<std::mutex> lock(db_mutex);
-    purgeExpired();
-    
-    return kv_store.size();
-}
+// STREAMED REPLIES
+//
+// Collections up to STREAM_THRESHOLD elements are serialized into the reply under
+// db_mutex. Bigger ones are answered with a ReplyStream: the handle to the value
+// is copied under the lock (a refcount bump, which also makes writers detach their
+// own copy from then on) and the stream serializes about STREAM_CHUNK_BYTES per
+// call without holding db_mutex. The connection sends each chunk before asking for
+// the next, so a big reply costs O(chunk) memory instead of O(collection).
 
-//LIST 
+static const size_t STREAM_THRESHOLD = 1024;
+static const size_t STREAM_CHUNK_BYTES = 64 * 1024;
+
+//LIST
 
 ssize_t RedisDatabase::llen(const std::string& key)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
     auto it = list_store.find(key);
     if(it != list_store.end()){
-        return it->second.size();
+        return it->second->size();
     } else {
         return 0;
     }
 }
 
-std::vector<std::string> RedisDatabase::Lget(const std::string& key)
+bool RedisDatabase::lrange(const std::string& key, long long start, long long stop, std::string& reply, ReplyStream* stream)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
     auto it = list_store.find(key);
-    if (it != list_store.end()) {
-        return it->second; 
+    if (it == list_store.end()) {
+        respAppendArrayHeader(reply, 0);
+        return false;
+    }
+
+    const auto& lst = *it->second;
+    long long len = static_cast<long long>(lst.size());
+    if (start < 0) start += len;
+    if (stop < 0) stop += len;
+    if (start < 0) start = 0;
+    if (stop >= len) stop = len - 1;
+
+    if (start > stop || start >= len) {
+        respAppendArrayHeader(reply, 0);
+        return true;
+    }
+
+    size_t count = static_cast<size_t>(stop - start + 1);
+    respAppendArrayHeader(reply, count);
+
+    //big windows are streamed from a snapshot of the list (see STREAMED REPLIES)
+    if (stream && count > STREAM_THRESHOLD) {
+        std::shared_ptr<const ListValue> snapshot = it->second;
+        auto pos = std::make_shared<size_t>(static_cast<size_t>(start));
+        size_t end = static_cast<size_t>(stop) + 1;
+        *stream = [snapshot, pos, end](std::string& out) {
+            while (*pos < end && out.size() < STREAM_CHUNK_BYTES) {
+                respAppendBulk(out, (*snapshot)[(*pos)++]);
+            }
+            return *pos < end;
+        };
+        return true;
+    }
+
+    //only the requested window is touched: size it, then serialize it in place
+    size_t bytes = 0;
+    for (long long i = start; i <= stop; ++i) {
+        bytes += respBulkSize(lst[i].size());
     }
-    return {}; 
+    reply.reserve(reply.size() + bytes);
+
+    for (long long i = start; i <= stop; ++i) {
+        respAppendBulk(reply, lst[i]);
+    }
+    return true;
 }
 
 bool RedisDatabase::lindex(const std::string& key, int index, std::string& value)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
     auto it = list_store.find(key);
 
     if(it == list_store.end()) return false;
     
-    const auto& lst = it->second;
+    const auto& lst = *it->second;
     // int vecSize = static_cast<int>(lst.size());
 
     if(index < 0) {
@@ -325,13 +2581,13 @@ bool RedisDatabase::lindex(const std::string& key, int index, std::string& value
 
 bool RedisDatabase::lSet(const std::string &key, int index, const std::string &value)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
     auto it = list_store.find(key);
 
     if(it == list_store.end()) return false;
     
-    auto& lst = it->second;
+    auto& lst = modify(key, it->second);
 
     if(index < 0) {
         index = lst.size() + index;
@@ -348,12 +2604,12 @@ bool RedisDatabase::lSet(const std::string &key, int index, const std::string &v
 
 int RedisDatabase::lRemove(const std::string &key,  int count, const std::string &value)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
     auto it = list_store.find(key);
     if (it == list_store.end()) return 0;  // no such list
 
-    auto& vec = it->second;
+    auto& vec = modify(key, it->second);
     int removed = 0;
     // Remove all elements equal to element.
     if(count == 0)
@@ -395,84 +2651,376 @@ int RedisDatabase::lRemove(const std::string &key,  int count, const std::string
 
 void RedisDatabase::lpush(const std::string &key, const std::string &value)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
-    list_store[key].insert(list_store[key].begin(), value);
+    auto& lst = modify(key, list_store[key]);
+    lst.insert(lst.begin(), value);
+    serveBlockedClients(key);
 }
 
-void RedisDatabase::lpush(const std::string &key, const std::vector<std::string> &values)
+size_t RedisDatabase::lpush(const std::string &key, const std::vector<std::string> &values)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
 
     //loop through adding in values
+    auto& lst = modify(key, list_store[key]);
     for(const auto& value : values){
-        list_store[key].insert(list_store[key].begin(), value);    
+        lst.insert(lst.begin(), value);    
     }    
+    size_t len = lst.size();
+    serveBlockedClients(key);
+    return len;
 }
 
 void RedisDatabase::rpush(const std::string &key, const std::string &value)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
-    list_store[key].emplace_back(value);
+    modify(key, list_store[key]).emplace_back(value);
+    serveBlockedClients(key);
 }
 
-void RedisDatabase::rpush(const std::string &key, const std::vector<std::string> &values)
+size_t RedisDatabase::rpush(const std::string &key, const std::vector<std::string> &values)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
     //loop and add in values
+    auto& lst = modify(key, list_store[key]);
     for(const auto& value : values){
-        list_store[key].emplace_back(value);
+        lst.emplace_back(value);
     }    
+    size_t len = lst.size();
+    serveBlockedClients(key);
+    return len;
 }
 
 bool RedisDatabase::lpop(const std::string &key, std::string &value)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
-    auto it = list_store.find(key);
-
-    if(it != list_store.end() && !it->second.empty())
-    {
-        value = it->second.front();
-        it->second.erase(it->second.begin());
-        return true;
-    } 
-    else 
-    {
-        return false;
-    }    
+    return popFrom(key, true, value);
 }
 
 bool RedisDatabase::rpop(const std::string &key, std::string &value)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    purgeExpired();
+    return popFrom(key, false, value);
+}
+
+bool RedisDatabase::lmove(const std::string &source, const std::string &destination, bool fromLeft, bool toLeft, std::string &value)
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    purgeExpired();
+    if(!popFrom(source, fromLeft, value)) return false;
+
+    pushTo(destination, value, toLeft);
+    serveBlockedClients(destination);
+    return true;
+}
+
+// BLOCKING LIST OPERATIONS
+//
+// A client that finds every key empty parks a BlockedClient in the FIFO wait
+// queue of each key and sleeps on its own condition variable, in the thread
+// already serving its connection. Whoever adds data to a key (LPUSH, RPUSH,
+// LINSERT, LMOVE) hands elements to the longest-waiting client directly under
+// db_mutex, so a woken client never races another for the element.
+//
+// The waiting thread sleeps until the timeout itself. Its connection thread can't
+// watch the socket meanwhile, so the hang-up watch thread poll()s the sockets of
+// all blocked clients and wakes the one whose peer closed.
+
+bool RedisDatabase::blockingPop(const std::vector<std::string> &keys, bool fromLeft, double timeoutSeconds, std::string &key, std::string &value, int clientFd)
+{
+    auto waiter = std::make_shared<BlockedClient>();
+    waiter->keys = keys;
+    waiter->popLeft = fromLeft;
+    waiter->fd = clientFd;
+    return blockOn(waiter, timeoutSeconds, key, value);
+}
+
+bool RedisDatabase::blmove(const std::string &source, const std::string &destination, bool fromLeft, bool toLeft, double timeoutSeconds, std::string &value, int clientFd)
+{
+    auto waiter = std::make_shared<BlockedClient>();
+    waiter->keys = {source};
+    waiter->popLeft = fromLeft;
+    waiter->moveTo = true;
+    waiter->target = destination;
+    waiter->pushLeft = toLeft;
+    waiter->fd = clientFd;
+    std::string key;
+    return blockOn(waiter, timeoutSeconds, key, value);
+}
+
+bool RedisDatabase::blockOn(const std::shared_ptr<BlockedClient> &waiter, double timeoutSeconds, std::string &key, std::string &value)
+{
+    std::unique_lock<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
+
+    //fast path: the first non-empty key in argument order wins
+    for(const auto& candidate : waiter->keys) {
+        if(popFrom(candidate, waiter->popLeft, value)) {
+            key = candidate;
+            propagatePop(*waiter, candidate);
+            if(waiter->moveTo) {
+                pushTo(waiter->target, value, waiter->pushLeft);
+                serveBlockedClients(waiter->target);
+            }
+            return true;
+        }
+    }
+
+    //inside EXEC nothing else can run until the transaction ends, so don't wait
+    if(exec_active) return false;
+
+    for(const auto& candidate : waiter->keys) {
+        blocking_keys[candidate].push_back(waiter);
+    }
+    ++blocked_count;
+    watchHangup(waiter, true);
+
+    //timeout 0 blocks forever; a push or a hang-up notifies the cv
+    const bool forever = timeoutSeconds <= 0;
+    const auto deadline = std::chrono::steady_clock::now() +
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(timeoutSeconds));
+    auto done = [&waiter]() { return waiter->served || waiter->abandoned; };
+    if(forever) waiter->cv.wait(lock, done);
+    else waiter->cv.wait_until(lock, deadline, done);
+
+    watchHangup(waiter, false);
+    --blocked_count;
+    if(!waiter->served) {
+        unblock(waiter);
+        return false;
+    }
+
+    key = waiter->servedKey;
+    value = waiter->servedValue;
+    return true;
+}
+
+//add waiter to the hang-up watch, or take it off; the thread polls the new list
+void RedisDatabase::watchHangup(const std::shared_ptr<BlockedClient> &waiter, bool watch)
+{
+    if(waiter->fd < 0) return;
+    {
+        std::lock_guard<std::mutex> lock(hangup_mutex);
+        if(watch) hangup_watch.push_back(waiter);
+        else hangup_watch.erase(std::remove(hangup_watch.begin(), hangup_watch.end(), waiter), hangup_watch.end());
+    }
+    uint64_t one = 1;
+    if(hangup_wake >= 0 && write(hangup_wake, &one, sizeof(one)) < 0) {}
+}
+
+void RedisDatabase::hangupLoop()
+{
+    std::vector<std::shared_ptr<BlockedClient>> watched;
+    std::vector<struct pollfd> fds;
+    while(true) {
+        {
+            std::lock_guard<std::mutex> lock(hangup_mutex);
+            if(hangup_stop) return;
+            watched = hangup_watch;
+        }
+        fds.assign(watched.size() + 1, pollfd{});
+        fds[0].fd = hangup_wake;
+        fds[0].events = POLLIN;
+        for(size_t i = 0; i < watched.size(); ++i) {
+            fds[i + 1].fd = watched[i]->fd;
+            fds[i + 1].events = POLLRDHUP;
+        }
+        //without an eventfd, look at the list again every 100ms instead
+        if(poll(fds.data(), fds.size(), hangup_wake >= 0 ? -1 : 100) < 0) {
+            if(errno == EINTR) continue;
+            std::cerr << "Warning: poll() failed watching blocked clients: " << std::strerror(errno) << "\n";
+            return;
+        }
+        if(fds[0].revents & POLLIN) {
+            uint64_t count;
+            while(read(hangup_wake, &count, sizeof(count)) > 0) {}
+        }
+
+        for(size_t i = 0; i < watched.size(); ++i) {
+            if(!(fds[i + 1].revents & (POLLRDHUP | POLLHUP | POLLERR | POLLNVAL))) continue;
+            //drop it from the list first, or the next poll() reports it again at once
+            {
+                std::lock_guard<std::mutex> lock(hangup_mutex);
+                hangup_watch.erase(std::remove(hangup_watch.begin(), hangup_watch.end(), watched[i]), hangup_watch.end());
+            }
+            std::lock_guard<std::recursive_mutex> lock(db_mutex);
+            watched[i]->abandoned = true;
+            watched[i]->cv.notify_one();
+        }
+        watched.clear();
+    }
+}
+
+void RedisDatabase::unblock(const std::shared_ptr<BlockedClient> &waiter)
+{
+    for(const auto& key : waiter->keys) {
+        auto it = blocking_keys.find(key);
+        if(it == blocking_keys.end()) continue;
+
+        auto& queue = it->second;
+        queue.erase(std::remove(queue.begin(), queue.end(), waiter), queue.end());
+        if(queue.empty()) blocking_keys.erase(it);
+    }
+}
+
+void RedisDatabase::serveBlockedClients(const std::string &key)
+{
+    //caller holds db_mutex
+    auto it = blocking_keys.find(key);
+    if(it == blocking_keys.end()) return;
+
+    std::vector<std::string> targets;
+    while(it != blocking_keys.end() && !it->second.empty()) {
+        auto waiter = it->second.front();
+        std::string value;
+        if(!popFrom(key, waiter->popLeft, value)) break;
+
+        //unblock() may erase this key's queue, so look it up again afterwards
+        unblock(waiter);
+        propagatePop(*waiter, key);
+        if(waiter->moveTo) {
+            pushTo(waiter->target, value, waiter->pushLeft);
+            targets.push_back(waiter->target);
+        }
+        waiter->servedKey = key;
+        waiter->servedValue = std::move(value);
+        waiter->served = true;
+        waiter->cv.notify_one();
+        it = blocking_keys.find(key);
+    }
+
+    for(const auto& target : targets) {
+        if(target != key) serveBlockedClients(target);
+    }
+}
+
+bool RedisDatabase::popFrom(const std::string &key, bool left, std::string &value)
+{
     auto it = list_store.find(key);
+    if(it == list_store.end() || it->second->empty()) return false;
+
+    auto& lst = modify(key, it->second);
+    if(left) {
+        value = std::move(lst.front());
+        lst.erase(lst.begin());
+    } else {
+        value = std::move(lst.back());
+        lst.pop_back();
+    }
+    return true;
+}
+
+void RedisDatabase::pushTo(const std::string &key, const std::string &value, bool left)
+{
+    auto& lst = modify(key, list_store[key]);
+    if(left) lst.insert(lst.begin(), value);
+    else lst.emplace_back(value);
+}
 
-    if(it != list_store.end() && !it->second.empty())
+// RANDOM SAMPLING
+
+//xoshiro256** per thread, seeded once from std::random_device via splitmix64
+static uint64_t splitmix64(uint64_t& state)
+{
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+struct FastRandom {
+    uint64_t s[4];
+
+    FastRandom()
     {
-        value = it->second.back();
-        it->second.pop_back();
-        return true;
-    } 
-    else 
+        std::random_device rd;
+        uint64_t seed = (static_cast<uint64_t>(rd()) << 32) ^ rd();
+        for(auto& word : s) word = splitmix64(seed);
+    }
+
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+    uint64_t next()
     {
-        return false;
-    }    
+        uint64_t result = rotl(s[1] * 5, 7) * 9;
+        uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return result;
+    }
+};
+
+//uniform in [0, n) using Lemire's multiply-shift reduction
+static uint64_t fastRandomBelow(uint64_t n)
+{
+    static thread_local FastRandom rng;
+    return static_cast<uint64_t>((static_cast<unsigned __int128>(rng.next()) * n) >> 64);
+}
+
+//Pick a random entry in O(1) expected time. A random bucket is probed and a slot
+//index drawn in [0, RANDOM_CHAIN_SLOTS); the probe only succeeds when that slot
+//exists in the bucket's chain. Every entry in a chain no longer than the slot count
+//is therefore equally likely, instead of entries in short chains being favoured.
+//The map must not be empty. unordered_map never shrinks its bucket array, so callers
+//compact tables left sparse by deletions (see isSparse) to keep probes few.
+static const size_t RANDOM_CHAIN_SLOTS = 8;
+
+template <typename Map>
+static bool isSparse(const Map& map)
+{
+    return map.size() * 8 < map.bucket_count();
+}
+
+template <typename Map>
+static const typename Map::value_type* randomEntry(const Map& map)
+{
+    size_t buckets = map.bucket_count();
+    while(true) {
+        size_t bucket = fastRandomBelow(buckets);
+        size_t chain = map.bucket_size(bucket);
+        if(chain == 0) continue;
+
+        //chains longer than the slot count are vanishingly rare at load factor <= 1
+        size_t slot = fastRandomBelow(std::max(chain, RANDOM_CHAIN_SLOTS));
+        if(slot >= chain) continue;
+
+        auto it = map.begin(bucket);
+        std::advance(it, slot);
+        return &*it;
+    }
+}
+
+//A random entry of a sharded table: the shard is chosen in proportion to its size,
+//O(shards), then the entry within it as above. The table must not be empty.
+template <typename Table>
+static const typename Table::value_type* randomTableEntry(Table& table)
+{
+    size_t pick = fastRandomBelow(table.size());
+    size_t s = 0;
+    while(pick >= table.shard(s).size()) pick -= table.shard(s++).size();
+    if(isSparse(table.shard(s))) table.compact(s);
+    return randomEntry(table.shard(s));
 }
 
 // HASH OPERATIONS
 
 ssize_t RedisDatabase::Hlen(const std::string &key)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
     auto it = hash_store.find(key);
     if(it != hash_store.end()){
-        return it->second.size();
+        return it->second->size();
     } else {
         return 0;
     }
@@ -480,20 +3028,20 @@ ssize_t RedisDatabase::Hlen(const std::string &key)
 
 bool RedisDatabase::Hset(const std::string &key, const std::string &field, const std::string &value)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
-    hash_store[key][field] = value;
+    modify(key, hash_store[key])[field] = value;
     return true;
 }
 
 bool RedisDatabase::Hget(const std::string &key, const std::string &field, std::string& value)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
     auto it = hash_store.find(key);
     if(it != hash_store.end()){
-        auto secondIt = hash_store[key].find(field);
-        if(secondIt != it->second.end()){
+        auto secondIt = it->second->find(field);
+        if(secondIt != it->second->end()){
             value = secondIt->second;
             return true;
         }        
@@ -503,11 +3051,11 @@ bool RedisDatabase::Hget(const std::string &key, const std::string &field, std::
 
 bool RedisDatabase::Hexists(const std::string &key, const std::string &field)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
     auto it = hash_store.find(key);
     if(it != hash_store.end()){
-        return (it->second.find(field) != hash_store[key].end());
+        return (it->second->find(field) != it->second->end());
     } else {
         return false;
     }
@@ -515,125 +3063,160 @@ bool RedisDatabase::Hexists(const std::string &key, const std::string &field)
 
 bool RedisDatabase::Hdel(const std::string &key, const std::string &field)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
     auto it = hash_store.find(key);
     if(it != hash_store.end()){
-        return it->second.erase(field) > 0;
+        if(it->second->find(field) == it->second->end()) return false;
+        return modify(key, it->second).erase(field) > 0;
     } else {
         return false;
     }
 
 }
 
-std::vector<std::string> RedisDatabase::Hkeys(const std::string &key)
+static void appendHashEntry(std::string& out, const std::pair<const std::string, std::string>& entry, RedisDatabase::HashPart part)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
-    purgeExpired();
-    std::vector<std::string> keysVec;
-    auto it = hash_store.find(key);
-
-    if(it != hash_store.end())
-    {
-        for(const auto& pair : it->second)
-        {
-            keysVec.emplace_back(pair.first);
-        }
-        return keysVec;
-    } 
-
-    return keysVec;    
+    if(part != RedisDatabase::HashPart::Values) respAppendBulk(out, entry.first);
+    if(part != RedisDatabase::HashPart::Fields) respAppendBulk(out, entry.second);
 }
 
-std::vector<std::string> RedisDatabase::Hvals(const std::string &key)
+void RedisDatabase::hashReply(const std::string &key, HashPart part, std::string &reply, ReplyStream &stream)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
-    std::vector<std::string> valuesVec;
     auto it = hash_store.find(key);
-
-    if(it != hash_store.end())
-    {
-        for(const auto& pair : it->second)
-        {
-            valuesVec.emplace_back(pair.second);
-        }
+    if(it == hash_store.end()) {
+        respAppendArrayHeader(reply, 0);
+        return;
     }
 
-    return valuesVec;
-}
-
-std::unordered_map<std::string, std::string> RedisDatabase::Hgetall(const std::string &key)
-{
-    std::lock_guard<std::mutex> lock(db_mutex);
-    purgeExpired();
-    std::unordered_map<std::string, std::string> all;    
+    const size_t perEntry = (part == HashPart::Both) ? 2 : 1;
+    std::shared_ptr<const HashValue> hash = it->second;
+    respAppendArrayHeader(reply, hash->size() * perEntry);
 
-    if(hash_store.find(key) != hash_store.end())
-    {
-        return hash_store[key];
+    if(hash->size() <= STREAM_THRESHOLD) {
+        for(const auto& entry : *hash) appendHashEntry(reply, entry, part);
+        return;
     }
-    return {};
+
+    auto pos = std::make_shared<HashValue::const_iterator>(hash->begin());
+    stream = [hash, pos, part](std::string& out) {
+        while(*pos != hash->end() && out.size() < STREAM_CHUNK_BYTES) {
+            appendHashEntry(out, **pos, part);
+            ++*pos;
+        }
+        return *pos != hash->end();
+    };
 }
 
 bool RedisDatabase::HMset(const std::string &key, const std::vector<std::pair<std::string, std::string>> &fieldValues)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
+    auto& hash = modify(key, hash_store[key]);
     for(const auto& pair : fieldValues)
     {
-        hash_store[key][pair.first] = pair.second;
+        hash[pair.first] = pair.second;
     }
     return true;
 }
 
 bool RedisDatabase::Hsetnx(const std::string &key, const std::string &field, const std::string &value)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
     auto it = hash_store.find(key);
     if(it != hash_store.end())
     {
-        hash_store[key][field] = value;
+        modify(key, it->second)[field] = value;
         return true;
     }
     return false;
 }
 
-bool RedisDatabase::Hrandfield(const std::string &key, std::vector<std::string> &value, const int &count)
+bool RedisDatabase::Hrandfield(const std::string &key, long long count, bool withValues, std::vector<std::string> &value)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
 
-    emplace_rand_fields(key, value, count);
-    
+    auto it = hash_store.find(key);
+    if(it == hash_store.end() || it->second->empty()) return false;
+
+    //compacting rehashes the table, a write as far as other holders are concerned,
+    //so a shared hash is sampled sparse rather than copied (as CowTable::compact)
+    if(it->second.use_count() == 1 && isSparse(*it->second)) it->second->rehash(0);
+    emplace_rand_fields(*it->second, count, withValues, value);
     return true;
 }
 
-void RedisDatabase::emplace_rand_fields(const std::string &key, std::vector<std::string> &value, const int &count)
+void RedisDatabase::emplace_rand_fields(std::unordered_map<std::string, std::string> &hash, long long count, bool withValues, std::vector<std::string> &value)
 {
-    // Create a random device to seed the generator
-    std::random_device rd;
-
-    // Create a Mersenne Twister generator (fast and high-quality)
-    std::mt19937 gen(rd());
+    auto emit = [&](const std::pair<const std::string, std::string>& entry) {
+        value.emplace_back(entry.first);
+        if(withValues) value.emplace_back(entry.second);
+    };
+
+    //negative count: samples may repeat, each one O(1); the handler bounds count
+    if(count < 0) {
+        size_t samples = static_cast<size_t>(-count);
+        value.reserve(samples * (withValues ? 2 : 1));
+        for(size_t i = 0; i < samples; ++i) {
+            emit(*randomEntry(hash));
+        }
+        return;
+    }
 
-    // Define the range [min, max]
-    int min = 0;
-    int max = hash_store[key].size() - 1;
+    size_t wanted = static_cast<size_t>(count);
+    if(wanted >= hash.size()) {
+        for(const auto& entry : hash) emit(entry);
+        return;
+    }
 
-    // Create a uniform distribution
-    std::uniform_int_distribution<> dist(min, max);
+    //asking for most of the hash: dropping random entries from a full index is cheaper
+    //than rejection sampling, which would keep hitting fields it already picked
+    if(wanted * 3 > hash.size()) {
+        std::vector<const std::pair<const std::string, std::string>*> entries;
+        entries.reserve(hash.size());
+        for(const auto& entry : hash) entries.push_back(&entry);
+        while(entries.size() > wanted) {
+            size_t victim = fastRandomBelow(entries.size());
+            entries[victim] = entries.back();
+            entries.pop_back();
+        }
+        for(const auto* entry : entries) emit(*entry);
+        return;
+    }
 
-    for (int i = 0; i < count; ++i) {
-        int random_index = dist(gen);
+    //few distinct fields out of many: sample and reject repeats, O(count) expected
+    std::unordered_set<const std::string*> picked;
+    picked.reserve(wanted);
+    while(picked.size() < wanted) {
+        auto* entry = randomEntry(hash);
+        if(picked.insert(&entry->first).second) emit(*entry);
+    }
+}
 
-        // advance iterator to random index
-        auto it = hash_store[key].begin();
-        std::advance(it, random_index);
+bool RedisDatabase::randomKey(std::string &key)
+{
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
+    purgeExpired();
 
-        value.emplace_back(it->second);
-    }   
+    //choose a store in proportion to its size, then a random entry within it
+    size_t total = kv_store.size() + list_store.size() + hash_store.size() + cold_index.size();
+    if(total == 0) return false;
+
+    size_t pick = fastRandomBelow(total);
+    if(pick < kv_store.size()) {
+        key = randomTableEntry(kv_store)->first;
+    } else if(pick < kv_store.size() + list_store.size()) {
+        key = randomTableEntry(list_store)->first;
+    } else if(pick < kv_store.size() + list_store.size() + hash_store.size()) {
+        key = randomTableEntry(hash_store)->first;
+    } else {
+        key = randomTableEntry(cold_index)->first;
+    }
+    return true;
 }
 
 bool RedisDatabase::Hscan(const std::string &key, const int &cursor, std::vector<std::string> &values)
@@ -642,7 +3225,7 @@ bool RedisDatabase::Hscan(const std::string &key, const int &cursor, std::vector
     // The first element is a Bulk string reply that represents an unsigned 64-bit number, the cursor.
     // The second element is an Array reply of field/value pairs that were scanned. When the NOVALUES flag (since Redis 7.4) is used, only the field names are returned.
     
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
     
     return true;
@@ -650,22 +3233,24 @@ bool RedisDatabase::Hscan(const std::string &key, const int &cursor, std::vector
 
 std::vector<std::string> RedisDatabase::Hgetdel(const std::string &key, const std::string &field, const int &count, const std::vector<std::string> &fields)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
 
     std::vector<std::string> result;
 
     for(const auto& key : fields)
     {
-        if(hash_store[key].find(field) != hash_store[key].end())
+        auto it = hash_store.find(key);
+        if(it != hash_store.end() && it->second->find(field) != it->second->end())
         {
-            result.emplace_back(hash_store[key][field]);
-            hash_store[key].erase(field);
+            auto& hash = modify(key, it->second);
+            result.emplace_back(hash[field]);
+            hash.erase(field);
             expire_map.erase(key);
             
-            if(hash_store[key].empty())
+            if(hash.empty())
             {
-                hash_store.erase(key);
+                hash_store.erase(it);
             }
         }
         else
@@ -682,7 +3267,7 @@ int RedisDatabase::linsert(const std::string& key, const std::string& value, con
     // Integer reply: the list length after a successful insert operation.
     // Integer reply: 0 when the key doesn't exist.
     // Integer reply: -1 when the pivot wasn't found.
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
 
     auto it = list_store.find(key);
@@ -694,8 +3279,11 @@ int RedisDatabase::linsert(const std::string& key, const std::string& value, con
     {
         if(it != list_store.end())
         {
-            it->second.insert(it->second.begin(), value);
-            return it->second.size();
+            auto& lst = modify(key, it->second);
+            lst.insert(lst.begin(), value);
+            int len = lst.size();
+            serveBlockedClients(key);
+            return len;
         }
         else
         {
@@ -706,8 +3294,11 @@ int RedisDatabase::linsert(const std::string& key, const std::string& value, con
     {        
         if(it != list_store.end())
         {
-            it->second.insert(it->second.end(), value);
-            return it->second.size();
+            auto& lst = modify(key, it->second);
+            lst.insert(lst.end(), value);
+            int len = lst.size();
+            serveBlockedClients(key);
+            return len;
         }
         else
         {
@@ -725,14 +3316,15 @@ int RedisDatabase::linsert(const std::string& key, const std::string& value, con
 
 bool RedisDatabase::ltrim(const std::string& key, const int& start, const int& stop)
 {
-    std::lock_guard<std::mutex> lock(db_mutex);
+    std::lock_guard<std::recursive_mutex> lock(db_mutex);
     purgeExpired();
     auto it = list_store.find(key);
     if(it == list_store.end())
     {
         return false;
     }
-    it->second.erase(it->second.begin() + start, it->second.begin() + stop);
+    auto& lst = modify(key, it->second);
+    lst.erase(lst.begin() + start, lst.begin() + stop);
     return true;
 }
 
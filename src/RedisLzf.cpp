@@ -0,0 +1,122 @@
+#include "RedisLzf.h"
+#include <cstdint>
+#include <cstring>
+
+//the hash table has up to 1 << LZF_HASH_LOG slots, fewer for short inputs: clearing
+//it is part of every call, and snapshots compress many small strings
+static const unsigned LZF_HASH_LOG = 14;
+static const unsigned LZF_MIN_HASH_LOG = 8;
+static const size_t LZF_MAX_LITERAL = 32;
+static const size_t LZF_MAX_OFFSET = 1 << 13;
+static const size_t LZF_MAX_MATCH = (1 << 8) + (1 << 3);
+
+static inline uint32_t lzfHash(const uint8_t* p, unsigned hashLog)
+{
+    uint32_t v = (static_cast<uint32_t>(p[0]) << 16) | (static_cast<uint32_t>(p[1]) << 8) | p[2];
+    return (v * 2654435761u) >> (32 - hashLog);
+}
+
+size_t lzfCompress(const void* in, size_t len, void* out, size_t outLen)
+{
+    const uint8_t* base = static_cast<const uint8_t*>(in);
+    const uint8_t* ip = base;
+    const uint8_t* inEnd = base + len;
+    uint8_t* op = static_cast<uint8_t*>(out);
+    uint8_t* outEnd = op + outLen;
+
+    //positions + 1 of the last 3-byte sequence seen with each hash (0 = none)
+    unsigned hashLog = LZF_MIN_HASH_LOG;
+    while(hashLog < LZF_HASH_LOG && (static_cast<size_t>(1) << hashLog) < len) ++hashLog;
+    uint32_t table[1 << LZF_HASH_LOG];
+    std::memset(table, 0, sizeof(table[0]) << hashLog);
+
+    const uint8_t* literals = ip;
+    auto flushLiterals = [&](const uint8_t* upTo) {
+        while(literals < upTo) {
+            size_t n = static_cast<size_t>(upTo - literals);
+            if(n > LZF_MAX_LITERAL) n = LZF_MAX_LITERAL;
+            if(static_cast<size_t>(outEnd - op) < n + 1) return false;
+            *op++ = static_cast<uint8_t>(n - 1);
+            std::memcpy(op, literals, n);
+            op += n;
+            literals += n;
+        }
+        return true;
+    };
+
+    while(inEnd - ip >= 3) {
+        uint32_t& slot = table[lzfHash(ip, hashLog)];
+        const uint8_t* ref = slot ? base + slot - 1 : nullptr;
+        slot = static_cast<uint32_t>(ip - base) + 1;
+
+        size_t distance = ref ? static_cast<size_t>(ip - ref) : 0;
+        if(!ref || distance > LZF_MAX_OFFSET || std::memcmp(ref, ip, 3) != 0) {
+            ++ip;
+            continue;
+        }
+
+        size_t limit = static_cast<size_t>(inEnd - ip);
+        if(limit > LZF_MAX_MATCH) limit = LZF_MAX_MATCH;
+        size_t match = 3;
+        while(match < limit && ref[match] == ip[match]) ++match;
+
+        if(!flushLiterals(ip) || outEnd - op < 3) return 0;
+        size_t code = match - 2;
+        size_t offset = distance - 1;
+        if(code < 7) {
+            *op++ = static_cast<uint8_t>((code << 5) | (offset >> 8));
+        } else {
+            *op++ = static_cast<uint8_t>((7 << 5) | (offset >> 8));
+            *op++ = static_cast<uint8_t>(code - 7);
+        }
+        *op++ = static_cast<uint8_t>(offset);
+
+        ip += match;
+        literals = ip;
+        //index the end of the match so runs keep chaining
+        if(inEnd - ip >= 3 && match > 3) {
+            table[lzfHash(ip - 1, hashLog)] = static_cast<uint32_t>(ip - 1 - base) + 1;
+            table[lzfHash(ip - 2, hashLog)] = static_cast<uint32_t>(ip - 2 - base) + 1;
+        }
+    }
+
+    if(!flushLiterals(inEnd)) return 0;
+    return static_cast<size_t>(op - static_cast<uint8_t*>(out));
+}
+
+size_t lzfDecompress(const void* in, size_t len, void* out, size_t outLen)
+{
+    const uint8_t* ip = static_cast<const uint8_t*>(in);
+    const uint8_t* inEnd = ip + len;
+    uint8_t* begin = static_cast<uint8_t*>(out);
+    uint8_t* op = begin;
+    uint8_t* outEnd = begin + outLen;
+
+    while(ip < inEnd) {
+        size_t ctrl = *ip++;
+        if(ctrl < 32) {
+            size_t n = ctrl + 1;
+            if(static_cast<size_t>(inEnd - ip) < n || static_cast<size_t>(outEnd - op) < n) return 0;
+            std::memcpy(op, ip, n);
+            ip += n;
+            op += n;
+            continue;
+        }
+
+        size_t match = ctrl >> 5;
+        if(match == 7) {
+            if(ip == inEnd) return 0;
+            match += *ip++;
+        }
+        match += 2;
+        if(ip == inEnd) return 0;
+        size_t distance = (((ctrl & 0x1f) << 8) | *ip++) + 1;
+        if(distance > static_cast<size_t>(op - begin) || static_cast<size_t>(outEnd - op) < match) return 0;
+
+        //the reference may overlap what is being written: copy forward byte by byte
+        const uint8_t* ref = op - distance;
+        for(size_t i = 0; i < match; ++i) op[i] = ref[i];
+        op += match;
+    }
+    return static_cast<size_t>(op - begin);
+}
@@ -0,0 +1,222 @@
+#include "RedisNet.h"
+#include "RedisResp.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <fcntl.h>
+#include <mutex>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <unordered_map>
+
+static std::string addressName(int fd, bool peer)
+{
+    sockaddr_storage addr{};
+    socklen_t len = sizeof(addr);
+    char host[NI_MAXHOST] = "?";
+    int got = peer ? getpeername(fd, reinterpret_cast<sockaddr*>(&addr), &len)
+                   : getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len);
+    if(got == 0) {
+        getnameinfo(reinterpret_cast<sockaddr*>(&addr), len, host, sizeof(host), nullptr, 0, NI_NUMERICHOST);
+    }
+    return host;
+}
+
+std::string peerName(int fd)
+{
+    return addressName(fd, true);
+}
+
+std::string localName(int fd)
+{
+    return addressName(fd, false);
+}
+
+bool sendAll(int fd, const std::string& data, int timeoutMs)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    size_t sent = 0;
+    while(sent < data.size()) {
+        if(timeoutMs >= 0) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            pollfd pfd{fd, POLLOUT, 0};
+            int ready = poll(&pfd, 1, static_cast<int>(std::max<long long>(left.count(), 0)));
+            if(ready < 0 && errno == EINTR) continue;
+            if(ready <= 0) return false;
+        }
+        //with a limit, take what fits now and poll again for the rest
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL | (timeoutMs >= 0 ? MSG_DONTWAIT : 0));
+        if(n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+        if(n <= 0) return false;
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool sendCommand(int fd, const std::vector<std::string>& argv)
+{
+    std::string out;
+    respAppendArrayHeader(out, argv.size());
+    for(const auto& arg : argv) respAppendBulk(out, arg);
+    return sendAll(fd, out);
+}
+
+int receive(int fd, std::string& in, int timeoutMs)
+{
+    pollfd pfd{fd, POLLIN, 0};
+    int ready = poll(&pfd, 1, timeoutMs);
+    if(ready < 0) return errno == EINTR ? 0 : -1;
+    if(ready == 0) return 0;
+    char buffer[16 * 1024];
+    ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+    if(n < 0 && errno == EINTR) return 0;
+    if(n <= 0) return -1;
+    in.append(buffer, static_cast<size_t>(n));
+    return 1;
+}
+
+bool readLine(int fd, std::string& in, std::string& line, int timeoutMs)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    size_t crlf;
+    while((crlf = in.find("\r\n")) == std::string::npos) {
+        int wait = -1;
+        if(timeoutMs >= 0) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            if(left.count() <= 0) return false;
+            wait = static_cast<int>(left.count());
+        }
+        if(receive(fd, in, wait) < 0) return false;
+    }
+    line.assign(in, 0, crlf);
+    in.erase(0, crlf + 2);
+    return true;
+}
+
+//connect(), giving up after timeoutMs (-1: the system's own timeout)
+static bool connectWithin(int fd, const sockaddr* addr, socklen_t len, int timeoutMs)
+{
+    if(timeoutMs < 0) return connect(fd, addr, len) == 0;
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    bool ok = connect(fd, addr, len) == 0;
+    if(!ok && errno == EINPROGRESS) {
+        pollfd pfd{fd, POLLOUT, 0};
+        int error = 0;
+        socklen_t errorLen = sizeof(error);
+        ok = poll(&pfd, 1, timeoutMs) == 1 &&
+             getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &errorLen) == 0 && error == 0;
+    }
+    fcntl(fd, F_SETFL, flags);
+    return ok;
+}
+
+int connectTo(const std::string& host, int port, int timeoutMs)
+{
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* found = nullptr;
+    if(getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &found) != 0) return -1;
+    int fd = -1;
+    for(addrinfo* addr = found; addr; addr = addr->ai_next) {
+        fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+        if(fd < 0) continue;
+        if(connectWithin(fd, addr->ai_addr, addr->ai_addrlen, timeoutMs)) break;
+        ::close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(found);
+    if(fd >= 0) {
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    }
+    return fd;
+}
+
+// CONNECTION POOL
+
+static const auto POOL_IDLE_LIMIT = std::chrono::seconds(10);
+
+namespace {
+struct PooledConnection {
+    int fd;
+    std::chrono::steady_clock::time_point since;
+};
+std::mutex pool_mutex;
+std::unordered_multimap<std::string, PooledConnection> pool;
+}
+
+//true when nothing is waiting to be read: no stray reply, no EOF from the other end
+static bool quiet(int fd)
+{
+    pollfd pfd{fd, POLLIN, 0};
+    return poll(&pfd, 1, 0) == 0;
+}
+
+int takeConnection(const std::string& host, int port, int timeoutMs)
+{
+    std::string name = host + ":" + std::to_string(port);
+    std::vector<int> stale;
+    int fd = -1;
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        auto now = std::chrono::steady_clock::now();
+        for(auto it = pool.begin(); it != pool.end(); ) {
+            if(now - it->second.since > POOL_IDLE_LIMIT) {
+                stale.push_back(it->second.fd);
+                it = pool.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        auto it = pool.find(name);
+        if(it != pool.end()) {
+            fd = it->second.fd;
+            pool.erase(it);
+        }
+    }
+    for(int idle : stale) ::close(idle);
+    if(fd >= 0 && quiet(fd)) return fd;
+    if(fd >= 0) ::close(fd);
+    return connectTo(host, port, timeoutMs);
+}
+
+void giveBack(const std::string& host, int port, int fd)
+{
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    pool.emplace(host + ":" + std::to_string(port), PooledConnection{fd, std::chrono::steady_clock::now()});
+}
+
+size_t parseCommand(const std::string& in, size_t pos, std::vector<std::string>& argv)
+{
+    size_t start = pos;
+    auto number = [&](char prefix, long long& value) -> int {
+        if(pos >= in.size()) return 0;
+        if(in[pos] != prefix) return -1;
+        size_t crlf = in.find("\r\n", pos);
+        if(crlf == std::string::npos) return in.size() - pos > 32 ? -1 : 0;
+        char* end = nullptr;
+        value = std::strtoll(in.c_str() + pos + 1, &end, 10);
+        if(end != in.c_str() + crlf || value < 0) return -1;
+        pos = crlf + 2;
+        return 1;
+    };
+
+    argv.clear();
+    long long count = 0;
+    int got = number('*', count);
+    if(got <= 0) return got < 0 ? std::string::npos : 0;
+    for(long long i = 0; i < count; ++i) {
+        long long len = 0;
+        got = number('$', len);
+        if(got <= 0) return got < 0 ? std::string::npos : 0;
+        if(in.size() - pos < static_cast<size_t>(len) + 2) return 0;
+        argv.emplace_back(in, pos, static_cast<size_t>(len));
+        pos += static_cast<size_t>(len) + 2;
+    }
+    return pos - start;
+}
@@ -0,0 +1,264 @@
+#include "RedisPubSub.h"
+#include <memory>
+#include "RedisResp.h"
+
+RedisPubSub& RedisPubSub::getInstance()
+{
+    static RedisPubSub instance;
+    return instance;
+}
+
+//the part of a pattern before its first glob character
+static std::string literalPrefix(const std::string& pattern)
+{
+    size_t end = pattern.find_first_of("*?[\\");
+    return pattern.substr(0, end == std::string::npos ? pattern.size() : end);
+}
+
+void RedisPubSub::confirm(RedisClient& client, const char* kind, const std::string& name)
+{
+    //caller holds pubsub_mutex
+    std::string out = "*3\r\n";
+    respAppendBulk(out, kind);
+    respAppendBulk(out, name);
+    out += ":" + std::to_string(client.channels.size() + client.patterns.size()) + "\r\n";
+    client.reply(std::move(out));
+}
+
+void RedisPubSub::subscribe(RedisClient& client, const std::vector<std::string>& names)
+{
+    std::lock_guard<std::mutex> lock(pubsub_mutex);
+    for (const auto& channel : names) {
+        if (client.channels.insert(channel).second) {
+            channels[channel].insert(&client);
+        }
+        client.subscriptions = client.channels.size() + client.patterns.size();
+        confirm(client, "subscribe", channel);
+    }
+}
+
+void RedisPubSub::unsubscribeChannel(RedisClient& client, const std::string& channel)
+{
+    if (client.channels.erase(channel) == 0) return;
+
+    auto it = channels.find(channel);
+    if (it == channels.end()) return;
+    it->second.erase(&client);
+    if (it->second.empty()) channels.erase(it);
+}
+
+void RedisPubSub::unsubscribe(RedisClient& client, const std::vector<std::string>& names)
+{
+    std::lock_guard<std::mutex> lock(pubsub_mutex);
+
+    //no arguments: drop every channel subscription
+    std::vector<std::string> targets = names;
+    if (targets.empty()) targets.assign(client.channels.begin(), client.channels.end());
+
+    if (targets.empty()) {
+        std::string out = "*3\r\n";
+        respAppendBulk(out, "unsubscribe");
+        out += "$-1\r\n:" + std::to_string(client.patterns.size()) + "\r\n";
+        client.reply(std::move(out));
+        return;
+    }
+
+    for (const auto& channel : targets) {
+        unsubscribeChannel(client, channel);
+        client.subscriptions = client.channels.size() + client.patterns.size();
+        confirm(client, "unsubscribe", channel);
+    }
+}
+
+void RedisPubSub::psubscribe(RedisClient& client, const std::vector<std::string>& names)
+{
+    std::lock_guard<std::mutex> lock(pubsub_mutex);
+    for (const auto& pattern : names) {
+        if (client.patterns.insert(pattern).second) {
+            std::string prefix = literalPrefix(pattern);
+            auto& byPattern = patterns_by_prefix[prefix];
+            auto& subscribers = byPattern[pattern];
+            if (subscribers.empty()) ++prefix_lengths[prefix.size()];
+            subscribers.insert(&client);
+        }
+        client.subscriptions = client.channels.size() + client.patterns.size();
+        confirm(client, "psubscribe", pattern);
+    }
+}
+
+void RedisPubSub::unsubscribePattern(RedisClient& client, const std::string& pattern)
+{
+    if (client.patterns.erase(pattern) == 0) return;
+
+    std::string prefix = literalPrefix(pattern);
+    auto byPrefix = patterns_by_prefix.find(prefix);
+    if (byPrefix == patterns_by_prefix.end()) return;
+
+    auto byPattern = byPrefix->second.find(pattern);
+    if (byPattern == byPrefix->second.end()) return;
+
+    byPattern->second.erase(&client);
+    if (!byPattern->second.empty()) return;
+
+    byPrefix->second.erase(byPattern);
+    if (byPrefix->second.empty()) patterns_by_prefix.erase(byPrefix);
+
+    auto len = prefix_lengths.find(prefix.size());
+    if (len != prefix_lengths.end() && --len->second == 0) prefix_lengths.erase(len);
+}
+
+void RedisPubSub::punsubscribe(RedisClient& client, const std::vector<std::string>& names)
+{
+    std::lock_guard<std::mutex> lock(pubsub_mutex);
+
+    std::vector<std::string> targets = names;
+    if (targets.empty()) targets.assign(client.patterns.begin(), client.patterns.end());
+
+    if (targets.empty()) {
+        std::string out = "*3\r\n";
+        respAppendBulk(out, "punsubscribe");
+        out += "$-1\r\n:" + std::to_string(client.channels.size()) + "\r\n";
+        client.reply(std::move(out));
+        return;
+    }
+
+    for (const auto& pattern : targets) {
+        unsubscribePattern(client, pattern);
+        client.subscriptions = client.channels.size() + client.patterns.size();
+        confirm(client, "punsubscribe", pattern);
+    }
+}
+
+void RedisPubSub::removeClient(RedisClient& client)
+{
+    std::lock_guard<std::mutex> lock(pubsub_mutex);
+    std::vector<std::string> names(client.channels.begin(), client.channels.end());
+    for (const auto& channel : names) unsubscribeChannel(client, channel);
+
+    names.assign(client.patterns.begin(), client.patterns.end());
+    for (const auto& pattern : names) unsubscribePattern(client, pattern);
+    client.subscriptions = 0;
+}
+
+size_t RedisPubSub::publish(const std::string& channel, const std::string& message)
+{
+    std::lock_guard<std::mutex> lock(pubsub_mutex);
+    size_t receivers = 0;
+
+    auto it = channels.find(channel);
+    if (it != channels.end()) {
+        std::string out = "*3\r\n";
+        respAppendBulk(out, "message");
+        respAppendBulk(out, channel);
+        respAppendBulk(out, message);
+        auto buffer = std::make_shared<const std::string>(std::move(out));
+
+        for (RedisClient* client : it->second) {
+            if (client->push(buffer)) ++receivers;
+        }
+    }
+
+    //only prefixes of lengths some pattern actually uses are looked up
+    for (const auto& len : prefix_lengths) {
+        if (len.first > channel.size()) break;
+
+        auto byPrefix = patterns_by_prefix.find(channel.substr(0, len.first));
+        if (byPrefix == patterns_by_prefix.end()) continue;
+
+        for (const auto& entry : byPrefix->second) {
+            if (!globMatch(entry.first, channel)) continue;
+
+            std::string out = "*4\r\n";
+            respAppendBulk(out, "pmessage");
+            respAppendBulk(out, entry.first);
+            respAppendBulk(out, channel);
+            respAppendBulk(out, message);
+            auto buffer = std::make_shared<const std::string>(std::move(out));
+
+            for (RedisClient* client : entry.second) {
+                if (client->push(buffer)) ++receivers;
+            }
+        }
+    }
+    return receivers;
+}
+
+//Match a [...] class starting at pattern[p] == '['. Sets next to the index just past
+//the closing ']' (or the end of the pattern when it is unterminated).
+static bool matchClass(const std::string& pattern, size_t p, char c, size_t& next)
+{
+    size_t i = p + 1;
+    bool negate = false;
+    if (i < pattern.size() && pattern[i] == '^') {
+        negate = true;
+        ++i;
+    }
+
+    bool matched = false;
+    while (i < pattern.size() && pattern[i] != ']') {
+        if (pattern[i] == '\\' && i + 1 < pattern.size()) {
+            ++i;
+            if (pattern[i] == c) matched = true;
+            ++i;
+        } else if (i + 2 < pattern.size() && pattern[i + 1] == '-' && pattern[i + 2] != ']') {
+            char lo = pattern[i], hi = pattern[i + 2];
+            if (lo > hi) std::swap(lo, hi);
+            if (c >= lo && c <= hi) matched = true;
+            i += 3;
+        } else {
+            if (pattern[i] == c) matched = true;
+            ++i;
+        }
+    }
+    next = (i < pattern.size()) ? i + 1 : i;
+    return negate ? !matched : matched;
+}
+
+bool globMatch(const std::string& pattern, const std::string& str)
+{
+    size_t p = 0, s = 0;
+    size_t starP = std::string::npos, starS = 0;
+
+    while (s < str.size()) {
+        if (p < pattern.size()) {
+            char c = pattern[p];
+            if (c == '*') {
+                //remember the star and first try matching it against nothing
+                starP = p++;
+                starS = s;
+                continue;
+            }
+            if (c == '?') {
+                ++p;
+                ++s;
+                continue;
+            }
+            if (c == '[') {
+                size_t next;
+                if (matchClass(pattern, p, str[s], next)) {
+                    p = next;
+                    ++s;
+                    continue;
+                }
+            } else {
+                size_t width = 1;
+                if (c == '\\' && p + 1 < pattern.size()) {
+                    c = pattern[p + 1];
+                    width = 2;
+                }
+                if (c == str[s]) {
+                    p += width;
+                    ++s;
+                    continue;
+                }
+            }
+        }
+        //mismatch: let the last star swallow one more character
+        if (starP == std::string::npos) return false;
+        p = starP + 1;
+        s = ++starS;
+    }
+
+    while (p < pattern.size() && pattern[p] == '*') ++p;
+    return p == pattern.size();
+}
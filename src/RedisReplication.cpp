@@ -0,0 +1,626 @@
+#include "RedisReplication.h"
+#include "RedisAof.h"
+#include "RedisCommandHandler.h"
+#include "RedisDatabase.h"
+#include "RedisNet.h"
+#include "RedisResp.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const std::string SNAPSHOT_FILE = "dump.my_rdb";
+//the master PINGs its replicas this often, so they can tell a quiet master from a dead one
+static const auto REPL_PING_PERIOD = std::chrono::seconds(10);
+//a replica drops the link after this long without a byte from the master
+static const int REPL_TIMEOUT_MS = 60 * 1000;
+//the stream held back for a replica while its snapshot is sent, at most; as the
+//replica output buffer limit (RedisClient.cpp)
+static const size_t REPL_PENDING_LIMIT = 256 * 1024 * 1024;
+static const size_t SYNC_CHUNK = 64 * 1024;
+
+RedisReplication& RedisReplication::getInstance()
+{
+    static RedisReplication instance;
+    return instance;
+}
+
+RedisReplication::RedisReplication()
+{
+    newReplid();
+    cron_thread = std::thread([this]() { cronLoop(); });
+}
+
+RedisReplication::~RedisReplication()
+{
+    {
+        std::lock_guard<std::mutex> lock(repl_mutex);
+        stopping = true;
+        ++link_generation;
+        if(link_fd >= 0) ::shutdown(link_fd, SHUT_RDWR);
+    }
+    repl_cv.notify_all();
+    if(cron_thread.joinable()) cron_thread.join();
+    if(link_thread.joinable()) link_thread.join();
+}
+
+void RedisReplication::newReplid()
+{
+    static const char HEX[] = "0123456789abcdef";
+    std::random_device seed;
+    std::mt19937_64 random(seed());
+    replid.clear();
+    for(int i = 0; i < 40; ++i) replid += HEX[random() & 15];
+}
+
+// MASTER SIDE
+
+void RedisReplication::createBacklog()
+{
+    if(!backlog.empty()) return;
+    backlog.assign(std::max<size_t>(backlog_size, 1), '\0');
+    backlog_idx = 0;
+    backlog_histlen = 0;
+    feeding = master_host.empty();
+}
+
+void RedisReplication::feed(const std::vector<std::string>& argv)
+{
+    if(!feeding) return;
+    std::string bytes;
+    respAppendArrayHeader(bytes, argv.size());
+    for(const auto& arg : argv) respAppendBulk(bytes, arg);
+    std::lock_guard<std::mutex> lock(repl_mutex);
+    if(feeding) appendStream(std::move(bytes));
+}
+
+void RedisReplication::appendStream(std::string bytes)
+{
+    if(backlog.empty()) createBacklog();
+    auto shared = std::make_shared<const std::string>(std::move(bytes));
+
+    //into the ring, over the oldest history
+    const char* p = shared->data();
+    size_t left = shared->size();
+    if(left > backlog.size()) {
+        p += left - backlog.size();
+        left = backlog.size();
+    }
+    while(left > 0) {
+        size_t n = std::min(left, backlog.size() - backlog_idx);
+        std::memcpy(&backlog[backlog_idx], p, n);
+        backlog_idx = (backlog_idx + n) % backlog.size();
+        p += n;
+        left -= n;
+    }
+    backlog_histlen = std::min<uint64_t>(backlog_histlen + shared->size(), backlog.size());
+    master_offset += shared->size();
+
+    for(auto& replica : replicas) {
+        if(replica->state == Replica::State::Online) {
+            replica->client->push(shared);
+        } else if(replica->state == Replica::State::Snapshot) {
+            replica->pending += *shared;
+            if(replica->pending.size() > REPL_PENDING_LIMIT) {
+                replica->client->disconnect("replica output buffer limit reached");
+                replica->state = Replica::State::Handshake;
+                std::string().swap(replica->pending);
+            }
+        }
+    }
+}
+
+bool RedisReplication::canContinue(const std::string& id, long long offset) const
+{
+    if(backlog.empty() || offset < 0) return false;
+    uint64_t wanted = static_cast<uint64_t>(offset);
+    if(id != replid && (replid2.empty() || id != replid2 || wanted > second_offset)) return false;
+    return wanted >= master_offset - backlog_histlen + 1 && wanted <= master_offset + 1;
+}
+
+void RedisReplication::backlogFrom(uint64_t offset, std::string& out) const
+{
+    uint64_t skip = offset - (master_offset - backlog_histlen + 1);
+    uint64_t left = backlog_histlen - skip;
+    size_t at = static_cast<size_t>((backlog_idx + backlog.size() - backlog_histlen + skip) % backlog.size());
+    while(left > 0) {
+        size_t n = static_cast<size_t>(std::min<uint64_t>(left, backlog.size() - at));
+        out.append(&backlog[at], n);
+        at = (at + n) % backlog.size();
+        left -= n;
+    }
+}
+
+std::shared_ptr<RedisReplication::Replica> RedisReplication::addReplica(RedisClient& client)
+{
+    for(auto& replica : replicas) {
+        if(replica->client == &client) return replica;
+    }
+    auto replica = std::make_shared<Replica>();
+    replica->client = &client;
+    replica->address = peerName(client.fd());
+    replicas.push_back(replica);
+    client.replica = true;
+    return replica;
+}
+
+std::string RedisReplication::psync(RedisClient& client, const std::string& id, const std::string& offsetArg, bool withHeader)
+{
+    char* end = nullptr;
+    long long offset = std::strtoll(offsetArg.c_str(), &end, 10);
+    if(offsetArg.empty() || *end != '\0')
+        return "-ERR value is not an integer or out of range\r\n";
+    std::string peer = peerName(client.fd());
+
+    {
+        //the reply and the backlog are queued under repl_mutex, ahead of any write fed after them
+        std::lock_guard<std::mutex> lock(repl_mutex);
+        if(withHeader && canContinue(id, offset)) {
+            auto replica = addReplica(client);
+            std::string reply = "+CONTINUE " + replid + "\r\n";
+            size_t header = reply.size();
+            backlogFrom(static_cast<uint64_t>(offset), reply);
+            std::cout << "Partial resynchronization request from " << peer << " accepted, sending "
+                      << (reply.size() - header) << " bytes of backlog\n";
+            client.reply(std::move(reply));
+            replica->state = Replica::State::Online;
+            return "";
+        }
+    }
+
+    //Full resync: a snapshot, taken at the offset the replica continues from
+    std::cout << "Full resync requested by replica " << peer << "\n";
+    static std::atomic<unsigned> syncs{0};
+    std::string path = SNAPSHOT_FILE + ".sync." + std::to_string(::getpid()) + "." + std::to_string(syncs++);
+    std::shared_ptr<Replica> replica;
+    std::string startId;
+    uint64_t startOffset = 0;
+    bool ok = RedisDatabase::getInstance().dumpForSync(path, [&]() {
+        std::lock_guard<std::mutex> lock(repl_mutex);
+        createBacklog();
+        replica = addReplica(client);
+        replica->state = Replica::State::Snapshot;
+        replica->pending.clear();
+        startId = replid;
+        startOffset = master_offset;
+    });
+    int fd = ok ? ::open(path.c_str(), O_RDONLY | O_CLOEXEC) : -1;
+    ::unlink(path.c_str());
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0) {
+        if(fd >= 0) ::close(fd);
+        std::lock_guard<std::mutex> lock(repl_mutex);
+        if(replica) replica->state = Replica::State::Handshake;
+        std::cerr << "Cannot write the snapshot for replica " << peer << "\n";
+        return "-ERR Cannot write the snapshot for replication\r\n";
+    }
+
+    std::string header;
+    if(withHeader) header = "+FULLRESYNC " + startId + " " + std::to_string(startOffset) + "\r\n";
+    header += "$" + std::to_string(st.st_size) + "\r\n";
+    client.reply(std::move(header));
+
+    //the file is already unlinked; the stream owns the descriptor
+    auto file = std::shared_ptr<int>(new int(fd), [](int* descriptor) { ::close(*descriptor); delete descriptor; });
+    RedisClient* target = &client;
+    client.setStream([this, file, replica, target, peer](std::string& out) {
+        char buffer[SYNC_CHUNK];
+        ssize_t n;
+        do {
+            n = ::read(*file, buffer, sizeof(buffer));
+        } while(n < 0 && errno == EINTR);
+        if(n > 0) {
+            out.append(buffer, static_cast<size_t>(n));
+            return true;
+        }
+        if(n < 0) {
+            target->disconnect("cannot read the snapshot for replication");
+            return false;
+        }
+        //the snapshot is through: the writes since follow, then the live stream
+        std::lock_guard<std::mutex> lock(repl_mutex);
+        out += replica->pending;
+        std::string().swap(replica->pending);
+        replica->state = Replica::State::Online;
+        std::cout << "Synchronization with replica " << peer << " succeeded\n";
+        return false;
+    });
+    return "";
+}
+
+std::string RedisReplication::replconf(RedisClient& client, const std::vector<std::string>& tokens)
+{
+    if(tokens.size() < 3 || tokens.size() % 2 == 0)
+        return "-ERR syntax error\r\n";
+    std::lock_guard<std::mutex> lock(repl_mutex);
+    for(size_t i = 1; i < tokens.size(); i += 2) {
+        std::string option = tokens[i];
+        std::transform(option.begin(), option.end(), option.begin(), ::tolower);
+        if(option == "listening-port") {
+            char* end = nullptr;
+            long port = std::strtol(tokens[i + 1].c_str(), &end, 10);
+            if(tokens[i + 1].empty() || *end != '\0' || port < 0 || port > 65535)
+                return "-ERR value is not an integer or out of range\r\n";
+            addReplica(client)->listeningPort = static_cast<int>(port);
+        } else if(option == "ack") {
+            //acknowledgements get no reply
+            uint64_t offset = std::strtoull(tokens[i + 1].c_str(), nullptr, 10);
+            for(auto& replica : replicas) {
+                if(replica->client != &client) continue;
+                replica->ackOffset = std::max(replica->ackOffset, offset);
+                replica->ackTime = std::chrono::steady_clock::now();
+            }
+            ack_cv.notify_all();
+            return "";
+        } else if(option == "getack") {
+            return "";
+        } else if(option != "capa") {
+            return "-ERR Unrecognized REPLCONF option: " + tokens[i] + "\r\n";
+        }
+    }
+    return "+OK\r\n";
+}
+
+void RedisReplication::removeClient(RedisClient& client)
+{
+    std::lock_guard<std::mutex> lock(repl_mutex);
+    auto gone = std::find_if(replicas.begin(), replicas.end(),
+                             [&client](const std::shared_ptr<Replica>& replica) { return replica->client == &client; });
+    if(gone == replicas.end()) return;
+    std::cout << "Connection with replica " << (*gone)->address << ":" << (*gone)->listeningPort << " lost\n";
+    replicas.erase(gone);
+}
+
+size_t RedisReplication::wait(size_t numReplicas, long long timeoutMs, const std::function<bool()>& abandoned)
+{
+    std::unique_lock<std::mutex> lock(repl_mutex);
+    uint64_t target = master_offset;
+    auto acked = [&]() {
+        size_t count = 0;
+        for(const auto& replica : replicas) {
+            if(replica->state == Replica::State::Online && replica->ackOffset >= target) ++count;
+        }
+        return count;
+    };
+    if(acked() >= numReplicas) return acked();
+
+    if(feeding) {
+        std::string getack;
+        respAppendArrayHeader(getack, 3);
+        respAppendBulk(getack, "REPLCONF");
+        respAppendBulk(getack, "GETACK");
+        respAppendBulk(getack, "*");
+        appendStream(std::move(getack));
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while(acked() < numReplicas && !abandoned()) {
+        //wake up now and then to notice a client that went away
+        auto wake = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+        if(timeoutMs > 0) {
+            if(std::chrono::steady_clock::now() >= deadline) break;
+            wake = std::min(wake, deadline);
+        }
+        ack_cv.wait_until(lock, wake);
+    }
+    return acked();
+}
+
+RedisReplication::Status RedisReplication::status()
+{
+    std::lock_guard<std::mutex> lock(repl_mutex);
+    auto now = std::chrono::steady_clock::now();
+    auto secondsSince = [now](std::chrono::steady_clock::time_point then) {
+        return static_cast<int64_t>(std::chrono::duration_cast<std::chrono::seconds>(now - then).count());
+    };
+    Status status;
+    status.replica = replica_role;
+    status.masterHost = master_host;
+    status.masterPort = master_port;
+    status.linkState = link_state;
+    status.lastIoSecondsAgo = link_last_io == std::chrono::steady_clock::time_point{} ? -1 : secondsSince(link_last_io);
+    status.readOnly = read_only;
+    status.replid = replid;
+    status.replid2 = replid2.empty() ? std::string(40, '0') : replid2;
+    status.offset = master_offset;
+    status.secondOffset = replid2.empty() ? 0 : second_offset;
+    status.backlogActive = !backlog.empty();
+    status.backlogSize = backlog_size;
+    status.backlogFirstByte = backlog.empty() ? 0 : master_offset - backlog_histlen + 1;
+    status.backlogHistlen = backlog_histlen;
+    for(const auto& replica : replicas) {
+        const char* state = replica->state == Replica::State::Online ? "online" :
+                            replica->state == Replica::State::Snapshot ? "send_bulk" : "handshake";
+        status.replicas.push_back({replica->address, replica->listeningPort, state, replica->ackOffset,
+                                   secondsSince(replica->ackTime)});
+    }
+    return status;
+}
+
+void RedisReplication::cronLoop()
+{
+    RedisDatabase& db = RedisDatabase::getInstance();
+    std::unique_lock<std::mutex> lock(repl_mutex);
+    while(!stopping) {
+        repl_cv.wait_for(lock, REPL_PING_PERIOD, [this]() { return stopping; });
+        if(stopping) break;
+        bool ping = feeding && !replicas.empty();
+        lock.unlock();
+        if(ping) {
+            //under db_mutex so the PING never lands inside a MULTI ... EXEC block
+            RedisDatabase::WriteScope scope(db);
+            feed({"PING"});
+        }
+        lock.lock();
+    }
+}
+
+// REPLICA SIDE
+
+void RedisReplication::replicaOf(const std::string& host, int port)
+{
+    //one REPLICAOF at a time
+    static std::mutex switching;
+    std::lock_guard<std::mutex> serial(switching);
+
+    std::thread previous;
+    {
+        std::lock_guard<std::mutex> lock(repl_mutex);
+        if(host == master_host && port == master_port) return;
+        ++link_generation;
+        if(link_fd >= 0) ::shutdown(link_fd, SHUT_RDWR);
+        previous = std::move(link_thread);
+    }
+    repl_cv.notify_all();
+    if(previous.joinable()) previous.join();
+
+    std::lock_guard<std::mutex> lock(repl_mutex);
+    if(host.empty()) {
+        //promoted: a new history starts here, and the old one stays valid up to now
+        replid2 = replid;
+        second_offset = master_offset + 1;
+        newReplid();
+        master_host.clear();
+        master_port = 0;
+        feeding = !backlog.empty();
+        replica_role = false;
+        link_state = "connect";
+        link_last_io = {};
+        std::cout << "MASTER MODE enabled, replication ID " << replid << "\n";
+        return;
+    }
+    master_host = host;
+    master_port = port;
+    feeding = false;
+    replica_role = true;
+    std::cout << "REPLICAOF " << host << ":" << port << " enabled\n";
+    link_thread = std::thread(&RedisReplication::linkLoop, this, host, port, link_generation);
+}
+
+bool RedisReplication::linkCurrent(uint64_t generation)
+{
+    std::lock_guard<std::mutex> lock(repl_mutex);
+    return generation == link_generation && !stopping;
+}
+
+//The $<size> payload after +FULLRESYNC: written to a file next to the dump, then
+//loaded in place of the dataset
+bool RedisReplication::fullSync(int fd, std::string& in, const std::string& id, uint64_t offset)
+{
+    std::string line;
+    if(!readLine(fd, in, line, REPL_TIMEOUT_MS) || line.empty() || line[0] != '$') return false;
+    char* end = nullptr;
+    long long size = std::strtoll(line.c_str() + 1, &end, 10);
+    if(*end != '\0' || size < 0) return false;
+    std::cout << "MASTER <-> REPLICA sync: receiving " << size << " bytes from master\n";
+
+    std::string received = SNAPSHOT_FILE + ".sync." + std::to_string(::getpid());
+    int out = ::open(received.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(out < 0) {
+        std::cerr << "Cannot open " << received << ": " << std::strerror(errno) << "\n";
+        return false;
+    }
+    auto writeAll = [out](const char* p, size_t n) {
+        while(n > 0) {
+            ssize_t written = ::write(out, p, n);
+            if(written < 0 && errno == EINTR) continue;
+            if(written <= 0) return false;
+            p += written;
+            n -= static_cast<size_t>(written);
+        }
+        return true;
+    };
+    uint64_t left = static_cast<uint64_t>(size);
+    bool ok = true;
+    while(ok && left > 0) {
+        if(in.empty() && receive(fd, in, REPL_TIMEOUT_MS) <= 0) {
+            ok = false;
+            break;
+        }
+        size_t n = static_cast<size_t>(std::min<uint64_t>(left, in.size()));
+        ok = writeAll(in.data(), n);
+        in.erase(0, n);
+        left -= n;
+    }
+    ::close(out);
+    if(!ok) {
+        ::unlink(received.c_str());
+        std::cerr << "MASTER <-> REPLICA sync: transfer failed\n";
+        return false;
+    }
+
+    {
+        //our replicas hold the old dataset: they have to start over as well
+        std::lock_guard<std::mutex> lock(repl_mutex);
+        for(auto& replica : replicas) replica->client->disconnect("master dataset replaced by a full resync");
+    }
+    RedisDatabase& db = RedisDatabase::getInstance();
+    db.setLoading(true);
+    ok = db.loadSyncSnapshot(received, SNAPSHOT_FILE);
+    db.setLoading(false);
+    if(!ok) {
+        ::unlink(received.c_str());
+        std::cerr << "MASTER <-> REPLICA sync: failed to load the snapshot\n";
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(repl_mutex);
+        replid = id;
+        replid2.clear();
+        second_offset = 0;
+        master_offset = offset;
+        createBacklog();
+        backlog_idx = 0;
+        backlog_histlen = 0;
+    }
+    //the AOF still describes the old dataset
+    RedisAof& aof = RedisAof::getInstance();
+    if(aof.isOpen() && !aof.rewriteInBackground())
+        std::cerr << "MASTER <-> REPLICA sync: could not start an AOF rewrite\n";
+    std::cout << "MASTER <-> REPLICA sync: finished with success\n";
+    return true;
+}
+
+void RedisReplication::linkLoop(std::string host, int port, uint64_t generation)
+{
+    RedisDatabase& db = RedisDatabase::getInstance();
+    RedisCommandHandler handler;
+    //a partial resync may resume inside a MULTI block, so the client applying the
+    //stream outlives a connection; a full resync starts a new one
+    auto newApplier = []() {
+        auto client = std::make_unique<RedisClient>(-1);
+        client->master_link = true;
+        return client;
+    };
+    auto applier = newApplier();
+    auto setLinkState = [this](const char* state) {
+        std::lock_guard<std::mutex> lock(repl_mutex);
+        link_state = state;
+        link_last_io = std::chrono::steady_clock::now();
+    };
+
+    auto sendAck = [this](int fd) {
+        uint64_t offset;
+        {
+            std::lock_guard<std::mutex> lock(repl_mutex);
+            offset = master_offset;
+        }
+        return sendCommand(fd, {"REPLCONF", "ACK", std::to_string(offset)});
+    };
+
+    auto serve = [&](int fd) {
+        std::string in, line;
+        if(!sendCommand(fd, {"PING"}) || !readLine(fd, in, line, REPL_TIMEOUT_MS)) return;
+        if(line.empty() || line[0] == '-') {
+            std::cerr << "Master answered PING with " << line << "\n";
+            return;
+        }
+        if(!sendCommand(fd, {"REPLCONF", "listening-port", std::to_string(listening_port)}) ||
+           !readLine(fd, in, line, REPL_TIMEOUT_MS))
+            return;
+
+        std::string id;
+        uint64_t offset;
+        {
+            std::lock_guard<std::mutex> lock(repl_mutex);
+            id = replid;
+            offset = master_offset;
+        }
+        //the master may write a whole snapshot before it answers
+        setLinkState("sync");
+        if(!sendCommand(fd, {"PSYNC", id, std::to_string(offset + 1)}) || !readLine(fd, in, line, -1)) return;
+        if(line.compare(0, 12, "+FULLRESYNC ") == 0) {
+            std::istringstream reply(line.substr(12));
+            if(!(reply >> id >> offset) || !fullSync(fd, in, id, offset)) return;
+            applier = newApplier();
+        } else if(line.compare(0, 9, "+CONTINUE") == 0) {
+            std::string newId = line.size() > 10 ? line.substr(10) : "";
+            std::lock_guard<std::mutex> lock(repl_mutex);
+            if(!newId.empty() && newId != replid) {
+                replid2 = replid;
+                second_offset = master_offset + 1;
+                replid = newId;
+            }
+            std::cout << "Successful partial resynchronization with master at offset " << master_offset << "\n";
+        } else {
+            std::cerr << "Unexpected reply to PSYNC from master: " << line << "\n";
+            return;
+        }
+
+        //the stream: apply each command, then count it and pass it on
+        setLinkState("connected");
+        auto lastData = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point lastAck{};
+        std::vector<std::string> argv;
+        while(true) {
+            size_t used = 0, n;
+            while((n = parseCommand(in, used, argv)) != 0 && n != std::string::npos) {
+                std::string raw = in.substr(used, n);
+                used += n;
+                std::string name = argv.empty() ? "" : argv[0];
+                std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+                if(name == "REPLCONF") {
+                    //GETACK: the offset up to, not including, this command
+                    if(!sendAck(fd)) return;
+                    lastAck = std::chrono::steady_clock::now();
+                    std::lock_guard<std::mutex> lock(repl_mutex);
+                    appendStream(std::move(raw));
+                    continue;
+                }
+                RedisDatabase::ExecLock exec(db);
+                if(!argv.empty()) handler.applyReplicated(argv, *applier);
+                std::lock_guard<std::mutex> lock(repl_mutex);
+                appendStream(std::move(raw));
+            }
+            if(n == std::string::npos) {
+                std::cerr << "Protocol error in the replication stream\n";
+                return;
+            }
+            in.erase(0, used);
+
+            auto now = std::chrono::steady_clock::now();
+            if(now - lastAck >= std::chrono::seconds(1)) {
+                if(!sendAck(fd)) return;
+                lastAck = now;
+            }
+            int got = receive(fd, in, 1000);
+            if(got < 0) {
+                std::cout << "Connection with master lost\n";
+                return;
+            }
+            if(got > 0) {
+                lastData = now;
+                std::lock_guard<std::mutex> lock(repl_mutex);
+                link_last_io = now;
+            } else if(now - lastData > std::chrono::milliseconds(REPL_TIMEOUT_MS)) {
+                std::cerr << "MASTER timeout: no data nor PING received\n";
+                return;
+            }
+        }
+    };
+
+    while(linkCurrent(generation)) {
+        std::cout << "Connecting to MASTER " << host << ":" << port << "\n";
+        setLinkState("connecting");
+        int fd = connectTo(host, port);
+        if(fd >= 0) {
+            {
+                std::lock_guard<std::mutex> lock(repl_mutex);
+                if(generation == link_generation) link_fd = fd;
+            }
+            if(linkCurrent(generation)) serve(fd);
+            std::lock_guard<std::mutex> lock(repl_mutex);
+            if(link_fd == fd) link_fd = -1;
+            ::close(fd);
+        }
+        std::unique_lock<std::mutex> lock(repl_mutex);
+        if(generation == link_generation) link_state = "connect";
+        repl_cv.wait_for(lock, std::chrono::seconds(1), [&]() { return generation != link_generation || stopping; });
+    }
+}
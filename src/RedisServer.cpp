@@ -1,6 +1,10 @@
 #include "RedisServer.h"
+#include "RedisAof.h"
 #include "RedisCommandHandler.h"
 #include "RedisDatabase.h"
+#include "RedisPubSub.h"
+#include "RedisReplication.h"
+#include "RedisStats.h"
 #include <cerrno>
 #include <cstring>
 #include <fcntl.h>
@@ -60,12 +64,17 @@ void RedisServer::shutdown()
 {
     running = false;
     
-    if(RedisDatabase::getInstance().dump("dump.my_rdb")){
+    //a dump taken mid-load would replace the file with part of the dataset
+    if(RedisDatabase::getInstance().loading()) {
+        std::cerr << "Still loading, not dumping the database.\n";
+    }
+    else if(RedisDatabase::getInstance().dump("dump.my_rdb", true)){
         std::cout <<"Database dumped to dump.my_rdb\n";
     }
     else {
         std::cerr << "Error dumping database. \n";
     }
+    RedisAof::getInstance().close();
 
     if (server_socket != INVALID_SOCK) {
         close(server_socket);
@@ -157,15 +166,39 @@ void RedisServer::run()
         }
 
         threads.emplace_back([client_socket, &cmdHandler](){
+            RedisClient client(client_socket);
+            RedisStats& stats = RedisStats::getInstance();
+            stats.clientConnected();
             std::string inbuf;
             char buffer[1024];
-            while (true) {
+            while (!client.closing()) {
+                // Wait for input, or for another thread (PUBLISH) to queue output for us
+                struct pollfd pfds[2];
+                pfds[0].fd = client_socket;
+                pfds[0].events = POLLIN;
+                pfds[0].revents = 0;
+                pfds[1].fd = client.wakeFd();
+                pfds[1].events = POLLIN;
+                pfds[1].revents = 0;
+                if (poll(pfds, 2, -1) < 0) {
+                    if (errno == EINTR) continue;
+                    break;
+                }
+
+                if (pfds[1].revents & POLLIN) {
+                    client.drainWakeups();
+                    if (!client.flush()) break;
+                }
+                if (!(pfds[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
                 int bytes = recv(client_socket, buffer, sizeof(buffer), 0);
                 if (bytes <= 0) break; // connection closed or error
+                stats.bytesIn(static_cast<size_t>(bytes));
                 inbuf.append(buffer, buffer + bytes);
 
                 // Try to process as many complete commands as available
-                while (true) {
+                bool ok = true;
+                while (ok) {
                     if (inbuf.empty()) break;
                     size_t consume = 0;
                     if (inbuf[0] == '*') {
@@ -178,11 +211,16 @@ void RedisServer::run()
                     }
 
                     std::string request = inbuf.substr(0, consume);
-                    std::string response = cmdHandler.processCommand(request);
-                    (void)send(client_socket, response.c_str(), response.size(), 0);
+                    client.reply(cmdHandler.processCommand(request, client));
+                    ok = client.flush();
                     inbuf.erase(0, consume);
                 }
+                if (!ok) break;
             }
+            RedisPubSub::getInstance().removeClient(client);
+            if (client.replica) RedisReplication::getInstance().removeClient(client);
+            RedisDatabase::getInstance().unwatch(client.watched);
+            stats.clientDisconnected();
             close(client_socket);
         });
     }
@@ -194,12 +232,16 @@ void RedisServer::run()
     }
 
     // beforeShutdown persist the database
-    if(RedisDatabase::getInstance().dump("dump.my_rdb")){
+    if(RedisDatabase::getInstance().loading()) {
+        std::cerr << "Still loading, not dumping the database.\n";
+    }
+    else if(RedisDatabase::getInstance().dump("dump.my_rdb", true)){
         std::cout <<"Database dumped to dump.my_rdb\n";
     }
     else {
         std::cerr << "Error dumping database. \n";
     }
+    RedisAof::getInstance().close();
     
 
     if (server_socket != INVALID_SOCK) {
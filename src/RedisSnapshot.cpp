@@ -0,0 +1,690 @@
+#include "RedisSnapshot.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char SNAPSHOT_MAGIC[] = "MYRDB";
+static const size_t SNAPSHOT_MAGIC_LEN = 5;
+static const uint8_t SNAPSHOT_VERSION = 3;
+
+static const uint8_t OP_EXPIRE_MS = 0xFC;
+static const uint8_t OP_EOF = 0xFF;
+
+static const size_t SNAPSHOT_BUFFER_SIZE = 1 << 20;
+//a section closes at the first record boundary past this many bytes
+static const uint64_t SNAPSHOT_SECTION_BYTES = 4 << 20;
+//strings shorter than this are not worth an attempt at compressing
+static const size_t SNAPSHOT_COMPRESS_MIN = 20;
+//LZF expands at most about 90x: a bigger claimed size means a corrupt file
+static const uint64_t LZF_MAX_EXPANSION = 100;
+//collection sizes come from the file: never trust them for more than this up front
+static const size_t SNAPSHOT_MAX_RESERVE = 1 << 20;
+
+// CRC64
+
+namespace {
+struct Crc64Tables {
+    uint64_t t[8][256];
+
+    Crc64Tables()
+    {
+        const uint64_t poly = 0x95ac9329ac4bc9b5ULL; //0xad93d23594c935a9, reflected
+        for(int i = 0; i < 256; ++i) {
+            uint64_t crc = static_cast<uint64_t>(i);
+            for(int bit = 0; bit < 8; ++bit) {
+                crc = (crc & 1) ? (crc >> 1) ^ poly : crc >> 1;
+            }
+            t[0][i] = crc;
+        }
+        for(int i = 0; i < 256; ++i) {
+            for(int k = 1; k < 8; ++k) {
+                t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+            }
+        }
+    }
+};
+}
+
+uint64_t crc64(uint64_t crc, const void* data, size_t len)
+{
+    static const Crc64Tables tables;
+    const auto& t = tables.t;
+    const auto* p = static_cast<const unsigned char*>(data);
+
+    //eight bytes per step, one table lookup per byte, no dependency between lookups
+    while(len >= 8) {
+        uint64_t word;
+        std::memcpy(&word, p, 8);
+        crc ^= word;
+        crc = t[7][crc & 0xff] ^ t[6][(crc >> 8) & 0xff] ^
+              t[5][(crc >> 16) & 0xff] ^ t[4][(crc >> 24) & 0xff] ^
+              t[3][(crc >> 32) & 0xff] ^ t[2][(crc >> 40) & 0xff] ^
+              t[1][(crc >> 48) & 0xff] ^ t[0][crc >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while(len--) {
+        crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static bool writeAll(int fd, const char* p, size_t n)
+{
+    while(n > 0) {
+        ssize_t written = ::write(fd, p, n);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            return false;
+        }
+        p += written;
+        n -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+// WRITER
+
+SnapshotWriter::SnapshotWriter() = default;
+
+SnapshotWriter::~SnapshotWriter()
+{
+    //never committed: leave the previous snapshot alone
+    if(fd >= 0) {
+        ::close(fd);
+        ::unlink(tmp_path.c_str());
+    }
+}
+
+bool SnapshotWriter::open(const std::string& target)
+{
+    //SAVE, BGSAVE and the shutdown dump may overlap: each writes its own file
+    static std::atomic<unsigned> sequence{0};
+    path = target;
+    tmp_path = target + ".tmp." + std::to_string(::getpid()) + "." + std::to_string(sequence++);
+    fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) return false;
+    buffer.resize(SNAPSHOT_BUFFER_SIZE);
+
+    reserve(SNAPSHOT_MAGIC_LEN + 1);
+    std::memcpy(buffer.data() + used, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+    used += SNAPSHOT_MAGIC_LEN;
+    putByte(SNAPSHOT_VERSION);
+
+    //the header belongs to no section
+    crc_from = used;
+    section.offset = used;
+    return true;
+}
+
+void SnapshotWriter::openPayload()
+{
+    in_memory = true;
+    used = 0;
+}
+
+std::string SnapshotWriter::payload()
+{
+    putByte(SNAPSHOT_VERSION);
+    putByte(0);
+    putFixed64(crc64(0, buffer.data(), used));
+    return std::string(buffer.data(), used);
+}
+
+bool SnapshotWriter::flushBuffer()
+{
+    if(used == 0 || failed) return !failed;
+    crc = crc64(crc, buffer.data() + crc_from, used - crc_from);
+    if(!writeAll(fd, buffer.data(), used)) failed = true;
+    flushed += used;
+    used = 0;
+    crc_from = 0;
+    return !failed;
+}
+
+void SnapshotWriter::endSection()
+{
+    crc = crc64(crc, buffer.data() + crc_from, used - crc_from);
+    crc_from = used;
+    uint64_t position = flushed + used;
+    section.length = position - section.offset;
+    section.crc = crc;
+    if(section.length > 0) sections.push_back(section);
+
+    section = SectionInfo{};
+    section.offset = position;
+    crc = 0;
+}
+
+void SnapshotWriter::reserve(size_t bytes)
+{
+    if(used + bytes <= buffer.size()) return;
+    //a payload grows its buffer instead
+    if(in_memory) buffer.resize(std::max(buffer.size() * 2, used + bytes));
+    else flushBuffer();
+}
+
+void SnapshotWriter::putByte(uint8_t byte)
+{
+    reserve(1);
+    buffer[used++] = static_cast<char>(byte);
+}
+
+void SnapshotWriter::putVarint(uint64_t value)
+{
+    reserve(10);
+    while(value >= 0x80) {
+        buffer[used++] = static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    buffer[used++] = static_cast<char>(value);
+}
+
+void SnapshotWriter::putFixed64(uint64_t value)
+{
+    reserve(8);
+    for(int i = 0; i < 8; ++i) {
+        buffer[used++] = static_cast<char>(value >> (8 * i));
+    }
+}
+
+void SnapshotWriter::putString(const std::string& value)
+{
+    if(value.size() >= SNAPSHOT_COMPRESS_MIN) {
+        //only keep the result when it saves something
+        scratch.resize(value.size() - 4);
+        size_t packed = lzfCompress(value.data(), value.size(), &scratch[0], scratch.size());
+        if(packed > 0) {
+            putVarint((static_cast<uint64_t>(packed) << 1) | 1);
+            putVarint(value.size());
+            putRaw(scratch.data(), packed);
+            ++stats.strings;
+            stats.rawBytes += value.size();
+            stats.storedBytes += packed;
+            return;
+        }
+    }
+    putVarint(static_cast<uint64_t>(value.size()) << 1);
+    putRaw(value.data(), value.size());
+}
+
+void SnapshotWriter::putRaw(const char* data, size_t len)
+{
+    if(in_memory || len <= buffer.size() / 2) {
+        reserve(len);
+        std::memcpy(buffer.data() + used, data, len);
+        used += len;
+        return;
+    }
+
+    //big values skip the buffer
+    flushBuffer();
+    if(failed) return;
+    crc = crc64(crc, data, len);
+    if(!writeAll(fd, data, len)) failed = true;
+    flushed += len;
+}
+
+void SnapshotWriter::beginRecord(SnapshotType type, const std::string& key, int64_t expireAtMs)
+{
+    if(flushed + used - section.offset >= SNAPSHOT_SECTION_BYTES) endSection();
+    //the counts size the loader's tables; deletions take no room
+    if(type != SnapshotType::Delete) ++section.counts[static_cast<size_t>(type)];
+
+    if(expireAtMs >= 0) {
+        putByte(OP_EXPIRE_MS);
+        putFixed64(static_cast<uint64_t>(expireAtMs));
+    }
+    putByte(static_cast<uint8_t>(type));
+    putString(key);
+}
+
+void SnapshotWriter::writeString(const std::string& key, const std::string& value, int64_t expireAtMs)
+{
+    beginRecord(SnapshotType::String, key, expireAtMs);
+    putString(value);
+}
+
+void SnapshotWriter::writeList(const std::string& key, const std::vector<std::string>& list, int64_t expireAtMs)
+{
+    beginRecord(SnapshotType::List, key, expireAtMs);
+    putVarint(list.size());
+    for(const auto& item : list) putString(item);
+}
+
+void SnapshotWriter::writeHash(const std::string& key, const std::unordered_map<std::string, std::string>& hash, int64_t expireAtMs)
+{
+    beginRecord(SnapshotType::Hash, key, expireAtMs);
+    putVarint(hash.size());
+    for(const auto& entry : hash) {
+        putString(entry.first);
+        putString(entry.second);
+    }
+}
+
+void SnapshotWriter::writeCompressedString(const std::string& key, const std::string& compressed, size_t rawSize, int64_t expireAtMs)
+{
+    beginRecord(SnapshotType::String, key, expireAtMs);
+    putVarint((static_cast<uint64_t>(compressed.size()) << 1) | 1);
+    putVarint(rawSize);
+    putRaw(compressed.data(), compressed.size());
+    ++stats.strings;
+    stats.rawBytes += rawSize;
+    stats.storedBytes += compressed.size();
+}
+
+void SnapshotWriter::writeDelete(const std::string& key)
+{
+    beginRecord(SnapshotType::Delete, key, -1);
+}
+
+bool SnapshotWriter::commit()
+{
+    if(fd < 0) return false;
+
+    //the index: everything from OP_EOF up to the trailer has its own checksum
+    endSection();
+    uint64_t indexOffset = flushed + used;
+    putByte(OP_EOF);
+    putVarint(sections.size());
+    for(const auto& info : sections) {
+        putVarint(info.offset);
+        putVarint(info.length);
+        for(uint64_t count : info.counts) putVarint(count);
+        putFixed64(info.crc);
+    }
+    putFixed64(indexOffset);
+    flushBuffer();
+
+    //the trailer itself is not covered by the checksum
+    char trailer[8];
+    for(int i = 0; i < 8; ++i) trailer[i] = static_cast<char>(crc >> (8 * i));
+    if(!failed && !writeAll(fd, trailer, sizeof(trailer))) failed = true;
+    if(!failed && ::fsync(fd) != 0) failed = true;
+
+    int closed = ::close(fd);
+    fd = -1;
+    if(failed || closed != 0 || ::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        ::unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// READER
+
+static bool readVarint(const char*& p, const char* end, uint64_t& value)
+{
+    value = 0;
+    for(int shift = 0; shift < 64 && p < end; shift += 7) {
+        uint8_t byte = static_cast<uint8_t>(*p++);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if(!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+static bool readFixed64(const char*& p, const char* end, uint64_t& value)
+{
+    if(end - p < 8) return false;
+    value = 0;
+    for(int i = 0; i < 8; ++i) {
+        value |= static_cast<uint64_t>(static_cast<uint8_t>(p[i])) << (8 * i);
+    }
+    p += 8;
+    return true;
+}
+
+SnapshotFile::~SnapshotFile()
+{
+    if(map) munmap(map, length);
+}
+
+bool SnapshotFile::isSnapshot(const std::string& path)
+{
+    int probe = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(probe < 0) return false;
+    char magic[SNAPSHOT_MAGIC_LEN];
+    ssize_t n = ::read(probe, magic, sizeof(magic));
+    ::close(probe);
+    return n == static_cast<ssize_t>(sizeof(magic)) && std::memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) == 0;
+}
+
+bool SnapshotFile::fail(const char* message)
+{
+    if(error_message.empty()) error_message = message;
+    return false;
+}
+
+bool SnapshotFile::open(const std::string& path)
+{
+    int in = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(in < 0) return fail("cannot open snapshot");
+    struct stat st;
+    if(fstat(in, &st) != 0 || st.st_size < static_cast<off_t>(SNAPSHOT_MAGIC_LEN + 1)) {
+        ::close(in);
+        return fail("truncated snapshot");
+    }
+    length = static_cast<uint64_t>(st.st_size);
+    map = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, in, 0);
+    ::close(in);
+    if(map == MAP_FAILED) {
+        map = nullptr;
+        return fail("cannot map snapshot");
+    }
+    //the sections are read by several threads at once: ask for all of it
+    (void)madvise(map, length, MADV_WILLNEED);
+
+    const char* data = static_cast<const char*>(map);
+    if(std::memcmp(data, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0) return fail("not a snapshot file");
+    uint8_t version = static_cast<uint8_t>(data[SNAPSHOT_MAGIC_LEN]);
+    if(version == 1) return openVersion1();
+    if(version == 2 || version == SNAPSHOT_VERSION) return openIndex(version);
+    return fail("unsupported snapshot version");
+}
+
+bool SnapshotFile::openVersion1()
+{
+    //records up to OP_EOF, then a CRC of every byte before it
+    const char* data = static_cast<const char*>(map);
+    if(length < SNAPSHOT_MAGIC_LEN + 1 + 1 + 8) return fail("truncated snapshot");
+    const char* trailer = data + length - 8;
+    Section whole;
+    whole.begin = data + SNAPSHOT_MAGIC_LEN + 1;
+    whole.end = trailer;
+    whole.check_begin = data;
+    whole.check_end = trailer;
+    whole.version = 1;
+    readFixed64(trailer, data + length, whole.crc);
+    file_checksum = whole.crc;
+    parts.push_back(whole);
+    return true;
+}
+
+bool SnapshotFile::openIndex(uint8_t version)
+{
+    const char* data = static_cast<const char*>(map);
+    const char* fileEnd = data + length;
+    const size_t header = SNAPSHOT_MAGIC_LEN + 1;
+    if(length < header + 1 + 16) return fail("truncated snapshot");
+
+    const char* trailer = fileEnd - 16;
+    uint64_t indexOffset, crc;
+    readFixed64(trailer, fileEnd, indexOffset);
+    readFixed64(trailer, fileEnd, crc);
+    if(indexOffset < header || indexOffset >= length - 16) return fail("bad index offset");
+    const char* index = data + indexOffset;
+    const char* indexEnd = fileEnd - 16;
+    if(crc64(0, index, static_cast<size_t>(fileEnd - 8 - index)) != crc) return fail("index checksum mismatch");
+    file_checksum = crc;
+
+    const char* p = index;
+    uint64_t count;
+    if(static_cast<uint8_t>(*p++) != OP_EOF || !readVarint(p, indexEnd, count)) return fail("bad index");
+    parts.reserve(static_cast<size_t>(std::min<uint64_t>(count, SNAPSHOT_MAX_RESERVE)));
+    for(uint64_t i = 0; i < count; ++i) {
+        uint64_t offset, len;
+        Section section;
+        if(!readVarint(p, indexEnd, offset) || !readVarint(p, indexEnd, len) ||
+           !readVarint(p, indexEnd, section.strings) || !readVarint(p, indexEnd, section.lists) ||
+           !readVarint(p, indexEnd, section.hashes) || !readFixed64(p, indexEnd, section.crc))
+            return fail("bad index");
+        if(offset < header || offset > indexOffset || len > indexOffset - offset) return fail("bad index");
+        section.begin = section.check_begin = data + offset;
+        section.end = section.check_end = data + offset + len;
+        section.version = version;
+        parts.push_back(section);
+    }
+    if(p != indexEnd) return fail("bad index");
+    return true;
+}
+
+bool SnapshotFile::verify(const Section& section)
+{
+    return crc64(0, section.check_begin, static_cast<size_t>(section.check_end - section.check_begin)) == section.crc;
+}
+
+bool SectionDecoder::fail(const char* message)
+{
+    if(!error_message) error_message = message;
+    p = end;
+    return false;
+}
+
+bool SectionDecoder::getByte(uint8_t& byte)
+{
+    if(p == end) return fail("truncated snapshot");
+    byte = static_cast<uint8_t>(*p++);
+    return true;
+}
+
+bool SectionDecoder::getVarint(uint64_t& value)
+{
+    return readVarint(p, end, value) || fail("bad length");
+}
+
+bool SectionDecoder::getFixed64(uint64_t& value)
+{
+    return readFixed64(p, end, value) || fail("truncated snapshot");
+}
+
+bool SectionDecoder::getString(std::string& out)
+{
+    uint64_t len;
+    if(!getVarint(len)) return false;
+    bool packed = false;
+    if(compressed_strings) {
+        packed = len & 1;
+        len >>= 1;
+    }
+    if(len > static_cast<uint64_t>(end - p)) return fail("truncated snapshot");
+    if(!packed) {
+        out.assign(p, static_cast<size_t>(len));
+        p += len;
+        return true;
+    }
+
+    uint64_t rawSize;
+    if(!getVarint(rawSize)) return false;
+    if(len > static_cast<uint64_t>(end - p)) return fail("truncated snapshot");
+    if(rawSize > len * LZF_MAX_EXPANSION) return fail("bad compressed string");
+    out.resize(static_cast<size_t>(rawSize));
+    if(lzfDecompress(p, static_cast<size_t>(len), &out[0], out.size()) != rawSize) return fail("bad compressed string");
+    p += len;
+    return true;
+}
+
+bool SectionDecoder::skipString()
+{
+    uint64_t len;
+    if(!getVarint(len)) return false;
+    if(compressed_strings) {
+        bool packed = len & 1;
+        len >>= 1;
+        uint64_t rawSize;
+        if(packed && !getVarint(rawSize)) return false;
+    }
+    if(len > static_cast<uint64_t>(end - p)) return fail("truncated snapshot");
+    p += len;
+    return true;
+}
+
+bool SectionDecoder::next(SnapshotEntry& entry)
+{
+    return header(entry) && body(entry);
+}
+
+bool SectionDecoder::nextKey(SnapshotEntry& entry, const char*& value)
+{
+    if(!header(entry)) return false;
+    value = p;
+
+    uint64_t count;
+    switch(entry.type) {
+    case SnapshotType::String:
+        return skipString();
+    case SnapshotType::List:
+    case SnapshotType::Hash:
+        if(!getVarint(count)) return false;
+        if(entry.type == SnapshotType::Hash) count *= 2;
+        for(uint64_t i = 0; i < count; ++i) {
+            if(!skipString()) return false;
+        }
+        return true;
+    case SnapshotType::Delete:
+        return true;
+    }
+    return fail("unknown record type");
+}
+
+bool SectionDecoder::readValue(const char* value, SnapshotEntry& entry)
+{
+    p = value;
+    return body(entry);
+}
+
+bool SectionDecoder::header(SnapshotEntry& entry)
+{
+    if(p == end) return false;
+
+    uint8_t op;
+    if(!getByte(op)) return false;
+
+    entry.expireAtMs = -1;
+    if(op == OP_EXPIRE_MS) {
+        uint64_t at;
+        if(!getFixed64(at) || !getByte(op)) return false;
+        entry.expireAtMs = static_cast<int64_t>(at);
+    }
+    //version 1 ends its only section with OP_EOF
+    if(op == OP_EOF) {
+        if(p != end) return fail("data after end of snapshot");
+        return false;
+    }
+
+    if(op > static_cast<uint8_t>(SnapshotType::Delete)) return fail("unknown record type");
+    entry.type = static_cast<SnapshotType>(op);
+    return getString(entry.key);
+}
+
+bool SectionDecoder::body(SnapshotEntry& entry)
+{
+    uint64_t count;
+    switch(entry.type) {
+    case SnapshotType::Delete:
+        return true;
+
+    case SnapshotType::String:
+        return getString(entry.str);
+
+    case SnapshotType::List:
+        if(!getVarint(count)) return false;
+        entry.list.clear();
+        entry.list.reserve(static_cast<size_t>(std::min<uint64_t>(count, SNAPSHOT_MAX_RESERVE)));
+        for(uint64_t i = 0; i < count; ++i) {
+            entry.list.emplace_back();
+            if(!getString(entry.list.back())) return false;
+        }
+        return true;
+
+    case SnapshotType::Hash:
+        if(!getVarint(count)) return false;
+        entry.hash.clear();
+        entry.hash.reserve(static_cast<size_t>(std::min<uint64_t>(count, SNAPSHOT_MAX_RESERVE)));
+        for(uint64_t i = 0; i < count; ++i) {
+            std::string field, value;
+            if(!getString(field) || !getString(value)) return false;
+            entry.hash[std::move(field)] = std::move(value);
+        }
+        return true;
+    }
+    return fail("unknown record type");
+}
+
+// DUMP PAYLOADS
+
+bool readPayload(const std::string& payload, SnapshotEntry& entry)
+{
+    if(payload.size() < 2 + 8 + 2) return false;
+    const char* data = payload.data();
+    const char* footer = data + payload.size() - 10;
+    uint16_t version = static_cast<uint8_t>(footer[0]) | (static_cast<uint8_t>(footer[1]) << 8);
+    const char* trailer = footer + 2;
+    uint64_t crc = 0;
+    readFixed64(trailer, data + payload.size(), crc);
+    if(version != SNAPSHOT_VERSION || crc64(0, data, payload.size() - 8) != crc) return false;
+
+    SnapshotFile::Section section{};
+    section.begin = data;
+    section.end = footer;
+    section.version = SNAPSHOT_VERSION;
+    SectionDecoder decoder(section);
+    SnapshotEntry extra;
+    return decoder.next(entry) && entry.type != SnapshotType::Delete && !decoder.next(extra) && decoder.ok();
+}
+
+// MANIFEST
+//
+//  base <checksum, 16 hex digits>
+//  delta <file>
+//  ...
+
+bool SnapshotManifest::read(const std::string& path)
+{
+    int in = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(in < 0) return false;
+    std::string text;
+    char chunk[4096];
+    ssize_t n;
+    while((n = ::read(in, chunk, sizeof(chunk))) > 0) text.append(chunk, static_cast<size_t>(n));
+    ::close(in);
+    if(n < 0) return false;
+
+    base = 0;
+    deltas.clear();
+    bool haveBase = false;
+    size_t pos = 0;
+    while(pos < text.size()) {
+        size_t eol = text.find('\n', pos);
+        if(eol == std::string::npos) return false; //cut short
+        std::string line = text.substr(pos, eol - pos);
+        pos = eol + 1;
+        if(line.compare(0, 5, "base ") == 0 && !haveBase) {
+            char* end = nullptr;
+            base = std::strtoull(line.c_str() + 5, &end, 16);
+            if(line.size() != 5 + 16 || *end != '\0') return false;
+            haveBase = true;
+        } else if(line.compare(0, 6, "delta ") == 0 && haveBase && line.size() > 6) {
+            deltas.push_back(line.substr(6));
+        } else {
+            return false;
+        }
+    }
+    return haveBase;
+}
+
+bool SnapshotManifest::write(const std::string& path) const
+{
+    char hex[17];
+    std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(base));
+    std::string text = std::string("base ") + hex + "\n";
+    for(const auto& delta : deltas) text += "delta " + delta + "\n";
+
+    std::string tmp = path + ".tmp." + std::to_string(::getpid());
+    int out = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(out < 0) return false;
+    bool ok = writeAll(out, text.data(), text.size()) && ::fsync(out) == 0;
+    ok = (::close(out) == 0) && ok;
+    if(!ok || ::rename(tmp.c_str(), path.c_str()) != 0) {
+        ::unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
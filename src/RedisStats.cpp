@@ -0,0 +1,213 @@
+#include "RedisStats.h"
+#include <algorithm>
+#include <cstdio>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+static const auto STATS_SAMPLE_PERIOD = std::chrono::milliseconds(100);
+static const size_t STATS_SAMPLES = 16;
+//mallinfo takes every arena lock, so the sampler looks at the heap this seldom
+static const auto STATS_MEMORY_PERIOD = std::chrono::seconds(1);
+
+struct RedisStats::ThreadCounters {
+    std::atomic<uint64_t> commands{0};
+    std::atomic<uint64_t> net_input{0};
+    std::atomic<uint64_t> net_output{0};
+    std::vector<std::atomic<uint64_t>> calls;
+    std::vector<std::atomic<uint64_t>> usec;
+
+    ThreadCounters() : calls(commandCount()), usec(commandCount()) {}
+};
+
+//registers the thread's counters on first use and hands them over when it exits
+struct RedisStats::ThreadSlot {
+    ThreadCounters counters;
+
+    ThreadSlot()
+    {
+        RedisStats& stats = getInstance();
+        std::lock_guard<std::mutex> lock(stats.stats_mutex);
+        stats.live.push_back(&counters);
+    }
+    ~ThreadSlot()
+    {
+        RedisStats& stats = getInstance();
+        std::lock_guard<std::mutex> lock(stats.stats_mutex);
+        add(stats.retired, counters);
+        for(auto& entry : stats.live) {
+            if(entry != &counters) continue;
+            entry = stats.live.back();
+            stats.live.pop_back();
+            break;
+        }
+    }
+};
+
+//only the owning thread writes a counter: no read-modify-write needed
+static inline void bump(std::atomic<uint64_t>& counter, uint64_t by)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+}
+
+RedisStats& RedisStats::getInstance()
+{
+    static RedisStats instance;
+    return instance;
+}
+
+RedisStats::RedisStats()
+{
+    retired.perCommand.resize(commandCount());
+    samples.resize(STATS_SAMPLES);
+    sampleMemory();
+    sampler_thread = std::thread([this]() { samplerLoop(); });
+}
+
+RedisStats::~RedisStats()
+{
+    {
+        std::lock_guard<std::mutex> lock(sample_mutex);
+        stopping = true;
+    }
+    sample_cv.notify_all();
+    if(sampler_thread.joinable()) sampler_thread.join();
+}
+
+RedisStats::ThreadCounters& RedisStats::local()
+{
+    static thread_local ThreadSlot slot;
+    return slot.counters;
+}
+
+void RedisStats::commandCalled(const CommandInfo* info, uint64_t usec)
+{
+    ThreadCounters& counters = local();
+    bump(counters.commands, 1);
+    if(!info) return;
+    size_t index = commandIndex(*info);
+    bump(counters.calls[index], 1);
+    bump(counters.usec[index], usec);
+}
+
+void RedisStats::bytesIn(size_t bytes)
+{
+    bump(local().net_input, bytes);
+}
+
+void RedisStats::bytesOut(size_t bytes)
+{
+    bump(local().net_output, bytes);
+}
+
+void RedisStats::clientConnected()
+{
+    ++connected_clients;
+    ++connections_received;
+}
+
+void RedisStats::clientDisconnected()
+{
+    --connected_clients;
+}
+
+void RedisStats::add(Totals& into, const ThreadCounters& counters)
+{
+    into.commands += counters.commands.load(std::memory_order_relaxed);
+    into.netInput += counters.net_input.load(std::memory_order_relaxed);
+    into.netOutput += counters.net_output.load(std::memory_order_relaxed);
+    if(into.perCommand.empty()) return;
+    for(size_t i = 0; i < into.perCommand.size(); ++i) {
+        into.perCommand[i].calls += counters.calls[i].load(std::memory_order_relaxed);
+        into.perCommand[i].usec += counters.usec[i].load(std::memory_order_relaxed);
+    }
+}
+
+RedisStats::Totals RedisStats::totals(bool perCommand)
+{
+    Totals sum;
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    sum.commands = retired.commands;
+    sum.netInput = retired.netInput;
+    sum.netOutput = retired.netOutput;
+    if(perCommand) sum.perCommand = retired.perCommand;
+    for(const ThreadCounters* counters : live) add(sum, *counters);
+    return sum;
+}
+
+RedisStats::Rates RedisStats::rates()
+{
+    std::lock_guard<std::mutex> lock(sample_mutex);
+    Sample sum;
+    for(const auto& sample : samples) {
+        sum.ops += sample.ops;
+        sum.input += sample.input;
+        sum.output += sample.output;
+    }
+    return Rates{sum.ops / STATS_SAMPLES, sum.input / 1024.0 / STATS_SAMPLES, sum.output / 1024.0 / STATS_SAMPLES};
+}
+
+int64_t RedisStats::uptimeSeconds() const
+{
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+size_t RedisStats::measureMemory()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+#elif defined(__GLIBC__)
+    //before 2.33 only mallinfo, whose int fields wrap past 2GB
+    struct mallinfo info = mallinfo();
+    return static_cast<size_t>(static_cast<unsigned>(info.uordblks)) + static_cast<unsigned>(info.hblkhd);
+#else
+    //no malloc statistics: the resident set is the nearest figure
+    return residentMemory();
+#endif
+}
+
+void RedisStats::sampleMemory()
+{
+    size_t used = measureMemory();
+    used_memory = used;
+    if(used > peak_memory) peak_memory = used;
+}
+
+size_t RedisStats::residentMemory()
+{
+    //the second field of statm: resident pages
+    FILE* statm = std::fopen("/proc/self/statm", "r");
+    if(!statm) return 0;
+    unsigned long long size = 0, resident = 0;
+    int got = std::fscanf(statm, "%llu %llu", &size, &resident);
+    std::fclose(statm);
+    return got == 2 ? static_cast<size_t>(resident * static_cast<unsigned long long>(sysconf(_SC_PAGESIZE))) : 0;
+}
+
+void RedisStats::samplerLoop()
+{
+    Totals last = totals(false);
+    auto lastTime = std::chrono::steady_clock::now();
+    auto lastMemory = lastTime - STATS_MEMORY_PERIOD;
+    std::unique_lock<std::mutex> lock(sample_mutex);
+    while(!sample_cv.wait_for(lock, STATS_SAMPLE_PERIOD, [this]() { return stopping; })) {
+        lock.unlock();
+        Totals now = totals(false);
+        auto nowTime = std::chrono::steady_clock::now();
+        uint64_t ms = std::max<uint64_t>(1, std::chrono::duration_cast<std::chrono::milliseconds>(nowTime - lastTime).count());
+        Sample sample{(now.commands - last.commands) * 1000 / ms,
+                      (now.netInput - last.netInput) * 1000 / ms,
+                      (now.netOutput - last.netOutput) * 1000 / ms};
+        last = now;
+        lastTime = nowTime;
+        if(nowTime - lastMemory >= STATS_MEMORY_PERIOD) {
+            lastMemory = nowTime;
+            sampleMemory();
+        }
+        lock.lock();
+        samples[sample_idx] = sample;
+        sample_idx = (sample_idx + 1) % STATS_SAMPLES;
+    }
+}
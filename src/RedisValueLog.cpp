@@ -0,0 +1,97 @@
+#include "RedisValueLog.h"
+#include "RedisSnapshot.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+static const size_t RECORD_HEADER = 12;
+
+static void putLE(char* p, uint64_t value, int bytes)
+{
+    for(int i = 0; i < bytes; ++i) p[i] = static_cast<char>(value >> (8 * i));
+}
+
+static uint64_t getLE(const char* p, int bytes)
+{
+    uint64_t value = 0;
+    for(int i = 0; i < bytes; ++i) value |= static_cast<uint64_t>(static_cast<uint8_t>(p[i])) << (8 * i);
+    return value;
+}
+
+RedisValueLog::~RedisValueLog()
+{
+    if(fd >= 0) ::close(fd);
+}
+
+bool RedisValueLog::create(const std::string& path)
+{
+    file_path = path;
+    std::string tmp = path + ".new";
+    fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) return false;
+    if(std::rename(tmp.c_str(), path.c_str()) != 0) {
+        ::close(fd);
+        fd = -1;
+        ::unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool RedisValueLog::moveTo(const std::string& path)
+{
+    if(std::rename(file_path.c_str(), path.c_str()) != 0) return false;
+    file_path = path;
+    return true;
+}
+
+void RedisValueLog::unlink()
+{
+    ::unlink(file_path.c_str());
+}
+
+bool RedisValueLog::append(const std::string& bytes, uint64_t& offset)
+{
+    if(fd < 0 || bytes.size() > UINT32_MAX) return false;
+    std::string record(RECORD_HEADER, '\0');
+    putLE(&record[0], bytes.size(), 4);
+    putLE(&record[4], crc64(0, bytes.data(), bytes.size()), 8);
+    record += bytes;
+
+    offset = end;
+    const char* p = record.data();
+    size_t n = record.size();
+    uint64_t at = offset;
+    while(n > 0) {
+        ssize_t written = ::pwrite(fd, p, n, static_cast<off_t>(at));
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            return false;
+        }
+        p += written;
+        n -= static_cast<size_t>(written);
+        at += static_cast<uint64_t>(written);
+    }
+    //readers only ever see offsets handed out after this
+    end = at;
+    return true;
+}
+
+bool RedisValueLog::read(uint64_t offset, uint32_t length, std::string& bytes) const
+{
+    if(fd < 0 || offset + RECORD_HEADER + length > end) return false;
+    std::string record(RECORD_HEADER + length, '\0');
+    size_t done = 0;
+    while(done < record.size()) {
+        ssize_t got = ::pread(fd, &record[done], record.size() - done, static_cast<off_t>(offset + done));
+        if(got < 0 && errno == EINTR) continue;
+        if(got <= 0) return false;
+        done += static_cast<size_t>(got);
+    }
+    if(getLE(record.data(), 4) != length) return false;
+    if(getLE(record.data() + 4, 8) != crc64(0, record.data() + RECORD_HEADER, length)) return false;
+    bytes.assign(record, RECORD_HEADER, length);
+    return true;
+}
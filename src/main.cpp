@@ -1,30 +1,202 @@
 #include "main.h"
 #include "RedisServer.h"
+#include "RedisAof.h"
+#include "RedisCluster.h"
+#include "RedisCommandHandler.h"
 #include "RedisDatabase.h"
+#include "RedisReplication.h"
+#include "RedisStats.h"
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char* AOF_FILE = "appendonly.aof";
+
+static bool fileExists(const std::string& path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+//"<seconds> <changes> ..." pairs, as in Redis' save directive; "" for none
+static bool parseSaveRules(const std::string& spec, std::vector<RedisDatabase::SaveRule>& rules)
+{
+    std::istringstream in(spec);
+    long long seconds, changes;
+    while(in >> seconds) {
+        if(!(in >> changes) || seconds <= 0 || changes <= 0) return false;
+        rules.push_back({seconds, static_cast<uint64_t>(changes)});
+    }
+    return in.eof();
+}
+
+//Rebuild the dataset from the AOF or the dump, then start passing writes on to the
+//AOF and to replicas
+static bool loadDataset(bool appendOnly, AofFsync fsyncPolicy, int autoRewritePercentage, uint64_t autoRewriteMinSize)
+{
+    RedisDatabase& db = RedisDatabase::getInstance();
+    //with the AOF on it is the most complete record, so it wins over the dump
+    bool aofExists = appendOnly && fileExists(AOF_FILE);
+    auto start = std::chrono::steady_clock::now();
+    if(aofExists) {
+        RedisCommandHandler replayer;
+        size_t commands = 0;
+        if(!replayer.loadAppendOnlyFile(AOF_FILE, commands)) {
+            std::cerr << "Error loading " << AOF_FILE << ". Fix or remove it before restarting.\n";
+            return false;
+        }
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Database loaded from " << AOF_FILE << ": " << commands << " commands in " << ms << " ms.\n";
+    } else if(db.load("dump.my_rdb")) {
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Database loaded from dump.my_rdb in " << ms << " ms.\n";
+    } else {
+        std::cout << "No dump found or load failed. Starting with empty database.\n";
+    }
+
+    if(appendOnly) {
+        RedisAof& aof = RedisAof::getInstance();
+        if(!aof.open(AOF_FILE, fsyncPolicy)) return false;
+        //a new AOF starts with the data loaded from the dump, or a restart would lose it
+        if(!aofExists) db.rewriteCommands([&aof](const std::vector<std::string>& command) { aof.append(command); });
+        aof.setDatasetWriter([&db](const RedisAof::Emit& emit, const std::function<void()>& snapshotTaken) {
+            db.rewriteCommands(emit, snapshotTaken);
+        });
+        aof.setAutoRewrite(autoRewritePercentage, autoRewriteMinSize);
+    }
+    //replicas may attach at any time, so writes are always propagated; replication
+    //ignores them until one does
+    db.setPropagator([appendOnly](const std::vector<std::string>& command) {
+        if(appendOnly) RedisAof::getInstance().append(command);
+        RedisReplication::getInstance().feed(command);
+    });
+
+    return true;
+}
 
 int main(int argc, char* argv[]) {
     //default port for now
     int port = 6379;
-    if(argc >=2) port = std::stoi(argv[1]);
+    //append-only file, off unless --appendonly yes
+    bool appendOnly = false;
+    AofFsync fsyncPolicy = AofFsync::EverySec;
+    //rewrite the AOF once it doubled since the last rewrite, if it is at least 64MB
+    int autoRewritePercentage = 100;
+    uint64_t autoRewriteMinSize = 64 * 1024 * 1024;
+    //Redis' default save points: after an hour if anything changed, 5 minutes after
+    //100 changes, a minute after 10000
+    std::vector<RedisDatabase::SaveRule> saveRules = {{3600, 1}, {300, 100}, {60, 10000}};
+    bool saveGiven = false;
+    //tiered storage, off unless --tier-file: spill values of 256 bytes and up left
+    //alone for 5 minutes
+    std::string tierFile;
+    uint32_t tierIdle = 300;
+    size_t tierMinBytes = 256;
+    //replication: a master to follow, if any
+    std::string masterHost;
+    int masterPort = 0;
+    //cluster mode, off unless --cluster-enabled yes
+    bool clusterEnabled = false;
+    std::string clusterConfigFile = "nodes.conf";
+    std::string clusterAnnounceIp;
 
-    if(RedisDatabase::getInstance().load("dump.my_rdb")) {
-        std::cout << "Database loaded from dump.my_rdb.\n";
-    } else {
-        std::cout << "No dump found or load failed. Starting with empty database.\n";
+    for(int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if(arg == "--appendonly" && i + 1 < argc) {
+            appendOnly = std::string(argv[++i]) == "yes";
+        } else if(arg == "--appendfsync" && i + 1 < argc) {
+            std::string policy = argv[++i];
+            if(policy == "always") fsyncPolicy = AofFsync::Always;
+            else if(policy == "everysec") fsyncPolicy = AofFsync::EverySec;
+            else if(policy == "no") fsyncPolicy = AofFsync::No;
+            else {
+                std::cerr << "Unknown appendfsync policy '" << policy << "' (always, everysec or no)\n";
+                return 1;
+            }
+        } else if(arg == "--auto-aof-rewrite-percentage" && i + 1 < argc) {
+            autoRewritePercentage = std::stoi(argv[++i]);
+        } else if(arg == "--auto-aof-rewrite-min-size" && i + 1 < argc) {
+            autoRewriteMinSize = std::stoull(argv[++i]);
+        } else if(arg == "--save" && i + 1 < argc) {
+            //the first --save replaces the defaults; more of them add rules
+            if(!saveGiven) saveRules.clear();
+            saveGiven = true;
+            if(!parseSaveRules(argv[++i], saveRules)) {
+                std::cerr << "Bad --save rules '" << argv[i] << "' (pairs of <seconds> <changes>)\n";
+                return 1;
+            }
+        } else if(arg == "--delta-saves" && i + 1 < argc) {
+            RedisDatabase::getInstance().setDeltaSaves(std::stoull(argv[++i]));
+        } else if(arg == "--compress-values-above" && i + 1 < argc) {
+            RedisDatabase::getInstance().setValueCompression(std::stoull(argv[++i]));
+        } else if(arg == "--tier-file" && i + 1 < argc) {
+            tierFile = argv[++i];
+        } else if(arg == "--tier-idle" && i + 1 < argc) {
+            tierIdle = static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else if(arg == "--tier-min-bytes" && i + 1 < argc) {
+            tierMinBytes = std::stoull(argv[++i]);
+        } else if(arg == "--replicaof" && i + 2 < argc) {
+            masterHost = argv[++i];
+            masterPort = std::stoi(argv[++i]);
+        } else if(arg == "--replica-read-only" && i + 1 < argc) {
+            RedisReplication::getInstance().setReadOnly(std::string(argv[++i]) != "no");
+        } else if(arg == "--repl-backlog-size" && i + 1 < argc) {
+            RedisReplication::getInstance().setBacklogSize(std::stoull(argv[++i]));
+        } else if(arg == "--cluster-enabled" && i + 1 < argc) {
+            clusterEnabled = std::string(argv[++i]) == "yes";
+        } else if(arg == "--cluster-config-file" && i + 1 < argc) {
+            clusterConfigFile = argv[++i];
+        } else if(arg == "--cluster-announce-ip" && i + 1 < argc) {
+            clusterAnnounceIp = argv[++i];
+        } else if(arg == "--lazy-load" && i + 1 < argc) {
+            std::string mode = argv[++i];
+            if(mode != "no" && mode != "yes" && mode != "warm") {
+                std::cerr << "Unknown lazy-load mode '" << mode << "' (no, yes or warm)\n";
+                return 1;
+            }
+            RedisDatabase::getInstance().setLazyLoad(mode != "no", mode == "warm");
+        } else {
+            port = std::stoi(arg);
+        }
+    }
+
+    if(!tierFile.empty() && !RedisDatabase::getInstance().setTiering(tierFile, tierIdle, tierMinBytes)) {
+        std::cerr << "Cannot create value log " << tierFile << "\n";
+        return 1;
     }
 
+    RedisReplication::getInstance().setListeningPort(port);
+    RedisStats::getInstance().setListeningPort(port);
+    if(clusterEnabled && !RedisCluster::getInstance().enable(clusterConfigFile, clusterAnnounceIp, port)) return 1;
+
+    //load in the background: the server is up at once and answers -LOADING until done
+    RedisDatabase::getInstance().setLoading(true);
+    std::thread loader([=]() {
+        if(!loadDataset(appendOnly, fsyncPolicy, autoRewritePercentage, autoRewriteMinSize)) {
+            //_exit, not exit: the main thread is still serving, and static destructors
+            //run from here would tear down objects it is using
+            std::cerr << "Cannot load the dataset, exiting\n";
+            std::cout.flush();
+            _exit(1);
+        }
+        RedisDatabase::getInstance().setLoading(false);
+        RedisDatabase::getInstance().refreshStatus();
+        if(!masterHost.empty()) RedisReplication::getInstance().replicaOf(masterHost, masterPort);
+    });
+    loader.detach();
+
     RedisServer server(port);
 
-    //Background persistannce: Every 5 minutes save database
+    //Background persistannce: check the save rules every second; saves run without blocking clients.
+    //The dataset figures INFO shows are refreshed on the same beat.
+    RedisDatabase::getInstance().setSaveRules(saveRules);
     std::thread persistanceThread([](){
         while(true){
-            std::this_thread::sleep_for(std::chrono::seconds(300));
-            if(!RedisDatabase::getInstance().dump("dump.my_rdb")) {
-                std::cerr << "Error dumping Database. \n";
-            } else {
-                std::cout <<"Database dumped to dump.my_rdb\n";
-            }            
-
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            RedisDatabase::getInstance().refreshStatus();
+            if(RedisDatabase::getInstance().saveIfDue("dump.my_rdb")) {
+                std::cout <<"Background saving started\n";
+            }
         }
     });
 
@@ -33,4 +205,4 @@ int main(int argc, char* argv[]) {
     server.run();
 
     return 0;
-}
\ No newline at end of file
+}